@@ -25,8 +25,28 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 1 $")
 #include <linux/types.h>
 #include <fcntl.h>
 #include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <time.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+/* AVX2 functions are compiled with a target attribute and selected at run time */
+#define AI_HAVE_AVX2 1
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #define ALSA_PCM_NEW_HW_PARAMS_API
 #define ALSA_PCM_NEW_SW_PARAMS_API
@@ -48,9 +68,11 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 1 $")
 #include <asterisk/format_cap.h>
 #endif /* (AST_VERSION >= 110) */
 #include <asterisk/frame.h>
+#include <asterisk/indications.h>
 #include <asterisk/linkedlists.h>
 #include <asterisk/lock.h>
 #include <asterisk/logger.h>
+#include <asterisk/manager.h>
 #include <asterisk/module.h>
 #include <asterisk/musiconhold.h>
 #include <asterisk/pbx.h>
@@ -115,21 +137,79 @@ typedef struct ast_format_cap alsa_input_ast_format_cap;
  * alsa_input_ast_format_cap_get_best_by_type should be updated
  */
 static alsa_input_ast_format *ast_format_slin;
+static alsa_input_ast_format *ast_format_slin16;
+static alsa_input_ast_format *ast_format_slin48;
 #endif /* (AST_VERSION <= 110) */
 
 static void alsa_input_init_cache_ast_format(void)
 {
 #if (AST_VERSION < 110)
    static format_t format_slin = AST_FORMAT_SLINEAR;
+   static format_t format_slin16 = AST_FORMAT_SLINEAR16;
    ast_format_slin = &(format_slin);
+   ast_format_slin16 = &(format_slin16);
+   /* There's no 48 kHz signed linear format before Asterisk 11 */
+   ast_format_slin48 = NULL;
 #endif /* (AST_VERSION < 110) */
 #if (110 == AST_VERSION)
    static struct ast_format format_slin;
+   static struct ast_format format_slin16;
+   static struct ast_format format_slin48;
    ast_format_slin = ast_getformatbyname("slin", &(format_slin));
    alsa_input_assert(NULL != ast_format_slin);
+   ast_format_slin16 = ast_getformatbyname("slin16", &(format_slin16));
+   alsa_input_assert(NULL != ast_format_slin16);
+   ast_format_slin48 = ast_getformatbyname("slin48", &(format_slin48));
+   alsa_input_assert(NULL != ast_format_slin48);
 #endif /* (110 == AST_VERSION) */
 }
 
+/* Sample rates of the sound devices */
+typedef enum {
+   AI_RATE_8000,
+   AI_RATE_16000,
+   AI_RATE_48000,
+   AI_RATE_COUNT
+} alsa_input_rate_t;
+
+static const unsigned int alsa_input_rate_values[AI_RATE_COUNT] = {
+   8000, 16000, 48000
+};
+
+static inline unsigned int alsa_input_rate_samples_per_ms(alsa_input_rate_t rate)
+{
+   return (alsa_input_rate_values[rate] / 1000);
+}
+
+/*
+ Return the Asterisk format of signed linear samples at the rate, or NULL
+ if this version of Asterisk doesn't have one
+*/
+static inline alsa_input_ast_format *alsa_input_rate_format(alsa_input_rate_t rate)
+{
+   alsa_input_ast_format *ret = NULL;
+
+   switch (rate) {
+      case AI_RATE_8000: {
+         ret = ast_format_slin;
+         break;
+      }
+      case AI_RATE_16000: {
+         ret = ast_format_slin16;
+         break;
+      }
+      case AI_RATE_48000: {
+         ret = ast_format_slin48;
+         break;
+      }
+      default: {
+         alsa_input_assert(false);
+         break;
+      }
+   }
+   return (ret);
+}
+
 static inline const char *alsa_input_ast_format_get_name(
    const alsa_input_ast_format *format)
 {
@@ -525,6 +605,18 @@ static inline void alsa_input_ast_set_frame_format(
 #define RING_CADENCE_OFF 4000
 #define RING_CADENCE_ON 2000
 
+/* Value of alsa_input_pvt_t.monitor.deadline when the line has no deadline */
+#define AI_NO_DEADLINE INT64_MAX
+/* Value of alsa_input_pvt_t.monitor.heap_index when the line is not in the heap */
+#define AI_NOT_IN_HEAP ((size_t)(-1))
+
+/*
+ Delay (in ms) between the last change in the directories of the devices and
+ the search for the lines whose devices came back : udev creates the links
+ (by-id, by-path) and sets the permissions of the nodes meanwhile
+*/
+#define AI_HOTPLUG_SETTLE_MS 500
+
 #define AST_MODULE alsa_input_chan_type
 
 typedef struct {
@@ -535,38 +627,74 @@ typedef struct {
    unsigned int midinote:1;
 } alsa_input_tone_part_t;
 
+/* Number of samples between two exact computations of the phases */
+#define AI_TONE_SYNTH_BLOCK 64
+/* Length of the longest cadence rendered, longer ones are synthesized live */
+#define AI_TONE_MAX_RENDERED_MS 4000
+
 typedef struct {
-   int fac1;
-   int init_v2_1;
-   int init_v3_1;
-   int fac2;
-   int init_v2_2;
-   int init_v3_2;
+   /* Frequencies in Hz (MIDI notes are converted) */
+   unsigned int freq1;
+   unsigned int freq2;
    int modulate;
+   /* Duration in ms, 0 if the item is played forever */
    unsigned int duration;
+   /* Sample rate, phase steps and amplitude of the oscillators */
+   unsigned int rate;
+   double w1;
+   double w2;
+   float amp;
+   /* sin and cos of k times the phase steps, k from 0 to 8 */
+   float rot1_sin[9];
+   float rot1_cos[9];
+   float rot2_sin[9];
+   float rot2_cos[9];
 } alsa_input_tone_item_t;
 
-#define MAX_ITEM_PER_PLAYTONE 2
-
 typedef struct {
+   /* Index of the item playing restarts at once the last one is played, or -1 */
    int reppos;
    int nitems;
-   alsa_input_tone_item_t items[MAX_ITEM_PER_PLAYTONE];
+   /* Sample rate the items are computed for */
+   unsigned int samples_per_ms;
+   /* Array of nitems items */
+   alsa_input_tone_item_t *items;
+   /*
+    Samples of the whole cadence, rendered once by alsa_input_init_tones()
+    and shared read-only by all the lines playing the tone. Once
+    pcm_len samples are played, playing restarts at pcm_loop, or stops if
+    pcm_loop is equal to pcm_len
+   */
+   int16_t *pcm;
+   size_t pcm_len;
+   size_t pcm_loop;
 } alsa_input_tone_def_t;
 
+/*
+ Tones that depend on the country, from a zone of indications.conf
+ (parameter 'tone_zone'). A tone missing in the zone is taken from the
+ built-in zone. Zones are rendered when the configuration is read and
+ shared by all the lines using them
+*/
+typedef struct alsa_input_tone_zone {
+   struct alsa_input_tone_zone *next;
+   char name[16];
+   const alsa_input_tone_def_t *dial;
+   const alsa_input_tone_def_t *busy;
+   const alsa_input_tone_def_t *invalid;
+   /* Definitions the pointers above refer to, for the tones of the zone */
+   alsa_input_tone_def_t defs[3][AI_RATE_COUNT];
+} alsa_input_tone_zone_t;
+
 typedef struct {
-   int v1_1;
-   int v2_1;
-   int v3_1;
-   int v1_2;
-   int v2_2;
-   int v3_2;
-   int reppos;
-   size_t nitems;
-   const alsa_input_tone_item_t *items;
-   size_t npos;
-   size_t oldnpos;
+   const int16_t *pcm;
+   size_t len;
+   size_t loop;
    size_t pos;
+   /* Used instead of pcm when the cadence is not rendered */
+   const alsa_input_tone_def_t *def;
+   int item;
+   size_t item_pos;
 } alsa_input_tone_state_t;
 
 typedef enum {
@@ -677,6 +805,29 @@ typedef enum {
    AI_ST_OFF_NO_SERVICE,
 } alsa_input_state_t;
 
+/*
+ Quality of the resampler used when a sound device doesn't support the rate
+ of the line (parameter 'resample_quality'). AI_RESAMPLE_NONE forbids
+ resampling : the line can't be opened with such a device
+*/
+typedef enum {
+   AI_RESAMPLE_NONE,
+   AI_RESAMPLE_LOW,
+   AI_RESAMPLE_MEDIUM,
+   AI_RESAMPLE_HIGH,
+} alsa_input_resample_quality_t;
+
+/*
+ What is done with the frames captured during silences (parameter 'vad') :
+ nothing, they are dropped, or replaced by a comfort noise frame at the
+ start of each silence and dropped
+*/
+typedef enum {
+   AI_VAD_NONE,
+   AI_VAD_DROP,
+   AI_VAD_CNG,
+} alsa_input_vad_mode_t;
+
 typedef struct {
    bool enable;
    struct ast_jb_conf jb_conf;
@@ -718,16 +869,110 @@ typedef struct {
    char cid_num[AST_MAX_EXTENSION];
    /* For music to play on hold */
    char moh_interpret[MAX_MUSICCLASS];
+   /*
+    Maximum duration (in ms) of voice queued by alsa_input_chan_write() and
+    not yet written to the sound playback device
+   */
+   int playback_buffer_ms;
+   /*
+    If true, the voice missing when the playback ring runs dry during a call
+    is concealed, instead of letting the sound playback device underrun
+   */
+   bool plc;
+   /* If true, sound devices are accessed with mmap (if they support it) */
+   bool snd_mmap;
+   /* Period of the sound devices in ms */
+   int period_ms;
+   /* Number of periods in the buffer of the sound devices */
+   int periods;
+   /* Highest sample rate tried when the sound devices are opened */
+   alsa_input_rate_t max_rate;
+   /* Resampler used if a sound device doesn't support the rate of the line */
+   alsa_input_resample_quality_t resample_quality;
+   /*
+    If not null, the line uses this channel (starting from 1) of a
+    multi-channel sound device shared with the other lines using the same
+    device (see alsa_input_snd_shared_t)
+   */
+   unsigned int snd_capture_channel;
+   unsigned int snd_playback_channel;
+   /* Name of the zone of indications.conf, empty for the built-in tones */
+   char tone_zone[16];
+   /*
+    If true, DTMF digits are detected in the captured samples (for handsets
+    without keypad) : capture then runs while dialing too
+   */
+   bool dtmf_detect;
+   /* Minimum level (in dBFS) of each tone of a DTMF digit */
+   int dtmf_threshold;
+   /*
+    Maximum difference (in dB) between the tone of the row and the tone of
+    the column, when the row is stronger (normal) or weaker (reverse)
+   */
+   int dtmf_normal_twist;
+   int dtmf_reverse_twist;
+   /*
+    If true, the echo of the sound played is removed from the sound
+    captured, the filter covering echo_tail_ms ms
+   */
+   bool echo_cancel;
+   int echo_tail_ms;
+   /*
+    If true, the noise of the captured samples is attenuated by at most
+    noise_reduction dB
+   */
+   bool noise_suppress;
+   int noise_reduction;
+   /*
+    If true, the gain of the captured samples is controlled to reach
+    agc_target dBFS, with at most agc_max_gain dB
+   */
+   bool agc;
+   int agc_target;
+   int agc_max_gain;
+   /* Initial playback volume, and step of the volume keys (in dB) */
+   int volume;
+   int volume_step;
+   /* Voice activity detection, and level (in dB) above the noise of the voice */
+   alsa_input_vad_mode_t vad;
+   int vad_threshold;
+   /* Dial, busy and congestion tones of the line */
+   const alsa_input_tone_zone_t *tones;
 } alsa_input_line_config_t;
 
-#define MAX_LINES 1
+/*
+ Upper bound for parameter 'lines' : it's only a sanity check, as memory
+ for the lines is allocated dynamically once the configuration is read
+*/
+#define MAX_LINES 256
 
 typedef struct {
    char language[MAX_LANGUAGE];
+   /*
+    Priority (SCHED_FIFO) of the audio thread. If null, the audio thread
+    keeps the default scheduling policy
+   */
+   int audio_thread_priority;
+   /* CPU the audio thread is bound to, or -1 */
+   int audio_thread_cpu;
    size_t line_count;
-   alsa_input_line_config_t line_cfgs[MAX_LINES];
+   /* Array of line_count items */
+   alsa_input_line_config_t *line_cfgs;
+   /* Zones of indications.conf used by the lines */
+   alsa_input_tone_zone_t *tone_zones;
 } alsa_input_chan_config_t;
 
+/*
+ Configuration of a line replaced by a reload, freed once no thread can
+ still read it (see alsa_input_reclaim_line_cfgs())
+*/
+typedef struct alsa_input_retired_cfg {
+   struct alsa_input_retired_cfg *next;
+   alsa_input_line_config_t *line_cfg;
+   /* Value of alsa_input_chan_t.audio.passes when it was replaced */
+   unsigned int audio_passes;
+} alsa_input_retired_cfg_t;
+
 #define SAMPLE_SIZE 2
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 #define SND_PCM_SAMPLE_FORMAT SND_PCM_FORMAT_S16_LE
@@ -735,24 +980,588 @@ typedef struct {
 #define SND_PCM_SAMPLE_FORMAT SND_PCM_FORMAT_S16_BE
 #endif
 
-/* Let's use a 30 ms period */
-#define PERIOD_SIZE_IN_FRAMES (30 * DEFAULT_SAMPLES_PER_MS)
-/* Buffer size must contain at least PERIOD_SIZE_IN_FRAMES * 2 bytes */
-#define BUFFER_SIZE (PERIOD_SIZE_IN_FRAMES * SAMPLE_SIZE)
+/*
+ Default period of the sound devices in ms (parameter 'period_ms'). A frame
+ sent to Asterisk contains the samples of one period
+*/
+#define DEFAULT_PERIOD_MS 30
+/* Default number of periods in the buffer of the sound devices (parameter 'periods') */
+#define DEFAULT_PERIODS 16
+
+/*
+ Polyphase FIR resampler, converting signed linear samples from in_rate to
+ out_rate = in_rate * up / down (up and down are prime to each other).
+ The prototype low-pass filter (up * taps coefficients) is split in up
+ phases of taps coefficients : each output sample is the dot product of the
+ last taps input samples with one phase, so the cost doesn't depend on up.
+*/
+typedef struct {
+   unsigned int up;
+   unsigned int down;
+   /*
+    Number of coefficients per phase, multiple of 4 (see
+    alsa_input_resampler_dot()), larger when decimating
+   */
+   unsigned int taps;
+   /* Phases of the filter (up * taps coefficients), coefficients of each phase are reversed */
+   float *coefs;
+   /*
+    Last taps input samples, stored twice (2 * taps items) so that they can
+    always be read as a contiguous window, oldest first, starting at hist_pos
+   */
+   float *hist;
+   unsigned int hist_pos;
+   /* Phase of the next output sample */
+   unsigned int phase;
+   /* Number of input samples to push before the next output sample */
+   unsigned int need;
+} alsa_input_resampler_t;
+
+/* Upper bound of alsa_input_resampler_t.up, to bound the size of the filter */
+#define AI_RESAMPLER_MAX_PHASES 1024
 
 typedef struct {
    snd_pcm_t *card;
    snd_pcm_hw_params_t *hw_params;
    snd_pcm_sw_params_t *sw_params;
+   /*
+    true if the device is accessed with SND_PCM_ACCESS_MMAP_INTERLEAVED
+    (see alsa_input_snd_card_read() and alsa_input_snd_card_write())
+   */
+   bool mmap;
+   /* Number of bytes of a frame (SAMPLE_SIZE * number of channels) */
+   size_t frame_bytes;
+   snd_pcm_uframes_t period_size;
+   snd_pcm_uframes_t buffer_size;
+   snd_pcm_uframes_t start_threshold;
+   /*
+    Minimum number of frames available to wake up the audio thread : the
+    period size, or more for a playback device while the voice is concealed
+    (see alsa_input_snd_card_set_avail_min())
+   */
+   snd_pcm_uframes_t avail_min;
+   /*
+    Number of errors (xruns, suspend) recovered, incremented (atomically) by
+    the audio thread
+   */
+   unsigned long errors_recovered;
+   /*
+    If the device doesn't run at the rate of the line, samples are resampled
+    by alsa_input_snd_card_read() and alsa_input_snd_card_write() :
+    rs_buf holds rs_buf_frames samples at the rate of the device. For the
+    capture device, rs_buf_len samples read and not yet resampled, for the
+    playback device rs_buf_len samples resampled and not yet written, from
+    offset rs_buf_offset
+   */
+   alsa_input_resampler_t *resampler;
+   __u8 *rs_buf;
+   snd_pcm_uframes_t rs_buf_frames;
+   snd_pcm_uframes_t rs_buf_len;
+   snd_pcm_uframes_t rs_buf_offset;
 } alsa_input_snd_card_t;
 
+/*
+ Goertzel DTMF detector, run by the audio thread on the captured samples.
+ The 4 row frequencies and the 4 column frequencies are filtered together
+ (one SIMD lane per frequency) over blocks of 102 samples at 8 kHz (12.75 ms,
+ the same duration at the other rates). A digit is reported when it's
+ found in 2 consecutive blocks, and released after 2 blocks without it
+*/
+#define AI_DTMF_FREQS 8
+#define AI_DTMF_BLOCK_8K 102
+
+typedef struct {
+   /* Goertzel coefficients 2 * cos(2 * pi * f / rate) */
+   float coefs[AI_DTMF_FREQS];
+   /* Goertzel states of the block being processed */
+   float s1[AI_DTMF_FREQS];
+   float s2[AI_DTMF_FREQS];
+   /* Energy of the samples of the block */
+   float energy;
+   size_t block_len;
+   size_t count;
+   /* Thresholds, in the scale of the Goertzel output */
+   float threshold;
+   float normal_twist;
+   float reverse_twist;
+   char last_hit;
+   char current;
+} alsa_input_dtmf_t;
+
+/*
+ Real FFT of 2 * size points, computed with a complex FFT of size points
+ (a power of 2). Used by the echo canceller and the noise suppressor
+*/
+typedef struct {
+   unsigned int size;
+   /* Data of the complex FFT (interleaved), twiddles and bit reversal */
+   float *cbuf;
+   float *twiddles;
+   unsigned int *bitrev;
+   /* Twiddles of the real FFT (size + 1 complex values) */
+   float *rtwiddles;
+} alsa_input_fft_t;
+
+/*
+ Acoustic echo canceller, run by the audio thread on the captured samples
+ when the line plays something : partitioned block frequency domain NLMS
+ (overlap-save). The filter covering the tail is split in partitions of
+ block samples (64 at 8 kHz, 8 ms), each one filtering in the frequency
+ domain the spectrum of an older block of the reference (the samples
+ written to the playback device). A block costs 3 real FFTs of 2 * block
+ points plus 2 complex multiply-accumulate per partition, instead of
+ block * taps multiplications for a time domain filter.
+ The spectra are stored as separate arrays of real and imaginary parts
+ (stride floats per partition) for the SIMD kernels.
+*/
+#define AI_AEC_BLOCK_8K 64
+/* The filter is not adapted when the reference is below this level */
+#define AI_AEC_MIN_FAR 64.0f
+/*
+ Geigel double talk detector : the filter is not adapted when the near end
+ is louder than this ratio of the reference over the tail
+*/
+#define AI_AEC_GEIGEL 0.5f
+/*
+ The reference given to the echo canceller is this much earlier than the
+ delays of the devices tell, so that the echo path stays causal
+*/
+#define AI_AEC_MARGIN_MS 2
+
+typedef struct {
+   /* Number of samples of a block, a power of 2 */
+   unsigned int block;
+   /* Number of partitions of the filter */
+   unsigned int partitions;
+   /* Number of floats of a spectrum (block + 1 bins, multiple of 4) */
+   unsigned int stride;
+   /* Memory holding all the arrays of floats below */
+   float *mem;
+   /* Spectra of the last blocks of the reference, x_slot is the newest */
+   float *x_re;
+   float *x_im;
+   unsigned int x_slot;
+   /* Spectra of the partitions of the filter */
+   float *w_re;
+   float *w_im;
+   /* Power of the reference over the tail, per bin */
+   float *psd;
+   /* Spectra of the echo estimated and of the error */
+   float *y_re;
+   float *y_im;
+   float *e_re;
+   float *e_im;
+   /* Previous block of the reference, first half of the FFT input */
+   float *x_prev;
+   /* 2 * block floats of time domain data */
+   float *work;
+   alsa_input_fft_t fft;
+   /* Maximum level of the reference in each block of the tail */
+   float *far_max;
+   /* Partition constrained by the next block */
+   unsigned int constrain;
+   /* Step and regularization */
+   float mu;
+   float delta;
+   /*
+    Block being filled (fill samples of the microphone and of the
+    reference), and output of the previous block
+   */
+   int16_t *in_d;
+   int16_t *in_x;
+   int16_t *out;
+   size_t fill;
+} alsa_input_aec_t;
+
+/*
+ Noise suppressor of the captured samples : short time spectral
+ attenuation with a Wiener gain per bin, computed from the a priori signal
+ to noise ratio (decision-directed). The frames have 2 * hop samples (hop
+ is 64 at 8 kHz, 8 ms), overlap by half and are weighted by a square root
+ Hann window before the FFT and after the inverse FFT. The noise of each
+ bin is the minimum of its smoothed power, rising by AI_NS_NOISE_RISE dB
+ per second, multiplied by AI_NS_BIAS (the minimum is below the mean)
+*/
+#define AI_NS_HOP_8K 64
+#define AI_NS_NOISE_RISE 1.0f
+#define AI_NS_BIAS 2.0f
+/* Smoothing of the power of the bins, weight of the previous frame in the a priori SNR */
+#define AI_NS_SMOOTH 0.7f
+#define AI_NS_DD 0.98f
+
+typedef struct {
+   /* Number of samples of a hop, a power of 2 */
+   unsigned int hop;
+   alsa_input_fft_t fft;
+   /* Memory holding all the arrays of floats below */
+   float *mem;
+   /* 2 * hop floats */
+   float *window;
+   float *work;
+   /* Spectrum of the frame (hop + 1 bins) */
+   float *re;
+   float *im;
+   /* Smoothed power, noise, and power of the output of the previous frame, per bin */
+   float *power;
+   float *noise;
+   float *prev;
+   /* Previous hop of input, second half of the previous output frame */
+   float *in_prev;
+   float *overlap;
+   /* Factor of the rise of the noise per frame, lowest gain */
+   float rise;
+   float gain_min;
+   /* false until the first frame gives the noise */
+   bool started;
+   /* Hop being filled (fill samples) and output of the previous hop */
+   int16_t *in;
+   int16_t *out;
+   size_t fill;
+} alsa_input_ns_t;
+
+/*
+ Gains applied to the samples are fixed point numbers with AI_GAIN_SHIFT
+ fractional bits : AI_GAIN_UNITY is 0 dB, the largest gain (INT16_MAX) is
+ about +24 dB
+*/
+#define AI_GAIN_SHIFT 11
+#define AI_GAIN_UNITY (1 << AI_GAIN_SHIFT)
+
+/* Range (in dB) of the playback volume of a line */
+#define AI_VOLUME_MIN -30
+#define AI_VOLUME_MAX 12
+
+/*
+ Automatic gain control of the captured samples : the gain follows the
+ level of the voice towards a target level, quickly down and slowly up,
+ and holds while the level is below AI_AGC_GATE (silence or noise). A
+ limiter lowers it further when a chunk would clip
+*/
+#define AI_AGC_GATE -50.0f
+/* Lowest gain (in dB) */
+#define AI_AGC_MIN_GAIN -12.0f
+/* Slopes of the gain (in dB per second) */
+#define AI_AGC_ATTACK 60.0f
+#define AI_AGC_RELEASE 6.0f
+/* Time constant (in s) of the level measured */
+#define AI_AGC_TIME 0.05f
+
+/*
+ Voice activity detector of the captured frames. The level of the noise is
+ the minimum of the level of the frames, rising slowly (AI_VAD_NOISE_RISE
+ dB per second) so that it follows a louder noise. A frame is voice if its
+ level is threshold dB above the noise, or half as much with many zero
+ crossings (unvoiced consonants). Silence starts AI_VAD_HANGOVER_MS ms
+ after the last frame of voice
+*/
+#define AI_VAD_NOISE_RISE 1.0f
+#define AI_VAD_HANGOVER_MS 300
+/* Frames below this level (in dBFS) are always silence */
+#define AI_VAD_FLOOR -70.0f
+/* Rate of zero crossings per sample of the unvoiced consonants */
+#define AI_VAD_ZCR 0.3f
+
+typedef struct {
+   /* Level of the noise (in dBFS) */
+   float noise;
+   float threshold;
+   /* Remaining time (in ms) of voice after the last frame of voice */
+   int hangover;
+   bool talking;
+} alsa_input_vad_t;
+
+typedef struct {
+   /* Level (mean square, in the scale of full scale = 1) and gain (in dB) */
+   float level;
+   float gain;
+   /* Parameters of the line */
+   float target;
+   float max_gain;
+   float rate;
+} alsa_input_agc_t;
+
+/*
+ Concealment of the voice missing on the playback path, in the manner of
+ G.711 Appendix I : when the playback ring runs dry during a call, the
+ last pitch period of the samples played is repeated (its end blended with
+ the period before, so that the repetition is smooth), faded out from
+ AI_PLC_FADE_START_MS to silence AI_PLC_FADE_MS later. Silence is then
+ played until the voice comes back, for AI_PLC_HOLD_MS at most. The first
+ samples of the voice that comes back are blended with the concealment
+*/
+/* Pitch periods (in samples at 8 kHz) searched : 66 Hz to 200 Hz */
+#define AI_PLC_PITCH_MIN_8K 40
+#define AI_PLC_PITCH_MAX_8K 120
+#define AI_PLC_FADE_START_MS 10
+#define AI_PLC_FADE_MS 50
+#define AI_PLC_HOLD_MS 1000
+
+typedef struct {
+   /* Pitch periods searched (in samples), step of the coarse search */
+   unsigned int pitch_min;
+   unsigned int pitch_max;
+   unsigned int step;
+   /* Last samples played (hist_size, a power of 2), the newest at hist_head - 1 */
+   int16_t *hist;
+   size_t hist_size;
+   size_t hist_head;
+   /* The last 2 * pitch_max samples played, oldest first, when concealment starts */
+   float *work;
+   /* Period repeated (pitch samples) and position of the next sample */
+   float *cycle;
+   unsigned int pitch;
+   unsigned int pos;
+   /*
+    Difference between the sample following the last one played and the
+    first sample of the period, removed over the first ov samples
+   */
+   float jump;
+   unsigned int ov;
+   /* Number of samples concealed since the voice stopped */
+   size_t concealed;
+   /* Durations (in samples) */
+   size_t fade_start;
+   size_t fade_len;
+   size_t hold;
+   /* true once voice has been played, until the concealment gives up */
+   bool armed;
+   /* true while concealing */
+   bool active;
+} alsa_input_plc_t;
+
+/* Number of digits detected that can wait for the monitor, per line */
+#define AI_DTMF_DIGITS_LEN 16
+
+/* Number of commands that can be pending for the audio thread, per line */
+#define AI_AUDIO_CMDS_LEN 16
+
+/* Number of input events that can wait for the monitor, per line (power of 2) */
+#define AI_INPUT_EVENTS_LEN 128
+/*
+ Minimum duration (in ms) of the captured frames that can wait for
+ alsa_input_chan_read(), per line. The number of frames is a power of 2
+ computed from the period of the line, but at least AI_AUDIO_FRAMES_MIN
+*/
+#define AI_AUDIO_FRAMES_MS 240
+#define AI_AUDIO_FRAMES_MIN 8
+
+/*
+ Commands sent to the audio thread
+*/
+typedef enum {
+   /* Start sound capture, the frames are delivered to alsa_input_chan_read() */
+   AI_AUDIO_CMD_CAPTURE_START,
+   /*
+    Start sound capture for DTMF detection only, the frames are dropped.
+    AI_AUDIO_CMD_CAPTURE_START delivers them from the next frame
+   */
+   AI_AUDIO_CMD_DETECT_START,
+   /* Stop sound capture */
+   AI_AUDIO_CMD_CAPTURE_STOP,
+   /*
+    Play a tone, or stop playing a tone if tone_def is NULL. Voice samples
+    queued in the playback ring are dropped. If drop_playback is true,
+    samples already written to the playback device are dropped too
+   */
+   AI_AUDIO_CMD_TONE,
+   /* Samples have been queued in the playback ring of an idle line */
+   AI_AUDIO_CMD_PLAYBACK,
+   /* The line is disconnected : close the sound devices */
+   AI_AUDIO_CMD_CLOSE,
+} alsa_input_audio_cmd_kind_t;
+
+typedef struct {
+   alsa_input_audio_cmd_kind_t kind;
+   /* The following fields are only used by AI_AUDIO_CMD_TONE */
+   const alsa_input_tone_def_t *tone_def;
+   size_t tone_duration_in_bytes;
+   bool drop_playback;
+   unsigned int playback_seq;
+   /* Only used by AI_AUDIO_CMD_CLOSE */
+   unsigned int close_seq;
+} alsa_input_audio_cmd_t;
+
+/*
+ Frame captured by the audio thread. Samples are stored after
+ AST_FRIENDLY_OFFSET bytes, so that the frame can be given to Asterisk
+ without any copy
+*/
+typedef struct {
+   size_t len;
+   /* AST_FRIENDLY_OFFSET + alsa_input_pvt_t.audio.frame_size bytes */
+   __u8 *buf;
+   /*
+    If true, the frame is a comfort noise frame (no samples) of level
+    -cng_level dBov
+   */
+   bool cng;
+   int cng_level;
+} alsa_input_audio_frame_t;
+
+/*
+ Buckets of the histogram of the latency from alsa_input_chan_write() to the
+ sound playback device : below 5 ms, then below twice the previous bound
+ (10, 20, ... 320 ms), the last one above
+*/
+#define AI_STATS_LATENCY_BUCKETS 8
+#define AI_STATS_LATENCY_FIRST_MS 5
+
+/* Delay (in samples at the rate of the line) of a sound device */
+typedef struct {
+   unsigned long min;
+   unsigned long max;
+   unsigned long sum;
+   unsigned long count;
+   unsigned long last;
+} alsa_input_stats_delay_t;
+
+/*
+ Statistics of a line, shown by 'ai show stats' and sent in the manager
+ event AlsaInputStats when a call ends. Each counter is only written by one
+ thread (the audio thread unless noted), atomically, so that the other
+ threads can read it at any time. They count since the module is loaded
+*/
+typedef struct {
+   /* Overruns of the capture device, underruns of the playback device */
+   unsigned long capture_xruns;
+   unsigned long playback_xruns;
+   /*
+    Frames queued for alsa_input_chan_read(), frames dropped because
+    they were not read quickly enough, and most frames waiting
+   */
+   unsigned long capture_frames;
+   unsigned long capture_dropped;
+   unsigned long capture_queue_max;
+   /* Periods of voice concealed (see alsa_input_plc_t) */
+   unsigned long concealed;
+   /* Delay of the sound devices, measured each time they are read or written */
+   alsa_input_stats_delay_t capture_delay;
+   alsa_input_stats_delay_t playback_delay;
+   /*
+    Written by alsa_input_chan_write() : frames queued, frames (partly)
+    dropped because the playback ring is full, and histogram of the latency
+    (samples queued before the frame and delay of the device)
+   */
+   unsigned long playback_frames;
+   unsigned long playback_dropped;
+   unsigned long latency[AI_STATS_LATENCY_BUCKETS];
+   /* Written by the monitor : frames (or controls) Asterisk refused to queue */
+   unsigned long queue_failures;
+} alsa_input_stats_t;
+
+struct alsa_input_pvt;
+
+/*
+ Kind of file descriptor registered in the epoll set of the monitor or in the
+ epoll set of the audio thread
+*/
+typedef enum {
+   AI_SRC_INPUT,
+   AI_SRC_CAPTURE,
+   AI_SRC_PLAYBACK,
+   /* Sound devices shared by several lines (see alsa_input_snd_shared_t) */
+   AI_SRC_SHARED_CAPTURE,
+   AI_SRC_SHARED_PLAYBACK,
+   /* eventfd used to wake up the monitor or the audio thread */
+   AI_SRC_WAKEUP,
+   /* timerfd armed on the nearest deadline of the lines */
+   AI_SRC_TIMER,
+} alsa_input_monitor_src_kind_t;
+
+struct alsa_input_snd_shared;
+
+/*
+ Pointer stored in epoll_event.data.ptr, so that when epoll_wait() returns,
+ the monitor goes straight to the line concerned.
+ For the file descriptors not related to a line (AI_SRC_WAKEUP and
+ AI_SRC_TIMER), pvt is NULL. For shared sound devices, pvt is NULL and
+ shared is the device.
+*/
+typedef struct {
+   struct alsa_input_pvt *pvt;
+   struct alsa_input_snd_shared *shared;
+   alsa_input_monitor_src_kind_t kind;
+} alsa_input_monitor_src_t;
+
+/* Upper bound of the number of channels of a shared sound device */
+#define AI_SHARED_MAX_CHANNELS 32
+
+/*
+ Multi-channel sound device shared by several lines, each line using one
+ channel : the device is opened once, with one poll descriptor, and each
+ period read (or written) serves all the lines. Interleaved samples are
+ split (or merged) by alsa_input_deinterleave() (or alsa_input_interleave()).
+ Only accessed by the audio thread once the devices are opened.
+*/
+typedef struct alsa_input_snd_shared {
+   struct alsa_input_snd_shared *next;
+   const char *dev_name;
+   snd_pcm_stream_t stream;
+   alsa_input_snd_card_t card;
+   int fd;
+   alsa_input_monitor_src_t src;
+   /* Rate of the device, valid once card is opened */
+   alsa_input_rate_t rate;
+   unsigned int channels;
+   /* Line using each channel (channels items), NULL if none */
+   struct alsa_input_pvt **lines;
+   /*
+    Number of lines capturing (or playing) : the device is started and
+    registered in the epoll set of the audio thread while it's not null
+   */
+   unsigned int users;
+   /* Set when a critical error occurs, the device is no more used */
+   bool failed;
+   /* One period of interleaved samples (buf_frames frames) */
+   int16_t *buf;
+   snd_pcm_uframes_t buf_frames;
+   /* Playback only : frames of buf not yet written, from buf_offset */
+   snd_pcm_uframes_t buf_len;
+   snd_pcm_uframes_t buf_offset;
+   /* One period of samples per channel (channels * buf_frames samples) */
+   int16_t *planes;
+   /* Array of channels pointers, used by the (de)interleave kernels */
+   int16_t **ptrs;
+} alsa_input_snd_shared_t;
+
 typedef struct alsa_input_pvt {
    AST_LIST_ENTRY(alsa_input_pvt) list;
    struct alsa_input_chan *channel;
    /* Index of the line in array channel->config.line_cfgs */
    size_t index_line;
-   /* Configuration of the line */
+   /*
+    Configuration of the line. It's replaced as a whole by a reload (see
+    alsa_input_publish_line_cfg()) : readers holding the monitor's lock or
+    the lock of the owner see a stable configuration, the audio thread
+    reads it with alsa_input_audio_line_cfg()
+   */
    const alsa_input_line_config_t *line_cfg;
+   /*
+    Configurations given by a reload and not yet applied, protected by the
+    monitor's lock
+   */
+   struct {
+      /*
+       Configuration to publish once the owner can be locked, with the
+       parameters of the sound and event devices of the running one
+      */
+      alsa_input_line_config_t *next_cfg;
+      /*
+       Whole configuration to apply once the line is idle, when parameters
+       of the devices changed : the devices are then reopened
+      */
+      alsa_input_line_config_t *pending_cfg;
+      /* true while the devices thread reopens the devices of the line */
+      bool reopening;
+      /* Set (atomically) to ask the devices thread to reopen the line */
+      int requested;
+      /*
+       Incremented each time a command AI_AUDIO_CMD_CLOSE is sent to the
+       audio thread : the line can be reopened once audio.close_ack is equal
+       to close_seq
+      */
+      unsigned int close_seq;
+   } reload;
    /*
     Asterisk channel linked to this line :
     any change of this field is protected by the monitor's lock and the channel
@@ -763,6 +1572,20 @@ typedef struct alsa_input_pvt {
 #ifdef DEBUG
    int owner_lock_count;
 #endif /* DEBUG */
+   /*
+    Sample rate of the sound devices : the highest one, not above parameter
+    'max_rate', supported by both devices. It's negotiated when the devices
+    are opened (see alsa_input_open_devices()) and the voice is exchanged
+    with Asterisk in signed linear at this rate.
+   */
+   alsa_input_rate_t rate;
+   /* Asterisk format for rate */
+   alsa_input_ast_format *format;
+   /* Native formats of the channels of the line (only format) */
+#if (AST_VERSION < 110)
+   alsa_input_ast_format_cap cap_value;
+#endif /* (AST_VERSION < 110) */
+   alsa_input_ast_format_cap *cap;
 
    /*
     The following fields are used by the monitor.
@@ -775,80 +1598,222 @@ typedef struct alsa_input_pvt {
        monitor thread when the ast_channel is not locked
       */
       alsa_input_state_t last_known_state;
-      /*
-       Copy of ast_channel.snd_capture_muted that can be accessed from the
-       monitor thread when the ast_channel is not locked
-      */
-      bool last_known_snd_capture_muted;
-      /* File descriptor of sound capture device */
-      int fd_snd_capture;
       /* File descriptor of input event device */
       int fd_input;
       /* File descriptor of output event device */
       int fd_output;
       /* If fd_input is the read end of a pipe, fd_pipe is the write end */
       int fd_pipe;
-      /* Buffer of input_events */
-      struct input_event events[64];
-      /* Number of significant bytes in array events */
-      size_t events_len_in_bytes;
+      /*
+       Ring of input_events : read() appends at events_head, the monitor
+       handles them from events_tail. The indexes run freely and are taken
+       modulo AI_INPUT_EVENTS_LEN
+      */
+      struct input_event events[AI_INPUT_EVENTS_LEN];
+      unsigned int events_head;
+      unsigned int events_tail;
+      /*
+       Index following the last SYN_REPORT received : only whole packets
+       (up to events_synced) are handled
+      */
+      unsigned int events_synced;
+      /* true after a SYN_DROPPED, until the next SYN_REPORT */
+      bool events_dropping;
+      /* Item registered in the epoll set for fd_input */
+      alsa_input_monitor_src_t src_input;
+      /* Events returned by epoll_wait() and not yet handled */
+      uint32_t revents_input;
+      /*
+       true if the line is already in the list of lines to service during
+       the current pass of the monitor
+      */
+      bool in_pass;
+      /* Next line in the list of lines to service */
+      struct alsa_input_pvt *next_service;
+      /*
+       Set to 1 (atomically) by alsa_input_monitor_kick() when the line is
+       pushed in the list alsa_input_chan_t.monitor.kicked. Can be
+       accessed without any lock.
+      */
+      int kicked;
+      /* Next line in the list alsa_input_chan_t.monitor.kicked */
+      struct alsa_input_pvt *next_kicked;
+      /*
+       Time (see alsa_input_clock_ms()) at which the line must be serviced
+       again by the monitor, or AI_NO_DEADLINE
+      */
+      int64_t deadline;
+      /*
+       Position of the line in the heap alsa_input_chan_t.monitor.heap or
+       AI_NOT_IN_HEAP
+      */
+      size_t heap_index;
+      /* Playback volume (in dB), changed by the volume keys */
+      int volume;
    } monitor;
 
    /*
-    The following fields must be accessed under the protection of the
-    ast_channel's lock (if an ast_channel is associated with this line)
+    The following fields are used by the audio thread, which owns the sound
+    devices : it captures the voice, plays the tones and the voice queued
+    by alsa_input_chan_write(). Unless told otherwise, they are only
+    accessed by the audio thread.
    */
    struct {
-      /* Logical state */
-      alsa_input_state_t state;
+      /*
+       Number of bytes of a period of the sound devices of the line (set from
+       its parameter 'period_ms' and its rate, see alsa_input_set_pvt_rate())
+      */
+      size_t frame_size;
+      /*
+       Lock-free single producer single consumer ring of commands. Producers
+       are the threads changing the state of the line : they are serialized
+       by the lock protecting pvt->ast_channel. cmds_head is only written by
+       the producer, cmds_tail only by the audio thread.
+      */
+      alsa_input_audio_cmd_t cmds[AI_AUDIO_CMDS_LEN];
+      unsigned int cmds_head;
+      unsigned int cmds_tail;
+      /*
+       Lock-free single producer single consumer ring of frames captured.
+       The producer is the audio thread (frames_head), the consumer is
+       alsa_input_chan_read() (frames_tail)
+      */
+      alsa_input_audio_frame_t *frames;
+      /* Number of items of array frames, a power of 2 */
+      unsigned int frames_len;
+      /* Memory holding the data of all the frames */
+      __u8 *frames_data;
+      unsigned int frames_head;
+      unsigned int frames_tail;
+      /*
+       eventfd written each time a frame is captured. It's the file
+       descriptor 0 of the ast_channel, so Asterisk calls
+       alsa_input_chan_read() when it's readable
+      */
+      int fd_frames;
       /* Handle of sound capture device */
       alsa_input_snd_card_t snd_capture;
-      /* Handle of sound playback device */
+      /*
+       Handle of sound playback device. The handle itself is set when the
+       devices are opened and reset by the audio thread on AI_AUDIO_CMD_CLOSE
+      */
       alsa_input_snd_card_t snd_playback;
-
+      /* File descriptors of sound devices */
+      int fd_snd_capture;
+      int fd_snd_playback;
+      /* Items registered in the epoll set of the audio thread */
+      alsa_input_monitor_src_t src_capture;
+      alsa_input_monitor_src_t src_playback;
       /*
-       Used to accumulate digits dialed
-       - to recognize an extension when dialing,
-       - to send dtmfs when in conversation (because we can't send
-       DTMFs too quickly so we must use a buffer to store them)
+       If not NULL, the line uses a channel (channel_capture or
+       channel_playback, starting from 0) of a shared device instead of
+       snd_capture or snd_playback. Reset by the audio thread on
+       AI_AUDIO_CMD_CLOSE
       */
-      char digits[AST_MAX_EXTENSION + 1];
-      /* Number of significants digits in array digits */
-      size_t digits_len;
+      alsa_input_snd_shared_t *shared_capture;
+      alsa_input_snd_shared_t *shared_playback;
+      unsigned int channel_capture;
+      unsigned int channel_playback;
       /*
-       When dialing flag set to true when a new digit is dialed, meaning
-       we can search for an extension
-       (after waiting the delay line_cfg->dialing_timeout).
-       Flag reset to false when the search has been done to not repeat
-       the search until no new digit has been dialed
+       Set when a critical error occurs on a sound device : the devices are
+       no more used until they are closed
       */
-      bool search_extension;
+      bool failed;
+      /* true if capture is started (fd_snd_capture is registered) */
+      bool capturing;
+      /* false if capture is started for DTMF detection only */
+      bool capture_deliver;
+      /* DTMF detector, used if line_cfg->dtmf_detect */
+      alsa_input_dtmf_t dtmf;
       /*
-       When AI_STATE_RINGING == ast_channel.state, boolean to know if buzzer
-       is on or off
+       Lock-free single producer single consumer ring of digits detected.
+       The producer is the audio thread (dtmf_head), the consumer is the
+       monitor (dtmf_tail) that handles them like keys pressed
       */
-      bool buzzer_is_on;
+      char dtmf_digits[AI_DTMF_DIGITS_LEN];
+      unsigned int dtmf_head;
+      unsigned int dtmf_tail;
       /*
-       When in conversation flag set to NONE, ON or OFF to handle
-       sending of DTMF.
+       Echo canceller, NULL unless line_cfg->echo_cancel. It's allocated for
+       the rate of the line once the sound devices are opened
       */
-      enum {
-         NONE, ON, OFF
-      } dtmf_sent;
+      alsa_input_aec_t *aec;
       /*
-       Used to wait a minimum delay :
-       - when ringing to toggle the buzzer on and off
-       - when dialing between last digit dialed and the search for
-       an extension
-       - when in conversation, between the queuing of two DTMFs
+       Ring of the samples written to the playback device, the reference of
+       the echo canceller (ref_size is a power of 2). ref_head counts the
+       samples written, ref_pos is the next one given to the echo canceller.
+       ref_chunk holds the reference of the samples being captured
       */
-      struct timeval tv_wait;
-      /* Status of the line */
-      alsa_input_status_t status;
-      /* When in conversation to know is sound capture is on or off */
-      bool snd_capture_muted;
-      /* Current tone playing */
-      alsa_input_tone_t tone;
+      int16_t *ref_buf;
+      size_t ref_size;
+      size_t ref_head;
+      size_t ref_pos;
+      int16_t *ref_chunk;
+      /*
+       Noise suppressor, NULL unless line_cfg->noise_suppress. It's
+       allocated for the rate of the line once the sound devices are opened
+      */
+      alsa_input_ns_t *ns;
+      /* Automatic gain control, used if line_cfg->agc */
+      alsa_input_agc_t agc;
+      /* Voice activity detector, used unless AI_VAD_NONE == line_cfg->vad */
+      alsa_input_vad_t vad;
+      /*
+       Gain of the voice and of the tones played (see AI_GAIN_SHIFT). Set
+       (atomically) by the monitor when the volume keys are pressed, read
+       by alsa_input_chan_write() and the audio thread
+      */
+      int play_gain;
+      /*
+       Number of bytes already read in the frame being captured (that is to
+       say in frames[frames_head])
+      */
+      size_t offset_capture;
+      /*
+       true if the frame being captured is dropped (read in buf_dropped)
+       because the ring of frames is full
+      */
+      bool capture_dropping;
+      __u8 *buf_dropped;
+      /*
+       true if fd_snd_playback is registered (a tone is playing or voice is
+       queued in the playback ring)
+      */
+      bool playback_polled;
+      /*
+       Lock-free single producer single consumer ring of voice samples to
+       play. The producer is alsa_input_chan_write() (play_head), the
+       consumer is the audio thread (play_tail) which writes them to the
+       device each time it can accept a period.
+       play_size is a power of 2, play_depth (<= play_size) is the maximum
+       number of bytes queued, that bounds the latency added by the ring
+      */
+      __u8 *play_buf;
+      size_t play_size;
+      size_t play_depth;
+      size_t play_head;
+      size_t play_tail;
+      /*
+       Set to 1 (atomically) by the audio thread when it stops polling
+       fd_snd_playback for voice (ring empty or tone playing). The producer
+       resets it to 0 when it queues samples and then sends
+       AI_AUDIO_CMD_PLAYBACK
+      */
+      int play_idle;
+      /*
+       Concealment of the voice missing, NULL unless line_cfg->plc. It's
+       allocated for the rate of the line once the sound devices are opened.
+       plc_buf holds a period of concealment
+      */
+      alsa_input_plc_t *plc;
+      int16_t *plc_buf;
+      /*
+       true when the playback device is left to run dry (a tone ended, the
+       concealment gave up) : the underrun that follows isn't counted
+      */
+      bool play_drained;
+      /* Tone playing, NULL if none */
+      const alsa_input_tone_def_t *tone_def;
       /*
        If tone must be played for a limited time (like for DTMF tones),
        number of bytes to generate.
@@ -858,31 +1823,116 @@ typedef struct alsa_input_pvt {
       /* State variable for tone generation */
       size_t tone_bytes_generated;
       alsa_input_tone_state_t tone_state;
+      /* Samples of the tone generated but not yet written */
+      __u8 *tone_buf;
+      size_t tone_buf_len;
+      size_t offset_tone_buf;
+      /* playback_seq of the last AI_AUDIO_CMD_TONE received */
+      unsigned int playback_seq;
+      /*
+       Set (atomically) to the playback_seq of the last AI_AUDIO_CMD_TONE
+       once the tone is stopped or completely played, so that voice can be
+       queued again. Read by the other threads.
+      */
+      unsigned int playback_ack;
+      /*
+       Set (atomically) to the close_seq of the last AI_AUDIO_CMD_CLOSE once
+       the sound devices are closed, the devices thread is then woken up.
+       Read by the other threads.
+      */
+      unsigned int close_ack;
+      /*
+       Set to 1 (atomically) by the audio thread when a critical error occurs
+       on a sound device, the monitor then disconnects the line
+      */
+      int critical_error;
+   } audio;
+
+   /*
+    The following fields must be accessed under the protection of the
+    ast_channel's lock (if an ast_channel is associated with this line)
+   */
+   struct {
+      /* Logical state */
+      alsa_input_state_t state;
+
+      /*
+       Used to accumulate digits dialed
+       - to recognize an extension when dialing,
+       - to send dtmfs when in conversation (because we can't send
+       DTMFs too quickly so we must use a buffer to store them)
+      */
+      char digits[AST_MAX_EXTENSION + 1];
+      /* Number of significants digits in array digits */
+      size_t digits_len;
+      /*
+       When dialing flag set to true when a new digit is dialed, meaning
+       we can search for an extension
+       (after waiting the delay line_cfg->dialing_timeout).
+       Flag reset to false when the search has been done to not repeat
+       the search until no new digit has been dialed
+      */
+      bool search_extension;
+      /*
+       When AI_STATE_RINGING == ast_channel.state, boolean to know if buzzer
+       is on or off
+      */
+      bool buzzer_is_on;
+      /*
+       When in conversation flag set to NONE, ON or OFF to handle
+       sending of DTMF.
+      */
+      enum {
+         NONE, ON, OFF
+      } dtmf_sent;
+      /*
+       Used to wait a minimum delay :
+       - when ringing to toggle the buzzer on and off
+       - when dialing between last digit dialed and the search for
+       an extension
+       - when in conversation, between the queuing of two DTMFs
+       Time in ms given by alsa_input_clock_ms()
+      */
+      int64_t wait_start;
+      /* Status of the line */
+      alsa_input_status_t status;
+      /* When in conversation to know is sound capture is on or off */
+      bool snd_capture_muted;
+      /* Current tone playing */
+      alsa_input_tone_t tone;
+      /*
+       Incremented each time a command AI_AUDIO_CMD_TONE is sent to the audio
+       thread. alsa_input_chan_write() can queue voice only if
+       audio.playback_ack is equal to playback_seq
+      */
+      unsigned int playback_seq;
       /* Frame used when calling ast_queue_frame() */
       struct ast_frame frame_to_queue;
-      __u8 buf_fr_to_queue[BUFFER_SIZE];
-      size_t offset_buf_fr_to_queue;
       /* Frame used in alsa_input_chan_read() */
       struct ast_frame frame;
-      __u8 buf_fr[AST_FRIENDLY_OFFSET + BUFFER_SIZE];
-      /*
-       Buffer used to hold an incomplete sample in order to only write
-       to the driver, a number of bytes that is a factor of SAMPLE_SIZE.
-       Buffer is also used to hold tone samples when playing tone.
-      */
-      __u8 bytes_not_written[BUFFER_SIZE];
       /*
-       Number of significant bytes in array bytes_not_written and position
-       of the first byte
+       true if the data of frame point to the slot audio.frames_tail of the
+       ring of frames captured, that is not yet given back to the audio
+       thread
       */
-      size_t bytes_not_written_len;
-      size_t offset_bytes_not_written;
+      bool frame_held;
    } ast_channel;
+
+   alsa_input_stats_t stats;
 } alsa_input_pvt_t;
 
 typedef struct {
    bool channel_is_locked;
-   int timeout;
+   /*
+    Time of the wakeup of the monitor (see alsa_input_clock_ms()), read
+    once per pass and used for all the lines serviced during the pass
+   */
+   int64_t now;
+   /*
+    Nearest time at which the line being serviced asks to be serviced again,
+    or AI_NO_DEADLINE
+   */
+   int64_t deadline;
 } alsa_input_monitor_prms_t;
 
 typedef struct alsa_input_chan
@@ -903,9 +1953,100 @@ typedef struct alsa_input_chan
 #ifdef DEBUG
       int lock_count;
 #endif /* DEBUG */
-      /* Used to poll files of the lines */
-      struct pollfd pfds[MAX_LINES * 2];
+      /*
+       epoll set containing the file descriptors of the lines. A file
+       descriptor is registered (or unregistered) only when the state of a
+       line changes, not on each iteration of the monitor
+      */
+      int epfd;
+      /*
+       eventfd registered in the epoll set, written by
+       alsa_input_monitor_kick() to wake up the monitor
+      */
+      int fd_wakeup;
+      /*
+       timerfd registered in the epoll set, armed on the nearest deadline
+       of the lines, so that the monitor is only woken up when a line has
+       something to do
+      */
+      int fd_timer;
+      /* Deadline on which fd_timer is armed, or AI_NO_DEADLINE */
+      int64_t timer_deadline;
+      /* Items registered in the epoll set for fd_wakeup and fd_timer */
+      alsa_input_monitor_src_t src_wakeup;
+      alsa_input_monitor_src_t src_timer;
+      /*
+       Binary min-heap of the lines having a deadline, ordered by
+       alsa_input_pvt_t.monitor.deadline : array of heap_len items
+       (allocated when the configuration is read). Only accessed by the
+       monitor thread
+      */
+      struct alsa_input_pvt **heap;
+      size_t heap_len;
+      /*
+       Buffer used by epoll_wait() : array of events_len items (allocated when
+       the configuration is read)
+      */
+      struct epoll_event *events;
+      size_t events_len;
+      /*
+       Lock-free list of lines whose state has been changed by another thread
+       and that must be serviced by the monitor
+      */
+      struct alsa_input_pvt *kicked;
+      /* Number of lines not in state AI_ST_DISCONNECTED */
+      size_t lines_connected;
+      /* Configurations of lines replaced by a reload and not yet freed */
+      alsa_input_retired_cfg_t *retired;
    } monitor;
+   struct
+   {
+      /* Flag set to false to stop the audio thread */
+      volatile bool run;
+      /*
+       Thread reading the sound capture devices and playing the tones of all
+       the lines. It never takes a lock : it receives commands through
+       alsa_input_pvt_t.audio.cmds and delivers frames through
+       alsa_input_pvt_t.audio.frames
+      */
+      pthread_t thread;
+      /* epoll set containing the sound devices in use */
+      int epfd;
+      /* List of the sound devices shared by several lines */
+      alsa_input_snd_shared_t *shared;
+      /* eventfd written when a command is sent to the audio thread */
+      int fd_wakeup;
+      alsa_input_monitor_src_t src_wakeup;
+      /* Buffer used by epoll_wait() : array of events_len items */
+      struct epoll_event *events;
+      size_t events_len;
+      /*
+       Number of passes of the audio thread, incremented (atomically) once it
+       has handled all the events returned by epoll_wait() : a configuration
+       replaced before a pass is no longer read once the next pass is done
+       (see alsa_input_reclaim_line_cfgs())
+      */
+      unsigned int passes;
+   } audio;
+   struct
+   {
+      /* Flag set to false to stop the devices thread */
+      volatile bool run;
+      /*
+       Thread reopening the devices of the lines (see
+       alsa_input_reopen_line()), so that neither the monitor nor the audio
+       thread waits for a device being opened
+      */
+      pthread_t thread;
+      /* eventfd written when a line must be reopened */
+      int fd_wakeup;
+      /*
+       inotify watching the directories of the event and sound devices, so
+       that lines disconnected when their phone was unplugged are reopened
+       when it's plugged again (see alsa_input_devices_hotplug()), or -1
+      */
+      int fd_inotify;
+   } devices;
 } alsa_input_chan_t;
 
 /*! Global jitterbuffer configuration - by default, jb is disabled
@@ -1125,25 +2266,32 @@ alsa_input_tone_part_t alsa_input_tone_dtmf_D_parts[1] = {
    }
 };
 
-static alsa_input_tone_def_t alsa_input_tone_dial;
-static alsa_input_tone_def_t alsa_input_tone_busy;
-static alsa_input_tone_def_t alsa_input_tone_invalid;
-static alsa_input_tone_def_t alsa_input_tone_dtmf_0;
-static alsa_input_tone_def_t alsa_input_tone_dtmf_1;
-static alsa_input_tone_def_t alsa_input_tone_dtmf_2;
-static alsa_input_tone_def_t alsa_input_tone_dtmf_3;
-static alsa_input_tone_def_t alsa_input_tone_dtmf_4;
-static alsa_input_tone_def_t alsa_input_tone_dtmf_5;
-static alsa_input_tone_def_t alsa_input_tone_dtmf_6;
-static alsa_input_tone_def_t alsa_input_tone_dtmf_7;
-static alsa_input_tone_def_t alsa_input_tone_dtmf_8;
-static alsa_input_tone_def_t alsa_input_tone_dtmf_9;
-static alsa_input_tone_def_t alsa_input_tone_dtmf_aster;
-static alsa_input_tone_def_t alsa_input_tone_dtmf_pound;
-static alsa_input_tone_def_t alsa_input_tone_dtmf_A;
-static alsa_input_tone_def_t alsa_input_tone_dtmf_B;
-static alsa_input_tone_def_t alsa_input_tone_dtmf_C;
-static alsa_input_tone_def_t alsa_input_tone_dtmf_D;
+static alsa_input_tone_def_t alsa_input_tone_dial[AI_RATE_COUNT];
+static alsa_input_tone_def_t alsa_input_tone_busy[AI_RATE_COUNT];
+static alsa_input_tone_def_t alsa_input_tone_invalid[AI_RATE_COUNT];
+static const alsa_input_tone_zone_t alsa_input_tone_zone_builtin = {
+   .next = NULL,
+   .name = "",
+   .dial = alsa_input_tone_dial,
+   .busy = alsa_input_tone_busy,
+   .invalid = alsa_input_tone_invalid,
+};
+static alsa_input_tone_def_t alsa_input_tone_dtmf_0[AI_RATE_COUNT];
+static alsa_input_tone_def_t alsa_input_tone_dtmf_1[AI_RATE_COUNT];
+static alsa_input_tone_def_t alsa_input_tone_dtmf_2[AI_RATE_COUNT];
+static alsa_input_tone_def_t alsa_input_tone_dtmf_3[AI_RATE_COUNT];
+static alsa_input_tone_def_t alsa_input_tone_dtmf_4[AI_RATE_COUNT];
+static alsa_input_tone_def_t alsa_input_tone_dtmf_5[AI_RATE_COUNT];
+static alsa_input_tone_def_t alsa_input_tone_dtmf_6[AI_RATE_COUNT];
+static alsa_input_tone_def_t alsa_input_tone_dtmf_7[AI_RATE_COUNT];
+static alsa_input_tone_def_t alsa_input_tone_dtmf_8[AI_RATE_COUNT];
+static alsa_input_tone_def_t alsa_input_tone_dtmf_9[AI_RATE_COUNT];
+static alsa_input_tone_def_t alsa_input_tone_dtmf_aster[AI_RATE_COUNT];
+static alsa_input_tone_def_t alsa_input_tone_dtmf_pound[AI_RATE_COUNT];
+static alsa_input_tone_def_t alsa_input_tone_dtmf_A[AI_RATE_COUNT];
+static alsa_input_tone_def_t alsa_input_tone_dtmf_B[AI_RATE_COUNT];
+static alsa_input_tone_def_t alsa_input_tone_dtmf_C[AI_RATE_COUNT];
+static alsa_input_tone_def_t alsa_input_tone_dtmf_D[AI_RATE_COUNT];
 
 static const char alsa_input_chan_type[] = "AlsaInput";
 static const char alsa_input_chan_desc[] = "ALSA / Input Channel Driver";
@@ -1151,25 +2299,23 @@ static const char alsa_input_cfg_file[] = "alsa_input.conf";
 static const char alsa_input_default_extension[] = "s";
 /*
  Constant short_timeout is used for example when we fail to lock a
- mutex : we set a short timeout for poll() to retry quicly
+ mutex : we set a short deadline for the line to retry quickly
 */
 static const int alsa_input_monitor_short_timeout = 10 /* ms */;
-/*
- When no line are in conversation mode, we set a timeout on poll()
- of several seconds (but remember that this timeout will delay the unloading of
- the module, more specifically, when we stop the monitor)
-*/
-static const int alsa_input_monitor_idle_timeout = 5000; /* ms */
 
-/*
- When at least one line is in conversation mode, as monitor thread is
- in charge of queuing data received, we set a period equal to the time
- needed to fill a frame
-*/
-static const int alsa_input_monitor_busy_period = (BUFFER_SIZE / (SAMPLE_SIZE * DEFAULT_SAMPLES_PER_MS));
+static unsigned int alsa_input_gcd(unsigned int a, unsigned int b)
+{
+   while (0 != b) {
+      unsigned int tmp = a % b;
+      a = b;
+      b = tmp;
+   }
+   return (a);
+}
 
 static void alsa_input_convert_tone_part_to_item(
-   const alsa_input_tone_part_t *pp, alsa_input_tone_item_t *pi, int vol)
+   const alsa_input_tone_part_t *pp, alsa_input_tone_item_t *pi,
+   unsigned int sample_rate, int vol)
 {
    static const int midi_tohz[128] = {
       8,     8,     9,     9,     10,    10,    11,    12,    12,    13,
@@ -1186,3301 +2332,9348 @@ static void alsa_input_convert_tone_part_to_item(
       4698,  4978,  5274,  5587,  5919,  6271,  6644,  7040,  7458,  7902,
       8372,  8869,  9397,  9956,  10548, 11175, 11839, 12543
    };
-   static const double max_sample_val = 32768.0;
-
-   double freq1;
-   double freq2;
+   size_t k;
 
    if (pp->midinote) {
       /* midi notes must be between 0 and 127 */
       if (/* (pp->freq1 >= 0) && */ (pp->freq1 <= 127)) {
-         freq1 = midi_tohz[pp->freq1];
+         pi->freq1 = midi_tohz[pp->freq1];
       }
       else {
-         freq1 = 0;
+         pi->freq1 = 0;
       }
       if (/* (pp->freq2 >= 0) && */ (pp->freq2 <= 127)) {
-         freq2 = midi_tohz[pp->freq2];
+         pi->freq2 = midi_tohz[pp->freq2];
       }
       else {
-         freq2 = 0;
+         pi->freq2 = 0;
       }
    }
    else {
-      freq1 = pp->freq1;
-      freq2 = pp->freq2;
+      pi->freq1 = pp->freq1;
+      pi->freq2 = pp->freq2;
    }
 
-   pi->fac1 = 2.0 * cos(2.0 * M_PI * (freq1 / DEFAULT_SAMPLE_RATE)) * max_sample_val;
-   pi->init_v2_1 = sin(-4.0 * M_PI * (freq1 / DEFAULT_SAMPLE_RATE)) * vol;
-   pi->init_v3_1 = sin(-2.0 * M_PI * (freq1 / DEFAULT_SAMPLE_RATE)) * vol;
-
-   pi->fac2 = 2.0 * cos(2.0 * M_PI * (freq2 / DEFAULT_SAMPLE_RATE)) * max_sample_val;
-   pi->init_v2_2 = sin(-4.0 * M_PI * (freq2 / DEFAULT_SAMPLE_RATE)) * vol;
-   pi->init_v3_2 = sin(-2.0 * M_PI * (freq2 / DEFAULT_SAMPLE_RATE)) * vol;
-
    pi->duration = pp->time;
    pi->modulate = pp->modulate;
+
+   pi->rate = sample_rate;
+   pi->w1 = 2.0 * M_PI * ((double)(pi->freq1) / sample_rate);
+   pi->w2 = 2.0 * M_PI * ((double)(pi->freq2) / sample_rate);
+   pi->amp = vol;
+   for (k = 0; (k < ARRAY_LEN(pi->rot1_sin)); k += 1) {
+      pi->rot1_sin[k] = sin(pi->w1 * k);
+      pi->rot1_cos[k] = cos(pi->w1 * k);
+      pi->rot2_sin[k] = sin(pi->w2 * k);
+      pi->rot2_cos[k] = cos(pi->w2 * k);
+   }
 }
 
-static void alsa_input_tone_def_init(alsa_input_tone_def_t *pd,
-   int vol, const alsa_input_tone_part_t *parts, size_t part_count)
+/*
+ Number of samples of an item played forever that are rendered : both
+ frequencies complete a whole number of cycles so the loop is seamless. It
+ is at most one second
+*/
+static size_t alsa_input_tone_item_period(const alsa_input_tone_item_t *pi,
+   unsigned int sample_rate)
 {
-   size_t i;
+   unsigned int g = alsa_input_gcd(sample_rate, pi->freq1);
 
-   alsa_input_assert((NULL != parts) && (part_count > 0) && (part_count <= ARRAY_LEN(pd->items)));
-   pd->nitems = part_count;
-   pd->reppos = 0;
-   for (i = 0; (i < part_count); i += 1) {
-      alsa_input_convert_tone_part_to_item(&(parts[i]), &(pd->items[i]), vol);
-   }
+   g = alsa_input_gcd(g, pi->freq2);
+   return (sample_rate / g);
 }
 
-static void alsa_input_tone_state_init(alsa_input_tone_state_t *ps,
-   const alsa_input_tone_def_t *pd)
+/*
+ Exact sin and cos of the phases of the oscillators of an item at sample pos.
+ The frequencies are integers, so the phases are periodic over rate samples
+*/
+static void alsa_input_tone_item_phase(const alsa_input_tone_item_t *pi,
+   size_t pos, float *s1, float *c1, float *s2, float *c2)
 {
-   memset(ps, 0, sizeof(*ps));
-   ps->reppos = pd->reppos;
-   ps->nitems = pd->nitems;
-   ps->items = pd->items;
-   ps->pos = 0;
-   ps->npos = 0;
-   ps->oldnpos = ARRAY_LEN(pd->items) + 1;
+   double n = (double)(pos % pi->rate);
+
+   *s1 = sin(pi->w1 * n);
+   *c1 = cos(pi->w1 * n);
+   *s2 = sin(pi->w2 * n);
+   *c2 = cos(pi->w2 * n);
 }
 
-#if (2 != SAMPLE_SIZE)
-#error "SAMPLE_SIZE must be equal to 2"
-#endif
+/*
+ Dual-tone synthesis kernels : they write count native int16 samples of an
+ item starting at sample pos of the item. The oscillators are complex
+ phasors rotated by the phase step, several samples in parallel, and their
+ phases are computed exactly every AI_TONE_SYNTH_BLOCK samples so they don't
+ drift
+*/
+typedef void (*alsa_input_tone_synth_fn_t)(const alsa_input_tone_item_t *pi,
+   size_t pos, int16_t *out, size_t count);
 
-static size_t alsa_input_generate_tone_data(alsa_input_tone_state_t *ps, __u8 *data, size_t len)
+static inline float alsa_input_tone_mix(const alsa_input_tone_item_t *pi,
+   float s1, float s2)
 {
-   size_t ret = 0;
+   float v1 = s1 * pi->amp;
+   float v2 = s2 * pi->amp;
 
-   /* alsa_input_pr_debug("alsa_input_generate_tone_data(len=%lu)\n",
-      (unsigned long)(len)); */
-
-   alsa_input_assert((NULL != data) && (len > 0));
+   if (pi->modulate) {
+      return ((v1 * (((32768.0f - v2) * 0.9f) + 1.0f)) * (1.0f / 32768.0f));
+   }
+   return (v1 + v2);
+}
 
-   if (ps->npos < ps->nitems) {
+static void alsa_input_tone_synth_scalar(const alsa_input_tone_item_t *pi,
+   size_t pos, int16_t *out, size_t count)
+{
+   while (count > 0) {
+      size_t n = (count < AI_TONE_SYNTH_BLOCK) ? count : AI_TONE_SYNTH_BLOCK;
+      float s1, c1, s2, c2;
+      size_t x;
+
+      alsa_input_tone_item_phase(pi, pos, &s1, &c1, &s2, &c2);
+      for (x = 0; (x < n); x += 1) {
+         long v = lrintf(alsa_input_tone_mix(pi, s1, s2));
+         float t;
+
+         out[x] = (v > INT16_MAX) ? INT16_MAX : ((v < INT16_MIN) ? INT16_MIN : v);
+         t = (s1 * pi->rot1_cos[1]) + (c1 * pi->rot1_sin[1]);
+         c1 = (c1 * pi->rot1_cos[1]) - (s1 * pi->rot1_sin[1]);
+         s1 = t;
+         t = (s2 * pi->rot2_cos[1]) + (c2 * pi->rot2_sin[1]);
+         c2 = (c2 * pi->rot2_cos[1]) - (s2 * pi->rot2_sin[1]);
+         s2 = t;
+      }
+      out += n;
+      pos += n;
+      count -= n;
+   }
+}
 
-      /* we need to prepare a frame with 16 * timelen samples as we're
-       * generating SLIN audio */
-      memset(data, 0, len);
+#if defined(__SSE2__)
+/* Mixes 4 samples of both oscillators and rounds them to int32 */
+static inline __m128i alsa_input_tone_mix_sse2(const alsa_input_tone_item_t *pi,
+   __m128 s1, __m128 s2)
+{
+   const __m128 amp = _mm_set1_ps(pi->amp);
+   __m128 v1 = _mm_mul_ps(s1, amp);
+   __m128 v2 = _mm_mul_ps(s2, amp);
+
+   if (pi->modulate) {
+      __m128 p = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(_mm_set1_ps(32768.0f), v2),
+         _mm_set1_ps(0.9f)), _mm_set1_ps(1.0f));
+      return (_mm_cvtps_epi32(_mm_mul_ps(_mm_mul_ps(v1, p), _mm_set1_ps(1.0f / 32768.0f))));
+   }
+   return (_mm_cvtps_epi32(_mm_add_ps(v1, v2)));
+}
 
-      for (;;) {
-         const alsa_input_tone_item_t *pi = &(ps->items[ps->npos]);
-         size_t sample_count;
-         size_t x;
-
-         if (ps->oldnpos != ps->npos) {
-            /* Load new parameters */
-            ps->v1_1 = 0;
-            ps->v2_1 = pi->init_v2_1;
-            ps->v3_1 = pi->init_v3_1;
-            ps->v1_2 = 0;
-            ps->v2_2 = pi->init_v2_2;
-            ps->v3_2 = pi->init_v3_2;
-            ps->pos = 0;
-            ps->oldnpos = ps->npos;
-         }
-
-         sample_count = len / SAMPLE_SIZE;
-         if ((pi->duration > 0)
-             && ((ps->pos + sample_count) > (pi->duration * DEFAULT_SAMPLES_PER_MS))) {
-            sample_count = (pi->duration * DEFAULT_SAMPLES_PER_MS) - ps->pos;
-         }
-
-         for (x = 0; (x < sample_count); x += 1) {
-            __s16 sample;
-            ps->v1_1 = ps->v2_1;
-            ps->v2_1 = ps->v3_1;
-            ps->v3_1 = (pi->fac1 * ps->v2_1 >> 15) - ps->v1_1;
-
-            ps->v1_2 = ps->v2_2;
-            ps->v2_2 = ps->v3_2;
-            ps->v3_2 = (pi->fac2 * ps->v2_2 >> 15) - ps->v1_2;
-            if (pi->modulate) {
-               int p;
-               p = ps->v3_2 - 32768;
-               if (p < 0) {
-                  p = -p;
-               }
-               p = ((p * 9) / 10) + 1;
-               sample = (ps->v3_1 * p) >> 15;
-            } else {
-               sample = ps->v3_1 + ps->v3_2;
-            }
-#if __BYTE_ORDER == __LITTLE_ENDIAN
-            *data = (__u8)(sample & 0xFF);
-            data += 1;
-            *data = (__u8)(sample >> 8);
-#else
-            *data = (__u8)(sample >> 8);
-            data += 1;
-            *data = (__u8)(sample & 0xFF);
-#endif
-            data += 1;
+static void alsa_input_tone_synth_sse2(const alsa_input_tone_item_t *pi,
+   size_t pos, int16_t *out, size_t count)
+{
+   const __m128 rs1 = _mm_loadu_ps(&(pi->rot1_sin[0]));
+   const __m128 rc1 = _mm_loadu_ps(&(pi->rot1_cos[0]));
+   const __m128 rs2 = _mm_loadu_ps(&(pi->rot2_sin[0]));
+   const __m128 rc2 = _mm_loadu_ps(&(pi->rot2_cos[0]));
+   const __m128 ss1 = _mm_set1_ps(pi->rot1_sin[4]);
+   const __m128 sc1 = _mm_set1_ps(pi->rot1_cos[4]);
+   const __m128 ss2 = _mm_set1_ps(pi->rot2_sin[4]);
+   const __m128 sc2 = _mm_set1_ps(pi->rot2_cos[4]);
+
+   while (count > 0) {
+      size_t n = (count < AI_TONE_SYNTH_BLOCK) ? count : AI_TONE_SYNTH_BLOCK;
+      float s1, c1, s2, c2;
+      __m128 vs1, vc1, vs2, vc2;
+      size_t x;
+
+      alsa_input_tone_item_phase(pi, pos, &s1, &c1, &s2, &c2);
+      /* Lane k holds the phasors of sample k */
+      vs1 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(s1), rc1), _mm_mul_ps(_mm_set1_ps(c1), rs1));
+      vc1 = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(c1), rc1), _mm_mul_ps(_mm_set1_ps(s1), rs1));
+      vs2 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(s2), rc2), _mm_mul_ps(_mm_set1_ps(c2), rs2));
+      vc2 = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(c2), rc2), _mm_mul_ps(_mm_set1_ps(s2), rs2));
+      for (x = 0; (x < n); x += 8) {
+         __m128i lo;
+         __m128i hi;
+         __m128 t;
+
+         lo = alsa_input_tone_mix_sse2(pi, vs1, vs2);
+         t = _mm_add_ps(_mm_mul_ps(vs1, sc1), _mm_mul_ps(vc1, ss1));
+         vc1 = _mm_sub_ps(_mm_mul_ps(vc1, sc1), _mm_mul_ps(vs1, ss1));
+         vs1 = t;
+         t = _mm_add_ps(_mm_mul_ps(vs2, sc2), _mm_mul_ps(vc2, ss2));
+         vc2 = _mm_sub_ps(_mm_mul_ps(vc2, sc2), _mm_mul_ps(vs2, ss2));
+         vs2 = t;
+         hi = alsa_input_tone_mix_sse2(pi, vs1, vs2);
+         t = _mm_add_ps(_mm_mul_ps(vs1, sc1), _mm_mul_ps(vc1, ss1));
+         vc1 = _mm_sub_ps(_mm_mul_ps(vc1, sc1), _mm_mul_ps(vs1, ss1));
+         vs1 = t;
+         t = _mm_add_ps(_mm_mul_ps(vs2, sc2), _mm_mul_ps(vc2, ss2));
+         vc2 = _mm_sub_ps(_mm_mul_ps(vc2, sc2), _mm_mul_ps(vs2, ss2));
+         vs2 = t;
+         if ((n - x) >= 8) {
+            _mm_storeu_si128((__m128i *)(&(out[x])), _mm_packs_epi32(lo, hi));
          }
+         else {
+            int16_t tmp[8];
 
-         ps->pos += x;
-         ret += x;
-         len -= (x * SAMPLE_SIZE);
+            _mm_storeu_si128((__m128i *)tmp, _mm_packs_epi32(lo, hi));
+            memcpy(&(out[x]), tmp, (n - x) * sizeof(tmp[0]));
+         }
+      }
+      out += n;
+      pos += n;
+      count -= n;
+   }
+}
+#endif /* defined(__SSE2__) */
 
-         if ((pi->duration > 0)
-             && (ps->pos >= (pi->duration * DEFAULT_SAMPLES_PER_MS))) { /* item finished? */
-            ps->npos += 1;
-            if (ps->npos >= ps->nitems) { /* last item? */
-               if (ps->reppos >= 0) {     /* repeat set? */
-                  ps->npos = ps->reppos;  /* redo from top */
-               }
-            }
+#if defined(AI_HAVE_AVX2)
+__attribute__((target("avx2")))
+static void alsa_input_tone_synth_avx2(const alsa_input_tone_item_t *pi,
+   size_t pos, int16_t *out, size_t count)
+{
+   const __m256 rs1 = _mm256_loadu_ps(&(pi->rot1_sin[0]));
+   const __m256 rc1 = _mm256_loadu_ps(&(pi->rot1_cos[0]));
+   const __m256 rs2 = _mm256_loadu_ps(&(pi->rot2_sin[0]));
+   const __m256 rc2 = _mm256_loadu_ps(&(pi->rot2_cos[0]));
+   const __m256 ss1 = _mm256_set1_ps(pi->rot1_sin[8]);
+   const __m256 sc1 = _mm256_set1_ps(pi->rot1_cos[8]);
+   const __m256 ss2 = _mm256_set1_ps(pi->rot2_sin[8]);
+   const __m256 sc2 = _mm256_set1_ps(pi->rot2_cos[8]);
+   const __m256 amp = _mm256_set1_ps(pi->amp);
+
+   while (count > 0) {
+      size_t n = (count < AI_TONE_SYNTH_BLOCK) ? count : AI_TONE_SYNTH_BLOCK;
+      float s1, c1, s2, c2;
+      __m256 vs1, vc1, vs2, vc2;
+      size_t x;
+
+      alsa_input_tone_item_phase(pi, pos, &s1, &c1, &s2, &c2);
+      /* Lane k holds the phasors of sample k */
+      vs1 = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(s1), rc1), _mm256_mul_ps(_mm256_set1_ps(c1), rs1));
+      vc1 = _mm256_sub_ps(_mm256_mul_ps(_mm256_set1_ps(c1), rc1), _mm256_mul_ps(_mm256_set1_ps(s1), rs1));
+      vs2 = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(s2), rc2), _mm256_mul_ps(_mm256_set1_ps(c2), rs2));
+      vc2 = _mm256_sub_ps(_mm256_mul_ps(_mm256_set1_ps(c2), rc2), _mm256_mul_ps(_mm256_set1_ps(s2), rs2));
+      for (x = 0; (x < n); x += 8) {
+         __m256 v1 = _mm256_mul_ps(vs1, amp);
+         __m256 v2 = _mm256_mul_ps(vs2, amp);
+         __m256i v;
+         __m128i w;
+         __m256 t;
+
+         if (pi->modulate) {
+            __m256 p = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(32768.0f), v2),
+               _mm256_set1_ps(0.9f)), _mm256_set1_ps(1.0f));
+            v = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_mul_ps(v1, p), _mm256_set1_ps(1.0f / 32768.0f)));
+         }
+         else {
+            v = _mm256_cvtps_epi32(_mm256_add_ps(v1, v2));
+         }
+         w = _mm_packs_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+         if ((n - x) >= 8) {
+            _mm_storeu_si128((__m128i *)(&(out[x])), w);
          }
+         else {
+            int16_t tmp[8];
 
-         if (len < SAMPLE_SIZE) {
-            break;
+            _mm_storeu_si128((__m128i *)tmp, w);
+            memcpy(&(out[x]), tmp, (n - x) * sizeof(tmp[0]));
          }
-      }
+         t = _mm256_add_ps(_mm256_mul_ps(vs1, sc1), _mm256_mul_ps(vc1, ss1));
+         vc1 = _mm256_sub_ps(_mm256_mul_ps(vc1, sc1), _mm256_mul_ps(vs1, ss1));
+         vs1 = t;
+         t = _mm256_add_ps(_mm256_mul_ps(vs2, sc2), _mm256_mul_ps(vc2, ss2));
+         vc2 = _mm256_sub_ps(_mm256_mul_ps(vc2, sc2), _mm256_mul_ps(vs2, ss2));
+         vs2 = t;
+      }
+      out += n;
+      pos += n;
+      count -= n;
    }
+}
+#endif /* defined(AI_HAVE_AVX2) */
 
-   return (ret * SAMPLE_SIZE);
+#if defined(__ARM_NEON)
+/* Mixes 4 samples of both oscillators and rounds them to int32 */
+static inline int32x4_t alsa_input_tone_mix_neon(const alsa_input_tone_item_t *pi,
+   float32x4_t s1, float32x4_t s2)
+{
+   float32x4_t v1 = vmulq_n_f32(s1, pi->amp);
+   float32x4_t v2 = vmulq_n_f32(s2, pi->amp);
+   float32x4_t r;
+
+   if (pi->modulate) {
+      float32x4_t p = vaddq_f32(vmulq_n_f32(vsubq_f32(vdupq_n_f32(32768.0f), v2), 0.9f),
+         vdupq_n_f32(1.0f));
+      r = vmulq_n_f32(vmulq_f32(v1, p), 1.0f / 32768.0f);
+   }
+   else {
+      r = vaddq_f32(v1, v2);
+   }
+   /* Round to nearest, vcvtq_s32_f32() truncates */
+   r = vaddq_f32(r, vbslq_f32(vcltq_f32(r, vdupq_n_f32(0.0f)),
+      vdupq_n_f32(-0.5f), vdupq_n_f32(0.5f)));
+   return (vcvtq_s32_f32(r));
 }
 
-static void alsa_input_init_tones(void)
+static void alsa_input_tone_synth_neon(const alsa_input_tone_item_t *pi,
+   size_t pos, int16_t *out, size_t count)
 {
-   static const int vol = 7219; /* Default to -8db */
+   const float32x4_t rs1 = vld1q_f32(&(pi->rot1_sin[0]));
+   const float32x4_t rc1 = vld1q_f32(&(pi->rot1_cos[0]));
+   const float32x4_t rs2 = vld1q_f32(&(pi->rot2_sin[0]));
+   const float32x4_t rc2 = vld1q_f32(&(pi->rot2_cos[0]));
+   const float ss1 = pi->rot1_sin[4];
+   const float sc1 = pi->rot1_cos[4];
+   const float ss2 = pi->rot2_sin[4];
+   const float sc2 = pi->rot2_cos[4];
+
+   while (count > 0) {
+      size_t n = (count < AI_TONE_SYNTH_BLOCK) ? count : AI_TONE_SYNTH_BLOCK;
+      float s1, c1, s2, c2;
+      float32x4_t vs1, vc1, vs2, vc2;
+      size_t x;
+
+      alsa_input_tone_item_phase(pi, pos, &s1, &c1, &s2, &c2);
+      /* Lane k holds the phasors of sample k */
+      vs1 = vaddq_f32(vmulq_n_f32(rc1, s1), vmulq_n_f32(rs1, c1));
+      vc1 = vsubq_f32(vmulq_n_f32(rc1, c1), vmulq_n_f32(rs1, s1));
+      vs2 = vaddq_f32(vmulq_n_f32(rc2, s2), vmulq_n_f32(rs2, c2));
+      vc2 = vsubq_f32(vmulq_n_f32(rc2, c2), vmulq_n_f32(rs2, s2));
+      for (x = 0; (x < n); x += 8) {
+         int16x4_t lo;
+         int16x4_t hi;
+         float32x4_t t;
+
+         lo = vqmovn_s32(alsa_input_tone_mix_neon(pi, vs1, vs2));
+         t = vaddq_f32(vmulq_n_f32(vs1, sc1), vmulq_n_f32(vc1, ss1));
+         vc1 = vsubq_f32(vmulq_n_f32(vc1, sc1), vmulq_n_f32(vs1, ss1));
+         vs1 = t;
+         t = vaddq_f32(vmulq_n_f32(vs2, sc2), vmulq_n_f32(vc2, ss2));
+         vc2 = vsubq_f32(vmulq_n_f32(vc2, sc2), vmulq_n_f32(vs2, ss2));
+         vs2 = t;
+         hi = vqmovn_s32(alsa_input_tone_mix_neon(pi, vs1, vs2));
+         t = vaddq_f32(vmulq_n_f32(vs1, sc1), vmulq_n_f32(vc1, ss1));
+         vc1 = vsubq_f32(vmulq_n_f32(vc1, sc1), vmulq_n_f32(vs1, ss1));
+         vs1 = t;
+         t = vaddq_f32(vmulq_n_f32(vs2, sc2), vmulq_n_f32(vc2, ss2));
+         vc2 = vsubq_f32(vmulq_n_f32(vc2, sc2), vmulq_n_f32(vs2, ss2));
+         vs2 = t;
+         if ((n - x) >= 8) {
+            vst1q_s16(&(out[x]), vcombine_s16(lo, hi));
+         }
+         else {
+            int16_t tmp[8];
 
-   alsa_input_tone_def_init(&(alsa_input_tone_dial), vol, alsa_input_tone_dial_parts, ARRAY_LEN(alsa_input_tone_dial_parts));
-   alsa_input_tone_def_init(&(alsa_input_tone_busy), vol, alsa_input_tone_busy_parts, ARRAY_LEN(alsa_input_tone_busy_parts));
-   alsa_input_tone_def_init(&(alsa_input_tone_invalid), vol, alsa_input_tone_invalid_parts, ARRAY_LEN(alsa_input_tone_invalid_parts));
-   alsa_input_tone_def_init(&(alsa_input_tone_dtmf_0), vol, alsa_input_tone_dtmf_0_parts, ARRAY_LEN(alsa_input_tone_dtmf_0_parts));
-   alsa_input_tone_def_init(&(alsa_input_tone_dtmf_1), vol, alsa_input_tone_dtmf_1_parts, ARRAY_LEN(alsa_input_tone_dtmf_1_parts));
-   alsa_input_tone_def_init(&(alsa_input_tone_dtmf_2), vol, alsa_input_tone_dtmf_2_parts, ARRAY_LEN(alsa_input_tone_dtmf_2_parts));
-   alsa_input_tone_def_init(&(alsa_input_tone_dtmf_3), vol, alsa_input_tone_dtmf_3_parts, ARRAY_LEN(alsa_input_tone_dtmf_3_parts));
-   alsa_input_tone_def_init(&(alsa_input_tone_dtmf_4), vol, alsa_input_tone_dtmf_4_parts, ARRAY_LEN(alsa_input_tone_dtmf_4_parts));
-   alsa_input_tone_def_init(&(alsa_input_tone_dtmf_5), vol, alsa_input_tone_dtmf_5_parts, ARRAY_LEN(alsa_input_tone_dtmf_5_parts));
-   alsa_input_tone_def_init(&(alsa_input_tone_dtmf_6), vol, alsa_input_tone_dtmf_6_parts, ARRAY_LEN(alsa_input_tone_dtmf_6_parts));
-   alsa_input_tone_def_init(&(alsa_input_tone_dtmf_7), vol, alsa_input_tone_dtmf_7_parts, ARRAY_LEN(alsa_input_tone_dtmf_7_parts));
-   alsa_input_tone_def_init(&(alsa_input_tone_dtmf_8), vol, alsa_input_tone_dtmf_8_parts, ARRAY_LEN(alsa_input_tone_dtmf_8_parts));
-   alsa_input_tone_def_init(&(alsa_input_tone_dtmf_9), vol, alsa_input_tone_dtmf_9_parts, ARRAY_LEN(alsa_input_tone_dtmf_9_parts));
-   alsa_input_tone_def_init(&(alsa_input_tone_dtmf_aster), vol, alsa_input_tone_dtmf_aster_parts, ARRAY_LEN(alsa_input_tone_dtmf_aster_parts));
-   alsa_input_tone_def_init(&(alsa_input_tone_dtmf_pound), vol, alsa_input_tone_dtmf_pound_parts, ARRAY_LEN(alsa_input_tone_dtmf_pound_parts));
-   alsa_input_tone_def_init(&(alsa_input_tone_dtmf_A), vol, alsa_input_tone_dtmf_A_parts, ARRAY_LEN(alsa_input_tone_dtmf_A_parts));
-   alsa_input_tone_def_init(&(alsa_input_tone_dtmf_B), vol, alsa_input_tone_dtmf_B_parts, ARRAY_LEN(alsa_input_tone_dtmf_B_parts));
-   alsa_input_tone_def_init(&(alsa_input_tone_dtmf_C), vol, alsa_input_tone_dtmf_C_parts, ARRAY_LEN(alsa_input_tone_dtmf_C_parts));
-   alsa_input_tone_def_init(&(alsa_input_tone_dtmf_D), vol, alsa_input_tone_dtmf_D_parts, ARRAY_LEN(alsa_input_tone_dtmf_D_parts));
+            vst1q_s16(tmp, vcombine_s16(lo, hi));
+            memcpy(&(out[x]), tmp, (n - x) * sizeof(tmp[0]));
+         }
+      }
+      out += n;
+      pos += n;
+      count -= n;
+   }
 }
+#endif /* defined(__ARM_NEON) */
 
-static int alsa_input_snd_card_init(alsa_input_snd_card_t *t, const char *dev,
-   snd_pcm_stream_t stream, int *fd)
+/* Kernel selected by alsa_input_init_tone_synth() */
+static alsa_input_tone_synth_fn_t alsa_input_tone_synth = alsa_input_tone_synth_scalar;
+
+static void alsa_input_init_tone_synth(void)
 {
-   int ret = -1;
-   snd_pcm_t *handle = NULL;
-   snd_pcm_hw_params_t *hw_params = NULL;
-   snd_pcm_sw_params_t *sw_params = NULL;
+#if defined(__SSE2__)
+   alsa_input_tone_synth = alsa_input_tone_synth_sse2;
+#elif defined(__ARM_NEON)
+   alsa_input_tone_synth = alsa_input_tone_synth_neon;
+#else
+   alsa_input_tone_synth = alsa_input_tone_synth_scalar;
+#endif
+#if defined(AI_HAVE_AVX2)
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("avx2")) {
+      alsa_input_tone_synth = alsa_input_tone_synth_avx2;
+   }
+#endif /* defined(AI_HAVE_AVX2) */
+}
 
-   memset(t, 0, sizeof(*t));
+/*
+ Renders the cadence of a tone def. Items after an item played forever are
+ never reached and are not rendered
+*/
+static int alsa_input_tone_def_render(alsa_input_tone_def_t *pd,
+   unsigned int sample_rate)
+{
+   int ret = -1;
+   size_t len = 0;
+   size_t loop;
+   size_t pos;
+   int i;
 
    do { /* Empty loop */
-      int err;
-      int direction;
-      snd_pcm_uframes_t period_size;
-      snd_pcm_uframes_t buffer_size = 0;
-      unsigned int rate;
-      snd_pcm_uframes_t start_threshold;
-      snd_pcm_uframes_t stop_threshold;
+      loop = 0;
+      for (i = 0; (i < pd->nitems); i += 1) {
+         const alsa_input_tone_item_t *pi = &(pd->items[i]);
 
-      err = snd_pcm_open(&(handle), dev, stream, SND_PCM_NONBLOCK);
-      if (err) {
-         ast_log(AST_LOG_ERROR, "snd_pcm_open() failed for device '%s': '%s'\n", dev, snd_strerror(err));
-         ret = err;
+         if (i == pd->reppos) {
+            loop = len;
+         }
+         if (0 == pi->duration) {
+            loop = len;
+            len += alsa_input_tone_item_period(pi, sample_rate);
+            break;
+         }
+         len += (size_t)(pi->duration) * pd->samples_per_ms;
+      }
+      if ((i >= pd->nitems) && (pd->reppos < 0)) {
+         loop = len;
+      }
+      if (0 == len) {
+         ast_log(AST_LOG_ERROR, "Tone has no sample\n");
          break;
       }
-      alsa_input_pr_debug("Opening device '%s' in %s mode\n", dev, (stream == SND_PCM_STREAM_CAPTURE) ? "read" : "write");
 
-      hw_params = NULL;
-      err = snd_pcm_hw_params_malloc(&(hw_params));
-      if ((err < 0) || (NULL == hw_params)) {
-         ast_log(AST_LOG_ERROR, "Failed to allocate hw_params structure for device '%s'\n", dev);
+      /* Too long or not enough memory : the tone is synthesized live */
+      ret = 0;
+      if (len > ((size_t)(AI_TONE_MAX_RENDERED_MS) * pd->samples_per_ms)) {
          break;
       }
-
-      err = snd_pcm_hw_params_any(handle, hw_params);
-      if (err < 0) {
-         ret = err;
-         ast_log(AST_LOG_ERROR, "snd_pcm_hw_params_any() failed for device '%s': '%s'\n", dev, snd_strerror(err));
+      pd->pcm = ast_malloc(len * sizeof(pd->pcm[0]));
+      if (NULL == pd->pcm) {
          break;
       }
+      pos = 0;
+      for (i = 0; ((i < pd->nitems) && (pos < len)); i += 1) {
+         const alsa_input_tone_item_t *pi = &(pd->items[i]);
+         size_t count;
 
-      err = snd_pcm_hw_params_set_access(handle, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED);
-      if (err < 0) {
-         ret = err;
-         ast_log(AST_LOG_ERROR, "snd_pcm_hw_params_set_access() failed for device '%s': '%s'\n", dev, snd_strerror(err));
-         break;
+         if (0 == pi->duration) {
+            count = len - pos;
+         }
+         else {
+            count = (size_t)(pi->duration) * pd->samples_per_ms;
+         }
+         alsa_input_tone_synth(pi, 0, &(pd->pcm[pos]), count);
+         pos += count;
       }
+      pd->pcm_len = len;
+      pd->pcm_loop = loop;
+   } while (false);
 
-      err = snd_pcm_hw_params_set_format(handle, hw_params, SND_PCM_SAMPLE_FORMAT);
-      if (err < 0) {
-         ret = err;
-         ast_log(AST_LOG_ERROR, "snd_pcm_hw_params_set_format() failed for device '%s': '%s'\n", dev, snd_strerror(err));
+   return (ret);
+}
+
+/* Initializes and renders the definitions of a tone for all the sample rates */
+static int alsa_input_tone_def_init(alsa_input_tone_def_t *pd,
+   int vol, const alsa_input_tone_part_t *parts, size_t part_count,
+   int reppos)
+{
+   int ret = 0;
+   size_t r;
+
+   for (r = 0; (r < AI_RATE_COUNT); r += 1) {
+      size_t i;
+
+      alsa_input_assert((NULL != parts) && (part_count > 0) && (reppos < (int)(part_count)));
+      pd[r].items = ast_calloc(part_count, sizeof(pd[r].items[0]));
+      if (NULL == pd[r].items) {
+         ret = -1;
          break;
       }
-
-      err = snd_pcm_hw_params_set_channels(handle, hw_params, 1);
-      if (err < 0) {
-         ret = err;
-         ast_log(AST_LOG_ERROR, "snd_pcm_hw_params_set_channels() failed for device '%s': '%s'\n", dev, snd_strerror(err));
+      pd[r].nitems = part_count;
+      pd[r].reppos = reppos;
+      pd[r].samples_per_ms = alsa_input_rate_samples_per_ms(r);
+      for (i = 0; (i < part_count); i += 1) {
+         alsa_input_convert_tone_part_to_item(&(parts[i]), &(pd[r].items[i]),
+            alsa_input_rate_values[r], vol);
+      }
+      if (alsa_input_tone_def_render(&(pd[r]), alsa_input_rate_values[r])) {
+         ret = -1;
          break;
       }
+   }
 
-      direction = 0;
-      rate = DEFAULT_SAMPLES_PER_MS * 1000;
-      err = snd_pcm_hw_params_set_rate_near(handle, hw_params, &(rate), &(direction));
-      if (err < 0) {
-         ret = err;
-         ast_log(AST_LOG_ERROR, "snd_pcm_hw_params_set_rate_near() failed for device '%s': '%s'\n", dev, snd_strerror(err));
-         break;
-      }
-      if (rate != (DEFAULT_SAMPLES_PER_MS * 1000)) {
-         ast_log(AST_LOG_WARNING, "Can't set rate for device '%s', requested %u, got %u\n",
-            dev, (unsigned int)(DEFAULT_SAMPLES_PER_MS * 1000), (unsigned int)(rate));
-         break;
-      }
-
-      direction = 0;
-      period_size = PERIOD_SIZE_IN_FRAMES;
-      err = snd_pcm_hw_params_set_period_size_near(handle, hw_params, &(period_size), &(direction));
-      if (err < 0) {
-         ast_log(AST_LOG_ERROR, "snd_pcm_hw_params_set_period_size_near() failed for device '%s': '%s'\n", dev, snd_strerror(err));
-         break;
-      }
-      alsa_input_pr_debug("Period size is %lu\n", (unsigned long)(period_size));
-
-      buffer_size = period_size * 16;
-      err = snd_pcm_hw_params_set_buffer_size_near(handle, hw_params, &(buffer_size));
-      if (err < 0) {
-         ast_log(AST_LOG_WARNING, "snd_pcm_hw_params_set_buffer_size_near() failed for device '%s': '%s'\n", dev, snd_strerror(err));
-         break;
-      }
-      alsa_input_pr_debug("Buffer size is set to %lu frames\n", (unsigned long)(buffer_size));
+   return (ret);
+}
 
-      err = snd_pcm_hw_params(handle, hw_params);
-      if (err < 0) {
-         ret = err;
-         ast_log(AST_LOG_ERROR, "Couldn't set the new hw params for device '%s': '%s'\n", dev, snd_strerror(err));
-         break;
-      }
+static void alsa_input_tone_def_free(alsa_input_tone_def_t *pd)
+{
+   size_t r;
 
-      sw_params = NULL;
-      err = snd_pcm_sw_params_malloc(&(sw_params));
-      if ((err < 0) || (NULL == sw_params)) {
-         ast_log(AST_LOG_ERROR, "Failed to allocate sw_params structure for device '%s'\n", dev);
-         break;
+   for (r = 0; (r < AI_RATE_COUNT); r += 1) {
+      if (NULL != pd[r].pcm) {
+         ast_free(pd[r].pcm);
+         pd[r].pcm = NULL;
       }
-
-      err = snd_pcm_sw_params_current(handle, sw_params);
-      if (err < 0) {
-         ret = err;
-         ast_log(AST_LOG_ERROR, "snd_pcm_sw_params_current() failed for device '%s': '%s'\n", dev, snd_strerror(err));
-         break;
+      pd[r].pcm_len = 0;
+      pd[r].pcm_loop = 0;
+      if (NULL != pd[r].items) {
+         ast_free(pd[r].items);
+         pd[r].items = NULL;
       }
+      pd[r].nitems = 0;
+   }
+}
 
-      if (stream == SND_PCM_STREAM_PLAYBACK) {
-         start_threshold = period_size;
-      }
-      else {
-         start_threshold = 1;
-      }
-      err = snd_pcm_sw_params_set_start_threshold(handle, sw_params, start_threshold);
-      if (err < 0) {
-         ast_log(AST_LOG_ERROR, "snd_pcm_sw_params_set_start_threshold() failed for device '%s': '%s'\n", dev, snd_strerror(err));
-         break;
-      }
+static void alsa_input_tone_state_init(alsa_input_tone_state_t *ps,
+   const alsa_input_tone_def_t *pd)
+{
+   ps->pcm = pd->pcm;
+   ps->len = pd->pcm_len;
+   ps->loop = pd->pcm_loop;
+   ps->pos = 0;
+   ps->def = pd;
+   ps->item = 0;
+   ps->item_pos = 0;
+}
 
-      if (stream == SND_PCM_STREAM_PLAYBACK) {
-         stop_threshold = buffer_size;
-      }
-      else {
-         stop_threshold = buffer_size;
-      }
-      err = snd_pcm_sw_params_set_stop_threshold(handle, sw_params, stop_threshold);
-      if (err < 0) {
-         ast_log(AST_LOG_ERROR, "snd_pcm_sw_params_set_stop_threshold() failed for device '%s': '%s'\n", dev, snd_strerror(err));
-         break;
-      }
+#if (2 != SAMPLE_SIZE)
+#error "SAMPLE_SIZE must be equal to 2"
+#endif
 
-      err = snd_pcm_sw_params(handle, sw_params);
-      if (err < 0) {
-         ast_log(AST_LOG_ERROR, "Couldn't set the new sw params for device '%s': '%s'\n", dev, snd_strerror(err));
-         break;
-      }
+/*
+ Synthesizes the samples of a tone whose cadence is not rendered, item
+ after item
+*/
+static size_t alsa_input_synth_tone_data(alsa_input_tone_state_t *ps,
+   int16_t *data, size_t count)
+{
+   const alsa_input_tone_def_t *pd = ps->def;
+   size_t ret = 0;
 
-      if (NULL != fd) {
-         struct pollfd pfd;
-         err = snd_pcm_poll_descriptors_count(handle);
-         if (err <= 0) {
-            ast_log(AST_LOG_ERROR, "Unable to get a poll descriptors count for device '%s': '%s'\n", dev, snd_strerror(err));
-            break;
-         }
-         if (err != 1) {
-            alsa_input_pr_debug("Can't handle more than one poll descritor\n");
-            break;
+   while ((ret < count) && (ps->item < pd->nitems)) {
+      const alsa_input_tone_item_t *pi = &(pd->items[ps->item]);
+      size_t n = count - ret;
+      size_t item_len = (size_t)(pi->duration) * pd->samples_per_ms;
+
+      if ((pi->duration > 0) && (n > (item_len - ps->item_pos))) {
+         n = item_len - ps->item_pos;
+      }
+      alsa_input_tone_synth(pi, ps->item_pos, &(data[ret]), n);
+      ps->item_pos += n;
+      ret += n;
+      if ((pi->duration > 0) && (ps->item_pos >= item_len)) { /* item finished? */
+         ps->item_pos = 0;
+         ps->item += 1;
+         if ((ps->item >= pd->nitems) && (pd->reppos >= 0)) { /* repeat set? */
+            ps->item = pd->reppos; /* redo from top */
          }
-
-         snd_pcm_poll_descriptors(handle, &(pfd), err);
-         *fd = pfd.fd;
       }
+   }
 
-      t->card = handle;
-      handle = NULL;
-      t->hw_params = hw_params;
-      hw_params = NULL;
-      t->sw_params = sw_params;
-      sw_params = NULL;
+   return (ret);
+}
 
-      ret = 0;
-   }
-   while (false);
+/*
+ Copies the samples of the tone from the rendered cadence : the tone state
+ is only a cursor in it. Returns the number of bytes copied, less than len
+ when a tone that doesn't repeat ends
+*/
+static size_t alsa_input_generate_tone_data(alsa_input_tone_state_t *ps, __u8 *data, size_t len)
+{
+   size_t ret = 0;
+   size_t count;
 
-   if (NULL != handle) {
-      snd_pcm_close(handle);
-      handle = NULL;
-   }
+   alsa_input_assert((NULL != data) && (len > 0));
 
-   if (NULL != sw_params) {
-      snd_pcm_sw_params_free(sw_params);
-      sw_params = NULL;
+   count = len / SAMPLE_SIZE;
+   if (NULL == ps->pcm) {
+      alsa_input_assert(0 == (((uintptr_t)data) % sizeof(int16_t)));
+      return (alsa_input_synth_tone_data(ps, (int16_t *)data, count) * SAMPLE_SIZE);
    }
+   while ((ret < count) && (ps->pos < ps->len)) {
+      size_t n = ps->len - ps->pos;
 
-   if (NULL != hw_params) {
-      snd_pcm_hw_params_free(hw_params);
-      hw_params = NULL;
+      if (n > (count - ret)) {
+         n = count - ret;
+      }
+      memcpy(&(data[ret * SAMPLE_SIZE]), &(ps->pcm[ps->pos]), n * SAMPLE_SIZE);
+      ps->pos += n;
+      ret += n;
+      if ((ps->pos >= ps->len) && (ps->loop < ps->len)) {
+         ps->pos = ps->loop;
+      }
    }
 
-   return (ret);
+   return (ret * SAMPLE_SIZE);
 }
 
-static void alsa_input_snd_card_deinit(alsa_input_snd_card_t *t)
+static const int alsa_input_tone_vol = 7219; /* Default to -8db */
+
+static const struct {
+   alsa_input_tone_def_t *defs;
+   const alsa_input_tone_part_t *parts;
+   size_t part_count;
+} alsa_input_tones[] = {
+   { alsa_input_tone_dial, alsa_input_tone_dial_parts, ARRAY_LEN(alsa_input_tone_dial_parts) },
+   { alsa_input_tone_busy, alsa_input_tone_busy_parts, ARRAY_LEN(alsa_input_tone_busy_parts) },
+   { alsa_input_tone_invalid, alsa_input_tone_invalid_parts, ARRAY_LEN(alsa_input_tone_invalid_parts) },
+   { alsa_input_tone_dtmf_0, alsa_input_tone_dtmf_0_parts, ARRAY_LEN(alsa_input_tone_dtmf_0_parts) },
+   { alsa_input_tone_dtmf_1, alsa_input_tone_dtmf_1_parts, ARRAY_LEN(alsa_input_tone_dtmf_1_parts) },
+   { alsa_input_tone_dtmf_2, alsa_input_tone_dtmf_2_parts, ARRAY_LEN(alsa_input_tone_dtmf_2_parts) },
+   { alsa_input_tone_dtmf_3, alsa_input_tone_dtmf_3_parts, ARRAY_LEN(alsa_input_tone_dtmf_3_parts) },
+   { alsa_input_tone_dtmf_4, alsa_input_tone_dtmf_4_parts, ARRAY_LEN(alsa_input_tone_dtmf_4_parts) },
+   { alsa_input_tone_dtmf_5, alsa_input_tone_dtmf_5_parts, ARRAY_LEN(alsa_input_tone_dtmf_5_parts) },
+   { alsa_input_tone_dtmf_6, alsa_input_tone_dtmf_6_parts, ARRAY_LEN(alsa_input_tone_dtmf_6_parts) },
+   { alsa_input_tone_dtmf_7, alsa_input_tone_dtmf_7_parts, ARRAY_LEN(alsa_input_tone_dtmf_7_parts) },
+   { alsa_input_tone_dtmf_8, alsa_input_tone_dtmf_8_parts, ARRAY_LEN(alsa_input_tone_dtmf_8_parts) },
+   { alsa_input_tone_dtmf_9, alsa_input_tone_dtmf_9_parts, ARRAY_LEN(alsa_input_tone_dtmf_9_parts) },
+   { alsa_input_tone_dtmf_aster, alsa_input_tone_dtmf_aster_parts, ARRAY_LEN(alsa_input_tone_dtmf_aster_parts) },
+   { alsa_input_tone_dtmf_pound, alsa_input_tone_dtmf_pound_parts, ARRAY_LEN(alsa_input_tone_dtmf_pound_parts) },
+   { alsa_input_tone_dtmf_A, alsa_input_tone_dtmf_A_parts, ARRAY_LEN(alsa_input_tone_dtmf_A_parts) },
+   { alsa_input_tone_dtmf_B, alsa_input_tone_dtmf_B_parts, ARRAY_LEN(alsa_input_tone_dtmf_B_parts) },
+   { alsa_input_tone_dtmf_C, alsa_input_tone_dtmf_C_parts, ARRAY_LEN(alsa_input_tone_dtmf_C_parts) },
+   { alsa_input_tone_dtmf_D, alsa_input_tone_dtmf_D_parts, ARRAY_LEN(alsa_input_tone_dtmf_D_parts) },
+};
+
+static void alsa_input_free_tones(void)
 {
-   if (NULL != t->card) {
-      snd_pcm_close(t->card);
-      t->card = NULL;
-      alsa_input_assert(NULL != t->hw_params);
-      snd_pcm_hw_params_free(t->hw_params);
-      t->hw_params = NULL;
-      alsa_input_assert(NULL != t->sw_params);
-      snd_pcm_sw_params_free(t->sw_params);
-      t->sw_params = NULL;
+   size_t i;
+
+   for (i = 0; (i < ARRAY_LEN(alsa_input_tones)); i += 1) {
+      alsa_input_tone_def_free(alsa_input_tones[i].defs);
    }
 }
 
-static bool alsa_input_snd_card_handle_error(alsa_input_snd_card_t *t, snd_pcm_sframes_t error, const char *function)
+static int alsa_input_init_tones(void)
 {
-   bool ret = false;
-
-   alsa_input_assert(error < 0);
+   int ret = 0;
+   size_t i;
 
-   do { /* Empty loop */
-      if (-EAGAIN == error) {
-          /*  Nothing todo */
-         break;
-      }
-      alsa_input_pr_debug("%s() failed with error %ld : '%s'\n",
-         function, (long)(error), snd_strerror(error));
-      error = snd_pcm_recover(t->card, error, 0);
-      if (error >= 0) {
+   alsa_input_init_tone_synth();
+   for (i = 0; (i < ARRAY_LEN(alsa_input_tones)); i += 1) {
+      if (alsa_input_tone_def_init(alsa_input_tones[i].defs, alsa_input_tone_vol,
+             alsa_input_tones[i].parts, alsa_input_tones[i].part_count, 0)) {
+         ast_log(AST_LOG_ERROR, "Unable to render the tones\n");
+         alsa_input_free_tones();
+         ret = -1;
          break;
       }
-      if (-EAGAIN == error) {
-          /*  Nothing todo */
-         break;
+   }
+
+   return (ret);
+}
+
+/*
+ Builds a tone of a zone from its definition in indications.conf, a list
+ of parts separated by ',' (or '|'). As in ast_playtones_start(), a part
+ starting with '!' is not repeated : playing restarts at the first part
+ without '!'. Returns NULL if the zone doesn't define the tone
+*/
+static const alsa_input_tone_def_t *alsa_input_tone_zone_def(
+   struct ast_tone_zone *zone, const char *indication, alsa_input_tone_def_t *pd)
+{
+   const alsa_input_tone_def_t *ret = NULL;
+   struct ast_tone_zone_sound *ts;
+   alsa_input_tone_part_t *parts = NULL;
+   size_t part_count = 0;
+   int reppos = -1;
+
+   ts = ast_get_indication_tone(zone, indication);
+   if (NULL == ts) {
+      return (NULL);
+   }
+   do { /* Empty loop */
+      char *stringp = ast_strdupa(ts->data);
+      const char *separator = (NULL != strchr(stringp, '|')) ? "|" : ",";
+      size_t n = 1;
+      char *c;
+
+      for (c = stringp; ('\0' != *c); c += 1) {
+         if (*c == separator[0]) {
+            n += 1;
+         }
       }
-      if (-EPIPE == error) {
+      parts = ast_calloc(n, sizeof(parts[0]));
+      if (NULL == parts) {
          break;
       }
-      if (-ESTRPIPE == error) {
-         /* Device is in suspend state */
-         int err = 0;
-         for (;;) {
-            int err = snd_pcm_resume(t->card);
-            if (-EAGAIN != err) {
-               break;
-            }
+      while ((NULL != (c = strsep(&stringp, separator))) && (!ast_strlen_zero(c))) {
+         struct ast_tone_zone_part tone_data;
+         bool repeat = true;
+
+         c = ast_strip(c);
+         if ('!' == c[0]) {
+            repeat = false;
+            c += 1;
          }
-         if (err) {
-            err = snd_pcm_prepare(t->card);
-            if (err) {
-               ast_log(AST_LOG_ERROR, "snd_pcm_prepare() failed: '%s'\n", snd_strerror(error));
-            }
+         if (ast_tone_zone_part_parse(c, &tone_data)) {
+            ast_log(AST_LOG_ERROR, "Failed to parse part '%s' of tone '%s' of zone '%s'\n",
+               c, indication, zone->country);
+            continue;
          }
+         if ((repeat) && (reppos < 0)) {
+            reppos = part_count;
+         }
+         parts[part_count].freq1 = tone_data.freq1;
+         parts[part_count].freq2 = tone_data.freq2;
+         parts[part_count].time = tone_data.time;
+         parts[part_count].modulate = tone_data.modulate;
+         parts[part_count].midinote = tone_data.midinote;
+         part_count += 1;
+      }
+      if (0 == part_count) {
          break;
       }
-      ast_log(AST_LOG_ERROR, "%s() failed: '%s'\n", function, snd_strerror(error));
-      if ((-ENODEV == error) || (-ENOTTY == error)) {
-         ret = true;
+      if (alsa_input_tone_def_init(pd, alsa_input_tone_vol, parts, part_count, reppos)) {
+         alsa_input_tone_def_free(pd);
          break;
       }
+      ret = pd;
    } while (false);
 
+   if (NULL != parts) {
+      ast_free(parts);
+   }
+   ts = ast_tone_zone_sound_unref(ts);
+
    return (ret);
 }
 
-static void alsa_input_snd_card_start(alsa_input_snd_card_t *t)
+static void alsa_input_free_tone_zones(alsa_input_chan_t *t)
 {
-   int err = snd_pcm_prepare(t->card);
-   if (err) {
-      alsa_input_pr_debug("snd_pcm_prepare() failed: '%s'\n", snd_strerror(err));
-   }
-   err = snd_pcm_start(t->card);
-   if (err) {
-      alsa_input_pr_debug("snd_pcm_start() failed: '%s'\n", snd_strerror(err));
-   }
-}
+   while (NULL != t->config.tone_zones) {
+      alsa_input_tone_zone_t *tz = t->config.tone_zones;
+      size_t i;
 
-static void alsa_input_snd_card_stop(alsa_input_snd_card_t *t)
-{
-   int err = snd_pcm_drop(t->card);
-   if (err) {
-      alsa_input_pr_debug("snd_pcm_drop() failed: '%s'\n", snd_strerror(err));
+      t->config.tone_zones = tz->next;
+      for (i = 0; (i < ARRAY_LEN(tz->defs)); i += 1) {
+         alsa_input_tone_def_free(tz->defs[i]);
+      }
+      ast_free(tz);
    }
 }
 
-/* Must be called with pvt->owner locked */
-static inline void alsa_input_reset_pvt_monitor_state(alsa_input_pvt_t *pvt)
+/*
+ Returns the tones of a zone of indications.conf ("default" is the default
+ zone of Asterisk), building them the first time the zone is used
+*/
+static const alsa_input_tone_zone_t *alsa_input_get_tone_zone(
+   alsa_input_chan_t *t, const char *name)
 {
-   alsa_input_pr_debug("alsa_input_reset_pvt_monitor_state()\n");
+   const alsa_input_tone_zone_t *ret = NULL;
+   alsa_input_tone_zone_t *tz;
+   struct ast_tone_zone *zone;
 
-   alsa_input_assert((NULL == pvt->owner) || (pvt->owner_lock_count > 0));
+   for (tz = t->config.tone_zones; (NULL != tz); tz = tz->next) {
+      if (!strcasecmp(tz->name, name)) {
+         return (tz);
+      }
+   }
 
-   pvt->ast_channel.digits[0] = '\0';
-   pvt->ast_channel.digits_len = 0;
-   pvt->ast_channel.search_extension = false;
-   pvt->ast_channel.dtmf_sent = NONE;
+   zone = ast_get_indication_zone(strcasecmp(name, "default") ? name : NULL);
+   if (NULL == zone) {
+      ast_log(AST_LOG_ERROR, "Unknown tone zone '%s'\n", name);
+      return (NULL);
+   }
+   do { /* Empty loop */
+      tz = ast_calloc(1, sizeof(*tz));
+      if (NULL == tz) {
+         break;
+      }
+      ast_copy_string(tz->name, name, sizeof(tz->name));
+      tz->dial = alsa_input_tone_zone_def(zone, "dial", tz->defs[0]);
+      if (NULL == tz->dial) {
+         tz->dial = alsa_input_tone_zone_builtin.dial;
+      }
+      tz->busy = alsa_input_tone_zone_def(zone, "busy", tz->defs[1]);
+      if (NULL == tz->busy) {
+         tz->busy = alsa_input_tone_zone_builtin.busy;
+      }
+      tz->invalid = alsa_input_tone_zone_def(zone, "congestion", tz->defs[2]);
+      if (NULL == tz->invalid) {
+         tz->invalid = alsa_input_tone_zone_builtin.invalid;
+      }
+      tz->next = t->config.tone_zones;
+      t->config.tone_zones = tz;
+      ret = tz;
+   } while (false);
+   zone = ast_tone_zone_unref(zone);
+
+   return (ret);
 }
 
-/*
- Must be called with pvt->owner locked.
-*/
-static void alsa_input_reset_buf_fr_to_queue(alsa_input_pvt_t *pvt)
+static const unsigned int alsa_input_dtmf_freqs[AI_DTMF_FREQS] = {
+   697, 770, 852, 941, 1209, 1336, 1477, 1633
+};
+
+static const char alsa_input_dtmf_digits[4][4] = {
+   { '1', '2', '3', 'A' },
+   { '4', '5', '6', 'B' },
+   { '7', '8', '9', 'C' },
+   { '*', '0', '#', 'D' },
+};
+
+static void alsa_input_dtmf_reset(alsa_input_dtmf_t *d)
 {
-   alsa_input_assert((NULL == pvt->owner) || (pvt->owner_lock_count > 0));
-   pvt->ast_channel.offset_buf_fr_to_queue = 0;
+   memset(d->s1, 0, sizeof(d->s1));
+   memset(d->s2, 0, sizeof(d->s2));
+   d->energy = 0.0f;
+   d->count = 0;
+   d->last_hit = '\0';
+   d->current = '\0';
 }
 
-/*
- Must be called with pvt->owner locked.
-*/
-static void alsa_input_reset_buf_bytes_not_written(alsa_input_pvt_t *pvt)
+static void alsa_input_dtmf_init(alsa_input_dtmf_t *d,
+   alsa_input_rate_t rate, const alsa_input_line_config_t *line_cfg)
 {
-   alsa_input_assert((NULL == pvt->owner) || (pvt->owner_lock_count > 0));
-   pvt->ast_channel.bytes_not_written_len = 0;
-   pvt->ast_channel.offset_bytes_not_written = 0;
+   double amp;
+   size_t i;
+
+   d->block_len = (AI_DTMF_BLOCK_8K * alsa_input_rate_values[rate]) / 8000;
+   for (i = 0; (i < AI_DTMF_FREQS); i += 1) {
+      d->coefs[i] = 2.0 * cos((2.0 * M_PI * alsa_input_dtmf_freqs[i]) / alsa_input_rate_values[rate]);
+   }
+   /* A tone of amplitude amp gives (amp * block_len / 2)^2 */
+   amp = 32768.0 * pow(10.0, line_cfg->dtmf_threshold / 20.0);
+   d->threshold = (amp * d->block_len / 2.0) * (amp * d->block_len / 2.0);
+   d->normal_twist = pow(10.0, line_cfg->dtmf_normal_twist / 10.0);
+   d->reverse_twist = pow(10.0, line_cfg->dtmf_reverse_twist / 10.0);
+   alsa_input_dtmf_reset(d);
 }
 
-/*
- Must be called with pvt->owner locked
-*/
-static void alsa_input_turn_buzzer_on(alsa_input_pvt_t *pvt)
+/* Runs the 8 Goertzel filters on count samples */
+static void alsa_input_dtmf_goertzel(alsa_input_dtmf_t *d,
+   const int16_t *samples, size_t count)
 {
-   alsa_input_pr_debug("alsa_input_turn_buzzer_on()\n");
+   float energy = d->energy;
+   size_t i;
+#if defined(__SSE__)
+   const __m128 c_row = _mm_loadu_ps(&(d->coefs[0]));
+   const __m128 c_col = _mm_loadu_ps(&(d->coefs[4]));
+   __m128 s1_row = _mm_loadu_ps(&(d->s1[0]));
+   __m128 s1_col = _mm_loadu_ps(&(d->s1[4]));
+   __m128 s2_row = _mm_loadu_ps(&(d->s2[0]));
+   __m128 s2_col = _mm_loadu_ps(&(d->s2[4]));
+
+   for (i = 0; (i < count); i += 1) {
+      const float x = samples[i];
+      const __m128 vx = _mm_set1_ps(x);
+      __m128 s0_row = _mm_sub_ps(_mm_add_ps(vx, _mm_mul_ps(c_row, s1_row)), s2_row);
+      __m128 s0_col = _mm_sub_ps(_mm_add_ps(vx, _mm_mul_ps(c_col, s1_col)), s2_col);
+      s2_row = s1_row;
+      s2_col = s1_col;
+      s1_row = s0_row;
+      s1_col = s0_col;
+      energy += x * x;
+   }
+   _mm_storeu_ps(&(d->s1[0]), s1_row);
+   _mm_storeu_ps(&(d->s1[4]), s1_col);
+   _mm_storeu_ps(&(d->s2[0]), s2_row);
+   _mm_storeu_ps(&(d->s2[4]), s2_col);
+#elif defined(__ARM_NEON)
+   const float32x4_t c_row = vld1q_f32(&(d->coefs[0]));
+   const float32x4_t c_col = vld1q_f32(&(d->coefs[4]));
+   float32x4_t s1_row = vld1q_f32(&(d->s1[0]));
+   float32x4_t s1_col = vld1q_f32(&(d->s1[4]));
+   float32x4_t s2_row = vld1q_f32(&(d->s2[0]));
+   float32x4_t s2_col = vld1q_f32(&(d->s2[4]));
+
+   for (i = 0; (i < count); i += 1) {
+      const float x = samples[i];
+      const float32x4_t vx = vdupq_n_f32(x);
+      float32x4_t s0_row = vsubq_f32(vmlaq_f32(vx, c_row, s1_row), s2_row);
+      float32x4_t s0_col = vsubq_f32(vmlaq_f32(vx, c_col, s1_col), s2_col);
+      s2_row = s1_row;
+      s2_col = s1_col;
+      s1_row = s0_row;
+      s1_col = s0_col;
+      energy += x * x;
+   }
+   vst1q_f32(&(d->s1[0]), s1_row);
+   vst1q_f32(&(d->s1[4]), s1_col);
+   vst1q_f32(&(d->s2[0]), s2_row);
+   vst1q_f32(&(d->s2[4]), s2_col);
+#else
+   /* The loop on the frequencies can be vectorized by the compiler */
+   for (i = 0; (i < count); i += 1) {
+      const float x = samples[i];
+      size_t k;
 
-   alsa_input_assert((NULL == pvt->owner) || (pvt->owner_lock_count > 0));
+      for (k = 0; (k < AI_DTMF_FREQS); k += 1) {
+         float s0 = (x + (d->coefs[k] * d->s1[k])) - d->s2[k];
+         d->s2[k] = d->s1[k];
+         d->s1[k] = s0;
+      }
+      energy += x * x;
+   }
+#endif
+   d->energy = energy;
+}
 
-   if (pvt->monitor.fd_output >= 0) {
-      struct input_event event;
-      event.type = EV_SND;
-      event.code = SND_BELL;
-      event.value = 1;
-      write(pvt->monitor.fd_output, &(event), sizeof(event));
+/* Returns the digit found in the block just processed, or '\0' */
+static char alsa_input_dtmf_block(const alsa_input_dtmf_t *d)
+{
+   /* The other tones of a group must be at least 8 dB weaker */
+   static const float relative_peak = 6.3f;
+   float power[AI_DTMF_FREQS];
+   size_t best_row = 0;
+   size_t best_col = 4;
+   size_t i;
+
+   for (i = 0; (i < AI_DTMF_FREQS); i += 1) {
+      power[i] = ((d->s1[i] * d->s1[i]) + (d->s2[i] * d->s2[i]))
+         - (d->coefs[i] * d->s1[i] * d->s2[i]);
    }
-   pvt->ast_channel.buzzer_is_on = true;
-   pvt->ast_channel.tv_wait = ast_tvnow();
-   alsa_input_pr_debug("Line %lu should be ringing\n", (unsigned long)(pvt->index_line + 1));
+   for (i = 1; (i < 4); i += 1) {
+      if (power[i] > power[best_row]) {
+         best_row = i;
+      }
+      if (power[i + 4] > power[best_col]) {
+         best_col = i + 4;
+      }
+   }
+   if ((power[best_row] < d->threshold) || (power[best_col] < d->threshold)) {
+      return ('\0');
+   }
+   if ((power[best_row] > (power[best_col] * d->normal_twist))
+       || (power[best_col] > (power[best_row] * d->reverse_twist))) {
+      return ('\0');
+   }
+   for (i = 0; (i < 4); i += 1) {
+      if (((i != best_row) && ((power[i] * relative_peak) > power[best_row]))
+          || (((i + 4) != best_col) && ((power[i + 4] * relative_peak) > power[best_col]))) {
+         return ('\0');
+      }
+   }
+   /*
+    Both tones must hold most of the energy of the block (a pure tone of
+    energy e gives e * block_len / 2), which rejects voice
+   */
+   if ((power[best_row] + power[best_col]) < (0.5f * d->energy * (d->block_len / 2.0f))) {
+      return ('\0');
+   }
+   return (alsa_input_dtmf_digits[best_row][best_col - 4]);
 }
 
 /*
- Must be called with pvt->owner locked
+ Processes count samples and returns the digit whose beginning is detected,
+ or '\0'
 */
-static void alsa_input_turn_buzzer_off(alsa_input_pvt_t *pvt)
+static char alsa_input_dtmf_process(alsa_input_dtmf_t *d,
+   const int16_t *samples, size_t count)
 {
-   alsa_input_pr_debug("alsa_input_turn_buzzer_off()\n");
+   char ret = '\0';
 
-   alsa_input_assert((NULL == pvt->owner) || (pvt->owner_lock_count > 0));
+   while (count > 0) {
+      size_t n = d->block_len - d->count;
+      char hit;
 
-   if (pvt->monitor.fd_output >= 0) {
-      struct input_event event;
-      event.type = EV_SND;
-      event.code = SND_BELL;
-      event.value = 0;
-      write(pvt->monitor.fd_output, &(event), sizeof(event));
+      if (n > count) {
+         n = count;
+      }
+      alsa_input_dtmf_goertzel(d, samples, n);
+      samples += n;
+      count -= n;
+      d->count += n;
+      if (d->count < d->block_len) {
+         break;
+      }
+
+      hit = alsa_input_dtmf_block(d);
+      if (hit == d->last_hit) {
+         if ('\0' == hit) {
+            d->current = '\0';
+         }
+         else if (hit != d->current) {
+            d->current = hit;
+            ret = hit;
+         }
+      }
+      d->last_hit = hit;
+      memset(d->s1, 0, sizeof(d->s1));
+      memset(d->s2, 0, sizeof(d->s2));
+      d->energy = 0.0f;
+      d->count = 0;
    }
-   pvt->ast_channel.buzzer_is_on = false;
-   pvt->ast_channel.tv_wait = ast_tvnow();
-   alsa_input_pr_debug("Line %lu should not ring anymore\n", (unsigned long)(pvt->index_line + 1));
+
+   return (ret);
 }
 
-static void alsa_input_set_line_tone(alsa_input_pvt_t *pvt,
-   alsa_input_tone_t tone, size_t tone_duration);
+static void alsa_input_fft_destroy(alsa_input_fft_t *fft)
+{
+   ast_free(fft->cbuf);
+   ast_free(fft->bitrev);
+   fft->cbuf = NULL;
+   fft->bitrev = NULL;
+}
 
-/* Must be called with pvt->owner locked */
-static void alsa_input_set_new_state(alsa_input_pvt_t *pvt,
-   alsa_input_state_t new_state, alsa_input_event_t cause)
+/* Prepares the tables of a real FFT of 2 * size points */
+static int alsa_input_fft_init(alsa_input_fft_t *fft, unsigned int size)
 {
-   alsa_input_pr_debug("alsa_input_set_new_state(new_state=%d, cause=%d)\n",
-      (int)(new_state), (int)(cause));
+   unsigned int b;
+   unsigned int i;
+
+   fft->size = size;
+   /* cbuf, twiddles (size complex values each), rtwiddles (size + 1) */
+   fft->cbuf = ast_calloc((6 * (size_t)(size)) + 2, sizeof(float));
+   fft->bitrev = ast_calloc(size, sizeof(fft->bitrev[0]));
+   if ((NULL == fft->cbuf) || (NULL == fft->bitrev)) {
+      alsa_input_fft_destroy(fft);
+      return (-1);
+   }
+   fft->twiddles = &(fft->cbuf[2 * size]);
+   fft->rtwiddles = &(fft->cbuf[4 * size]);
 
-   alsa_input_assert((NULL == pvt->owner) || (pvt->owner_lock_count > 0));
+   b = 0;
+   while ((1U << b) < size) {
+      b += 1;
+   }
+   for (i = 0; (i < size); i += 1) {
+      unsigned int r = 0;
+      unsigned int j;
 
-   if (new_state != pvt->ast_channel.state) {
-      if (((AI_ST_OFF_TALKING == new_state)
-           || (AI_ST_OFF_WAITING_ANSWER == new_state))
-          && (AI_ST_OFF_TALKING != pvt->ast_channel.state)
-          && (AI_ST_OFF_WAITING_ANSWER != pvt->ast_channel.state)) {
-         /*
-          Start capture if not muted, playback will be started the
-          next call of alsa_input_chan_write() */
-         pvt->ast_channel.snd_capture_muted = false;
-         alsa_input_snd_card_start(&(pvt->ast_channel.snd_capture));
-         alsa_input_reset_buf_fr_to_queue(pvt);
-      }
-      else if (AI_ST_ON_RINGING == new_state) {
-         alsa_input_turn_buzzer_on(pvt);
-      }
-      if (((AI_ST_OFF_TALKING == pvt->ast_channel.state)
-           || (AI_ST_OFF_WAITING_ANSWER == pvt->ast_channel.state))
-          && (AI_ST_OFF_TALKING != new_state)
-          && (AI_ST_OFF_WAITING_ANSWER != new_state)) {
-         /* Stop capture and playback */
-         pvt->ast_channel.snd_capture_muted = true;
-         alsa_input_snd_card_stop(&(pvt->ast_channel.snd_capture));
-         if (AI_TONE_NONE == pvt->ast_channel.tone) {
-            alsa_input_snd_card_stop(&(pvt->ast_channel.snd_playback));
-            alsa_input_reset_buf_bytes_not_written(pvt);
+      for (j = 0; (j < b); j += 1) {
+         if ((i & (1U << j))) {
+            r |= 1U << (b - 1 - j);
          }
       }
-      else if (AI_ST_ON_RINGING == pvt->ast_channel.state) {
-         alsa_input_turn_buzzer_off(pvt);
-      }
+      fft->bitrev[i] = r;
+      fft->twiddles[2 * i] = cos((2.0 * M_PI * i) / size);
+      fft->twiddles[(2 * i) + 1] = -sin((2.0 * M_PI * i) / size);
+   }
+   for (i = 0; (i <= size); i += 1) {
+      fft->rtwiddles[2 * i] = cos((M_PI * i) / size);
+      fft->rtwiddles[(2 * i) + 1] = -sin((M_PI * i) / size);
    }
+   return (0);
+}
 
-   switch (new_state) {
-      case AI_ST_DISCONNECTED: {
-         alsa_input_assert((AI_STATUS_DISCONNECTED == pvt->ast_channel.status)
-            && (NULL == pvt->owner));
-         alsa_input_assert(AI_EV_DISCONNECTED == cause);
-         alsa_input_set_line_tone(pvt, AI_TONE_NONE, 0);
-         alsa_input_reset_pvt_monitor_state(pvt);
-         pvt->ast_channel.snd_capture_muted = true;
-         alsa_input_reset_buf_fr_to_queue(pvt);
-         alsa_input_reset_buf_bytes_not_written(pvt);
-         break;
-      }
-      case AI_ST_ON_IDLE: {
-         alsa_input_assert((AI_STATUS_ON_HOOK == pvt->ast_channel.status)
-            && (NULL == pvt->owner));
-         alsa_input_assert((AI_EV_AST_HANGUP == cause)
-            || (AI_EV_INTERNAL_ERROR == cause)
-            || (AI_EV_ON_HOOK == cause));
-         alsa_input_set_line_tone(pvt, AI_TONE_NONE, 0);
-         alsa_input_reset_pvt_monitor_state(pvt);
-         pvt->ast_channel.snd_capture_muted = true;
-         alsa_input_reset_buf_fr_to_queue(pvt);
-         break;
-      }
-      case AI_ST_ON_PRE_RINGING: {
-         alsa_input_assert((AI_STATUS_ON_HOOK == pvt->ast_channel.status)
-            && (NULL != pvt->owner));
-         alsa_input_assert((AI_ST_ON_IDLE == pvt->ast_channel.state)
-            && (AI_EV_AST_REQUEST == cause));
-         break;
-      }
-      case AI_ST_ON_RINGING: {
-         alsa_input_assert((AI_STATUS_ON_HOOK == pvt->ast_channel.status)
-            && (NULL != pvt->owner));
-         alsa_input_assert((AI_ST_ON_PRE_RINGING == pvt->ast_channel.state)
-            && (AI_EV_AST_CALL == cause));
-         break;
-      }
-      case AI_ST_OFF_DIALING: {
-         alsa_input_assert((AI_STATUS_OFF_HOOK == pvt->ast_channel.status)
-            && (NULL == pvt->owner) && (pvt->line_cfg->monitor_dialing));
-         alsa_input_assert((AI_ST_ON_IDLE == pvt->ast_channel.state)
-            && (AI_EV_OFF_HOOK == cause));
-         alsa_input_set_line_tone(pvt, AI_TONE_WAITING_DIAL, 0);
-         alsa_input_reset_pvt_monitor_state(pvt);
-         /*
-          We start searching alsa_input_default_extension ('s') after
-          pvt->line_cfg->dialing_timeout_1st_digit milliseconds
-         */
-         pvt->ast_channel.search_extension = true;
-         pvt->ast_channel.tv_wait = ast_tvnow();
-         break;
-      }
-      case AI_ST_OFF_WAITING_ANSWER: {
-         alsa_input_assert((AI_STATUS_OFF_HOOK == pvt->ast_channel.status)
-            && (NULL != pvt->owner));
-         alsa_input_assert(((AI_ST_ON_IDLE == pvt->ast_channel.state)
-            && (AI_EV_OFF_HOOK == cause) && (!pvt->line_cfg->monitor_dialing))
-                    || ((AI_ST_OFF_DIALING == pvt->ast_channel.state)
-            && (AI_EV_EXT_FOUND == cause)));
-         alsa_input_set_line_tone(pvt, AI_TONE_NONE, 0);
-         /*
-          We forget all digits dialed
-         */
-         alsa_input_reset_pvt_monitor_state(pvt);
-         break;
-      }
-      case AI_ST_OFF_TALKING: {
-         alsa_input_assert((AI_STATUS_OFF_HOOK == pvt->ast_channel.status)
-            && (NULL != pvt->owner));
-         alsa_input_assert(((AI_ST_ON_RINGING == pvt->ast_channel.state)
-            && (AI_EV_OFF_HOOK == cause))
-                    || ((AI_ST_OFF_WAITING_ANSWER == pvt->ast_channel.state)
-            && (AI_EV_AST_ANSWER == cause)));
-         alsa_input_set_line_tone(pvt, AI_TONE_NONE, 0);
-         break;
+/* In-place complex FFT of size points (interleaved), not scaled */
+static void alsa_input_fft_complex(const alsa_input_fft_t *fft, float *buf,
+   bool inverse)
+{
+   const unsigned int m = fft->size;
+   const float sign = inverse ? -1.0f : 1.0f;
+   unsigned int len;
+   unsigned int i;
+
+   for (i = 0; (i < m); i += 1) {
+      unsigned int j = fft->bitrev[i];
+      if (j > i) {
+         float tmp;
+         tmp = buf[2 * i];
+         buf[2 * i] = buf[2 * j];
+         buf[2 * j] = tmp;
+         tmp = buf[(2 * i) + 1];
+         buf[(2 * i) + 1] = buf[(2 * j) + 1];
+         buf[(2 * j) + 1] = tmp;
       }
-      case AI_ST_OFF_NO_SERVICE: {
-         alsa_input_assert((AI_STATUS_OFF_HOOK == pvt->ast_channel.status)
-            && (NULL == pvt->owner));
-         alsa_input_assert(((AI_ST_OFF_DIALING == pvt->ast_channel.state) && (AI_EV_NO_EXT_CAN_BE_FOUND == cause))
-            || (AI_EV_AST_HANGUP == cause)
-            || (AI_EV_INTERNAL_ERROR == cause));
-         if (AI_EV_AST_HANGUP == cause) {
-            alsa_input_set_line_tone(pvt, AI_TONE_BUSY, 0);
-         }
-         else {
-            alsa_input_set_line_tone(pvt, AI_TONE_INVALID, 0);
+   }
+   for (len = 2; (len <= m); len <<= 1) {
+      unsigned int half = len / 2;
+      unsigned int step = m / len;
+
+      for (i = 0; (i < m); i += len) {
+         unsigned int k;
+
+         for (k = 0; (k < half); k += 1) {
+            const float wr = fft->twiddles[2 * k * step];
+            const float wi = sign * fft->twiddles[(2 * k * step) + 1];
+            float *a = &(buf[2 * (i + k)]);
+            float *b = &(buf[2 * (i + k + half)]);
+            float tr = (b[0] * wr) - (b[1] * wi);
+            float ti = (b[0] * wi) + (b[1] * wr);
+
+            b[0] = a[0] - tr;
+            b[1] = a[1] - ti;
+            a[0] += tr;
+            a[1] += ti;
          }
-         alsa_input_reset_pvt_monitor_state(pvt);
-         pvt->ast_channel.snd_capture_muted = true;
-         alsa_input_reset_buf_fr_to_queue(pvt);
-         alsa_input_reset_buf_bytes_not_written(pvt);
-         /*
-          Store time this state was entered to hook on the phone after
-          DELAY_AUTO_HOOK_ON
-         */
-         pvt->ast_channel.tv_wait = ast_tvnow();
-         break;
       }
    }
-   pvt->ast_channel.state = new_state;
 }
 
-/* Must be called with pvt->owner and monitor.lock locked */
-static void alsa_input_unlink_from_ast_channel(alsa_input_pvt_t *pvt,
-   alsa_input_event_t cause, bool unlock_ast_channel)
+/* Real FFT of 2 * size samples : bins 0 to size in re and im, not scaled */
+static void alsa_input_fft_real(const alsa_input_fft_t *fft, const float *in,
+   float *re, float *im)
 {
-   struct ast_channel *ast = pvt->owner;
-
-   alsa_input_pr_debug("alsa_input_unlink_from_ast_channel(cause=%d)\n",
-      (int)(cause));
-
-   alsa_input_assert((pvt->channel->monitor.lock_count > 0)
-      && (NULL != pvt->owner) && (pvt->owner_lock_count > 0));
-   alsa_input_ast_channel_tech_pvt_set(ast, NULL);
-   pvt->owner = NULL;
-   ast_setstate(ast, AST_STATE_DOWN);
-   /* Set state before unlocking the channel */
-   if (AI_STATUS_OFF_HOOK == pvt->ast_channel.status) {
-      alsa_input_set_new_state(pvt, AI_ST_OFF_NO_SERVICE, cause);
+   const unsigned int m = fft->size;
+   float *z = fft->cbuf;
+   unsigned int k;
+
+   memcpy(z, in, 2 * m * sizeof(z[0]));
+   alsa_input_fft_complex(fft, z, false);
+   for (k = 0; (k <= m); k += 1) {
+      unsigned int k1 = (k < m) ? k : 0;
+      unsigned int k2 = (k > 0) ? (m - k) : 0;
+      /* Spectra of the even and of the odd samples */
+      float ev_re = 0.5f * (z[2 * k1] + z[2 * k2]);
+      float ev_im = 0.5f * (z[(2 * k1) + 1] - z[(2 * k2) + 1]);
+      float od_re = 0.5f * (z[(2 * k1) + 1] + z[(2 * k2) + 1]);
+      float od_im = -0.5f * (z[2 * k1] - z[2 * k2]);
+      const float wr = fft->rtwiddles[2 * k];
+      const float wi = fft->rtwiddles[(2 * k) + 1];
+
+      re[k] = ev_re + ((od_re * wr) - (od_im * wi));
+      im[k] = ev_im + ((od_re * wi) + (od_im * wr));
    }
-   else if (AI_STATUS_ON_HOOK == pvt->ast_channel.status) {
-      alsa_input_set_new_state(pvt, AI_ST_ON_IDLE, cause);
+}
+
+/* Inverse of alsa_input_fft_real(), scaled */
+static void alsa_input_fft_real_inverse(const alsa_input_fft_t *fft,
+   const float *re, const float *im, float *out)
+{
+   const unsigned int m = fft->size;
+   const float scale = 1.0f / m;
+   float *z = fft->cbuf;
+   unsigned int k;
+
+   for (k = 0; (k < m); k += 1) {
+      float ev_re = 0.5f * (re[k] + re[m - k]);
+      float ev_im = 0.5f * (im[k] - im[m - k]);
+      float d_re = 0.5f * (re[k] - re[m - k]);
+      float d_im = 0.5f * (im[k] + im[m - k]);
+      /* Multiplied by the conjugate of the twiddle */
+      const float wr = fft->rtwiddles[2 * k];
+      const float wi = -fft->rtwiddles[(2 * k) + 1];
+      float od_re = (d_re * wr) - (d_im * wi);
+      float od_im = (d_re * wi) + (d_im * wr);
+
+      /* Even samples in the real parts, odd samples in the imaginary parts */
+      z[2 * k] = ev_re - od_im;
+      z[(2 * k) + 1] = ev_im + od_re;
    }
-   else {
-      alsa_input_assert(AI_STATUS_DISCONNECTED == pvt->ast_channel.status);
-      alsa_input_set_new_state(pvt, AI_ST_DISCONNECTED, AI_EV_DISCONNECTED);
+   alsa_input_fft_complex(fft, z, true);
+   for (k = 0; (k < (2 * m)); k += 1) {
+      out[k] = z[k] * scale;
    }
-   alsa_input_pr_debug("Line %lu unlink from channel '%s'.\n",
-      (unsigned long)(pvt->index_line + 1), alsa_input_ast_channel_name(ast));
-   ast_module_unref(ast_module_info->self);
-   if (unlock_ast_channel) {
-#ifdef DEBUG
-      alsa_input_assert(pvt->owner_lock_count > 0);
-      pvt->owner_lock_count -= 1;
-#endif /* DEBUG */
-      ast_channel_unlock(ast);
+}
+
+static void alsa_input_aec_free(alsa_input_aec_t *aec)
+{
+   if (NULL != aec) {
+      ast_free(aec->mem);
+      alsa_input_fft_destroy(&(aec->fft));
+      ast_free(aec->in_d);
+      ast_free(aec);
    }
 }
 
+static void alsa_input_aec_reset(alsa_input_aec_t *aec)
+{
+   size_t len = (size_t)(aec->partitions) * aec->stride;
+
+   memset(aec->x_re, 0, len * sizeof(float));
+   memset(aec->x_im, 0, len * sizeof(float));
+   memset(aec->w_re, 0, len * sizeof(float));
+   memset(aec->w_im, 0, len * sizeof(float));
+   memset(aec->psd, 0, aec->stride * sizeof(float));
+   memset(aec->x_prev, 0, aec->block * sizeof(float));
+   memset(aec->far_max, 0, aec->partitions * sizeof(float));
+   memset(aec->in_d, 0, aec->block * sizeof(aec->in_d[0]));
+   memset(aec->in_x, 0, aec->block * sizeof(aec->in_x[0]));
+   memset(aec->out, 0, aec->block * sizeof(aec->out[0]));
+   aec->x_slot = 0;
+   aec->constrain = 0;
+   aec->fill = 0;
+}
+
 /*
- Must be called with pvt->owner and monitor.lock locked.
- When exiting pvt->owner has been unlocked, pvt->owner is set to NULL.
+ Forgets the samples of the block being filled, when capture restarts. The
+ filter is kept, the echo path doesn't change between two calls
 */
-static void alsa_input_queue_hangup(alsa_input_pvt_t *pvt,
-   alsa_input_event_t cause)
+static void alsa_input_aec_restart(alsa_input_aec_t *aec)
 {
-   struct ast_channel *ast = pvt->owner;
+   memset(aec->out, 0, aec->block * sizeof(aec->out[0]));
+   aec->fill = 0;
+}
 
-   alsa_input_pr_debug("alsa_input_queue_hangup(cause=%d)\n", (int)(cause));
+/*
+ Allocates an echo canceller for a line at rate sample_rate, whose filter
+ covers tail_ms ms
+*/
+static alsa_input_aec_t *alsa_input_aec_alloc(unsigned int sample_rate,
+   unsigned int tail_ms)
+{
+   alsa_input_aec_t *ret = NULL;
+   alsa_input_aec_t *aec = NULL;
 
-   alsa_input_assert((pvt->channel->monitor.lock_count > 0)
-      && (NULL != pvt->owner) && (pvt->owner_lock_count > 0));
+   do { /* Empty loop */
+      size_t len;
+      size_t tail;
+      float *p;
 
-   alsa_input_unlink_from_ast_channel(pvt, cause, true);
-   alsa_input_assert(NULL == pvt->owner);
-   if (ast_queue_hangup(ast)) {
-      ast_log(AST_LOG_WARNING, "Unable to queue hangup on line '%s'\n", alsa_input_ast_channel_name(ast));
-   }
+      aec = ast_calloc(1, sizeof(*aec));
+      if (NULL == aec) {
+         break;
+      }
+      /* 8 ms at 8 kHz, at most as long at the other rates (power of 2) */
+      aec->block = AI_AEC_BLOCK_8K;
+      while ((aec->block * 2 * 8000) <= (AI_AEC_BLOCK_8K * sample_rate)) {
+         aec->block <<= 1;
+      }
+      tail = ((size_t)(tail_ms) * sample_rate) / 1000;
+      aec->partitions = (tail + aec->block - 1) / aec->block;
+      if (0 == aec->partitions) {
+         aec->partitions = 1;
+      }
+      /* Bins 0 to block, rounded to a multiple of 4 for the SIMD kernels */
+      aec->stride = aec->block + 4;
+
+      len = (4 * (size_t)(aec->partitions) * aec->stride) /* x_re, x_im, w_re, w_im */
+         + (5 * (size_t)(aec->stride)) /* psd, y_re, y_im, e_re, e_im */
+         + aec->block /* x_prev */
+         + (2 * (size_t)(aec->block)) /* work */
+         + aec->partitions; /* far_max */
+      aec->mem = ast_calloc(len, sizeof(float));
+      aec->in_d = ast_calloc(3 * (size_t)(aec->block), sizeof(aec->in_d[0]));
+      if ((NULL == aec->mem) || (NULL == aec->in_d)
+          || alsa_input_fft_init(&(aec->fft), aec->block)) {
+         break;
+      }
+      aec->in_x = &(aec->in_d[aec->block]);
+      aec->out = &(aec->in_d[2 * aec->block]);
+      p = aec->mem;
+      aec->x_re = p;
+      p += (size_t)(aec->partitions) * aec->stride;
+      aec->x_im = p;
+      p += (size_t)(aec->partitions) * aec->stride;
+      aec->w_re = p;
+      p += (size_t)(aec->partitions) * aec->stride;
+      aec->w_im = p;
+      p += (size_t)(aec->partitions) * aec->stride;
+      aec->psd = p;
+      p += aec->stride;
+      aec->y_re = p;
+      p += aec->stride;
+      aec->y_im = p;
+      p += aec->stride;
+      aec->e_re = p;
+      p += aec->stride;
+      aec->e_im = p;
+      p += aec->stride;
+      aec->x_prev = p;
+      p += aec->block;
+      aec->work = p;
+      p += 2 * aec->block;
+      aec->far_max = p;
+
+      /*
+       Regularization of the step : power of a noise of amplitude 30
+       over the tail
+      */
+      aec->mu = 0.5f;
+      aec->delta = 2.0f * aec->block * aec->partitions * 30.0f * 30.0f;
+      alsa_input_aec_reset(aec);
+
+      ret = aec;
+      aec = NULL;
+   } while (false);
+
+   alsa_input_aec_free(aec);
+
+   return (ret);
 }
 
 /*
- Must be called with pvt->owner and monitor.lock locked
+ y += w * x on n complex bins (n multiple of 4) : filtering by one
+ partition
 */
-static void alsa_input_disconnect_line(alsa_input_pvt_t *pvt)
+static inline void alsa_input_aec_cmac(float *y_re, float *y_im,
+   const float *w_re, const float *w_im, const float *x_re, const float *x_im,
+   unsigned int n)
 {
-   alsa_input_pr_debug("alsa_input_disconnect_line()\n");
-
-   alsa_input_assert((pvt->channel->monitor.lock_count > 0)
-      && ((NULL == pvt->owner) || (pvt->owner_lock_count > 0))
-      && (AI_STATUS_DISCONNECTED == pvt->ast_channel.status));
-
-   if (NULL != pvt->owner) {
-      alsa_input_queue_hangup(pvt, AI_EV_DISCONNECTED);
-      alsa_input_assert(NULL == pvt->owner);
+   unsigned int i;
+#if defined(__SSE__)
+   for (i = 0; (i < n); i += 4) {
+      __m128 wr = _mm_loadu_ps(&(w_re[i]));
+      __m128 wi = _mm_loadu_ps(&(w_im[i]));
+      __m128 xr = _mm_loadu_ps(&(x_re[i]));
+      __m128 xi = _mm_loadu_ps(&(x_im[i]));
+      _mm_storeu_ps(&(y_re[i]), _mm_add_ps(_mm_loadu_ps(&(y_re[i])),
+         _mm_sub_ps(_mm_mul_ps(wr, xr), _mm_mul_ps(wi, xi))));
+      _mm_storeu_ps(&(y_im[i]), _mm_add_ps(_mm_loadu_ps(&(y_im[i])),
+         _mm_add_ps(_mm_mul_ps(wr, xi), _mm_mul_ps(wi, xr))));
    }
-   else {
-      alsa_input_set_new_state(pvt, AI_ST_DISCONNECTED, AI_EV_DISCONNECTED);
-   }
-   pvt->monitor.last_known_state = pvt->ast_channel.state;
-   /* Closes sound devices */
-   if (NULL != pvt->ast_channel.snd_capture.card) {
-      alsa_input_snd_card_deinit(&(pvt->ast_channel.snd_capture));
-      pvt->monitor.fd_snd_capture = -1;
+#elif defined(__ARM_NEON)
+   for (i = 0; (i < n); i += 4) {
+      float32x4_t wr = vld1q_f32(&(w_re[i]));
+      float32x4_t wi = vld1q_f32(&(w_im[i]));
+      float32x4_t xr = vld1q_f32(&(x_re[i]));
+      float32x4_t xi = vld1q_f32(&(x_im[i]));
+      vst1q_f32(&(y_re[i]), vmlsq_f32(vmlaq_f32(vld1q_f32(&(y_re[i])), wr, xr), wi, xi));
+      vst1q_f32(&(y_im[i]), vmlaq_f32(vmlaq_f32(vld1q_f32(&(y_im[i])), wr, xi), wi, xr));
    }
-   if (NULL != pvt->ast_channel.snd_playback.card) {
-      alsa_input_snd_card_deinit(&(pvt->ast_channel.snd_playback));
+#else
+   for (i = 0; (i < n); i += 1) {
+      y_re[i] += (w_re[i] * x_re[i]) - (w_im[i] * x_im[i]);
+      y_im[i] += (w_re[i] * x_im[i]) + (w_im[i] * x_re[i]);
    }
-   if (pvt->monitor.fd_pipe >= 0) {
-      close(pvt->monitor.fd_pipe);
-      pvt->monitor.fd_pipe = -1;
+#endif
+}
+
+/*
+ w += conj(x) * g on n complex bins (n multiple of 4) : adaptation of one
+ partition
+*/
+static inline void alsa_input_aec_update(float *w_re, float *w_im,
+   const float *x_re, const float *x_im, const float *g_re, const float *g_im,
+   unsigned int n)
+{
+   unsigned int i;
+#if defined(__SSE__)
+   for (i = 0; (i < n); i += 4) {
+      __m128 xr = _mm_loadu_ps(&(x_re[i]));
+      __m128 xi = _mm_loadu_ps(&(x_im[i]));
+      __m128 gr = _mm_loadu_ps(&(g_re[i]));
+      __m128 gi = _mm_loadu_ps(&(g_im[i]));
+      _mm_storeu_ps(&(w_re[i]), _mm_add_ps(_mm_loadu_ps(&(w_re[i])),
+         _mm_add_ps(_mm_mul_ps(xr, gr), _mm_mul_ps(xi, gi))));
+      _mm_storeu_ps(&(w_im[i]), _mm_add_ps(_mm_loadu_ps(&(w_im[i])),
+         _mm_sub_ps(_mm_mul_ps(xr, gi), _mm_mul_ps(xi, gr))));
    }
-   if (pvt->monitor.fd_input >= 0) {
-      close(pvt->monitor.fd_input);
-      pvt->monitor.fd_input = -1;
+#elif defined(__ARM_NEON)
+   for (i = 0; (i < n); i += 4) {
+      float32x4_t xr = vld1q_f32(&(x_re[i]));
+      float32x4_t xi = vld1q_f32(&(x_im[i]));
+      float32x4_t gr = vld1q_f32(&(g_re[i]));
+      float32x4_t gi = vld1q_f32(&(g_im[i]));
+      vst1q_f32(&(w_re[i]), vmlaq_f32(vmlaq_f32(vld1q_f32(&(w_re[i])), xr, gr), xi, gi));
+      vst1q_f32(&(w_im[i]), vmlsq_f32(vmlaq_f32(vld1q_f32(&(w_im[i])), xr, gi), xi, gr));
    }
-   if (pvt->monitor.fd_output >= 0) {
-      close(pvt->monitor.fd_output);
-      pvt->monitor.fd_output = -1;
+#else
+   for (i = 0; (i < n); i += 1) {
+      w_re[i] += (x_re[i] * g_re[i]) + (x_im[i] * g_im[i]);
+      w_im[i] += (x_re[i] * g_im[i]) - (x_im[i] * g_re[i]);
    }
+#endif
 }
 
 /*
- Must be called with pvt->owner locked
+ Processes the block of in_d (microphone) and in_x (reference) : the
+ echo estimated is removed from in_d to out, then the filter is adapted
+ unless the near end talks (Geigel detector)
 */
-static void alsa_input_critical_error(alsa_input_pvt_t *pvt,
-   bool monitor_is_locked)
+static void alsa_input_aec_block(alsa_input_aec_t *aec)
 {
-   alsa_input_pr_debug("alsa_input_critical_error()\n");
-   alsa_input_assert((NULL == pvt->owner) || (pvt->owner_lock_count > 0));
-   ast_log(AST_LOG_ERROR, "Line %lu : critical error dectected, so line is disconnected\n", (unsigned long)(pvt->index_line + 1));
-   pvt->ast_channel.status = AI_STATUS_DISCONNECTED;
-   if (monitor_is_locked) {
-      alsa_input_disconnect_line(pvt);
-   }
-   else {
-      if (NULL != pvt->owner) {
-         ast_hangup(pvt->owner);
+   const unsigned int m = aec->block;
+   const unsigned int n = aec->stride;
+   float *x_re;
+   float *x_im;
+   float far_max = 0.0f;
+   float near_max = 0.0f;
+   unsigned int p;
+   unsigned int i;
+
+   /* Spectrum of the last 2 blocks of the reference */
+   aec->x_slot = (aec->x_slot + 1) % aec->partitions;
+   x_re = &(aec->x_re[aec->x_slot * n]);
+   x_im = &(aec->x_im[aec->x_slot * n]);
+   memcpy(aec->work, aec->x_prev, m * sizeof(aec->work[0]));
+   for (i = 0; (i < m); i += 1) {
+      float v = aec->in_x[i];
+      aec->work[m + i] = v;
+      aec->x_prev[i] = v;
+      if (fabsf(v) > far_max) {
+         far_max = fabsf(v);
       }
    }
-}
+   aec->far_max[aec->x_slot] = far_max;
+   alsa_input_fft_real(&(aec->fft), aec->work, x_re, x_im);
+
+   /* Echo estimated : sum of the partitions filtering the older blocks */
+   memset(aec->y_re, 0, n * sizeof(aec->y_re[0]));
+   memset(aec->y_im, 0, n * sizeof(aec->y_im[0]));
+   for (p = 0; (p < aec->partitions); p += 1) {
+      unsigned int s = ((aec->x_slot + aec->partitions) - p) % aec->partitions;
+      alsa_input_aec_cmac(aec->y_re, aec->y_im,
+         &(aec->w_re[p * n]), &(aec->w_im[p * n]),
+         &(aec->x_re[s * n]), &(aec->x_im[s * n]), n);
+   }
+   alsa_input_fft_real_inverse(&(aec->fft), aec->y_re, aec->y_im, aec->work);
 
-/* Must be called with pvt->owner locked */
-static void alsa_input_write_tone_data(alsa_input_pvt_t *pvt)
-{
-   /* alsa_input_pr_debug("alsa_input_write_tone_data()\n"); */
+   /* Error (output), the first half of work is zeroed for its spectrum */
+   for (i = 0; (i < m); i += 1) {
+      float d = aec->in_d[i];
+      float e = d - aec->work[m + i];
 
-   alsa_input_assert(((NULL == pvt->owner) || (pvt->owner_lock_count > 0))
-      && (AI_TONE_NONE != pvt->ast_channel.tone));
+      if (fabsf(d) > near_max) {
+         near_max = fabsf(d);
+      }
+      aec->out[i] = (e > INT16_MAX) ? INT16_MAX : ((e < INT16_MIN) ? INT16_MIN : lrintf(e));
+      aec->work[i] = 0.0f;
+      aec->work[m + i] = e;
+   }
 
-   for (;;) {
-      /* We test if there is samples to write */
-      if (pvt->ast_channel.bytes_not_written_len < SAMPLE_SIZE) {
-         /*
-          * Not enough data, we generate some samples, but we must be careful about
-          * tone duration asked
-          */
-         size_t len_needed;
-
-         if (pvt->ast_channel.bytes_not_written_len > 0) {
-            memmove(pvt->ast_channel.bytes_not_written,
-               &(pvt->ast_channel.bytes_not_written[pvt->ast_channel.offset_bytes_not_written]),
-               pvt->ast_channel.bytes_not_written_len);
-         }
-         pvt->ast_channel.offset_bytes_not_written = 0;
-
-         len_needed = ARRAY_LEN(pvt->ast_channel.bytes_not_written) - pvt->ast_channel.bytes_not_written_len;
-         if (pvt->ast_channel.tone_duration_in_bytes > 0) {
-            if ((pvt->ast_channel.tone_bytes_generated + len_needed) > pvt->ast_channel.tone_duration_in_bytes) {
-               len_needed = pvt->ast_channel.tone_duration_in_bytes - pvt->ast_channel.tone_bytes_generated;
-            }
-         }
-         if (len_needed > 0) {
-            size_t tmp = alsa_input_generate_tone_data(&(pvt->ast_channel.tone_state),
-                  &(pvt->ast_channel.bytes_not_written[pvt->ast_channel.bytes_not_written_len]),
-                  len_needed);
-            pvt->ast_channel.bytes_not_written_len += tmp;
-            pvt->ast_channel.tone_bytes_generated += tmp;
-         }
+   /* Far end silent or near end talking : the filter is not adapted */
+   for (p = 0; (p < aec->partitions); p += 1) {
+      if (aec->far_max[p] > far_max) {
+         far_max = aec->far_max[p];
       }
+   }
+   if ((far_max < AI_AEC_MIN_FAR) || (near_max > (AI_AEC_GEIGEL * far_max))) {
+      return;
+   }
 
-      if (pvt->ast_channel.bytes_not_written_len > 0) {
-         snd_pcm_state_t state;
-         snd_pcm_sframes_t written;
-         size_t tmp;
+   /*
+    Normalized step per bin : mu * E / (power of the reference over the
+    tail + delta), smoothed with a fast attack so that the step never
+    overshoots on onsets
+   */
+   alsa_input_fft_real(&(aec->fft), aec->work, aec->e_re, aec->e_im);
+   for (i = 0; (i <= m); i += 1) {
+      float pw = 0.0f;
+      float g;
+
+      for (p = 0; (p < aec->partitions); p += 1) {
+         float r = aec->x_re[(p * n) + i];
+         float im = aec->x_im[(p * n) + i];
+         pw += (r * r) + (im * im);
+      }
+      aec->psd[i] = (pw > aec->psd[i]) ? pw : ((0.7f * aec->psd[i]) + (0.3f * pw));
+      g = aec->mu / (aec->psd[i] + aec->delta);
+      aec->e_re[i] *= g;
+      aec->e_im[i] *= g;
+   }
+   for (p = 0; (p < aec->partitions); p += 1) {
+      unsigned int s = ((aec->x_slot + aec->partitions) - p) % aec->partitions;
+      alsa_input_aec_update(&(aec->w_re[p * n]), &(aec->w_im[p * n]),
+         &(aec->x_re[s * n]), &(aec->x_im[s * n]), aec->e_re, aec->e_im, n);
+   }
 
-         /* We test if playback card is started */
-         state = snd_pcm_state(pvt->ast_channel.snd_playback.card);
-         if ((state != SND_PCM_STATE_PREPARED) && (state != SND_PCM_STATE_RUNNING)) {
-            int err = snd_pcm_prepare(pvt->ast_channel.snd_playback.card);
-            if (err) {
-               ast_log(AST_LOG_ERROR, "snd_pcm_prepare() failed: '%s'\n", snd_strerror(err));
-            }
-         }
-         written = snd_pcm_writei(pvt->ast_channel.snd_playback.card,
-            &(pvt->ast_channel.bytes_not_written[pvt->ast_channel.offset_bytes_not_written]),
-            pvt->ast_channel.bytes_not_written_len / SAMPLE_SIZE);
-         if (written < 0) {
-            if (alsa_input_snd_card_handle_error(&(pvt->ast_channel.snd_playback), written, "snd_pcm_writei")) {
-               /* Critical error */
-               alsa_input_critical_error(pvt, false);
-            }
-            break;
-         }
-         tmp = (written * SAMPLE_SIZE);
-         pvt->ast_channel.offset_bytes_not_written += tmp;
-         pvt->ast_channel.bytes_not_written_len -= tmp;
-         if (pvt->ast_channel.bytes_not_written_len >= SAMPLE_SIZE) {
-            break;
-         }
-      }
-      else {
-         alsa_input_set_line_tone(pvt, AI_TONE_NONE, 0);
-         break;
+   /*
+    Gradient constraint, one partition per block : the impulse response of
+    a partition must fit in block samples
+   */
+   p = aec->constrain;
+   alsa_input_fft_real_inverse(&(aec->fft), &(aec->w_re[p * n]), &(aec->w_im[p * n]), aec->work);
+   memset(&(aec->work[m]), 0, m * sizeof(aec->work[0]));
+   alsa_input_fft_real(&(aec->fft), aec->work, &(aec->w_re[p * n]), &(aec->w_im[p * n]));
+   aec->constrain = (p + 1) % aec->partitions;
+}
+
+/*
+ Removes the echo of ref from the count samples of mic, in place. The
+ output is late by one block
+*/
+static void alsa_input_aec_process(alsa_input_aec_t *aec, int16_t *mic,
+   const int16_t *ref, size_t count)
+{
+   while (count > 0) {
+      size_t n = aec->block - aec->fill;
+
+      if (n > count) {
+         n = count;
+      }
+      memcpy(&(aec->in_d[aec->fill]), mic, n * sizeof(mic[0]));
+      memcpy(&(aec->in_x[aec->fill]), ref, n * sizeof(ref[0]));
+      memcpy(mic, &(aec->out[aec->fill]), n * sizeof(mic[0]));
+      aec->fill += n;
+      mic += n;
+      ref += n;
+      count -= n;
+      if (aec->fill >= aec->block) {
+         alsa_input_aec_block(aec);
+         aec->fill = 0;
       }
    }
 }
 
-/* Must be called with pvt->owner locked */
-static void alsa_input_set_line_tone(alsa_input_pvt_t *pvt,
-   alsa_input_tone_t tone, size_t tone_duration)
+static void alsa_input_ns_free(alsa_input_ns_t *ns)
 {
-   alsa_input_pr_debug("alsa_input_set_line_tone(tone=%d, tone_duration=%lu)\n",
-      (int)(tone), (long)(tone_duration));
+   if (NULL != ns) {
+      ast_free(ns->mem);
+      alsa_input_fft_destroy(&(ns->fft));
+      ast_free(ns->in);
+      ast_free(ns);
+   }
+}
 
-   alsa_input_assert((NULL == pvt->owner) || (pvt->owner_lock_count > 0));
+/*
+ Forgets the samples of the frames being processed, when capture restarts.
+ The noise is kept
+*/
+static void alsa_input_ns_restart(alsa_input_ns_t *ns)
+{
+   memset(ns->in_prev, 0, ns->hop * sizeof(ns->in_prev[0]));
+   memset(ns->overlap, 0, ns->hop * sizeof(ns->overlap[0]));
+   memset(ns->prev, 0, (ns->hop + 1) * sizeof(ns->prev[0]));
+   memset(ns->out, 0, ns->hop * sizeof(ns->out[0]));
+   ns->fill = 0;
+}
 
-   switch (tone) {
-      case AI_TONE_NONE: {
-         tone_duration = 0;
-         break;
-      }
-      case AI_TONE_WAITING_DIAL: {
-         alsa_input_tone_state_init(&(pvt->ast_channel.tone_state), &(alsa_input_tone_dial));
-         break;
-      }
-      case AI_TONE_INVALID: {
-         alsa_input_tone_state_init(&(pvt->ast_channel.tone_state), &(alsa_input_tone_invalid));
-         break;
-      }
-      case AI_TONE_BUSY: {
-         alsa_input_tone_state_init(&(pvt->ast_channel.tone_state), &(alsa_input_tone_busy));
-         break;
-      }
-      case AI_TONE_DTMF_0: {
-         alsa_input_tone_state_init(&(pvt->ast_channel.tone_state), &(alsa_input_tone_dtmf_0));
-         break;
-      }
-      case AI_TONE_DTMF_1: {
-         alsa_input_tone_state_init(&(pvt->ast_channel.tone_state), &(alsa_input_tone_dtmf_1));
-         break;
-      }
-      case AI_TONE_DTMF_2: {
-         alsa_input_tone_state_init(&(pvt->ast_channel.tone_state), &(alsa_input_tone_dtmf_2));
-         break;
-      }
-      case AI_TONE_DTMF_3: {
-         alsa_input_tone_state_init(&(pvt->ast_channel.tone_state), &(alsa_input_tone_dtmf_3));
+/*
+ Allocates a noise suppressor for a line at rate sample_rate, attenuating
+ the noise by at most reduction dB
+*/
+static alsa_input_ns_t *alsa_input_ns_alloc(unsigned int sample_rate,
+   unsigned int reduction)
+{
+   alsa_input_ns_t *ret = NULL;
+   alsa_input_ns_t *ns = NULL;
+
+   do { /* Empty loop */
+      unsigned int i;
+      float *p;
+
+      ns = ast_calloc(1, sizeof(*ns));
+      if (NULL == ns) {
          break;
       }
-      case AI_TONE_DTMF_4: {
-         alsa_input_tone_state_init(&(pvt->ast_channel.tone_state), &(alsa_input_tone_dtmf_4));
-         break;
+      /* 8 ms at 8 kHz, at most as long at the other rates (power of 2) */
+      ns->hop = AI_NS_HOP_8K;
+      while ((ns->hop * 2 * 8000) <= (AI_NS_HOP_8K * sample_rate)) {
+         ns->hop <<= 1;
       }
-      case AI_TONE_DTMF_5: {
-         alsa_input_tone_state_init(&(pvt->ast_channel.tone_state), &(alsa_input_tone_dtmf_5));
+      /* window, work, re, im, power, noise, prev, in_prev, overlap */
+      ns->mem = ast_calloc((4 * (size_t)(ns->hop)) + (5 * ((size_t)(ns->hop) + 1)) + (2 * (size_t)(ns->hop)), sizeof(float));
+      ns->in = ast_calloc(2 * (size_t)(ns->hop), sizeof(ns->in[0]));
+      if ((NULL == ns->mem) || (NULL == ns->in)
+          || alsa_input_fft_init(&(ns->fft), ns->hop)) {
          break;
       }
-      case AI_TONE_DTMF_6: {
-         alsa_input_tone_state_init(&(pvt->ast_channel.tone_state), &(alsa_input_tone_dtmf_6));
-         break;
+      ns->out = &(ns->in[ns->hop]);
+      p = ns->mem;
+      ns->window = p;
+      p += 2 * ns->hop;
+      ns->work = p;
+      p += 2 * ns->hop;
+      ns->re = p;
+      p += ns->hop + 1;
+      ns->im = p;
+      p += ns->hop + 1;
+      ns->power = p;
+      p += ns->hop + 1;
+      ns->noise = p;
+      p += ns->hop + 1;
+      ns->prev = p;
+      p += ns->hop + 1;
+      ns->in_prev = p;
+      p += ns->hop;
+      ns->overlap = p;
+
+      /* Periodic window : the squares of the overlapping halves sum to 1 */
+      for (i = 0; (i < (2 * ns->hop)); i += 1) {
+         ns->window[i] = sqrt(0.5 - (0.5 * cos((M_PI * i) / ns->hop)));
+      }
+      ns->rise = powf(10.0f, (AI_NS_NOISE_RISE * ns->hop) / (10.0f * sample_rate));
+      ns->gain_min = powf(10.0f, -(float)(reduction) / 20.0f);
+      ns->started = false;
+      alsa_input_ns_restart(ns);
+
+      ret = ns;
+      ns = NULL;
+   } while (false);
+
+   alsa_input_ns_free(ns);
+
+   return (ret);
+}
+
+/* Processes the hop of ns->in, the output of the previous hop goes to ns->out */
+static void alsa_input_ns_block(alsa_input_ns_t *ns)
+{
+   const unsigned int m = ns->hop;
+   unsigned int i;
+
+   for (i = 0; (i < m); i += 1) {
+      float v = ns->in[i];
+      ns->work[i] = ns->in_prev[i] * ns->window[i];
+      ns->work[m + i] = v * ns->window[m + i];
+      ns->in_prev[i] = v;
+   }
+   alsa_input_fft_real(&(ns->fft), ns->work, ns->re, ns->im);
+   for (i = 0; (i <= m); i += 1) {
+      float pw = (ns->re[i] * ns->re[i]) + (ns->im[i] * ns->im[i]);
+      float noise;
+      float post;
+      float prio;
+      float g;
+
+      if (!ns->started) {
+         ns->power[i] = pw;
+         ns->noise[i] = pw;
+      }
+      ns->power[i] = (AI_NS_SMOOTH * ns->power[i]) + ((1.0f - AI_NS_SMOOTH) * pw);
+      if (ns->power[i] < ns->noise[i]) {
+         ns->noise[i] = ns->power[i];
       }
-      case AI_TONE_DTMF_7: {
-         alsa_input_tone_state_init(&(pvt->ast_channel.tone_state), &(alsa_input_tone_dtmf_7));
-         break;
+      else {
+         ns->noise[i] *= ns->rise;
+      }
+      noise = (AI_NS_BIAS * ns->noise[i]) + 1e-3f;
+      post = pw / noise;
+      prio = (AI_NS_DD * (ns->prev[i] / noise)) + ((1.0f - AI_NS_DD) * fmaxf(post - 1.0f, 0.0f));
+      g = fmaxf(prio / (1.0f + prio), ns->gain_min);
+      ns->re[i] *= g;
+      ns->im[i] *= g;
+      ns->prev[i] = g * g * pw;
+   }
+   ns->started = true;
+   alsa_input_fft_real_inverse(&(ns->fft), ns->re, ns->im, ns->work);
+   for (i = 0; (i < m); i += 1) {
+      float v = ns->overlap[i] + (ns->work[i] * ns->window[i]);
+      ns->out[i] = (v > INT16_MAX) ? INT16_MAX : ((v < INT16_MIN) ? INT16_MIN : lrintf(v));
+      ns->overlap[i] = ns->work[m + i] * ns->window[m + i];
+   }
+}
+
+/* Suppresses the noise of count samples, in place. The output is late by 2 hops */
+static void alsa_input_ns_process(alsa_input_ns_t *ns, int16_t *samples,
+   size_t count)
+{
+   while (count > 0) {
+      size_t n = ns->hop - ns->fill;
+
+      if (n > count) {
+         n = count;
       }
-      case AI_TONE_DTMF_8: {
-         alsa_input_tone_state_init(&(pvt->ast_channel.tone_state), &(alsa_input_tone_dtmf_8));
-         break;
+      memcpy(&(ns->in[ns->fill]), samples, n * sizeof(samples[0]));
+      memcpy(samples, &(ns->out[ns->fill]), n * sizeof(samples[0]));
+      ns->fill += n;
+      samples += n;
+      count -= n;
+      if (ns->fill >= ns->hop) {
+         alsa_input_ns_block(ns);
+         ns->fill = 0;
       }
-      case AI_TONE_DTMF_9: {
-         alsa_input_tone_state_init(&(pvt->ast_channel.tone_state), &(alsa_input_tone_dtmf_9));
+   }
+}
+
+static void alsa_input_plc_free(alsa_input_plc_t *plc)
+{
+   if (NULL != plc) {
+      ast_free(plc->hist);
+      ast_free(plc->work);
+      ast_free(plc);
+   }
+}
+
+/* Forgets the samples played, concealment stops until voice is played again */
+static void alsa_input_plc_reset(alsa_input_plc_t *plc)
+{
+   memset(plc->hist, 0, plc->hist_size * sizeof(plc->hist[0]));
+   plc->hist_head = 0;
+   plc->concealed = 0;
+   plc->armed = false;
+   plc->active = false;
+}
+
+/* Allocates the concealment of a line at rate sample_rate */
+static alsa_input_plc_t *alsa_input_plc_alloc(unsigned int sample_rate)
+{
+   alsa_input_plc_t *ret = NULL;
+   alsa_input_plc_t *plc = NULL;
+
+   do { /* Empty loop */
+      plc = ast_calloc(1, sizeof(*plc));
+      if (NULL == plc) {
          break;
       }
-      case AI_TONE_DTMF_ASTER: {
-         alsa_input_tone_state_init(&(pvt->ast_channel.tone_state), &(alsa_input_tone_dtmf_aster));
+      plc->pitch_min = (AI_PLC_PITCH_MIN_8K * sample_rate) / 8000;
+      plc->pitch_max = (AI_PLC_PITCH_MAX_8K * sample_rate) / 8000;
+      /* The coarse search runs on every other sample at 8 kHz */
+      plc->step = sample_rate / 4000;
+      plc->hist_size = 1;
+      while (plc->hist_size < (2 * (size_t)(plc->pitch_max))) {
+         plc->hist_size <<= 1;
+      }
+      plc->hist = ast_calloc(plc->hist_size, sizeof(plc->hist[0]));
+      /* work, cycle */
+      plc->work = ast_calloc(3 * (size_t)(plc->pitch_max), sizeof(float));
+      if ((NULL == plc->hist) || (NULL == plc->work)) {
          break;
       }
-      case AI_TONE_DTMF_POUND: {
-         alsa_input_tone_state_init(&(pvt->ast_channel.tone_state), &(alsa_input_tone_dtmf_pound));
-         break;
+      plc->cycle = &(plc->work[2 * plc->pitch_max]);
+      plc->fade_start = (size_t)(AI_PLC_FADE_START_MS) * (sample_rate / 1000);
+      plc->fade_len = (size_t)(AI_PLC_FADE_MS) * (sample_rate / 1000);
+      plc->hold = (size_t)(AI_PLC_HOLD_MS) * (sample_rate / 1000);
+      alsa_input_plc_reset(plc);
+
+      ret = plc;
+      plc = NULL;
+   } while (false);
+
+   alsa_input_plc_free(plc);
+
+   return (ret);
+}
+
+/* Appends count samples played to the history */
+static void alsa_input_plc_store(alsa_input_plc_t *plc, const int16_t *samples,
+   size_t count)
+{
+   if (count > plc->hist_size) {
+      samples += count - plc->hist_size;
+      count = plc->hist_size;
+   }
+   while (count > 0) {
+      size_t offset = plc->hist_head & (plc->hist_size - 1);
+      size_t n = plc->hist_size - offset;
+
+      if (n > count) {
+         n = count;
       }
-      case AI_TONE_DTMF_A: {
-         alsa_input_tone_state_init(&(pvt->ast_channel.tone_state), &(alsa_input_tone_dtmf_A));
-         break;
+      memcpy(&(plc->hist[offset]), samples, n * sizeof(samples[0]));
+      plc->hist_head += n;
+      samples += n;
+      count -= n;
+   }
+}
+
+/* Records count samples of voice written to the playback device */
+static inline void alsa_input_plc_played(alsa_input_plc_t *plc,
+   const int16_t *samples, size_t count)
+{
+   alsa_input_plc_store(plc, samples, count);
+   plc->armed = true;
+}
+
+/*
+ Returns the correlation, normalized by the energy of the lagged window, of
+ the last pitch_max samples of work with the samples lag samples before,
+ using one sample every step samples
+*/
+static float alsa_input_plc_correlation(const alsa_input_plc_t *plc,
+   unsigned int lag, unsigned int step)
+{
+   const unsigned int len = 2 * plc->pitch_max;
+   float c = 0.0f;
+   float e = 1.0f;
+   unsigned int i;
+
+   for (i = len - plc->pitch_max; (i < len); i += step) {
+      float x = plc->work[i - lag];
+      c += plc->work[i] * x;
+      e += x * x;
+   }
+   return ((c * fabsf(c)) / e);
+}
+
+/*
+ Starts a concealment : finds the pitch of the last samples played (coarse
+ search then refinement around the best period) and prepares the period
+ repeated
+*/
+static void alsa_input_plc_start(alsa_input_plc_t *plc)
+{
+   const unsigned int len = 2 * plc->pitch_max;
+   float best;
+   unsigned int lag;
+   unsigned int first;
+   unsigned int last;
+   unsigned int i;
+
+   for (i = 0; (i < len); i += 1) {
+      plc->work[i] = plc->hist[(plc->hist_head - len + i) & (plc->hist_size - 1)];
+   }
+
+   plc->pitch = plc->pitch_min;
+   best = alsa_input_plc_correlation(plc, plc->pitch, plc->step);
+   for (lag = plc->pitch_min + plc->step; (lag <= plc->pitch_max); lag += plc->step) {
+      float c = alsa_input_plc_correlation(plc, lag, plc->step);
+      if (c > best) {
+         best = c;
+         plc->pitch = lag;
       }
-      case AI_TONE_DTMF_B: {
-         alsa_input_tone_state_init(&(pvt->ast_channel.tone_state), &(alsa_input_tone_dtmf_B));
-         break;
+   }
+   first = ((plc->pitch - plc->step + 1) > plc->pitch_min) ? (plc->pitch - plc->step + 1) : plc->pitch_min;
+   last = ((plc->pitch + plc->step - 1) < plc->pitch_max) ? (plc->pitch + plc->step - 1) : plc->pitch_max;
+   best = -HUGE_VALF;
+   for (lag = first; (lag <= last); lag += 1) {
+      float c = alsa_input_plc_correlation(plc, lag, 1);
+      if (c > best) {
+         best = c;
+         plc->pitch = lag;
       }
-      case AI_TONE_DTMF_C: {
-         alsa_input_tone_state_init(&(pvt->ast_channel.tone_state), &(alsa_input_tone_dtmf_C));
-         break;
+   }
+
+   /* The end of the period fades into the samples preceding it */
+   plc->ov = plc->pitch / 4;
+   for (i = 0; (i < plc->pitch); i += 1) {
+      plc->cycle[i] = plc->work[len - plc->pitch + i];
+   }
+   for (i = 0; (i < plc->ov); i += 1) {
+      float w = (float)(i + 1) / (float)(plc->ov + 1);
+      plc->cycle[plc->pitch - plc->ov + i] = (plc->work[len - plc->ov + i] * (1.0f - w))
+         + (plc->work[len - plc->pitch - plc->ov + i] * w);
+   }
+   /* Continues the slope of the last samples played */
+   plc->jump = ((2.0f * plc->work[len - 1]) - plc->work[len - 2]) - plc->cycle[0];
+   plc->pos = 0;
+   plc->concealed = 0;
+   plc->active = true;
+}
+
+/* Returns the next sample of the concealment */
+static inline float alsa_input_plc_next(alsa_input_plc_t *plc)
+{
+   float v = 0.0f;
+
+   if (plc->concealed < (plc->fade_start + plc->fade_len)) {
+      v = plc->cycle[plc->pos];
+      if (plc->concealed < plc->ov) {
+         v += (plc->jump * (float)(plc->ov - plc->concealed)) / (float)(plc->ov);
       }
-      case AI_TONE_DTMF_D: {
-         alsa_input_tone_state_init(&(pvt->ast_channel.tone_state), &(alsa_input_tone_dtmf_D));
-         break;
+      if (plc->concealed >= plc->fade_start) {
+         v *= 1.0f - ((float)(plc->concealed - plc->fade_start) / (float)(plc->fade_len));
       }
-      default: {
-         alsa_input_assert(false);
-         tone = AI_TONE_NONE;
-         break;
+      plc->pos += 1;
+      if (plc->pos >= plc->pitch) {
+         plc->pos = 0;
       }
    }
-   pvt->ast_channel.tone = tone;
-   pvt->ast_channel.tone_duration_in_bytes = tone_duration * DEFAULT_SAMPLES_PER_MS * SAMPLE_SIZE;
-   pvt->ast_channel.tone_bytes_generated = 0;
-   if (AI_TONE_NONE == tone) {
-      if ((AI_ST_OFF_TALKING != pvt->ast_channel.state)
-          && (AI_ST_OFF_WAITING_ANSWER != pvt->ast_channel.state)) {
-         alsa_input_snd_card_stop(&(pvt->ast_channel.snd_playback));
-         alsa_input_reset_buf_bytes_not_written(pvt);
-      }
-      else {
-         /*
-          * Remove remaining data but take care that we wrote
-          * a number of bytes that is a factor of SAMPLE_SIZE
-          */
-         size_t tmp = pvt->ast_channel.bytes_not_written_len % SAMPLE_SIZE;
-         if (tmp > 0) {
-            memmove(pvt->ast_channel.bytes_not_written,
-               &(pvt->ast_channel.bytes_not_written[pvt->ast_channel.offset_bytes_not_written + pvt->ast_channel.bytes_not_written_len - tmp]), tmp);
-         }
-         pvt->ast_channel.bytes_not_written_len = tmp;
-         pvt->ast_channel.offset_bytes_not_written = 0;
-      }
+   plc->concealed += 1;
+   return (v);
+}
+
+/* Generates count samples of concealment in out */
+static void alsa_input_plc_generate(alsa_input_plc_t *plc, int16_t *out,
+   size_t count)
+{
+   size_t i;
+
+   if (!plc->active) {
+      alsa_input_plc_start(plc);
    }
-   else {
-      alsa_input_write_tone_data(pvt);
+   for (i = 0; (i < count); i += 1) {
+      float v = alsa_input_plc_next(plc);
+      out[i] = (v > INT16_MAX) ? INT16_MAX : ((v < INT16_MIN) ? INT16_MIN : lrintf(v));
    }
+   alsa_input_plc_store(plc, out, count);
 }
 
-/* Must be called with monitor.lock locked */
-static void alsa_input_new(alsa_input_pvt_t *pvt,
-   alsa_input_state_t state, alsa_input_event_t cause,
-#if (AST_VERSION <= 110)
-   const char *linkedid,
-#else /* (AST_VERSION > 110) */
-   const struct ast_assigned_ids *assigned_ids,
-   const struct ast_channel *requestor,
-#endif /* (AST_VERSION > 110) */
-   bool *try_to_lock_ast_channel)
+/*
+ Called when voice comes back, before count samples are played : the first
+ of them are blended with the continuation of the concealment
+*/
+static void alsa_input_plc_resume(alsa_input_plc_t *plc, int16_t *samples,
+   size_t count)
 {
-   enum ast_channel_state ast_state;
-   struct ast_channel *tmp = NULL;
+   size_t n = plc->ov + 1;
+   size_t i;
 
-   alsa_input_pr_debug("alsa_input_new(state=%d, cause=%d)\n",
-      (int)(state), (int)(cause));
+   if (!plc->active) {
+      return;
+   }
+   if (n > count) {
+      n = count;
+   }
+   for (i = 0; (i < n); i += 1) {
+      float w = (float)(i + 1) / (float)(n + 1);
+      float v = (samples[i] * w) + (alsa_input_plc_next(plc) * (1.0f - w));
+      samples[i] = (v > INT16_MAX) ? INT16_MAX : ((v < INT16_MIN) ? INT16_MIN : lrintf(v));
+   }
+   plc->active = false;
+   plc->concealed = 0;
+}
 
-   alsa_input_assert((pvt->channel->monitor.lock_count > 0)
-                     && (NULL == pvt->owner));
+/* Return true if the concealment has played silence long enough and gives up */
+static inline bool alsa_input_plc_expired(const alsa_input_plc_t *plc)
+{
+   return ((plc->active) && (plc->concealed >= plc->hold));
+}
 
-   switch (state) {
-      case AI_ST_OFF_WAITING_ANSWER: {
-         /*
-          We don't set AST_STATE_UP right now, because it makes Asterisk
-          believe that the call is already answered : in function
-          ast_channel_alloc(), Asterisk call ast_cdr_init() and test if state
-          is AST_STATE_UP to pass AST_CDR_ANSWERED or AST_CDR_NOANSWER
-         */
-         ast_state = AST_STATE_RING;
-         alsa_input_assert((cause == AI_EV_OFF_HOOK) || (cause == AI_EV_EXT_FOUND));
-         break;
-      }
-      case AI_ST_ON_PRE_RINGING: {
-         ast_state = AST_STATE_DOWN;
-         alsa_input_assert(cause == AI_EV_AST_REQUEST);
-         break;
-      }
-      default: {
-         alsa_input_assert(false);
-         ast_state = AST_STATE_DOWN;
-         break;
+/* Resets the voice activity detector, when capture starts */
+static void alsa_input_vad_reset(alsa_input_vad_t *vad,
+   const alsa_input_line_config_t *line_cfg)
+{
+   /* The first frame gives the level of the noise */
+   vad->noise = 0.0f;
+   vad->threshold = line_cfg->vad_threshold;
+   vad->hangover = AI_VAD_HANGOVER_MS;
+   vad->talking = true;
+}
+
+/*
+ Classifies a frame of count samples lasting duration ms. Return true while
+ there is voice (hangover included)
+*/
+static bool alsa_input_vad_process(alsa_input_vad_t *vad,
+   const int16_t *samples, size_t count, int duration)
+{
+   int64_t energy = 0;
+   size_t crossings = 0;
+   float level;
+   float zcr;
+   size_t i;
+
+   if (0 == count) {
+      return (vad->talking);
+   }
+   for (i = 0; (i < count); i += 1) {
+      energy += (int32_t)(samples[i]) * samples[i];
+      if ((i > 0) && ((samples[i] ^ samples[i - 1]) < 0)) {
+         crossings += 1;
       }
    }
-   alsa_input_assert(pvt->ast_channel.digits_len < ARRAY_LEN(pvt->ast_channel.digits));
-   if (pvt->ast_channel.digits_len <= 0) {
-      alsa_input_assert(ARRAY_LEN(alsa_input_default_extension) <= ARRAY_LEN(pvt->ast_channel.digits));
-      strcpy(pvt->ast_channel.digits, alsa_input_default_extension);
+   level = 10.0f * log10f(((float)(energy) / (count * 32768.0f * 32768.0f)) + 1e-12f);
+   zcr = (float)(crossings) / count;
+
+   if (level < vad->noise) {
+      vad->noise = level;
    }
    else {
-      pvt->ast_channel.digits[pvt->ast_channel.digits_len] = '\0';
+      vad->noise += fminf(level - vad->noise, (AI_VAD_NOISE_RISE * duration) / 1000.0f);
    }
-   /*
-    Because we provide no file descriptor to poll (for ast_waitfor()), it's
-    important to set parameter needqueue to true.
-    That way if Asterisk can't create a timer (eg because there's no timing
-    interfaces) it will at least create an "alert" pipe whose read end is polled
-    in ast_waitfor() and whose write end is written each time we queue a frame
-    (in ast_queue_frame()). read end of the pipe is read in ast_read().
-    If Asterisk can create a timer and if its name is "timerfd", it will not
-    create the "alert" pipe.
-    Asterisk uses the timer by setting it in continuous mode in
-    ast_queue_frame() and unsetting from continuous mode in ast_read()
-    The file descriptor provided by the timer is used in ast_waitfor().
-   */
-   tmp = ast_channel_alloc(1, ast_state,
-      ('\0' != pvt->line_cfg->cid_num[0]) ? pvt->line_cfg->cid_num : NULL,
-      ('\0' != pvt->line_cfg->cid_name[0]) ? pvt->line_cfg->cid_name : NULL,
-      "" /* acctcode */, pvt->ast_channel.digits, pvt->line_cfg->context,
-#if (AST_VERSION <= 110)
-      linkedid, 0,
-#else /* (AST_VERSION > 110) */
-      assigned_ids, requestor, AST_AMA_NONE,
-#endif /* (AST_VERSION > 110) */
-      "%s/%lu", pvt->channel->chan_tech.type, (unsigned long)(pvt->index_line + 1));
-   if (NULL != tmp) {
-      bool hangup = false;
+   if ((level > AI_VAD_FLOOR)
+       && ((level > (vad->noise + vad->threshold))
+         || ((level > (vad->noise + (vad->threshold / 2))) && (zcr > AI_VAD_ZCR)))) {
+      vad->hangover = AI_VAD_HANGOVER_MS;
+      vad->talking = true;
+   }
+   else if (vad->talking) {
+      vad->hangover -= duration;
+      if (vad->hangover <= 0) {
+         vad->talking = false;
+      }
+   }
+   return (vad->talking);
+}
 
-      /* From version 12.0, ast_channel_alloc() returned an ast_channel locked */
-#if (AST_VERSION <= 110)
-      /*
-       We can safely lock channel (without fear of a deadlock because
-       monitor.lock is locked), for 2 reasons :
-       - channel_tech is not set
-       - pvt->owner is still NULL
-      */
-      ast_channel_lock(tmp);
-#endif /* (AST_VERSION <= 110) */
-#ifdef DEBUG
-      pvt->owner_lock_count += 1;
-      alsa_input_assert(pvt->owner_lock_count > 0);
-#endif /* DEBUG */
+/* Returns the fixed point gain (see AI_GAIN_SHIFT) of db dB */
+static int alsa_input_gain_from_db(float db)
+{
+   float g = AI_GAIN_UNITY * powf(10.0f, db / 20.0f);
 
-      alsa_input_ast_channel_tech_set(tmp, &(pvt->channel->chan_tech));
+   return ((g >= INT16_MAX) ? INT16_MAX : (int)(lrintf(g)));
+}
 
-      alsa_input_ast_channel_nativeformats_set(tmp, alsa_input_get_chan_tech_cap(&(pvt->channel->chan_tech)));
-      alsa_input_ast_channel_set_rawreadformat(tmp, ast_format_slin);
-      alsa_input_ast_channel_set_rawwriteformat(tmp, ast_format_slin);
-      alsa_input_ast_channel_set_readformat(tmp, ast_format_slin);
-      alsa_input_ast_channel_set_writeformat(tmp, ast_format_slin);
-      /* no need to call ast_setstate: the channel_alloc already did its job */
-      alsa_input_ast_channel_exten_set(tmp, pvt->ast_channel.digits);
-      if (!ast_strlen_zero(pvt->channel->config.language)) {
-         alsa_input_ast_channel_language_set(tmp, pvt->channel->config.language);
-      }
-      if (AST_STATE_RING == ast_state) {
-         alsa_input_ast_channel_rings_set(tmp, 1);
-      }
-      /* Don't use ast_set_callerid() here because it will
-       * generate a NewCallerID event before the NewChannel event */
-      if (!ast_strlen_zero(pvt->line_cfg->cid_num)) {
-         alsa_input_ast_channel_caller(tmp)->ani.number.valid = 1;
-         ast_free(alsa_input_ast_channel_caller(tmp)->ani.number.str);
-         alsa_input_ast_channel_caller(tmp)->ani.number.str = ast_strdup(pvt->line_cfg->cid_num);
-      }
-      ast_jb_configure(tmp, &(pvt->line_cfg->jb_conf));
+/* Multiplies count samples by the fixed point gain, in place, with saturation */
+static void alsa_input_gain_apply(int16_t *samples, size_t count, int gain)
+{
+   size_t i = 0;
+#if defined(__SSE2__)
+   const __m128i g = _mm_set1_epi16((int16_t)(gain));
 
-      alsa_input_ast_channel_tech_pvt_set(tmp, pvt);
-      ast_module_ref(ast_module_info->self);
-      pvt->owner = tmp;
+   if (AI_GAIN_UNITY == gain) {
+      return;
+   }
+   for (; ((i + 8) <= count); i += 8) {
+      __m128i x = _mm_loadu_si128((const __m128i *)(&(samples[i])));
+      __m128i lo = _mm_mullo_epi16(x, g);
+      __m128i hi = _mm_mulhi_epi16(x, g);
+      /* 32 bits products, shifted and packed back with saturation */
+      __m128i p0 = _mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), AI_GAIN_SHIFT);
+      __m128i p1 = _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), AI_GAIN_SHIFT);
+      _mm_storeu_si128((__m128i *)(&(samples[i])), _mm_packs_epi32(p0, p1));
+   }
+#elif defined(__ARM_NEON)
+   const int16x4_t g = vdup_n_s16((int16_t)(gain));
 
-      /*
-       Set internal state before starting channel's thread
-      */
-      alsa_input_set_new_state(pvt, state, cause);
+   if (AI_GAIN_UNITY == gain) {
+      return;
+   }
+   for (; ((i + 8) <= count); i += 8) {
+      int16x8_t x = vld1q_s16(&(samples[i]));
+      int32x4_t p0 = vmull_s16(vget_low_s16(x), g);
+      int32x4_t p1 = vmull_s16(vget_high_s16(x), g);
+      vst1q_s16(&(samples[i]), vcombine_s16(vqshrn_n_s32(p0, AI_GAIN_SHIFT), vqshrn_n_s32(p1, AI_GAIN_SHIFT)));
+   }
+#else
+   if (AI_GAIN_UNITY == gain) {
+      return;
+   }
+#endif
+   for (; (i < count); i += 1) {
+      int32_t v = ((int32_t)(samples[i]) * gain) >> AI_GAIN_SHIFT;
+      samples[i] = (v > INT16_MAX) ? INT16_MAX : ((v < INT16_MIN) ? INT16_MIN : v);
+   }
+}
 
-      /* Unset pvt->owner before unlocking channel (see below) */
-      pvt->owner = NULL;
-#ifdef DEBUG
-      alsa_input_assert(pvt->owner_lock_count > 0);
-      pvt->owner_lock_count -= 1;
-#endif /* DEBUG */
-      ast_channel_unlock(tmp);
+static void alsa_input_agc_init(alsa_input_agc_t *agc, alsa_input_rate_t rate,
+   const alsa_input_line_config_t *line_cfg)
+{
+   agc->level = 0.0f;
+   agc->gain = 0.0f;
+   agc->target = line_cfg->agc_target;
+   agc->max_gain = line_cfg->agc_max_gain;
+   agc->rate = alsa_input_rate_values[rate];
+}
 
-      if ((!hangup) && (AST_STATE_DOWN != ast_state) && (ast_pbx_start(tmp))) {
-         ast_log(AST_LOG_ERROR, "Unable to start PBX on '%s'\n", alsa_input_ast_channel_name(tmp));
-         hangup = true;
+/* Applies the automatic gain control to count samples captured, in place */
+static void alsa_input_agc_process(alsa_input_agc_t *agc, int16_t *samples,
+   size_t count)
+{
+   const float dt = count / agc->rate;
+   int64_t energy = 0;
+   int peak = 0;
+   float level;
+   int gain;
+   size_t i;
+
+   if (0 == count) {
+      return;
+   }
+   for (i = 0; (i < count); i += 1) {
+      int v = samples[i];
+      energy += v * v;
+      if (abs(v) > peak) {
+         peak = abs(v);
       }
-      /*
-       Here we can still safely lock channel (without fear of a deadlock
-       because monitor.lock is locked), as pvt->owner is still NULL
-      */
-      alsa_input_assert(NULL == pvt->owner);
-      ast_channel_lock(tmp);
-#ifdef DEBUG
-      pvt->owner_lock_count += 1;
-      alsa_input_assert(pvt->owner_lock_count > 0);
-#endif /* DEBUG */
-      pvt->owner = tmp;
-      if (hangup) {
-         alsa_input_unlink_from_ast_channel(pvt, AI_EV_INTERNAL_ERROR, true);
-         alsa_input_assert(NULL == pvt->owner);
-         /* ast_channel_unlock(tmp) is done in alsa_input_unlink_from_ast_channel() */
-         /*
-          Calling ast_hangup() means that we call indirectly
-          alsa_input_chan_hangup().
-          As the association between the ast_channel and the tech_pvt
-          is already removed alsa_input_chan_hangup() will do nothing.
-          Of course in alsa_input_chan_hangup(), we must check that the
-          ast_channel has a valid tech_pvt
-         */
-         ast_hangup(tmp);
-         tmp = NULL;
+   }
+   agc->level += (dt / (dt + AI_AGC_TIME))
+      * (((float)(energy) / (count * 32768.0f * 32768.0f)) - agc->level);
+   level = 10.0f * log10f(agc->level + 1e-12f);
+   if (level > AI_AGC_GATE) {
+      float wanted = agc->target - level;
+
+      if (wanted > agc->max_gain) {
+         wanted = agc->max_gain;
       }
-      else {
-         if ((NULL == try_to_lock_ast_channel) || (!(*try_to_lock_ast_channel))) {
-#ifdef DEBUG
-            alsa_input_assert(pvt->owner_lock_count > 0);
-            pvt->owner_lock_count -= 1;
-#endif /* DEBUG */
-            ast_channel_unlock(pvt->owner);
-         }
+      if (wanted < AI_AGC_MIN_GAIN) {
+         wanted = AI_AGC_MIN_GAIN;
       }
-   }
-   else {
-      ast_log(AST_LOG_ERROR, "Unable to allocate ast_channel structure\n");
-      if (AST_STATE_DOWN != ast_state) {
-         alsa_input_assert(AI_ST_OFF_WAITING_ANSWER == state);
-         /* We signals the user that there's a problem */
-         alsa_input_set_new_state(pvt, AI_ST_OFF_NO_SERVICE, AI_EV_INTERNAL_ERROR);
+      if (wanted < agc->gain) {
+         agc->gain -= fminf(agc->gain - wanted, AI_AGC_ATTACK * dt);
       }
       else {
-         alsa_input_assert(AI_ST_ON_PRE_RINGING == state);
-         alsa_input_set_new_state(pvt, AI_ST_ON_IDLE, AI_EV_INTERNAL_ERROR);
+         agc->gain += fminf(wanted - agc->gain, AI_AGC_RELEASE * dt);
       }
    }
+   gain = alsa_input_gain_from_db(agc->gain);
+   /* Limiter : the peak of the chunk doesn't clip */
+   if (((peak * gain) >> AI_GAIN_SHIFT) > INT16_MAX) {
+      gain = (INT16_MAX << AI_GAIN_SHIFT) / peak;
+   }
+   alsa_input_gain_apply(samples, count, gain);
 }
 
-/* Must be call with pvt->owner locked. */
-static int alsa_input_setup(alsa_input_pvt_t *pvt,
-   const alsa_input_ast_format *format, enum ast_channel_state ast_state,
-   alsa_input_event_t cause)
+/* Modified Bessel function of the first kind, order 0 (for the Kaiser window) */
+static double alsa_input_bessel_i0(double x)
 {
-   int ret = 0;
+   double sum = 1.0;
+   double term = 1.0;
+   unsigned int k;
+
+   for (k = 1; (k < 50); k += 1) {
+      term *= (x / (2.0 * k)) * (x / (2.0 * k));
+      sum += term;
+      if (term < (sum * 1e-12)) {
+         break;
+      }
+   }
+   return (sum);
+}
 
-   alsa_input_pr_debug("alsa_input_setup(ast_state=%d)\n",
-      (int)(ast_state));
+static void alsa_input_resampler_free(alsa_input_resampler_t *rs)
+{
+   if (NULL != rs) {
+      ast_free(rs->coefs);
+      ast_free(rs->hist);
+      ast_free(rs);
+   }
+}
+
+/* Forgets the samples pushed so far (the device has been stopped) */
+static void alsa_input_resampler_reset(alsa_input_resampler_t *rs)
+{
+   memset(rs->hist, 0, 2 * rs->taps * sizeof(rs->hist[0]));
+   rs->hist_pos = 0;
+   rs->phase = 0;
+   rs->need = 1;
+}
+
+/*
+ Allocates a resampler from in_rate to out_rate. The filter is a windowed
+ sinc (Kaiser window) : higher quality means more taps per phase, a
+ steeper transition band and a higher stop band attenuation, but more CPU
+*/
+static alsa_input_resampler_t *alsa_input_resampler_alloc(unsigned int in_rate,
+   unsigned int out_rate, alsa_input_resample_quality_t quality)
+{
+   alsa_input_resampler_t *ret = NULL;
+   alsa_input_resampler_t *rs = NULL;
 
-   alsa_input_assert((NULL != pvt->owner) && (pvt->owner_lock_count > 0));
    do { /* Empty loop */
-      if (NULL == format) {
-         ast_log(AST_LOG_WARNING, "No format specified\n");
-         ret = -1;
+      unsigned int g = alsa_input_gcd(in_rate, out_rate);
+      unsigned int len;
+      unsigned int p;
+      unsigned int i;
+      double rolloff;
+      double beta;
+      double cutoff;
+      double center;
+      double i0_beta;
+
+      rs = ast_calloc(1, sizeof(*rs));
+      if (NULL == rs) {
          break;
       }
-      if (!alsa_input_ast_formats_are_equal(ast_format_slin, format)) {
-         ast_log(AST_LOG_WARNING, "Can't do format '%s'\n", alsa_input_ast_format_get_name(format));
-         ret = -1;
+      rs->up = out_rate / g;
+      rs->down = in_rate / g;
+      if (rs->up > AI_RESAMPLER_MAX_PHASES) {
+         ast_log(AST_LOG_ERROR, "Can't resample from %u Hz to %u Hz\n", in_rate, out_rate);
          break;
       }
-      alsa_input_set_new_state(pvt, AI_ST_OFF_TALKING, cause);
-      ast_setstate(pvt->owner, ast_state);
-   } while (0);
+      switch (quality) {
+         case AI_RESAMPLE_LOW: {
+            rs->taps = 8;
+            rolloff = 0.80;
+            beta = 5.0;
+            break;
+         }
+         case AI_RESAMPLE_HIGH: {
+            rs->taps = 32;
+            rolloff = 0.94;
+            beta = 9.0;
+            break;
+         }
+         default: {
+            rs->taps = 16;
+            rolloff = 0.90;
+            beta = 7.0;
+            break;
+         }
+      }
+      if (rs->down > rs->up) {
+         /*
+          When decimating, the cut-off is relative to the output rate : the
+          filter must span as many output samples, so more input samples
+         */
+         rs->taps *= (rs->down + rs->up - 1) / rs->up;
+      }
+      rs->coefs = ast_calloc(rs->up * rs->taps, sizeof(rs->coefs[0]));
+      rs->hist = ast_calloc(2 * rs->taps, sizeof(rs->hist[0]));
+      if ((NULL == rs->coefs) || (NULL == rs->hist)) {
+         break;
+      }
+
+      /*
+       Prototype filter at rate in_rate * up : cut-off at the lowest of the
+       two Nyquist frequencies, gain up to compensate the zeros inserted
+      */
+      len = rs->up * rs->taps;
+      cutoff = (0.5 * rolloff) / ((rs->up > rs->down) ? rs->up : rs->down);
+      center = (len - 1) / 2.0;
+      i0_beta = alsa_input_bessel_i0(beta);
+      for (p = 0; (p < rs->up); p += 1) {
+         for (i = 0; (i < rs->taps); i += 1) {
+            /* Coefficients of a phase are reversed (see alsa_input_resampler_process()) */
+            unsigned int n = ((rs->taps - 1 - i) * rs->up) + p;
+            double x = n - center;
+            double r = x / center;
+            double sinc = (0.0 == x) ? 1.0 : (sin(2.0 * M_PI * cutoff * x) / (2.0 * M_PI * cutoff * x));
+            double window = alsa_input_bessel_i0(beta * sqrt((r < 1.0) ? (1.0 - (r * r)) : 0.0)) / i0_beta;
+            rs->coefs[(p * rs->taps) + i] = (float)(rs->up * 2.0 * cutoff * sinc * window);
+         }
+      }
+      alsa_input_resampler_reset(rs);
+
+      ret = rs;
+      rs = NULL;
+   } while (false);
+
+   alsa_input_resampler_free(rs);
 
    return (ret);
 }
 
+/* Dot product of n floats, n multiple of 4 */
+static inline float alsa_input_resampler_dot(const float *a, const float *b, unsigned int n)
+{
+   unsigned int i;
+#if defined(__SSE__)
+   __m128 acc = _mm_setzero_ps();
+   float tmp[4];
+
+   for (i = 0; (i < n); i += 4) {
+      acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(&(a[i])), _mm_loadu_ps(&(b[i]))));
+   }
+   _mm_storeu_ps(tmp, acc);
+   return ((tmp[0] + tmp[1]) + (tmp[2] + tmp[3]));
+#elif defined(__ARM_NEON)
+   float32x4_t acc = vdupq_n_f32(0.0f);
+   float tmp[4];
+
+   for (i = 0; (i < n); i += 4) {
+      acc = vmlaq_f32(acc, vld1q_f32(&(a[i])), vld1q_f32(&(b[i])));
+   }
+   vst1q_f32(tmp, acc);
+   return ((tmp[0] + tmp[1]) + (tmp[2] + tmp[3]));
+#else
+   /* Four independent sums, that the compiler can vectorize */
+   float acc0 = 0.0f;
+   float acc1 = 0.0f;
+   float acc2 = 0.0f;
+   float acc3 = 0.0f;
+
+   for (i = 0; (i < n); i += 4) {
+      acc0 += a[i] * b[i];
+      acc1 += a[i + 1] * b[i + 1];
+      acc2 += a[i + 2] * b[i + 2];
+      acc3 += a[i + 3] * b[i + 3];
+   }
+   return ((acc0 + acc1) + (acc2 + acc3));
+#endif
+}
+
 /*
- Must be called with pvt->owner locked.
- If queue_frame is true, return true if a frame has been queued
- If queue_frame is false, return true if a frame is ready in
- pvt->ast_channel.frame
+ Resamples at most *in_len samples of in to out, without writing more than
+ out_len samples. Stops when all the input is consumed or out is full.
+ Return the number of samples written in out and sets *in_len to the
+ number of input samples consumed
 */
-static bool alsa_input_read_data(alsa_input_pvt_t *pvt,
-   bool queue_frame, bool monitor_is_locked)
+static size_t alsa_input_resampler_process(alsa_input_resampler_t *rs,
+   const int16_t *in, size_t *in_len, int16_t *out, size_t out_len)
 {
-   bool ret = false;
-   snd_pcm_state_t state;
-   snd_pcm_sframes_t read;
-   snd_pcm_uframes_t to_read;
-
-   /* alsa_input_pr_debug("alsa_input_read_data()\n"); */
-   alsa_input_assert((NULL != pvt->owner) && (pvt->owner_lock_count > 0));
-   if (!pvt->ast_channel.snd_capture_muted) {
-      to_read = (ARRAY_LEN(pvt->ast_channel.buf_fr_to_queue) - pvt->ast_channel.offset_buf_fr_to_queue);
-      for (;;) {
-         if (to_read >= SAMPLE_SIZE) {
-            state = snd_pcm_state(pvt->ast_channel.snd_capture.card);
-            if ((state != SND_PCM_STATE_PREPARED) && (state != SND_PCM_STATE_RUNNING)) {
-               int err = snd_pcm_prepare(pvt->ast_channel.snd_capture.card);
-               if (err) {
-                  ast_log(AST_LOG_ERROR, "snd_pcm_prepare() failed: '%s'\n", snd_strerror(err));
-               }
-            }
+   size_t consumed = 0;
+   size_t produced = 0;
 
-            read = snd_pcm_readi(pvt->ast_channel.snd_capture.card, pvt->ast_channel.buf_fr_to_queue + pvt->ast_channel.offset_buf_fr_to_queue,
-               to_read / SAMPLE_SIZE);
-            if (read < 0) {
-               if (alsa_input_snd_card_handle_error(&(pvt->ast_channel.snd_capture), read, "snd_pcm_readi")) {
-                  /* Critical error */
-                  alsa_input_critical_error(pvt, monitor_is_locked);
-               }
-               break;
-            }
+   for (;;) {
+      if (0 == rs->need) {
+         float val;
 
-            /* Update the number of bytes in the frame */
-            pvt->ast_channel.offset_buf_fr_to_queue += (read * SAMPLE_SIZE);
-            to_read = (ARRAY_LEN(pvt->ast_channel.buf_fr_to_queue) - pvt->ast_channel.offset_buf_fr_to_queue);
-         }
-         if (to_read < SAMPLE_SIZE) {
-            /* Buffer is full */
-            if (queue_frame) {
-               pvt->ast_channel.frame_to_queue.data.ptr = pvt->ast_channel.buf_fr_to_queue;
-               pvt->ast_channel.frame_to_queue.datalen = pvt->ast_channel.offset_buf_fr_to_queue;
-               pvt->ast_channel.frame_to_queue.samples = pvt->ast_channel.frame_to_queue.datalen / SAMPLE_SIZE;
-               pvt->ast_channel.frame_to_queue.frametype = AST_FRAME_VOICE;
-               alsa_input_ast_set_frame_format(&(pvt->ast_channel.frame_to_queue), ast_format_slin);
-               pvt->ast_channel.frame_to_queue.src = alsa_input_chan_type;
-               pvt->ast_channel.frame_to_queue.offset = 0;
-               pvt->ast_channel.frame_to_queue.mallocd = 0;
-               pvt->ast_channel.frame_to_queue.delivery = ast_tv(0,0);
-               if (ast_queue_frame(pvt->owner, &(pvt->ast_channel.frame_to_queue))) {
-                  ast_frfree(&(pvt->ast_channel.frame_to_queue));
-                  ast_log(AST_LOG_WARNING, "Can't queue voice frame for line %lu\n", (unsigned long)(pvt->index_line + 1));
-                  break;
-               }
-               ast_frfree(&(pvt->ast_channel.frame_to_queue));
-               ret = true;
-               alsa_input_reset_buf_fr_to_queue(pvt);
-               to_read = (ARRAY_LEN(pvt->ast_channel.buf_fr_to_queue) - pvt->ast_channel.offset_buf_fr_to_queue);
-            }
-            else {
-               memcpy(&(pvt->ast_channel.buf_fr[AST_FRIENDLY_OFFSET]), pvt->ast_channel.buf_fr_to_queue, pvt->ast_channel.offset_buf_fr_to_queue);
-               alsa_input_reset_buf_fr_to_queue(pvt);
-               pvt->ast_channel.frame.data.ptr = &(pvt->ast_channel.buf_fr[AST_FRIENDLY_OFFSET]);
-               pvt->ast_channel.frame.datalen = pvt->ast_channel.offset_buf_fr_to_queue;
-               pvt->ast_channel.frame.samples = pvt->ast_channel.frame.datalen / SAMPLE_SIZE;
-               pvt->ast_channel.frame.frametype = AST_FRAME_VOICE;
-               alsa_input_ast_set_frame_format(&(pvt->ast_channel.frame), ast_format_slin);
-               pvt->ast_channel.frame.src = alsa_input_chan_type;
-               pvt->ast_channel.frame.offset = AST_FRIENDLY_OFFSET;
-               pvt->ast_channel.frame.mallocd = 0;
-               pvt->ast_channel.frame.delivery = ast_tv(0,0);
-               ret = true;
-               break;
-            }
+         if (produced >= out_len) {
+            break;
+         }
+         val = alsa_input_resampler_dot(&(rs->hist[rs->hist_pos]),
+            &(rs->coefs[rs->phase * rs->taps]), rs->taps);
+         if (val > 32767.0f) {
+            out[produced] = 32767;
+         }
+         else if (val < -32768.0f) {
+            out[produced] = -32768;
          }
          else {
+            out[produced] = (int16_t)(lrintf(val));
+         }
+         produced += 1;
+         rs->phase += rs->down;
+         rs->need = rs->phase / rs->up;
+         rs->phase %= rs->up;
+      }
+      else {
+         if (consumed >= *in_len) {
             break;
          }
+         rs->hist[rs->hist_pos] = in[consumed];
+         rs->hist[rs->hist_pos + rs->taps] = in[consumed];
+         rs->hist_pos += 1;
+         if (rs->hist_pos >= rs->taps) {
+            rs->hist_pos = 0;
+         }
+         consumed += 1;
+         rs->need -= 1;
       }
    }
-
-   return (ret);
+   *in_len = consumed;
+   return (produced);
 }
 
-static inline void alsa_input_change_monitor_timeout(
-   alsa_input_monitor_prms_t *monitor_prms, int timeout)
+#if defined(__SSE2__)
+/* Transposes a block of 8x8 samples, rows r[0] to r[7] */
+static inline void alsa_input_transpose_8x8(__m128i *r)
 {
-   /* alsa_input_pr_debug("alsa_input_change_monitor_timeout(timeout=%d)\n",
-      (int)(timeout)); */
-
-   alsa_input_assert((timeout > 0) && (NULL != monitor_prms));
-   if (timeout < monitor_prms->timeout) {
-      monitor_prms->timeout = timeout;
-   }
+   __m128i t0 = _mm_unpacklo_epi16(r[0], r[1]);
+   __m128i t1 = _mm_unpackhi_epi16(r[0], r[1]);
+   __m128i t2 = _mm_unpacklo_epi16(r[2], r[3]);
+   __m128i t3 = _mm_unpackhi_epi16(r[2], r[3]);
+   __m128i t4 = _mm_unpacklo_epi16(r[4], r[5]);
+   __m128i t5 = _mm_unpackhi_epi16(r[4], r[5]);
+   __m128i t6 = _mm_unpacklo_epi16(r[6], r[7]);
+   __m128i t7 = _mm_unpackhi_epi16(r[6], r[7]);
+   __m128i u0 = _mm_unpacklo_epi32(t0, t2);
+   __m128i u1 = _mm_unpackhi_epi32(t0, t2);
+   __m128i u2 = _mm_unpacklo_epi32(t1, t3);
+   __m128i u3 = _mm_unpackhi_epi32(t1, t3);
+   __m128i u4 = _mm_unpacklo_epi32(t4, t6);
+   __m128i u5 = _mm_unpackhi_epi32(t4, t6);
+   __m128i u6 = _mm_unpacklo_epi32(t5, t7);
+   __m128i u7 = _mm_unpackhi_epi32(t5, t7);
+
+   r[0] = _mm_unpacklo_epi64(u0, u4);
+   r[1] = _mm_unpackhi_epi64(u0, u4);
+   r[2] = _mm_unpacklo_epi64(u1, u5);
+   r[3] = _mm_unpackhi_epi64(u1, u5);
+   r[4] = _mm_unpacklo_epi64(u2, u6);
+   r[5] = _mm_unpackhi_epi64(u2, u6);
+   r[6] = _mm_unpacklo_epi64(u3, u7);
+   r[7] = _mm_unpackhi_epi64(u3, u7);
 }
+#endif /* defined(__SSE2__) */
 
 /*
- Must be called with pvt->owner and monitor.lock locked.
+ Splits frames frames of channels interleaved samples : samples of channel c
+ are written to dst[c]. 2 and 8 channels (the usual multi-channel sound
+ cards) have SSE2 kernels, 8 samples of each channel at a time
 */
-static void alsa_input_handle_status_change(alsa_input_pvt_t *pvt,
-   alsa_input_monitor_prms_t *monitor_prms, alsa_input_status_t new_status)
+static void alsa_input_deinterleave(const int16_t *src, unsigned int channels,
+   size_t frames, int16_t * const *dst)
 {
-   alsa_input_pr_debug("alsa_input_handle_status_change(new_status=%d)\n",
-      (int)(new_status));
-
-   alsa_input_assert((pvt->channel->monitor.lock_count > 0)
-      && ((NULL == pvt->owner) || (pvt->owner_lock_count > 0))
-      && (NULL != monitor_prms) && (monitor_prms->channel_is_locked));
-
-   alsa_input_assert(((AI_STATUS_OFF_HOOK == new_status) || (AI_STATUS_ON_HOOK == new_status))
-      && (new_status != pvt->ast_channel.status));
-
-   pvt->ast_channel.status = new_status;
-
-   /* Handle status change */
-   if (AI_STATUS_OFF_HOOK == new_status) {
-      if ((AI_ST_ON_RINGING == pvt->ast_channel.state)
-          || (AI_ST_ON_PRE_RINGING == pvt->ast_channel.state)) {
-         alsa_input_assert(NULL != pvt->owner);
-         /*
-          alsa_input_chan_request() has created the channel.
-          Either alsa_input_chan_call() has been called so the phone
-          is ringing and the user picked up the phone to answer
-          the call or alsa_input_chan_call() has not been called and
-          the user picked up the phone to make a call.
-          In this latter case there's a conflict, so we hang
-          up the channel created by alsa_input_chan_request()
-          and emit the tone busy to the user.
-         */
-         bool hangup = true;
-         if (AI_ST_ON_RINGING == pvt->ast_channel.state) {
-            alsa_input_assert(AST_STATE_RINGING == alsa_input_ast_channel_state(pvt->owner));
-            /* The user wants to answer the call */
-            if (alsa_input_setup(pvt, alsa_input_ast_channel_rawreadformat(pvt->owner), AST_STATE_UP, AI_EV_OFF_HOOK)) {
-               ast_log(AST_LOG_ERROR, "Unable to answer the call on '%s'\n", alsa_input_ast_channel_name(pvt->owner));
-            }
-            else {
-               if (ast_queue_control(pvt->owner, AST_CONTROL_ANSWER)) {
-                  ast_log(AST_LOG_ERROR, "Unable to answer the call on '%s'\n", alsa_input_ast_channel_name(pvt->owner));
-               }
-               else {
-                  alsa_input_pr_debug("Call answered on '%s'\n", alsa_input_ast_channel_name(pvt->owner));
-                  hangup = false;
-                  alsa_input_change_monitor_timeout(monitor_prms, alsa_input_monitor_busy_period);
-               }
-            }
-         }
-         else {
-            alsa_input_assert(AI_ST_ON_PRE_RINGING == pvt->ast_channel.state);
-            /*
-             The user wants to make a call but that's not possible as
-             there's an incoming call pending
-            */
-         }
-         if (hangup) {
-            alsa_input_queue_hangup(pvt, AI_EV_INTERNAL_ERROR);
-            /* ast_channel_unlock(pvt->owner) is done in alsa_input_queue_hangup() */
-            alsa_input_assert((NULL == pvt->owner) && (AI_ST_OFF_NO_SERVICE == pvt->ast_channel.state));
-         }
-      }
-      else {
-         alsa_input_assert((AI_ST_ON_IDLE == pvt->ast_channel.state)
-            && (NULL == pvt->owner));
-         /* The user has picked up the phone to make a call */
-         if (pvt->line_cfg->monitor_dialing) {
-            /*
-             We do not create an ast_channel now
-             We just change the tone to AI_TONE_WAITING_DIAL, and
-             wait for digits dialed by the user.
-             When the digits will form a valid extension then we will
-             create the ast_channel dedicated to handle the call
-            */
-            alsa_input_set_new_state(pvt, AI_ST_OFF_DIALING, AI_EV_OFF_HOOK);
+   size_t i = 0;
+   unsigned int c;
+
+#if defined(__SSE2__)
+   if (8 == channels) {
+      for (; ((i + 8) <= frames); i += 8) {
+         __m128i r[8];
+         for (c = 0; (c < 8); c += 1) {
+            r[c] = _mm_loadu_si128((const __m128i *)(&(src[(i + c) * 8])));
          }
-         else { /* (!pvt->line_cfg->monitor_dialing) */
-            /*
-             We create an ast_channel now.
-            */
-            pvt->ast_channel.digits_len = 0;
-            alsa_input_new(pvt, AI_ST_OFF_WAITING_ANSWER, AI_EV_OFF_HOOK,
-#if (AST_VERSION > 110)
-               NULL,
-#endif /* (AST_VERSION > 110) */
-               NULL, &(monitor_prms->channel_is_locked));
+         alsa_input_transpose_8x8(r);
+         for (c = 0; (c < 8); c += 1) {
+            _mm_storeu_si128((__m128i *)(&(dst[c][i])), r[c]);
          }
       }
    }
-   else { /* (AI_STATUS_OFF_HOOK != new_status) */
-      /* Gone on hook, so notify hangup */
-      if (NULL != pvt->owner) {
-         alsa_input_queue_hangup(pvt, AI_EV_ON_HOOK);
-         /* ast_channel_unlock(pvt->owner) is done in alsa_input_queue_hangup() */
-         alsa_input_assert(NULL == pvt->owner);
+   else if (2 == channels) {
+      for (; ((i + 8) <= frames); i += 8) {
+         __m128i a = _mm_loadu_si128((const __m128i *)(&(src[i * 2])));
+         __m128i b = _mm_loadu_si128((const __m128i *)(&(src[(i * 2) + 8])));
+         /* Even samples (sign extended to 32 bits) then odd samples */
+         __m128i ea = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+         __m128i eb = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+         __m128i oa = _mm_srai_epi32(a, 16);
+         __m128i ob = _mm_srai_epi32(b, 16);
+         _mm_storeu_si128((__m128i *)(&(dst[0][i])), _mm_packs_epi32(ea, eb));
+         _mm_storeu_si128((__m128i *)(&(dst[1][i])), _mm_packs_epi32(oa, ob));
       }
-      else {
-         alsa_input_set_new_state(pvt, AI_ST_ON_IDLE, AI_EV_ON_HOOK);
+   }
+#endif /* defined(__SSE2__) */
+   for (c = 0; (c < channels); c += 1) {
+      int16_t *d = dst[c];
+      size_t j;
+      for (j = i; (j < frames); j += 1) {
+         d[j] = src[(j * channels) + c];
       }
    }
 }
 
 /*
- Must be called with pvt->owner and monitor.lock locked.
+ Merges frames samples of each channel c, read from src[c], into frames
+ interleaved frames (inverse of alsa_input_deinterleave())
 */
-static void alsa_input_handle_mute_change(alsa_input_pvt_t *pvt,
-   alsa_input_monitor_prms_t *monitor_prms)
+static void alsa_input_interleave(const int16_t * const *src,
+   unsigned int channels, size_t frames, int16_t *dst)
 {
-   alsa_input_pr_debug("alsa_input_handle_mute_change()\n");
-
-   alsa_input_assert((pvt->channel->monitor.lock_count > 0)
-      && ((NULL == pvt->owner) || (pvt->owner_lock_count > 0))
-      && (NULL != monitor_prms) && (monitor_prms->channel_is_locked));
-
-   if ((AI_ST_OFF_TALKING == pvt->ast_channel.state)
-       || (AI_ST_OFF_WAITING_ANSWER == pvt->ast_channel.state)) {
-      /* Toggle mute */
-      if (pvt->ast_channel.snd_capture_muted) {
-         alsa_input_pr_debug("Line %lu is unmuted\n",
-            (unsigned long)(pvt->index_line + 1));
-         pvt->ast_channel.snd_capture_muted = false;
-         alsa_input_snd_card_start(&(pvt->ast_channel.snd_capture));
+   size_t i = 0;
+   unsigned int c;
+
+#if defined(__SSE2__)
+   if (8 == channels) {
+      for (; ((i + 8) <= frames); i += 8) {
+         __m128i r[8];
+         for (c = 0; (c < 8); c += 1) {
+            r[c] = _mm_loadu_si128((const __m128i *)(&(src[c][i])));
+         }
+         alsa_input_transpose_8x8(r);
+         for (c = 0; (c < 8); c += 1) {
+            _mm_storeu_si128((__m128i *)(&(dst[(i + c) * 8])), r[c]);
+         }
       }
-      else {
-         alsa_input_pr_debug("Line %lu is muted\n",
-            (unsigned long)(pvt->index_line + 1));
-         pvt->ast_channel.snd_capture_muted = true;
-         alsa_input_snd_card_stop(&(pvt->ast_channel.snd_capture));
+   }
+   else if (2 == channels) {
+      for (; ((i + 8) <= frames); i += 8) {
+         __m128i a = _mm_loadu_si128((const __m128i *)(&(src[0][i])));
+         __m128i b = _mm_loadu_si128((const __m128i *)(&(src[1][i])));
+         _mm_storeu_si128((__m128i *)(&(dst[i * 2])), _mm_unpacklo_epi16(a, b));
+         _mm_storeu_si128((__m128i *)(&(dst[(i * 2) + 8])), _mm_unpackhi_epi16(a, b));
+      }
+   }
+#endif /* defined(__SSE2__) */
+   for (; (i < frames); i += 1) {
+      for (c = 0; (c < channels); c += 1) {
+         dst[(i * channels) + c] = src[c][i];
       }
-      pvt->monitor.last_known_snd_capture_muted = pvt->ast_channel.snd_capture_muted;
-      alsa_input_reset_buf_fr_to_queue(pvt);
    }
 }
 
 /*
- Must be called with monitor.lock locked and pvt->owner set to NULL.
+ Opens and configures a sound device.
+ The device is opened at the rate *rate. If rate_fallback is true and the
+ device (or Asterisk) doesn't support this rate, lower rates are tried and
+ *rate is updated with the rate used.
+ If the device supports none of these rates, it's opened at the rate it
+ supports nearest to *rate and the samples are resampled (unless quality is
+ AI_RESAMPLE_NONE, resampling is only available for mono devices).
+ If *channels is greater than 1, the device is opened with at least
+ *channels channels and *channels is updated with the number of channels.
 */
-static void alsa_input_search_extension(alsa_input_pvt_t *pvt,
-   alsa_input_monitor_prms_t *monitor_prms, bool ignore_timeout)
+static int alsa_input_snd_card_init(alsa_input_snd_card_t *t, const char *dev,
+   snd_pcm_stream_t stream, bool use_mmap, unsigned int *channels,
+   alsa_input_rate_t *rate,
+   bool rate_fallback, alsa_input_resample_quality_t quality,
+   unsigned int period_ms, unsigned int periods, int *fd)
 {
-   /* alsa_input_pr_debug("alsa_input_search_extension(ignore_timeout=%d)\n",
-      (int)(ignore_timeout)); */
+   int ret = -1;
+   snd_pcm_t *handle = NULL;
+   snd_pcm_hw_params_t *hw_params = NULL;
+   snd_pcm_sw_params_t *sw_params = NULL;
+   alsa_input_resampler_t *resampler = NULL;
+   __u8 *rs_buf = NULL;
 
-   alsa_input_assert((pvt->channel->monitor.lock_count > 0)
-      && (NULL == pvt->owner) && (pvt->line_cfg->monitor_dialing)
-      && (NULL != monitor_prms) && (monitor_prms->channel_is_locked)
-      && (AI_ST_OFF_DIALING == pvt->ast_channel.state));
+   memset(t, 0, sizeof(*t));
 
    do { /* Empty loop */
-      if (!pvt->ast_channel.search_extension) {
+      int err;
+      int direction;
+      snd_pcm_uframes_t period_size;
+      snd_pcm_uframes_t buffer_size = 0;
+      alsa_input_rate_t r;
+      unsigned int dev_rate;
+      unsigned int nb_channels = 1;
+      snd_pcm_uframes_t period_frames;
+      snd_pcm_uframes_t start_threshold;
+      snd_pcm_uframes_t stop_threshold;
+
+      err = snd_pcm_open(&(handle), dev, stream, SND_PCM_NONBLOCK);
+      if (err) {
+         ast_log(AST_LOG_ERROR, "snd_pcm_open() failed for device '%s': '%s'\n", dev, snd_strerror(err));
+         ret = err;
          break;
       }
-      alsa_input_assert(pvt->ast_channel.digits_len < ARRAY_LEN(pvt->ast_channel.digits));
-      if (pvt->ast_channel.digits_len <= 0) {
-         if ((!ignore_timeout) && (pvt->line_cfg->dialing_timeout_1st_digit > 0)) {
-            struct timeval now = ast_tvnow();
-            int64_t tvdiff = ast_tvdiff_ms(now, pvt->ast_channel.tv_wait);
-            if (tvdiff < pvt->line_cfg->dialing_timeout_1st_digit) {
-               alsa_input_change_monitor_timeout(monitor_prms, (int)(pvt->line_cfg->dialing_timeout_1st_digit - tvdiff));
-               break;
-            }
-         }
-         alsa_input_assert(ARRAY_LEN(alsa_input_default_extension) <= ARRAY_LEN(pvt->ast_channel.digits));
-         strcpy(pvt->ast_channel.digits, alsa_input_default_extension);
+      alsa_input_pr_debug("Opening device '%s' in %s mode\n", dev, (stream == SND_PCM_STREAM_CAPTURE) ? "read" : "write");
+
+      hw_params = NULL;
+      err = snd_pcm_hw_params_malloc(&(hw_params));
+      if ((err < 0) || (NULL == hw_params)) {
+         ast_log(AST_LOG_ERROR, "Failed to allocate hw_params structure for device '%s'\n", dev);
+         break;
       }
-      else {
-         if ((!ignore_timeout) && (pvt->line_cfg->dialing_timeout > 0)) {
-            struct timeval now = ast_tvnow();
-            int64_t tvdiff = ast_tvdiff_ms(now, pvt->ast_channel.tv_wait);
-            if (tvdiff < pvt->line_cfg->dialing_timeout) {
-               alsa_input_change_monitor_timeout(monitor_prms, (int)(pvt->line_cfg->dialing_timeout - tvdiff));
-               break;
-            }
+
+      err = snd_pcm_hw_params_any(handle, hw_params);
+      if (err < 0) {
+         ret = err;
+         ast_log(AST_LOG_ERROR, "snd_pcm_hw_params_any() failed for device '%s': '%s'\n", dev, snd_strerror(err));
+         break;
+      }
+
+      if (use_mmap) {
+         err = snd_pcm_hw_params_set_access(handle, hw_params, SND_PCM_ACCESS_MMAP_INTERLEAVED);
+         if (err < 0) {
+            ast_log(AST_LOG_WARNING, "Device '%s' can't be accessed with mmap ('%s'), using read/write\n", dev, snd_strerror(err));
+            use_mmap = false;
          }
-         pvt->ast_channel.digits[pvt->ast_channel.digits_len] = '\0';
       }
-      pvt->ast_channel.search_extension = false;
-      /* We test if, with these numbers, the extension is valid */
-      alsa_input_pr_debug("Searching for extension '%s' in context '%s'\n",
-         pvt->ast_channel.digits, pvt->line_cfg->context);
-      /*
-       Reset flag search_extension to false to stop
-       searching for an extension while no new digit is
-       dialed
-      */
-      if (ast_exists_extension(NULL, pvt->line_cfg->context, pvt->ast_channel.digits, 1, pvt->line_cfg->cid_num)) {
-         /* It's a valid extension in its context, get moving! */
-         alsa_input_pr_debug("Extension '%s' found in context '%s'\n", pvt->ast_channel.digits, pvt->line_cfg->context);
-         alsa_input_new(pvt, AI_ST_OFF_WAITING_ANSWER, AI_EV_EXT_FOUND,
-#if (AST_VERSION > 110)
-            NULL,
-#endif /* (AST_VERSION > 110) */
-            NULL, &(monitor_prms->channel_is_locked));
+      if (!use_mmap) {
+         err = snd_pcm_hw_params_set_access(handle, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED);
+      }
+      if (err < 0) {
+         ret = err;
+         ast_log(AST_LOG_ERROR, "snd_pcm_hw_params_set_access() failed for device '%s': '%s'\n", dev, snd_strerror(err));
+         break;
+      }
+
+      err = snd_pcm_hw_params_set_format(handle, hw_params, SND_PCM_SAMPLE_FORMAT);
+      if (err < 0) {
+         ret = err;
+         ast_log(AST_LOG_ERROR, "snd_pcm_hw_params_set_format() failed for device '%s': '%s'\n", dev, snd_strerror(err));
+         break;
+      }
+
+      if (1 == *channels) {
+         err = snd_pcm_hw_params_set_channels(handle, hw_params, 1);
+         if (err < 0) {
+            ret = err;
+            ast_log(AST_LOG_ERROR, "snd_pcm_hw_params_set_channels() failed for device '%s': '%s'\n", dev, snd_strerror(err));
+            break;
+         }
       }
       else {
-         if (!ast_canmatch_extension(NULL, pvt->line_cfg->context, pvt->ast_channel.digits, 1, pvt->line_cfg->cid_num)) {
-            /* It's not a valid extension */
-            alsa_input_pr_debug("Extension '%s' can't match anything in '%s'\n",
-               pvt->ast_channel.digits, pvt->line_cfg->context);
-            /* We signals the user that there's a problem */
-            alsa_input_set_new_state(pvt, AI_ST_OFF_NO_SERVICE, AI_EV_NO_EXT_CAN_BE_FOUND);
+         nb_channels = *channels;
+         err = snd_pcm_hw_params_set_channels_near(handle, hw_params, &(nb_channels));
+         if (err < 0) {
+            ret = err;
+            ast_log(AST_LOG_ERROR, "snd_pcm_hw_params_set_channels_near() failed for device '%s': '%s'\n", dev, snd_strerror(err));
+            break;
          }
-         else if (pvt->ast_channel.digits_len >= (ARRAY_LEN(pvt->ast_channel.digits) - 1)) {
-            /*
-             We overrun maximum length of extension without
-             matching anything
-            */
-            alsa_input_pr_debug("Extension '%s' can't match anything in '%s' and reaches maximum length\n",
-               pvt->ast_channel.digits, pvt->line_cfg->context);
-            /* We signals the user that there's a problem */
-            alsa_input_set_new_state(pvt, AI_ST_OFF_NO_SERVICE, AI_EV_NO_EXT_CAN_BE_FOUND);
+         if ((nb_channels < *channels) || (nb_channels > AI_SHARED_MAX_CHANNELS)) {
+            ast_log(AST_LOG_ERROR, "Device '%s' can't be opened with %u channels (got %u)\n",
+               dev, *channels, nb_channels);
+            break;
          }
+         /* Lines share the device : no resampling */
+         quality = AI_RESAMPLE_NONE;
       }
-   } while (false);
-}
-
-/*
- Must be called with pvt->owner and monitor.lock locked.
-*/
-static void alsa_input_try_to_send_dtmf(alsa_input_pvt_t *pvt,
-   alsa_input_monitor_prms_t *monitor_prms)
-{
-   bool send_a_null_frame = false;
-
-   alsa_input_assert((pvt->channel->monitor.lock_count > 0)
-      && (NULL != pvt->owner) && (pvt->owner_lock_count > 0)
-      && (NULL != monitor_prms) && (monitor_prms->channel_is_locked)
-      && ((AI_ST_OFF_TALKING == pvt->ast_channel.state)
-          || (AI_ST_OFF_WAITING_ANSWER == pvt->ast_channel.state)));
 
-   if (NONE != pvt->ast_channel.dtmf_sent) {
-      struct timeval now = ast_tvnow();
-      int64_t tvdiff = ast_tvdiff_ms(now, pvt->ast_channel.tv_wait);
-      if (ON == pvt->ast_channel.dtmf_sent) {
-         if (tvdiff < MIN_DTMF_DURATION) {
-            alsa_input_change_monitor_timeout(monitor_prms, (int)(MIN_DTMF_DURATION - tvdiff));
+      /* Highest rate (not above *rate) supported by the device and by Asterisk */
+      r = *rate;
+      for (;;) {
+         if ((NULL != alsa_input_rate_format(r))
+             && (0 == snd_pcm_hw_params_test_rate(handle, hw_params, alsa_input_rate_values[r], 0))) {
+            break;
          }
-         else {
-            pvt->ast_channel.dtmf_sent = OFF;
-            pvt->ast_channel.tv_wait = ast_tvnow();
-            alsa_input_change_monitor_timeout(monitor_prms, MIN_TIME_BETWEEN_DTMF);
-            send_a_null_frame = true;
+         if ((!rate_fallback) || (AI_RATE_8000 == r)) {
+            r = AI_RATE_COUNT;
+            break;
+         }
+         r -= 1;
+      }
+      if (AI_RATE_COUNT != r) {
+         dev_rate = alsa_input_rate_values[r];
+         err = snd_pcm_hw_params_set_rate(handle, hw_params, dev_rate, 0);
+         if (err < 0) {
+            ret = err;
+            ast_log(AST_LOG_ERROR, "snd_pcm_hw_params_set_rate() failed for device '%s': '%s'\n", dev, snd_strerror(err));
+            break;
+         }
+         if (r != *rate) {
+            ast_log(AST_LOG_WARNING, "Device '%s' doesn't support rate %u, using %u\n",
+               dev, alsa_input_rate_values[*rate], alsa_input_rate_values[r]);
          }
       }
+      else if (AI_RESAMPLE_NONE == quality) {
+         ast_log(AST_LOG_ERROR, "Device '%s' doesn't support rate %u%s\n",
+            dev, alsa_input_rate_values[*rate], rate_fallback ? " or a lower one" : "");
+         break;
+      }
       else {
-         alsa_input_assert(OFF == pvt->ast_channel.dtmf_sent);
-         if (tvdiff < MIN_TIME_BETWEEN_DTMF) {
-            alsa_input_change_monitor_timeout(monitor_prms, (int)(MIN_TIME_BETWEEN_DTMF - tvdiff));
-         }
-         else {
-            pvt->ast_channel.dtmf_sent = NONE;
-            send_a_null_frame = true;
+         /* The line keeps the rate asked, the device uses its nearest one */
+         r = *rate;
+         dev_rate = alsa_input_rate_values[r];
+         direction = 0;
+         err = snd_pcm_hw_params_set_rate_near(handle, hw_params, &(dev_rate), &(direction));
+         if (err < 0) {
+            ret = err;
+            ast_log(AST_LOG_ERROR, "snd_pcm_hw_params_set_rate_near() failed for device '%s': '%s'\n", dev, snd_strerror(err));
+            break;
          }
+         ast_log(AST_LOG_WARNING, "Device '%s' doesn't support rate %u, resampling from %u\n",
+            dev, alsa_input_rate_values[r], dev_rate);
       }
-   }
-   if (send_a_null_frame) {
-      /*
-       As we only send AST_FRAME_DTMF, we send a null frame
-       for Asterisk to properly generate AST_FRAME_DTMF_BEGIN
-       and AST_FRAME_DTMF_END (it does it only when processing
-       a frame)
-      */
-      if (ast_queue_frame(pvt->owner, &(ast_null_frame))) {
-         ast_log(AST_LOG_WARNING, "Can't queue null frame for line %lu\n", (unsigned long)(pvt->index_line + 1));
-      }
-   }
-   if ((NONE == pvt->ast_channel.dtmf_sent) && (pvt->ast_channel.digits_len > 0)) {
-      int ret;
-      pvt->ast_channel.frame_to_queue.datalen = 0;
-      pvt->ast_channel.frame_to_queue.samples = 0;
-      pvt->ast_channel.frame_to_queue.data.ptr =  NULL;
-      pvt->ast_channel.frame_to_queue.src = alsa_input_chan_type;
-      pvt->ast_channel.frame_to_queue.offset = 0;
-      pvt->ast_channel.frame_to_queue.mallocd = 0;
-      pvt->ast_channel.frame_to_queue.delivery = ast_tv(0,0);
-      pvt->ast_channel.frame_to_queue.frametype = AST_FRAME_DTMF;
-      pvt->ast_channel.frame_to_queue.subclass.integer = pvt->ast_channel.digits[0];
-      ret = ast_queue_frame(pvt->owner, &(pvt->ast_channel.frame_to_queue));
-      ast_frfree(&(pvt->ast_channel.frame_to_queue));
-      if (ret) {
-         ast_log(AST_LOG_WARNING, "Unable to queue a digit on line %lu\n", (unsigned long)(pvt->index_line + 1));
+
+      direction = 0;
+      period_frames = ((snd_pcm_uframes_t)(period_ms) * dev_rate) / 1000;
+      period_size = period_frames;
+      err = snd_pcm_hw_params_set_period_size_near(handle, hw_params, &(period_size), &(direction));
+      if (err < 0) {
+         ast_log(AST_LOG_ERROR, "snd_pcm_hw_params_set_period_size_near() failed for device '%s': '%s'\n", dev, snd_strerror(err));
+         break;
       }
-      else {
-         alsa_input_pr_debug("DTMF '%c' sent\n", (int)(pvt->ast_channel.frame_to_queue.subclass.integer));
-         pvt->ast_channel.dtmf_sent = ON;
-         pvt->ast_channel.tv_wait = ast_tvnow();
-         alsa_input_change_monitor_timeout(monitor_prms, MIN_DTMF_DURATION);
-         pvt->ast_channel.digits_len -= 1;
-         if (pvt->ast_channel.digits_len > 0) {
-            memmove(pvt->ast_channel.digits, &(pvt->ast_channel.digits[1]), pvt->ast_channel.digits_len);
-         }
+      if (period_size != period_frames) {
+         ast_log(AST_LOG_WARNING, "Can't set period size for device '%s', requested %lu, got %lu\n",
+            dev, (unsigned long)(period_frames), (unsigned long)(period_size));
       }
-   }
-}
-
-/*
- Must be called with pvt->owner and monitor.lock locked.
-*/
-static void alsa_input_handle_digit(alsa_input_pvt_t *pvt,
-   alsa_input_monitor_prms_t *monitor_prms, char digit)
-{
-   alsa_input_pr_debug("alsa_input_handle_digits(digit='%c')\n",
-      (char)(digit));
+      alsa_input_pr_debug("Period size is %lu\n", (unsigned long)(period_size));
 
-   alsa_input_assert((pvt->channel->monitor.lock_count > 0)
-      && ((NULL == pvt->owner) || (pvt->owner_lock_count > 0))
-      && (NULL != monitor_prms) && (monitor_prms->channel_is_locked));
+      buffer_size = period_size * periods;
+      err = snd_pcm_hw_params_set_buffer_size_near(handle, hw_params, &(buffer_size));
+      if (err < 0) {
+         ast_log(AST_LOG_WARNING, "snd_pcm_hw_params_set_buffer_size_near() failed for device '%s': '%s'\n", dev, snd_strerror(err));
+         break;
+      }
+      alsa_input_pr_debug("Buffer size is set to %lu frames\n", (unsigned long)(buffer_size));
 
-   if ((AI_ST_OFF_TALKING == pvt->ast_channel.state)
-       || (AI_ST_OFF_WAITING_ANSWER == pvt->ast_channel.state)) {
-      alsa_input_assert(NULL != pvt->owner);
-      if (pvt->ast_channel.digits_len < ARRAY_LEN(pvt->ast_channel.digits)) {
-         pvt->ast_channel.digits[pvt->ast_channel.digits_len] = digit;
-         pvt->ast_channel.digits_len += 1;
+      err = snd_pcm_hw_params(handle, hw_params);
+      if (err < 0) {
+         ret = err;
+         ast_log(AST_LOG_ERROR, "Couldn't set the new hw params for device '%s': '%s'\n", dev, snd_strerror(err));
+         break;
       }
-   }
-   else if (AI_ST_OFF_DIALING == pvt->ast_channel.state) {
-      alsa_input_assert((NULL == pvt->owner) && (pvt->line_cfg->monitor_dialing));
-      do { /* Empty loop */
-         /* We search for an extension before adding new digit */
-         alsa_input_search_extension(pvt, monitor_prms, false);
-         if ((AI_ST_OFF_DIALING != pvt->ast_channel.state) || (!monitor_prms->channel_is_locked)) {
-            break;
-         }
-         if (pvt->ast_channel.digits_len < (ARRAY_LEN(pvt->ast_channel.digits) - 1)) {
-            if (0 == pvt->ast_channel.digits_len) {
-               /* We switch off the AI_TONE_WAITING_DIAL tone */
-               alsa_input_set_line_tone(pvt, AI_TONE_NONE, 0);
-            }
-            /*
-             If the digit is equal to pvt->line_cfg->search_extension_trigger,
-             we search for an extension now, without adding the digit
-            */
-            alsa_input_assert('\0' != digit);
-            if (/* ('\0' != pvt->line_cfg->search_extension_trigger)
-                && */(digit == pvt->line_cfg->search_extension_trigger)) {
-               pvt->ast_channel.search_extension = true;
-               alsa_input_search_extension(pvt, monitor_prms, true);
-               alsa_input_assert(!pvt->ast_channel.search_extension);
-               if ((AI_ST_OFF_DIALING != pvt->ast_channel.state) || (!monitor_prms->channel_is_locked)) {
-                  break;
-               }
-            }
-            pvt->ast_channel.digits[pvt->ast_channel.digits_len] = digit;
-            pvt->ast_channel.digits_len += 1;
-            /* If there's no timeout, we search for an extension now */
-            if (pvt->line_cfg->dialing_timeout <= 0) {
-               pvt->ast_channel.search_extension = true;
-               alsa_input_search_extension(pvt, monitor_prms, true);
-               alsa_input_assert(!pvt->ast_channel.search_extension);
-               if ((AI_ST_OFF_DIALING != pvt->ast_channel.state) || (!monitor_prms->channel_is_locked)) {
-                  break;
-               }
-            }
-            else {
-               /*
-                We set the flag saying we can search for an extension
-                and we update the time last digit was dialed
-               */
-               pvt->ast_channel.search_extension = true;
-               pvt->ast_channel.tv_wait = ast_tvnow();
-               alsa_input_change_monitor_timeout(monitor_prms, pvt->line_cfg->dialing_timeout);
-            }
-         }
-      } while (false);
-   }
-}
 
-/*
- Must be called with pvt->owner and monitor.lock locked.
-*/
-static void alsa_input_monitor_pvt(alsa_input_pvt_t *pvt,
-   alsa_input_monitor_prms_t *monitor_prms)
-{
-   /* alsa_input_pr_debug("alsa_input_monitor_pvt()\n"); */
+      sw_params = NULL;
+      err = snd_pcm_sw_params_malloc(&(sw_params));
+      if ((err < 0) || (NULL == sw_params)) {
+         ast_log(AST_LOG_ERROR, "Failed to allocate sw_params structure for device '%s'\n", dev);
+         break;
+      }
 
-   alsa_input_assert((pvt->channel->monitor.lock_count > 0)
-      && ((NULL == pvt->owner) || (pvt->owner_lock_count > 0))
-      && (NULL != monitor_prms) && (monitor_prms->channel_is_locked));
+      err = snd_pcm_sw_params_current(handle, sw_params);
+      if (err < 0) {
+         ret = err;
+         ast_log(AST_LOG_ERROR, "snd_pcm_sw_params_current() failed for device '%s': '%s'\n", dev, snd_strerror(err));
+         break;
+      }
 
-   if ((AI_ST_OFF_TALKING == pvt->ast_channel.state)
-       || (AI_ST_OFF_WAITING_ANSWER == pvt->ast_channel.state)) {
-      alsa_input_assert(NULL != pvt->owner);
-      alsa_input_try_to_send_dtmf(pvt, monitor_prms);
-      if (monitor_prms->channel_is_locked) {
-         /* We read as much data as possible coming from the driver
-          and queue ast_frame */
-         alsa_input_read_data(pvt, true, true);
-         alsa_input_change_monitor_timeout(monitor_prms, alsa_input_monitor_busy_period);
+      if (stream == SND_PCM_STREAM_PLAYBACK) {
+         start_threshold = period_size;
       }
-   }
-   else if (AI_ST_OFF_DIALING == pvt->ast_channel.state) {
-      alsa_input_assert((NULL == pvt->owner) && (pvt->line_cfg->monitor_dialing));
-      alsa_input_search_extension(pvt, monitor_prms, false);
-   }
-   else if (AI_ST_OFF_NO_SERVICE == pvt->ast_channel.state) {
-      struct timeval now = ast_tvnow();
-      int64_t tvdiff = ast_tvdiff_ms(now, pvt->ast_channel.tv_wait);
-      if (tvdiff < DELAY_AUTO_HOOK_ON) {
-         alsa_input_change_monitor_timeout(monitor_prms, (int)(DELAY_AUTO_HOOK_ON - tvdiff));
+      else {
+         start_threshold = 1;
+      }
+      err = snd_pcm_sw_params_set_start_threshold(handle, sw_params, start_threshold);
+      if (err < 0) {
+         ast_log(AST_LOG_ERROR, "snd_pcm_sw_params_set_start_threshold() failed for device '%s': '%s'\n", dev, snd_strerror(err));
+         break;
+      }
+
+      if (stream == SND_PCM_STREAM_PLAYBACK) {
+         stop_threshold = buffer_size;
       }
       else {
-         alsa_input_handle_status_change(pvt, monitor_prms, AI_STATUS_ON_HOOK);
+         stop_threshold = buffer_size;
       }
-   }
-   else if (AI_ST_ON_RINGING == pvt->ast_channel.state) {
-      struct timeval now = ast_tvnow();
-      int64_t tvdiff = ast_tvdiff_ms(now, pvt->ast_channel.tv_wait);
-      if (pvt->ast_channel.buzzer_is_on) {
-         if (tvdiff < RING_CADENCE_ON) {
-            alsa_input_change_monitor_timeout(monitor_prms, (int)(RING_CADENCE_ON - tvdiff));
+      err = snd_pcm_sw_params_set_stop_threshold(handle, sw_params, stop_threshold);
+      if (err < 0) {
+         ast_log(AST_LOG_ERROR, "snd_pcm_sw_params_set_stop_threshold() failed for device '%s': '%s'\n", dev, snd_strerror(err));
+         break;
+      }
+
+      err = snd_pcm_sw_params_set_avail_min(handle, sw_params, period_size);
+      if (err < 0) {
+         ast_log(AST_LOG_ERROR, "snd_pcm_sw_params_set_avail_min() failed for device '%s': '%s'\n", dev, snd_strerror(err));
+         break;
+      }
+
+      err = snd_pcm_sw_params(handle, sw_params);
+      if (err < 0) {
+         ast_log(AST_LOG_ERROR, "Couldn't set the new sw params for device '%s': '%s'\n", dev, snd_strerror(err));
+         break;
+      }
+
+      if (dev_rate != alsa_input_rate_values[r]) {
+         if (SND_PCM_STREAM_CAPTURE == stream) {
+            resampler = alsa_input_resampler_alloc(dev_rate, alsa_input_rate_values[r], quality);
          }
          else {
-            alsa_input_turn_buzzer_off(pvt);
-            alsa_input_assert(!pvt->ast_channel.buzzer_is_on);
-            alsa_input_change_monitor_timeout(monitor_prms, RING_CADENCE_OFF);
+            resampler = alsa_input_resampler_alloc(alsa_input_rate_values[r], dev_rate, quality);
+         }
+         rs_buf = ast_calloc(period_size, SAMPLE_SIZE);
+         if ((NULL == resampler) || (NULL == rs_buf)) {
+            ast_log(AST_LOG_ERROR, "Unable to create the resampler for device '%s'\n", dev);
+            break;
          }
       }
-      else {
-         if (tvdiff < RING_CADENCE_OFF) {
-            alsa_input_change_monitor_timeout(monitor_prms, (int)(RING_CADENCE_OFF - tvdiff));
+
+      if (NULL != fd) {
+         struct pollfd pfd;
+         err = snd_pcm_poll_descriptors_count(handle);
+         if (err <= 0) {
+            ast_log(AST_LOG_ERROR, "Unable to get a poll descriptors count for device '%s': '%s'\n", dev, snd_strerror(err));
+            break;
          }
-         else {
-            alsa_input_turn_buzzer_on(pvt);
-            alsa_input_assert(pvt->ast_channel.buzzer_is_on);
-            alsa_input_change_monitor_timeout(monitor_prms, RING_CADENCE_ON);
+         if (err != 1) {
+            alsa_input_pr_debug("Can't handle more than one poll descritor\n");
+            break;
          }
+
+         snd_pcm_poll_descriptors(handle, &(pfd), err);
+         *fd = pfd.fd;
       }
+
+      t->card = handle;
+      handle = NULL;
+      t->hw_params = hw_params;
+      hw_params = NULL;
+      t->sw_params = sw_params;
+      sw_params = NULL;
+      t->mmap = use_mmap;
+      t->frame_bytes = SAMPLE_SIZE * nb_channels;
+      t->period_size = period_size;
+      t->buffer_size = buffer_size;
+      t->start_threshold = start_threshold;
+      t->avail_min = period_size;
+      t->resampler = resampler;
+      resampler = NULL;
+      t->rs_buf = rs_buf;
+      rs_buf = NULL;
+      t->rs_buf_frames = period_size;
+      *channels = nb_channels;
+      *rate = r;
+
+      ret = 0;
    }
-   if (AI_TONE_NONE != pvt->ast_channel.tone) {
-      alsa_input_write_tone_data(pvt);
-      alsa_input_change_monitor_timeout(monitor_prms, alsa_input_monitor_busy_period);
+   while (false);
+
+   if (NULL != handle) {
+      snd_pcm_close(handle);
+      handle = NULL;
    }
-}
 
-static inline void alsa_input_monitor_lock(alsa_input_chan_t *t)
-{
-   ast_mutex_lock(&(t->monitor.lock));
-#ifdef DEBUG
-   alsa_input_assert(0 == t->monitor.lock_count);
-   t->monitor.lock_count += 1;
-#endif /* DEBUG */
-}
+   if (NULL != sw_params) {
+      snd_pcm_sw_params_free(sw_params);
+      sw_params = NULL;
+   }
 
-static inline void alsa_input_monitor_unlock(alsa_input_chan_t *t)
-{
-#ifdef DEBUG
-   t->monitor.lock_count -= 1;
-   alsa_input_assert(0 == t->monitor.lock_count);
-#endif /* DEBUG */
-   ast_mutex_unlock(&(t->monitor.lock));
-}
+   if (NULL != hw_params) {
+      snd_pcm_hw_params_free(hw_params);
+      hw_params = NULL;
+   }
 
-static inline void alsa_input_prepare_start_monitor(alsa_input_chan_t *t)
-{
-   alsa_input_assert(!t->monitor.run);
-   t->monitor.run = true;
+   alsa_input_resampler_free(resampler);
+   ast_free(rs_buf);
+
+   return (ret);
 }
 
-static inline void alsa_input_prepare_stop_monitor(alsa_input_chan_t *t)
+static void alsa_input_snd_card_deinit(alsa_input_snd_card_t *t)
 {
-   t->monitor.run = false;
+   alsa_input_resampler_free(t->resampler);
+   t->resampler = NULL;
+   ast_free(t->rs_buf);
+   t->rs_buf = NULL;
+   t->rs_buf_len = 0;
+   if (NULL != t->card) {
+      snd_pcm_close(t->card);
+      t->card = NULL;
+      alsa_input_assert(NULL != t->hw_params);
+      snd_pcm_hw_params_free(t->hw_params);
+      t->hw_params = NULL;
+      alsa_input_assert(NULL != t->sw_params);
+      snd_pcm_sw_params_free(t->sw_params);
+      t->sw_params = NULL;
+   }
 }
 
-static void *alsa_input_do_monitor(void *data)
+static bool alsa_input_snd_card_handle_error(alsa_input_snd_card_t *t, snd_pcm_sframes_t error, const char *function)
 {
-   alsa_input_chan_t *t = (alsa_input_chan_t *)(data);
-   alsa_input_monitor_prms_t monitor_prms;
-#ifdef DEBUG
-   /* static int last_timeout; */
-#endif /* DEBUG */
-
-   monitor_prms.timeout = alsa_input_monitor_short_timeout;
-#ifdef DEBUG
-   /* last_timeout = monitor_prms.timeout; */
-#endif /* DEBUG */
-
-   alsa_input_pr_debug("Entering monitor's thread\n");
+   bool ret = false;
+   bool again = (-EAGAIN == error);
 
-   while (t->monitor.run) {
-      struct pollfd fds[2 * MAX_LINES];
-      size_t fds_len;
-      size_t pvt_count;
-      alsa_input_pvt_t *pvt;
+   alsa_input_assert(error < 0);
 
-      alsa_input_monitor_lock(t);
-      /* Initialize poll descriptors */
-      memset(fds, 0, sizeof(fds));
-      fds_len = 0;
-      pvt_count = 0;
-      AST_LIST_TRAVERSE(&(t->pvt_list), pvt, list) {
-         int fd_input;
-         int fd_icard;
-         if (AI_ST_DISCONNECTED != pvt->monitor.last_known_state) {
-            pvt_count += 1;
-            fd_input = pvt->monitor.fd_input;
-            /* Wait for data on sound input device only in conversation mode and if not muted */
-            if (!pvt->monitor.last_known_snd_capture_muted) {
-               alsa_input_assert((AI_ST_OFF_TALKING == pvt->monitor.last_known_state)
-                  || (AI_ST_OFF_WAITING_ANSWER == pvt->monitor.last_known_state));
-               fd_icard = pvt->monitor.fd_snd_capture;
-            }
-            else {
-               fd_icard = -1;
-            }
-         }
-         else {
-            fd_input = -1;
-            fd_icard = -1;
-         }
-         fds[fds_len].fd = fd_input;
-         fds[fds_len].events = POLLIN;
-         fds_len += 1;
-         fds[fds_len].fd = fd_icard;
-         fds[fds_len].events = POLLIN;
-         fds_len += 1;
-      }
-      if (pvt_count <= 0) {
-         /* No connected lines, so we exit the loop and stop the monitor */
-         alsa_input_prepare_stop_monitor(t);
-         alsa_input_monitor_unlock(t);
+   do { /* Empty loop */
+      if (-EAGAIN == error) {
+          /*  Nothing todo */
          break;
       }
-      alsa_input_monitor_unlock(t);
-
-      /* Wait for data on one of the file descriptors */
-#ifdef DEBUG
-      /*
-      if (monitor_prms.timeout != last_timeout) {
-         alsa_input_pr_debug("Monitor timeout changed from %d to %d\n",
-            (int)(last_timeout), (int)(monitor_prms.timeout));
-         last_timeout = monitor_prms.timeout;
+      alsa_input_pr_debug("%s() failed with error %ld : '%s'\n",
+         function, (long)(error), snd_strerror(error));
+      error = snd_pcm_recover(t->card, error, 0);
+      if (error >= 0) {
+         break;
       }
-      */
-#endif /* DEBUG */
-      poll(fds, fds_len, monitor_prms.timeout);
-
-      monitor_prms.timeout = alsa_input_monitor_idle_timeout;
-
-      alsa_input_monitor_lock(t);
-      pvt_count = 0;
-      AST_LIST_TRAVERSE(&(t->pvt_list), pvt, list) {
-         ssize_t rb;
-         size_t events_count;
-         size_t y;
-
-         pvt_count += 1;
-
-         /* If line is disconnected ignore it */
-         if (AI_ST_DISCONNECTED == pvt->monitor.last_known_state) {
-            continue;
-         }
-
-         if (NULL != pvt->owner) {
-            if (ast_channel_trylock(pvt->owner)) {
-               /*
-                Because the channel is locked in another thread,
-                we can't handle input events or read data.
-                The only thing we can do is set a short timeout to retry
-                quickly
-               */
-               alsa_input_change_monitor_timeout(&(monitor_prms), alsa_input_monitor_short_timeout);
-               continue;
+      if (-EAGAIN == error) {
+          /*  Nothing todo */
+         break;
+      }
+      if (-EPIPE == error) {
+         break;
+      }
+      if (-ESTRPIPE == error) {
+         /* Device is in suspend state */
+         int err = 0;
+         for (;;) {
+            int err = snd_pcm_resume(t->card);
+            if (-EAGAIN != err) {
+               break;
             }
-#ifdef DEBUG
-            alsa_input_assert(0 == pvt->owner_lock_count);
-            pvt->owner_lock_count += 1;
-#endif /* DEBUG */
          }
-         monitor_prms.channel_is_locked = true;
-
-         /* Update monitor status if changes occured in other threads */
-         if (pvt->monitor.last_known_state != pvt->ast_channel.state) {
-            pvt->monitor.last_known_state = pvt->ast_channel.state;
-            if (AI_ST_DISCONNECTED == pvt->ast_channel.state) {
-               alsa_input_disconnect_line(pvt);
-               alsa_input_assert(NULL == pvt->owner);
+         if (err) {
+            err = snd_pcm_prepare(t->card);
+            if (err) {
+               ast_log(AST_LOG_ERROR, "snd_pcm_prepare() failed: '%s'\n", snd_strerror(error));
             }
          }
-         pvt->monitor.last_known_snd_capture_muted = pvt->ast_channel.snd_capture_muted;
+         break;
+      }
+      ast_log(AST_LOG_ERROR, "%s() failed: '%s'\n", function, snd_strerror(error));
+      if ((-ENODEV == error) || (-ENOTTY == error)) {
+         ret = true;
+         break;
+      }
+   } while (false);
 
-         if (AI_ST_DISCONNECTED == pvt->monitor.last_known_state) {
-            continue;
-         }
+   if ((!ret) && (!again)) {
+      __atomic_add_fetch(&(t->errors_recovered), 1, __ATOMIC_RELAXED);
+   }
 
-         /*
-          We call poll() with POLLIN only, but poll() can return
-          (POLLERR | POLLHUP | POLLNVAL), so handle these events
-         */
-         {
-            struct pollfd *pfds = &(fds[(pvt_count - 1) * 2]);
-            if ((pfds[0].revents & (POLLERR | POLLHUP | POLLNVAL))) {
-               alsa_input_pr_debug("Line %lu : poll() returned an error for input event device (revents == %u)\n",
-                  (unsigned long)(pvt->index_line + 1), (unsigned int)(pfds[0].revents));
-               alsa_input_critical_error(pvt, true);
-               alsa_input_assert((NULL == pvt->owner)
-                  && (AI_ST_DISCONNECTED == pvt->ast_channel.state)
-                  && (AI_ST_DISCONNECTED == pvt->monitor.last_known_state));
-               continue;
-            }
-            if ((pfds[0].revents & POLLIN)) {
-               if (pvt->monitor.fd_pipe >= 0) {
-                  /*
-                   If fd_input is connected to the pipe, input events
-                   are already in array pvt->monitor.events
-                   Just call read() to handle POLLIN event but ignore the data
-                  */
-                  __u8 dummy[64];
-                  read(pvt->monitor.fd_input, dummy, sizeof(dummy));
-               }
-               else {
-                  rb = read(pvt->monitor.fd_input, (__u8 *)(pvt->monitor.events) + pvt->monitor.events_len_in_bytes, sizeof(pvt->monitor.events) - pvt->monitor.events_len_in_bytes);
-                  if (rb > 0) {
-                     pvt->monitor.events_len_in_bytes += rb;
-                  }
-               }
-            }
-            /*
-             Sound input device can return POLLERR after call of snd_pcm_drop()
-             (when leaving state AI_ST_OFF_TALKING or AI_ST_OFF_WAITING_ANSWER, or muting capture)
-             so handle (POLLERR | POLLHUP | POLLNVAL) only if condition
-             to poll sound input device is still valid
-            */
-            if (!pvt->monitor.last_known_snd_capture_muted) {
-               unsigned short revents;
-               int err = snd_pcm_poll_descriptors_revents(pvt->ast_channel.snd_capture.card, &(pfds[1]), 1, &(revents));
-               if (err) {
-                  ast_log(AST_LOG_ERROR, "snd_pcm_poll_descriptors_revents() failed: '%s'\n", snd_strerror(err));
-                  revents = POLLERR;
-               }
-               if ((revents & (POLLERR | POLLHUP | POLLNVAL))) {
-                  alsa_input_pr_debug("Line %lu : poll() returned an error for sound input device (revents == %u)\n",
-                     (unsigned long)(pvt->index_line + 1), (unsigned int)(revents));
-                  alsa_input_critical_error(pvt, true);
-                  alsa_input_assert((NULL == pvt->owner)
-                     && (AI_ST_DISCONNECTED == pvt->ast_channel.state)
-                     && (AI_ST_DISCONNECTED == pvt->monitor.last_known_state));
-                  continue;
-               }
-            }
-         }
+   return (ret);
+}
 
-         alsa_input_assert(monitor_prms.channel_is_locked);
+/*
+ Changes the minimum number of frames available for the poll descriptor of
+ a device to be ready, in the software parameters kept by the device
+*/
+static void alsa_input_snd_card_set_avail_min(alsa_input_snd_card_t *t,
+   snd_pcm_uframes_t avail_min)
+{
+   int err;
 
-         /* *** Handle input events received *** */
-         events_count = pvt->monitor.events_len_in_bytes / sizeof(pvt->monitor.events[0]);
-         y = 0;
-         for (y = 0; ((y < events_count) && (monitor_prms.channel_is_locked)); y += 1) {
-            char digit = '\0';
+   if (avail_min == t->avail_min) {
+      return;
+   }
+   err = snd_pcm_sw_params_set_avail_min(t->card, t->sw_params, avail_min);
+   if (err >= 0) {
+      err = snd_pcm_sw_params(t->card, t->sw_params);
+   }
+   if (err < 0) {
+      alsa_input_pr_debug("Unable to set avail_min to %lu: '%s'\n", (unsigned long)(avail_min), snd_strerror(err));
+      return;
+   }
+   t->avail_min = avail_min;
+}
 
-            /* alsa_input_pr_debug("Line %lu : event received (type=%u, code=%u, value=%ld)\n",
-               (unsigned long)(pvt->index_line + 1), (unsigned int)(pvt->monitor.events[y].type),
-               (unsigned int)(pvt->monitor.events[y].code), (long)(pvt->monitor.events[y].value)); */
-            if ((EV_KEY != pvt->monitor.events[y].type) || (0 == pvt->monitor.events[y].value)) {
-               /* alsa_input_pr_debug("Line %lu : event ignored (type or value not handled)\n",
-                  (unsigned long)(pvt->index_line + 1)); */
-               continue;
-            }
-            if (KEY_ENTER == pvt->monitor.events[y].code) {
-               /* Off hook */
-               alsa_input_pr_debug("Line %lu : key 'off hook' pressed\n",
-                  (unsigned long)(pvt->index_line + 1));
-               if (AI_STATUS_ON_HOOK == pvt->ast_channel.status) {
-                  alsa_input_handle_status_change(pvt, &(monitor_prms), AI_STATUS_OFF_HOOK);
-               }
-               else {
-                  alsa_input_pr_debug("Line %lu : event ignored because phone is already off hook\n",
-                        (unsigned long)(pvt->index_line + 1));
-               }
-               continue;
-            }
-            if (AI_STATUS_OFF_HOOK != pvt->ast_channel.status) {
-               /* When on hook no other key than KEY_ENTER can trigger an action */
-               alsa_input_pr_debug("Line %lu : event ignored because phone is on hook\n",
-                     (unsigned long)(pvt->index_line + 1));
-               continue;
-            }
-            if (KEY_ESC == pvt->monitor.events[y].code) {
-               alsa_input_pr_debug("Line %lu : key 'on hook' pressed\n",
-                     (unsigned long)(pvt->index_line + 1));
-               alsa_input_handle_status_change(pvt, &(monitor_prms), AI_STATUS_ON_HOOK);
-               continue;
-            }
-            else if (KEY_MUTE == pvt->monitor.events[y].code) {
-               alsa_input_pr_debug("Line %lu : key 'mute' pressed\n",
-                     (unsigned long)(pvt->index_line + 1));
-               alsa_input_handle_mute_change(pvt, &(monitor_prms));
-               continue;
-            }
-            else if ((pvt->monitor.events[y].code >= KEY_NUMERIC_0) && (pvt->monitor.events[y].code <= KEY_NUMERIC_9)) {
-               digit = (pvt->monitor.events[y].code - KEY_NUMERIC_0) + '0';
-            }
-            else if (KEY_NUMERIC_STAR == pvt->monitor.events[y].code) {
-               /* Star key */
-               digit = '*';
-            }
-            else if (KEY_NUMERIC_POUND == pvt->monitor.events[y].code) {
-               /* Pound key */
-               digit = '#';
-            }
-            else if (KEY_A == pvt->monitor.events[y].code) {
-               digit = 'A';
-            }
-            else if (KEY_B == pvt->monitor.events[y].code) {
-               digit = 'B';
-            }
-            else if (KEY_C == pvt->monitor.events[y].code) {
-               digit = 'C';
-            }
-            else if (KEY_D == pvt->monitor.events[y].code) {
-               digit = 'D';
-            }
-            if ('\0' == digit) {
-               alsa_input_pr_debug("Line %lu : event ignored (code %u not handled)\n",
-                  (unsigned long)(pvt->index_line + 1), (unsigned int)(pvt->monitor.events[y].code));
-               continue;
-            }
-            alsa_input_pr_debug("Line %lu : key '%c' pressed\n",
-                  (unsigned long)(pvt->index_line + 1), (char)(digit));
-            alsa_input_handle_digit(pvt, &(monitor_prms), digit);
-         }
-         if (y > 0) {
-            /* Remove handled events */
-            pvt->monitor.events_len_in_bytes -= (y * sizeof(pvt->monitor.events[0]));
-            if (pvt->monitor.events_len_in_bytes > 0) {
-               memmove(pvt->monitor.events, &(pvt->monitor.events[y]), pvt->monitor.events_len_in_bytes);
-            }
-         }
-         if (!monitor_prms.channel_is_locked) {
-            continue;
-         }
+/* Drops the samples waiting in the resampler of a device */
+static void alsa_input_snd_card_reset_resampler(alsa_input_snd_card_t *t)
+{
+   if (NULL != t->resampler) {
+      alsa_input_resampler_reset(t->resampler);
+      t->rs_buf_len = 0;
+      t->rs_buf_offset = 0;
+   }
+}
 
-         /* Do periodic tasks */
-         alsa_input_monitor_pvt(pvt, &(monitor_prms));
-         if (!monitor_prms.channel_is_locked) {
-            continue;
-         }
+static void alsa_input_snd_card_start(alsa_input_snd_card_t *t)
+{
+   int err;
 
-         if (NULL != pvt->owner) {
-#ifdef DEBUG
-            pvt->owner_lock_count -= 1;
-            alsa_input_assert(0 == pvt->owner_lock_count);
-#endif /* DEBUG */
-            ast_channel_unlock(pvt->owner);
-         }
-         monitor_prms.channel_is_locked = false;
-      }
-      alsa_input_monitor_unlock(t);
+   alsa_input_snd_card_reset_resampler(t);
+   err = snd_pcm_prepare(t->card);
+   if (err) {
+      alsa_input_pr_debug("snd_pcm_prepare() failed: '%s'\n", snd_strerror(err));
    }
+   err = snd_pcm_start(t->card);
+   if (err) {
+      alsa_input_pr_debug("snd_pcm_start() failed: '%s'\n", snd_strerror(err));
+   }
+}
 
-   alsa_input_pr_debug("Exiting monitor's thread\n");
-
-   return (NULL);
+static void alsa_input_snd_card_stop(alsa_input_snd_card_t *t)
+{
+   int err = snd_pcm_drop(t->card);
+   if (err) {
+      alsa_input_pr_debug("snd_pcm_drop() failed: '%s'\n", snd_strerror(err));
+   }
+   alsa_input_snd_card_reset_resampler(t);
 }
 
-static int alsa_input_stop_monitor(alsa_input_chan_t *t)
+/*
+ Copies at most frames frames between buf and the DMA area of a device
+ accessed with mmap. Same return value as snd_pcm_readi() and
+ snd_pcm_writei()
+*/
+static snd_pcm_sframes_t alsa_input_snd_card_mmap_transfer(
+   alsa_input_snd_card_t *t, __u8 *buf, snd_pcm_uframes_t frames,
+   bool to_device)
 {
-   int ret = 0;
+   snd_pcm_sframes_t avail;
+   snd_pcm_uframes_t done = 0;
 
-   alsa_input_pr_debug("Stopping the monitor\n");
+   avail = snd_pcm_avail_update(t->card);
+   if (avail < 0) {
+      return (avail);
+   }
+   if (0 == avail) {
+      return (-EAGAIN);
+   }
+   if (frames > (snd_pcm_uframes_t)(avail)) {
+      frames = avail;
+   }
+   /* Two iterations at most, if the area wraps around the end of the buffer */
+   while (done < frames) {
+      const snd_pcm_channel_area_t *areas;
+      snd_pcm_uframes_t offset;
+      snd_pcm_uframes_t count = frames - done;
+      snd_pcm_sframes_t committed;
+      __u8 *area;
+      int err;
 
-   do { /* Empty loop */
-      if (t->monitor.thread == pthread_self()) {
-         ast_log(AST_LOG_ERROR, "Cannot kill myself\n");
-         ret = -1;
+      err = snd_pcm_mmap_begin(t->card, &(areas), &(offset), &(count));
+      if (err < 0) {
+         return ((done > 0) ? (snd_pcm_sframes_t)(done) : err);
+      }
+      if (0 == count) {
          break;
       }
-      if ((AST_PTHREADT_NULL != t->monitor.thread) && (AST_PTHREADT_STOP != t->monitor.thread)) {
-         /* Stops the monitor thread */
-         alsa_input_prepare_stop_monitor(t);
-         /*
-          Don't send signal SIGURG with pthread_kill() because
-          poll() called by monitor thread,
-          if interrupted by signal, could end returning -ERESTARTSYS.
-          As the signal handler in Asterisk has the flags SA_RESTART,
-          the syscall would be retried and the monitor will stay
-          blocked on poll()
-         */
-         alsa_input_pr_debug("Calling pthread_join()\n");
-         ret = pthread_join(t->monitor.thread, NULL);
-         if (ret) {
-            ast_log(AST_LOG_ERROR, "pthread_join() failed: %d, %d\n", ret, errno);
-         }
-         else {
-            alsa_input_pr_debug("Monitor stopped\n");
-         }
-         t->monitor.thread = AST_PTHREADT_NULL;
-         ret = 0;
+      /* Interleaved samples : the area of the frames is contiguous */
+      area = (__u8 *)(areas[0].addr) + ((areas[0].first + (offset * areas[0].step)) / 8);
+      if (to_device) {
+         memcpy(area, buf + (done * t->frame_bytes), count * t->frame_bytes);
       }
       else {
-         alsa_input_pr_debug("Monitor not running\n");
+         memcpy(buf + (done * t->frame_bytes), area, count * t->frame_bytes);
       }
-   } while (false);
-
-   return (ret);
-}
-
-static int alsa_input_start_monitor(alsa_input_chan_t *t)
-{
-   int ret = 0;
-
-   alsa_input_pr_debug("Starting the monitor\n");
-
-   do { /* Empty loop */
-      /* If we're supposed to be stopped -- stay stopped */
-      if (AST_PTHREADT_STOP == t->monitor.thread) {
-         ret = 0;
-         break;
+      committed = snd_pcm_mmap_commit(t->card, offset, count);
+      if (committed < 0) {
+         return ((done > 0) ? (snd_pcm_sframes_t)(done) : committed);
       }
-      alsa_input_assert((AST_PTHREADT_NULL == t->monitor.thread) && (!t->monitor.run));
-      alsa_input_prepare_start_monitor(t);
-      /* Start a new monitor */
-      if (ast_pthread_create_background(&(t->monitor.thread), NULL, alsa_input_do_monitor, t) < 0) {
-         ast_log(AST_LOG_ERROR, "Unable to start monitor thread.\n");
-         t->monitor.thread = AST_PTHREADT_NULL;
-         ret = -1;
+      done += committed;
+      if ((snd_pcm_uframes_t)(committed) != count) {
          break;
       }
-      alsa_input_assert((AST_PTHREADT_STOP != t->monitor.thread) && (AST_PTHREADT_NULL != t->monitor.thread));
-      ret = 0;
-   } while (false);
-
-   return (ret);
+   }
+   return (done);
 }
 
-static inline alsa_input_pvt_t *alsa_input_get_pvt(struct ast_channel *ast)
+/*
+ Reads at most frames frames (at the rate of the device) from a capture
+ device. Same return value as snd_pcm_readi(). With mmap, samples are copied
+ once, directly from the DMA area to buf
+*/
+static inline snd_pcm_sframes_t alsa_input_snd_card_read_device(
+   alsa_input_snd_card_t *t, __u8 *buf, snd_pcm_uframes_t frames)
 {
-   alsa_input_pvt_t *pvt = alsa_input_ast_channel_tech_pvt(ast);
-
-   if ((NULL == pvt) || (pvt->owner != ast)) {
-      ast_log(AST_LOG_WARNING, "Channel '%s' unlink or link to another line\n", alsa_input_ast_channel_name(ast));
-      pvt = NULL;
+   if (!t->mmap) {
+      return (snd_pcm_readi(t->card, buf, frames));
    }
-   return (pvt);
+   if (SND_PCM_STATE_PREPARED == snd_pcm_state(t->card)) {
+      /* Unlike snd_pcm_readi(), mmap access doesn't start the device */
+      int err = snd_pcm_start(t->card);
+      if (err) {
+         alsa_input_pr_debug("snd_pcm_start() failed: '%s'\n", snd_strerror(err));
+      }
+   }
+   return (alsa_input_snd_card_mmap_transfer(t, buf, frames, false));
 }
 
-/*!
- * \brief Make a call
- * \note The channel is locked when this function gets called.
- * \param ast which channel to make the call on
- * \param addr destination of the call
- * \param timeout time to wait on for connect (Doesn't seem to be used.)
- * \retval 0 on success
- * \retval -1 on failure
- */
-static int alsa_input_chan_call(struct ast_channel *ast,
-#if (AST_VERSION < 110)
-   char *addr,
-#else /* (AST_VERSION >= 110) */
-   const char *addr,
-#endif /* (AST_VERSION >= 110)*/
-   int timeout)
+/*
+ Writes at most frames frames (at the rate of the device) to a playback
+ device. Same return value as snd_pcm_writei(). With mmap, samples are
+ copied once, directly from buf to the DMA area
+*/
+static snd_pcm_sframes_t alsa_input_snd_card_write_device(
+   alsa_input_snd_card_t *t, const __u8 *buf, snd_pcm_uframes_t frames)
 {
-   int ret = -1;
-   alsa_input_pvt_t *pvt = alsa_input_get_pvt(ast);
-
-   alsa_input_pr_debug("alsa_input_chan_call(ast='%s', addr='%s', timeout=%d)\n", alsa_input_ast_channel_name(ast), addr, (int)(timeout));
+   snd_pcm_sframes_t ret;
 
-   if (NULL != pvt) {
-#ifdef DEBUG
-      pvt->owner_lock_count += 1;
-      alsa_input_assert(pvt->owner_lock_count > 0);
-#endif /* DEBUG */
-      do { /* Empty loop */
-         /* If phone is off hook, call() is not allowed */
-         if (AI_STATUS_ON_HOOK != pvt->ast_channel.status) {
-            ast_log(AST_LOG_NOTICE, "'%s' is busy\n", alsa_input_ast_channel_name(ast));
-            ast_setstate(ast, AST_STATE_BUSY);
-            ast_queue_control(ast, AST_CONTROL_BUSY);
+   if (!t->mmap) {
+      return (snd_pcm_writei(t->card, buf, frames));
+   }
+   ret = alsa_input_snd_card_mmap_transfer(t, (__u8 *)(buf), frames, true);
+   if ((ret > 0) && (SND_PCM_STATE_PREPARED == snd_pcm_state(t->card))) {
+      /*
+       Unlike snd_pcm_writei(), snd_pcm_mmap_commit() doesn't start the
+       device when start_threshold is reached
+      */
+      snd_pcm_sframes_t avail = snd_pcm_avail_update(t->card);
+      if ((avail >= 0) && ((t->buffer_size - avail) >= t->start_threshold)) {
+         int err = snd_pcm_start(t->card);
+         if (err) {
+            alsa_input_pr_debug("snd_pcm_start() failed: '%s'\n", snd_strerror(err));
          }
-         else {
-            char number[20];
-            char name[80];
-            enum ast_channel_state ast_state = alsa_input_ast_channel_state(ast);
-
-            if ((AST_STATE_DOWN != ast_state) && (AST_STATE_RESERVED != ast_state)) {
-               ast_log(AST_LOG_WARNING, "alsa_input_chan_call() called on '%s', neither down nor reserved\n",
-                  alsa_input_ast_channel_name(ast));
-               break;
-            }
-
-            /* the standard format of ast->callerid is:  "name" <number>, but not always complete */
-            if ((!alsa_input_ast_channel_connected(ast)->id.name.valid)
-                || (ast_strlen_zero(alsa_input_ast_channel_connected(ast)->id.name.str))) {
-               strcpy(name, "unknown");
-            }
-            else {
-               ast_copy_string(name, alsa_input_ast_channel_connected(ast)->id.name.str, sizeof(name));
-            }
+      }
+   }
+   return (ret);
+}
 
-            number[0] = '\0';
-            if ((alsa_input_ast_channel_connected(ast)->id.number.valid) && (alsa_input_ast_channel_connected(ast)->id.number.str)) {
-               ast_copy_string(number, alsa_input_ast_channel_connected(ast)->id.number.str, sizeof(number));
-            }
+/*
+ Reads at most frames frames (at the rate of the line) from a capture device.
+ Same return value as snd_pcm_readi()
+*/
+static snd_pcm_sframes_t alsa_input_snd_card_read(
+   alsa_input_snd_card_t *t, __u8 *buf, snd_pcm_uframes_t frames)
+{
+   snd_pcm_uframes_t done = 0;
 
-            alsa_input_pr_debug("Ringing '%s' on '%s' (with CID '%s', '%s')\n",
-               addr, alsa_input_ast_channel_name(ast), number, name);
+   if (NULL == t->resampler) {
+      return (alsa_input_snd_card_read_device(t, buf, frames));
+   }
+   while (done < frames) {
+      size_t in_len;
 
-            ast_setstate(ast, AST_STATE_RINGING);
-            ast_queue_control(ast, AST_CONTROL_RINGING);
-            alsa_input_set_new_state(pvt, AI_ST_ON_RINGING, AI_EV_AST_CALL);
-            ret = 0;
+      if (0 == t->rs_buf_len) {
+         snd_pcm_sframes_t read = alsa_input_snd_card_read_device(t, t->rs_buf, t->rs_buf_frames);
+         if (read < 0) {
+            return ((done > 0) ? (snd_pcm_sframes_t)(done) : read);
          }
-      } while (false);
-#ifdef DEBUG
-      alsa_input_assert(pvt->owner_lock_count > 0);
-      pvt->owner_lock_count -= 1;
-#endif /* DEBUG */
+         if (0 == read) {
+            break;
+         }
+         t->rs_buf_len = read;
+         t->rs_buf_offset = 0;
+      }
+      in_len = t->rs_buf_len;
+      done += alsa_input_resampler_process(t->resampler,
+         (const int16_t *)(t->rs_buf) + t->rs_buf_offset, &(in_len),
+         (int16_t *)(buf) + done, frames - done);
+      t->rs_buf_offset += in_len;
+      t->rs_buf_len -= in_len;
    }
-
-   return (ret);
+   return (done);
 }
 
-/*!
- * \brief Answer the channel
- *
- * \note The channel is locked when this function gets called.
- */
-static int alsa_input_chan_answer(struct ast_channel *ast)
+/*
+ Writes at most frames frames (at the rate of the line) to a playback device.
+ Same return value as snd_pcm_writei()
+*/
+static snd_pcm_sframes_t alsa_input_snd_card_write(
+   alsa_input_snd_card_t *t, const __u8 *buf, snd_pcm_uframes_t frames)
 {
-   int ret = -1;
-   alsa_input_pvt_t *pvt = alsa_input_get_pvt(ast);
+   size_t in_len = frames;
+   snd_pcm_sframes_t written;
 
-   /* Remote end has answered the call */
-   alsa_input_pr_debug("alsa_input_chan_answer(ast='%s')\n", alsa_input_ast_channel_name(ast));
+   if (NULL == t->resampler) {
+      return (alsa_input_snd_card_write_device(t, buf, frames));
+   }
+   /* Samples resampled by the previous call are written first */
+   if (t->rs_buf_len > 0) {
+      written = alsa_input_snd_card_write_device(t, t->rs_buf + (t->rs_buf_offset * SAMPLE_SIZE), t->rs_buf_len);
+      if (written < 0) {
+         return (written);
+      }
+      t->rs_buf_offset += written;
+      t->rs_buf_len -= written;
+      if (t->rs_buf_len > 0) {
+         /* Device is full */
+         return (-EAGAIN);
+      }
+   }
+   t->rs_buf_offset = 0;
+   t->rs_buf_len = alsa_input_resampler_process(t->resampler,
+      (const int16_t *)(buf), &(in_len), (int16_t *)(t->rs_buf), t->rs_buf_frames);
+   if (t->rs_buf_len > 0) {
+      /* An error is returned by the next call */
+      written = alsa_input_snd_card_write_device(t, t->rs_buf, t->rs_buf_len);
+      if (written > 0) {
+         t->rs_buf_offset = written;
+         t->rs_buf_len -= written;
+      }
+   }
+   return (in_len);
+}
 
-   if (NULL != pvt) {
-#ifdef DEBUG
-      pvt->owner_lock_count += 1;
-      alsa_input_assert(pvt->owner_lock_count > 0);
-#endif /* DEBUG */
-      /* If phone not off hook, answer() is not allowed */
-      if ((AI_ST_OFF_TALKING != pvt->ast_channel.state)
-          && (AI_ST_OFF_NO_SERVICE != pvt->ast_channel.state)) {
-         ast_log(AST_LOG_WARNING, "Channel '%s' can't answer now, because not off hook or not in the correct state\n", alsa_input_ast_channel_name(ast));
+/*
+ Returns the number of samples (at the rate of the line) between the
+ application and the device of stream : captured and not yet read for a
+ capture device, written and not yet played for a playback device. The
+ samples held by the resampler are counted. 0 if the device isn't running
+*/
+static snd_pcm_uframes_t alsa_input_snd_card_delay(
+   const alsa_input_snd_card_t *t, snd_pcm_stream_t stream)
+{
+   snd_pcm_sframes_t delay;
+   snd_pcm_uframes_t ret;
+
+   if ((NULL == t->card) || (snd_pcm_delay(t->card, &(delay)) < 0) || (delay < 0)) {
+      delay = 0;
+   }
+   ret = delay;
+   if (NULL != t->resampler) {
+      ret += t->rs_buf_len;
+      if (SND_PCM_STREAM_CAPTURE == stream) {
+         ret = (ret * t->resampler->up) / t->resampler->down;
       }
       else {
-         /* We accept that answer() can be called if AI_ST_OFF_TALKING == pvt->ast_channel.state */
-         if (AI_ST_OFF_WAITING_ANSWER == pvt->ast_channel.state) {
-            ret = alsa_input_setup(pvt, alsa_input_ast_channel_rawreadformat(pvt->owner), AST_STATE_UP, AI_EV_AST_ANSWER);
-            if (!ret) {
-               alsa_input_ast_channel_rings_set(pvt->owner, 0);
-            }
-         }
+         ret = (ret * t->resampler->down) / t->resampler->up;
       }
-#ifdef DEBUG
-      alsa_input_assert(pvt->owner_lock_count > 0);
-      pvt->owner_lock_count -= 1;
-#endif /* DEBUG */
    }
    return (ret);
 }
 
-/*!
- * \brief Fix up a channel:  If a channel is consumed, this is called.  Basically update any ->owner links
- *
- * \note The channel is locked when this function gets called.
- */
-static int alsa_input_chan_fixup(struct ast_channel *old_chan, struct ast_channel *new_chan)
+/*
+ Returns the time in ms of CLOCK_MONOTONIC, the clock used for all the
+ deadlines of the monitor (it's the clock of the timerfd of the monitor and
+ it doesn't jump when the date of the system is changed)
+*/
+static inline int64_t alsa_input_clock_ms(void)
 {
-   alsa_input_pvt_t *pvt = alsa_input_get_pvt(old_chan);
+   struct timespec ts;
 
-   alsa_input_pr_debug("alsa_input_chan_fixup(oldchan='%s', newchan='%s')\n",
-      alsa_input_ast_channel_name(old_chan), alsa_input_ast_channel_name(new_chan));
+   clock_gettime(CLOCK_MONOTONIC, &(ts));
+   return ((((int64_t)(ts.tv_sec)) * 1000) + (ts.tv_nsec / 1000000));
+}
 
-   if (NULL != pvt) {
-#ifdef DEBUG
-      pvt->owner_lock_count += 1;
-      alsa_input_assert(pvt->owner_lock_count > 0);
-#endif /* DEBUG */
-      /*
-       Here the channel is locked and we get the monitor lock.
-       In the monitor we get the monitor lock and then only TRY to lock the channel
-       IMHO no deadlock can occur
-      */
-      alsa_input_monitor_lock(pvt->channel);
-      pvt->owner = new_chan;
-      alsa_input_monitor_unlock(pvt->channel);
-#ifdef DEBUG
-      alsa_input_assert(pvt->owner_lock_count > 0);
-      pvt->owner_lock_count -= 1;
-#endif /* DEBUG */
+/*
+ Wakes up the monitor if it's waiting in epoll_wait().
+ Can be called from any thread, without any lock.
+*/
+static void alsa_input_monitor_wakeup(alsa_input_chan_t *t)
+{
+   if (t->monitor.fd_wakeup >= 0) {
+      uint64_t val = 1;
+      if (write(t->monitor.fd_wakeup, &(val), sizeof(val)) < 0) {
+         alsa_input_pr_debug("Unable to wake up the monitor ('%s')\n", strerror(errno));
+      }
    }
+}
 
-   return (0);
+/*
+ Asks the monitor to service the line as soon as possible.
+ Can be called from any thread, without any lock : the line is pushed in a
+ lock-free list and the monitor is woken up by writing its eventfd.
+*/
+static void alsa_input_monitor_kick(alsa_input_pvt_t *pvt)
+{
+   alsa_input_chan_t *t = pvt->channel;
+
+   if (!__atomic_exchange_n(&(pvt->monitor.kicked), 1, __ATOMIC_ACQ_REL)) {
+      alsa_input_pvt_t *head = __atomic_load_n(&(t->monitor.kicked), __ATOMIC_ACQUIRE);
+      do {
+         pvt->monitor.next_kicked = head;
+      } while (!__atomic_compare_exchange_n(&(t->monitor.kicked), &(head), pvt,
+                  false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+   }
+   alsa_input_monitor_wakeup(t);
 }
 
-/*!
- * \brief Start sending a literal DTMF digit
- *
- * \note The channel is not locked when this function gets called.
- */
-static int alsa_input_chan_digit_begin(struct ast_channel *ast, char digit)
+/*
+ Can be called from any thread, as epoll_ctl() is thread safe : the thread
+ using the epoll set can be waiting in epoll_wait() at the same time
+*/
+static int alsa_input_epoll_add(int epfd, int fd, uint32_t events,
+   alsa_input_monitor_src_t *src)
 {
-   alsa_input_pr_debug("alsa_input_chan_digit_begin(ast='%s', digit='%c')\n", alsa_input_ast_channel_name(ast), (char)(digit));
+   int ret;
+   struct epoll_event ev;
+
+   memset(&(ev), 0, sizeof(ev));
+   ev.events = events;
+   ev.data.ptr = src;
+   ret = epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &(ev));
+   if (ret) {
+      ast_log(AST_LOG_ERROR, "epoll_ctl(EPOLL_CTL_ADD) failed: '%s'\n", strerror(errno));
+   }
+   return (ret);
+}
 
-   /* Done in alsa_input_chan_digit_end() */
+static void alsa_input_epoll_del(int epfd, int fd)
+{
+   struct epoll_event ev;
 
-   return (0);
+   /* ev is ignored but must be non NULL for kernels before 2.6.9 */
+   memset(&(ev), 0, sizeof(ev));
+   if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &(ev))) {
+      alsa_input_pr_debug("epoll_ctl(EPOLL_CTL_DEL) failed: '%s'\n", strerror(errno));
+   }
 }
 
-/*!
- * \brief Stop sending a literal DTMF digit
- *
- * \note The channel is not locked when this function gets called.
- */
-static int alsa_input_chan_digit_end(struct ast_channel *ast, char digit, unsigned int duration)
+static inline int alsa_input_monitor_register_fd(alsa_input_chan_t *t, int fd,
+   alsa_input_monitor_src_t *src)
 {
-   int ret = 0;
-   alsa_input_pvt_t *pvt;
-   alsa_input_tone_t tone;
+   return (alsa_input_epoll_add(t->monitor.epfd, fd, EPOLLIN, src));
+}
 
-   alsa_input_pr_debug("alsa_input_chan_digit_end(ast='%s', digit='%c', duration=%u)\n",
-      alsa_input_ast_channel_name(ast), (char)(digit), (unsigned int)(duration));
+static inline void alsa_input_monitor_unregister_fd(alsa_input_chan_t *t, int fd)
+{
+   alsa_input_epoll_del(t->monitor.epfd, fd);
+}
 
-   ast_channel_lock(ast);
-   pvt = alsa_input_get_pvt(ast);
-   if (NULL == pvt) {
-      ret = -1;
+/*
+ Sends a command to the audio thread.
+ Must be called with pvt->owner locked (or with monitor.lock locked if
+ pvt->owner is NULL), so that there's only one producer at a time.
+*/
+static void alsa_input_audio_send(alsa_input_pvt_t *pvt,
+   const alsa_input_audio_cmd_t *cmd)
+{
+   alsa_input_chan_t *t = pvt->channel;
+   unsigned int head = pvt->audio.cmds_head;
+
+   alsa_input_assert((NULL == pvt->owner) || (pvt->owner_lock_count > 0));
+
+   if ((head - __atomic_load_n(&(pvt->audio.cmds_tail), __ATOMIC_ACQUIRE)) >= AI_AUDIO_CMDS_LEN) {
+      ast_log(AST_LOG_ERROR, "Line %lu : too many commands pending for the audio thread\n",
+         (unsigned long)(pvt->index_line + 1));
+      return;
    }
-   else {
-#ifdef DEBUG
-      pvt->owner_lock_count += 1;
-      alsa_input_assert(pvt->owner_lock_count > 0);
-#endif /* DEBUG */
-      if ((AI_ST_OFF_TALKING != pvt->ast_channel.state)
-          && (AI_ST_OFF_WAITING_ANSWER != pvt->ast_channel.state)) {
-         ast_log(AST_LOG_WARNING, "Can't send a DTMF while not off hook or not in the correct state\n");
-         ret = -1;
+   pvt->audio.cmds[head % AI_AUDIO_CMDS_LEN] = *cmd;
+   __atomic_store_n(&(pvt->audio.cmds_head), head + 1, __ATOMIC_RELEASE);
+   if (t->audio.fd_wakeup >= 0) {
+      uint64_t val = 1;
+      if (write(t->audio.fd_wakeup, &(val), sizeof(val)) < 0) {
+         alsa_input_pr_debug("Unable to wake up the audio thread ('%s')\n", strerror(errno));
+      }
+   }
+}
+
+static inline void alsa_input_audio_send_simple(alsa_input_pvt_t *pvt,
+   alsa_input_audio_cmd_kind_t kind)
+{
+   alsa_input_audio_cmd_t cmd;
+
+   memset(&(cmd), 0, sizeof(cmd));
+   cmd.kind = kind;
+   alsa_input_audio_send(pvt, &(cmd));
+}
+
+/*
+ Sends AI_AUDIO_CMD_CLOSE, acknowledged in audio.close_ack.
+ Must be called with monitor.lock locked.
+*/
+static inline void alsa_input_audio_send_close(alsa_input_pvt_t *pvt)
+{
+   alsa_input_audio_cmd_t cmd;
+
+   memset(&(cmd), 0, sizeof(cmd));
+   cmd.kind = AI_AUDIO_CMD_CLOSE;
+   cmd.close_seq = __atomic_add_fetch(&(pvt->reload.close_seq), 1, __ATOMIC_RELAXED);
+   alsa_input_audio_send(pvt, &(cmd));
+}
+
+/*
+ Configuration of a line, as read by the audio thread : it takes no lock,
+ so it may see the replacement of the configuration by a reload at any time
+ (see alsa_input_publish_line_cfg())
+*/
+static inline const alsa_input_line_config_t *alsa_input_audio_line_cfg(const alsa_input_pvt_t *pvt)
+{
+   return (__atomic_load_n(&(pvt->line_cfg), __ATOMIC_ACQUIRE));
+}
+
+/*
+ Frees the configurations replaced by a reload that no thread can still
+ read : the audio thread has completed two passes since they were replaced
+ (or it's not running). The count read when one was replaced may miss the
+ pass in progress, which may still read it : the pass after this one
+ can't. If all is true, they are all freed.
+ Must be called with monitor.lock locked (unless the monitor is stopped).
+*/
+static void alsa_input_reclaim_line_cfgs(alsa_input_chan_t *t, bool all)
+{
+   unsigned int passes = __atomic_load_n(&(t->audio.passes), __ATOMIC_ACQUIRE);
+   alsa_input_retired_cfg_t **prev = &(t->monitor.retired);
+   bool waiting = false;
+
+   while (NULL != *prev) {
+      alsa_input_retired_cfg_t *r = *prev;
+
+      if ((all) || (AST_PTHREADT_NULL == t->audio.thread) || ((passes - r->audio_passes) >= 2)) {
+         *prev = r->next;
+         ast_free(r->line_cfg);
+         ast_free(r);
       }
       else {
-         switch (digit) {
-            case '0': {
-               tone = AI_TONE_DTMF_0;
-               break;
-            }
-            case '1': {
-               tone = AI_TONE_DTMF_1;
-               break;
-            }
-            case '2': {
-               tone = AI_TONE_DTMF_2;
-               break;
-            }
-            case '3': {
-               tone = AI_TONE_DTMF_3;
-               break;
-            }
-            case '4': {
-               tone = AI_TONE_DTMF_4;
-               break;
-            }
-            case '5': {
-               tone = AI_TONE_DTMF_5;
-               break;
-            }
-            case '6': {
-               tone = AI_TONE_DTMF_6;
-               break;
-            }
-            case '7': {
-               tone = AI_TONE_DTMF_7;
-               break;
-            }
-            case '8': {
-               tone = AI_TONE_DTMF_8;
-               break;
-            }
-            case '9': {
-               tone = AI_TONE_DTMF_9;
-               break;
-            }
-            case '*': {
-               tone = AI_TONE_DTMF_ASTER;
-               break;
-            }
-            case '#': {
-               tone = AI_TONE_DTMF_POUND;
-               break;
-            }
-            case 'A': {
-               tone = AI_TONE_DTMF_A;
-               break;
-            }
-            case 'B': {
-               tone = AI_TONE_DTMF_B;
-               break;
-            }
-            case 'C': {
-               tone = AI_TONE_DTMF_C;
-               break;
-            }
-            case 'D': {
-               tone = AI_TONE_DTMF_D;
-               break;
-            }
-            default: {
-               ast_log(AST_LOG_WARNING, "Unknown digit '%c'\n", (char)(digit));
-               ret = -1;
-               break;
-            }
-         }
-         if (!ret) {
-            alsa_input_pr_debug("Playing DTMF digit '%c'\n", (char)(digit));
-            alsa_input_set_line_tone(pvt, tone, duration);
-         }
+         waiting = true;
+         prev = &(r->next);
+      }
+   }
+   if ((waiting) && (t->audio.fd_wakeup >= 0)) {
+      /* The audio thread may be waiting for its devices : make it do a pass */
+      uint64_t val = 1;
+      if (write(t->audio.fd_wakeup, &(val), sizeof(val)) < 0) {
+         alsa_input_pr_debug("Unable to wake up the audio thread ('%s')\n", strerror(errno));
       }
-#ifdef DEBUG
-      alsa_input_assert(pvt->owner_lock_count > 0);
-      pvt->owner_lock_count -= 1;
-#endif /* DEBUG */
    }
+}
 
-   ast_channel_unlock(ast);
+/*
+ Replaces the configuration of a line by line_cfg (allocated by
+ alsa_input_reload_module()) : a reader sees either the old configuration
+ or the new one, never a mix of both. The old one is freed once no thread
+ can still read it.
+ Must be called with monitor.lock locked and pvt->owner locked (if not NULL).
+*/
+static void alsa_input_publish_line_cfg(alsa_input_pvt_t *pvt, alsa_input_line_config_t *line_cfg)
+{
+   alsa_input_chan_t *t = pvt->channel;
+   const alsa_input_line_config_t *old = pvt->line_cfg;
+   alsa_input_retired_cfg_t *r;
 
-   return (ret);
+   alsa_input_assert((t->monitor.lock_count > 0)
+      && ((NULL == pvt->owner) || (pvt->owner_lock_count > 0)));
+
+   __atomic_store_n(&(pvt->line_cfg), line_cfg, __ATOMIC_RELEASE);
+   /*
+    The count of passes is read after the store is visible to the audio
+    thread (pairs with the fence following the increment in
+    alsa_input_do_audio())
+   */
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   /* The configurations read by load_module() are freed with the module */
+   if ((old >= t->config.line_cfgs) && (old < &(t->config.line_cfgs[t->config.line_count]))) {
+      return;
+   }
+   r = ast_calloc(1, sizeof(*r));
+   if (NULL == r) {
+      /* Better leak it than free it while it may be read */
+      ast_log(AST_LOG_WARNING, "Unable to allocate memory to free the old configuration of line %lu\n",
+         (unsigned long)(pvt->index_line + 1));
+      return;
+   }
+   r->line_cfg = (alsa_input_line_config_t *)(old);
+   r->audio_passes = __atomic_load_n(&(t->audio.passes), __ATOMIC_ACQUIRE);
+   r->next = t->monitor.retired;
+   t->monitor.retired = r;
 }
 
-/*!
- * \brief Indicate a particular condition (e.g. AST_CONTROL_BUSY or AST_CONTROL_RINGING or AST_CONTROL_CONGESTION
- *
- * \note The channel is locked when this function gets called.
- */
-static int alsa_input_chan_indicate(struct ast_channel *ast, int condition, const void *data, size_t datalen)
+/*
+ Publishes the configuration given by a reload to a line whose owner can
+ be locked now.
+ Must be called with monitor.lock locked and pvt->owner locked (if not NULL).
+*/
+static void alsa_input_apply_next_cfg(alsa_input_pvt_t *pvt)
 {
-   int ret = 0;
-   alsa_input_pvt_t *pvt = alsa_input_get_pvt(ast);
-
-   if (NULL == pvt) {
-      ret = -1;
+   if (NULL != pvt->reload.next_cfg) {
+      alsa_input_publish_line_cfg(pvt, pvt->reload.next_cfg);
+      pvt->reload.next_cfg = NULL;
+      alsa_input_pr_debug("Line %lu : new configuration applied\n",
+         (unsigned long)(pvt->index_line + 1));
    }
-   else {
-#ifdef DEBUG
-      pvt->owner_lock_count += 1;
-      alsa_input_assert(pvt->owner_lock_count > 0);
-#endif /* DEBUG */
-      if ((AI_ST_OFF_TALKING != pvt->ast_channel.state)
-          && (AI_ST_OFF_WAITING_ANSWER != pvt->ast_channel.state)) {
-         ast_log(AST_LOG_WARNING, "Can't indicate a condition while not off hook or not in the correct state\n");
+}
+
+/*
+ Asks the devices thread to reopen a disconnected line with the
+ configuration given by a reload (see alsa_input_reopen_line()).
+ Must be called with monitor.lock locked.
+*/
+static void alsa_input_devices_request(alsa_input_pvt_t *pvt)
+{
+   alsa_input_chan_t *t = pvt->channel;
+
+   alsa_input_assert((t->monitor.lock_count > 0) && (AI_ST_DISCONNECTED == pvt->ast_channel.state));
+
+   pvt->reload.reopening = true;
+   __atomic_store_n(&(pvt->reload.requested), 1, __ATOMIC_RELEASE);
+   if (t->devices.fd_wakeup >= 0) {
+      uint64_t val = 1;
+      if (write(t->devices.fd_wakeup, &(val), sizeof(val)) < 0) {
+         alsa_input_pr_debug("Unable to wake up the devices thread ('%s')\n", strerror(errno));
       }
-      else {
-         switch (condition) {
-            case AST_CONTROL_BUSY:
-            case AST_CONTROL_CONGESTION:
-            case AST_CONTROL_RINGING:
-            case AST_CONTROL_INCOMPLETE:
-#if (AST_VERSION >= 110)
-            case AST_CONTROL_PVT_CAUSE_CODE:
-#endif /* (AST_VERSION >= 110) */
-            case -1: {
-               ret = -1;  /* Ask for inband indications */
-               break;
-            }
-            case AST_CONTROL_PROGRESS:
-            case AST_CONTROL_PROCEEDING:
-            case AST_CONTROL_VIDUPDATE:
-            case AST_CONTROL_SRCUPDATE: {
-               break;
-            }
-            case AST_CONTROL_HOLD: {
-               ast_verbose(" << Channel Has Been Placed on Hold >> \n");
-               ast_moh_start(ast, data, ('\0' != pvt->line_cfg->moh_interpret[0]) ? pvt->line_cfg->moh_interpret : NULL);
-               break;
-            }
-            case AST_CONTROL_UNHOLD: {
-               ast_verbose(" << Channel Has Been Retrieved from Hold >> \n");
-               ast_moh_stop(ast);
-               break;
-            }
-            default: {
-               ast_log(AST_LOG_WARNING, "Don't know how to indicate condition %d on '%s'\n",
-                  (int)(condition), alsa_input_ast_channel_name(ast));
-               ret = -1;
-               break;
-            }
-         }
+   }
+}
+
+/*
+ Forgets the frames captured and not yet read.
+ Must be called with pvt->owner locked (we are the consumer of the ring).
+*/
+static void alsa_input_audio_drain_frames(alsa_input_pvt_t *pvt)
+{
+   uint64_t val;
+
+   alsa_input_assert((NULL == pvt->owner) || (pvt->owner_lock_count > 0));
+
+   if (pvt->audio.fd_frames >= 0) {
+      /* Reset the counter of the eventfd */
+      if (read(pvt->audio.fd_frames, &(val), sizeof(val)) < 0) {
+         /* Nothing to do, counter is already null */
       }
-#ifdef DEBUG
-      alsa_input_assert(pvt->owner_lock_count > 0);
-      pvt->owner_lock_count -= 1;
-#endif /* DEBUG */
    }
+   /* The frame held (if any) is released too */
+   pvt->ast_channel.frame_held = false;
+   __atomic_store_n(&(pvt->audio.frames_tail),
+      __atomic_load_n(&(pvt->audio.frames_head), __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+}
 
-   return (ret);
+/*
+ Return true if the audio thread doesn't play a tone, so that
+ alsa_input_chan_write() can queue voice.
+ Must be called with pvt->owner locked.
+*/
+static inline bool alsa_input_audio_playback_is_free(alsa_input_pvt_t *pvt)
+{
+   return (__atomic_load_n(&(pvt->audio.playback_ack), __ATOMIC_ACQUIRE) == pvt->ast_channel.playback_seq);
 }
 
-/*!
- * \brief Read a frame, in standard format (see frame.h)
- *
- * \note The channel is locked when this function gets called.
- * As we don't associate a file descriptor to a channel, in theory this function
- * will be called only if there's a jitter buffer
- */
-static struct ast_frame *alsa_input_chan_read(struct ast_channel *ast)
+/*
+ Queues voice samples in the playback ring, the audio thread writes them to
+ the sound playback device.
+ Must be called with pvt->owner locked (we are the producer of the ring).
+ Return the number of bytes queued, that can be less than len if the ring
+ is full
+*/
+static size_t alsa_input_audio_queue_playback(alsa_input_pvt_t *pvt,
+   const __u8 *data, size_t len)
 {
-   struct ast_frame *ret = &(ast_null_frame);
-   alsa_input_pvt_t *pvt = alsa_input_get_pvt(ast);
+   size_t head = pvt->audio.play_head;
+   size_t room = pvt->audio.play_depth - (head - __atomic_load_n(&(pvt->audio.play_tail), __ATOMIC_ACQUIRE));
+   int gain = __atomic_load_n(&(pvt->audio.play_gain), __ATOMIC_RELAXED);
+   size_t offset;
+   size_t tmp;
 
-   /* alsa_input_pr_debug("alsa_input_chan_read(ast='%s')\n", alsa_input_ast_channel_name(ast)); */
-   if (NULL != pvt) {
-#ifdef DEBUG
-      pvt->owner_lock_count += 1;
-      alsa_input_assert(pvt->owner_lock_count > 0);
-#endif /* DEBUG */
-      do { /* Empty loop */
-         if ((AI_ST_OFF_TALKING != pvt->ast_channel.state)
-             && (AI_ST_OFF_WAITING_ANSWER != pvt->ast_channel.state)) {
-            /* Don't try to receive audio on-hook */
-            ast_log(AST_LOG_WARNING, "Trying to receive audio while not off hook or not in the correct state\n");
-            break;
-         }
+   alsa_input_assert((NULL != pvt->owner) && (pvt->owner_lock_count > 0));
 
-         if (alsa_input_read_data(pvt, false, false)) {
-            ret = &(pvt->ast_channel.frame);
-         }
-         else {
-            ret = &(ast_null_frame);
-         }
-      } while (0);
-#ifdef DEBUG
-      alsa_input_assert(pvt->owner_lock_count > 0);
-      pvt->owner_lock_count -= 1;
-#endif /* DEBUG */
+   if (len > room) {
+      len = room;
    }
-   return (ret);
+   /* Only complete samples are queued, so that head stays aligned */
+   len -= (len % SAMPLE_SIZE);
+   if (0 == len) {
+      return (0);
+   }
+   offset = head & (pvt->audio.play_size - 1);
+   tmp = pvt->audio.play_size - offset;
+   if (tmp > len) {
+      tmp = len;
+   }
+   /* The volume is applied in the ring, once the samples are copied */
+   memcpy(&(pvt->audio.play_buf[offset]), data, tmp);
+   alsa_input_gain_apply((int16_t *)(&(pvt->audio.play_buf[offset])), tmp / SAMPLE_SIZE, gain);
+   if (tmp < len) {
+      memcpy(pvt->audio.play_buf, data + tmp, len - tmp);
+      alsa_input_gain_apply((int16_t *)(pvt->audio.play_buf), (len - tmp) / SAMPLE_SIZE, gain);
+   }
+   __atomic_store_n(&(pvt->audio.play_head), head + len, __ATOMIC_SEQ_CST);
+   if (__atomic_exchange_n(&(pvt->audio.play_idle), 0, __ATOMIC_SEQ_CST)) {
+      /* The audio thread doesn't poll the playback device, we wake it up */
+      alsa_input_audio_send_simple(pvt, AI_AUDIO_CMD_PLAYBACK);
+   }
+   return (len);
 }
 
-/*!
- * \brief Write a frame, in standard format (see frame.h)
- *
- * \note The channel is locked when this function gets called.
- */
-static int alsa_input_chan_write(struct ast_channel *ast, struct ast_frame *frame)
+/*
+ Adds the latency (in samples) of a frame queued by alsa_input_chan_write()
+ to the histogram of the line
+*/
+static void alsa_input_stats_latency_add(alsa_input_pvt_t *pvt,
+   unsigned long samples)
 {
-   int ret = 0;
-   alsa_input_pvt_t *pvt = alsa_input_get_pvt(ast);
+   unsigned long ms = samples / alsa_input_rate_samples_per_ms(pvt->rate);
+   unsigned long bound = AI_STATS_LATENCY_FIRST_MS;
+   unsigned int i = 0;
 
-   /* alsa_input_pr_debug("alsa_input_chan_write(ast='%s')\n", alsa_input_ast_channel_name(ast)); */
-   if (NULL != pvt) {
-#ifdef DEBUG
-      pvt->owner_lock_count += 1;
-      alsa_input_assert(pvt->owner_lock_count > 0);
-#endif /* DEBUG */
+   while ((i < (AI_STATS_LATENCY_BUCKETS - 1)) && (ms >= bound)) {
+      bound <<= 1;
+      i += 1;
+   }
+   __atomic_add_fetch(&(pvt->stats.latency[i]), 1, __ATOMIC_RELAXED);
+}
 
-      do { /* Empty loop */
-         snd_pcm_state_t state;
-         __u8 *pos;
-         size_t tmp;
-         size_t to_write;
-         snd_pcm_sframes_t written;
+/* Copies a delay of the statistics, each counter being read atomically */
+static void alsa_input_stats_delay_get(const alsa_input_stats_delay_t *src,
+   alsa_input_stats_delay_t *dst)
+{
+   dst->min = __atomic_load_n(&(src->min), __ATOMIC_RELAXED);
+   dst->max = __atomic_load_n(&(src->max), __ATOMIC_RELAXED);
+   dst->sum = __atomic_load_n(&(src->sum), __ATOMIC_RELAXED);
+   dst->count = __atomic_load_n(&(src->count), __ATOMIC_RELAXED);
+   dst->last = __atomic_load_n(&(src->last), __ATOMIC_RELAXED);
+}
 
-         /* Write a frame of (presumably voice) data */
-         if (AST_FRAME_VOICE != frame->frametype) {
-            ast_log(AST_LOG_WARNING, "Don't know what to do with frame type %d\n", (int)(frame->frametype));
-            break;
-         }
+/*
+ Copies the statistics of a line to stats, each counter being read
+ atomically. Return the number of errors recovered by the sound devices of
+ the line
+*/
+static unsigned long alsa_input_stats_get(const alsa_input_pvt_t *pvt,
+   alsa_input_stats_t *stats)
+{
+   const alsa_input_stats_t *src = &(pvt->stats);
+   const alsa_input_snd_shared_t *sh;
+   unsigned long ret = 0;
+   size_t i;
 
-         if (frame->datalen <= 0) {
-            alsa_input_pr_debug("Void frame\n");
-            break;
-         }
+   stats->capture_xruns = __atomic_load_n(&(src->capture_xruns), __ATOMIC_RELAXED);
+   stats->playback_xruns = __atomic_load_n(&(src->playback_xruns), __ATOMIC_RELAXED);
+   stats->capture_frames = __atomic_load_n(&(src->capture_frames), __ATOMIC_RELAXED);
+   stats->capture_dropped = __atomic_load_n(&(src->capture_dropped), __ATOMIC_RELAXED);
+   stats->capture_queue_max = __atomic_load_n(&(src->capture_queue_max), __ATOMIC_RELAXED);
+   stats->concealed = __atomic_load_n(&(src->concealed), __ATOMIC_RELAXED);
+   alsa_input_stats_delay_get(&(src->capture_delay), &(stats->capture_delay));
+   alsa_input_stats_delay_get(&(src->playback_delay), &(stats->playback_delay));
+   stats->playback_frames = __atomic_load_n(&(src->playback_frames), __ATOMIC_RELAXED);
+   stats->playback_dropped = __atomic_load_n(&(src->playback_dropped), __ATOMIC_RELAXED);
+   for (i = 0; (i < AI_STATS_LATENCY_BUCKETS); i += 1) {
+      stats->latency[i] = __atomic_load_n(&(src->latency[i]), __ATOMIC_RELAXED);
+   }
+   stats->queue_failures = __atomic_load_n(&(src->queue_failures), __ATOMIC_RELAXED);
+   sh = __atomic_load_n(&(pvt->audio.shared_capture), __ATOMIC_ACQUIRE);
+   ret += __atomic_load_n((NULL != sh) ? &(sh->card.errors_recovered) : &(pvt->audio.snd_capture.errors_recovered), __ATOMIC_RELAXED);
+   sh = __atomic_load_n(&(pvt->audio.shared_playback), __ATOMIC_ACQUIRE);
+   ret += __atomic_load_n((NULL != sh) ? &(sh->card.errors_recovered) : &(pvt->audio.snd_playback.errors_recovered), __ATOMIC_RELAXED);
+   return (ret);
+}
 
-         if (!alsa_input_ast_formats_are_equal(ast_format_slin, alsa_input_ast_get_frame_format(frame))) {
-            ast_log(AST_LOG_WARNING, "Cannot handle frames in '%s' format\n",
-               alsa_input_ast_format_get_name(alsa_input_ast_get_frame_format(frame)));
-            ret = -1;
-            break;
-         }
+/*
+ Formats the minimum, average and maximum of a delay in ms (with one
+ decimal) in buf
+*/
+static void alsa_input_stats_delay_format(const alsa_input_pvt_t *pvt,
+   const alsa_input_stats_delay_t *d, char *buf, size_t size)
+{
+   unsigned long spm = alsa_input_rate_samples_per_ms(pvt->rate);
+   unsigned long avg = (d->count > 0) ? (d->sum / d->count) : 0;
 
-         if ((AI_ST_OFF_TALKING != pvt->ast_channel.state)
-             && (AI_ST_OFF_WAITING_ANSWER != pvt->ast_channel.state)) {
-            /* Don't try to receive audio on-hook */
-            ast_log(AST_LOG_WARNING, "Trying to receive audio while not off hook or not in the correct state\n");
-            break;
-         }
+   snprintf(buf, size, "%lu.%lu/%lu.%lu/%lu.%lu",
+      d->min / spm, ((d->min * 10) / spm) % 10,
+      avg / spm, ((avg * 10) / spm) % 10,
+      d->max / spm, ((d->max * 10) / spm) % 10);
+}
 
-         if (AI_TONE_NONE != pvt->ast_channel.tone) {
-            /* Don't try to send audio when emitting a tone */
-            /* alsa_input_pr_debug("Trying to send audio while emitting a tone\n"); */
-            alsa_input_write_tone_data(pvt);
-            break;
-         }
+/* Formats the counters of the latency histogram, separated by sep, in buf */
+static void alsa_input_stats_latency_format(const alsa_input_stats_t *stats,
+   const char *sep, char *buf, size_t size)
+{
+   size_t len = 0;
+   unsigned int i;
 
-         state = snd_pcm_state(pvt->ast_channel.snd_playback.card);
-         if ((state != SND_PCM_STATE_PREPARED) && (state != SND_PCM_STATE_RUNNING)) {
-            int err = snd_pcm_prepare(pvt->ast_channel.snd_playback.card);
-            if (err) {
-               ast_log(AST_LOG_ERROR, "snd_pcm_prepare() failed: '%s'\n", snd_strerror(err));
-            }
-         }
-
-         pos = frame->data.ptr;
-         to_write = frame->datalen;
-         alsa_input_assert((ARRAY_LEN(pvt->ast_channel.bytes_not_written) >= SAMPLE_SIZE)
-            && (pvt->ast_channel.offset_bytes_not_written == 0));
-         /* Are there some bytes not written ? */
-         if (pvt->ast_channel.bytes_not_written_len > 0) {
-            /* Yes */
-            if ((pvt->ast_channel.bytes_not_written_len + to_write) < SAMPLE_SIZE) {
-               /*
-                Not enough byte to make a complete sample, we just
-                add bytes to buffer pvt->ast_channel.bytes_not_written
-               */
-               memcpy(&(pvt->ast_channel.bytes_not_written[pvt->ast_channel.bytes_not_written_len]), pos, to_write);
-               pvt->ast_channel.bytes_not_written_len += to_write;
-               pos += to_write;
-               to_write = 0;
-               break;
-            }
-            alsa_input_assert(pvt->ast_channel.bytes_not_written_len <= SAMPLE_SIZE);
-            tmp = SAMPLE_SIZE - pvt->ast_channel.bytes_not_written_len;
-            alsa_input_assert(tmp <= to_write);
-            if (tmp > 0) {
-               memcpy(&(pvt->ast_channel.bytes_not_written[pvt->ast_channel.bytes_not_written_len]), pos, tmp);
-               pvt->ast_channel.bytes_not_written_len += tmp;
-               pos += tmp;
-               to_write -= tmp;
-            }
-            written = snd_pcm_writei(pvt->ast_channel.snd_playback.card, pvt->ast_channel.bytes_not_written, 1);
-            if (written < 0) {
-               if (alsa_input_snd_card_handle_error(&(pvt->ast_channel.snd_playback), written, "snd_pcm_writei")) {
-                  /* Critical error */
-                  alsa_input_critical_error(pvt, false);
-               }
-               break;
-            }
-            if (written > 0) {
-               tmp = (written * SAMPLE_SIZE);
-               pvt->ast_channel.bytes_not_written_len -= tmp;
-               if (pvt->ast_channel.bytes_not_written_len > 0) {
-                  memmove(pvt->ast_channel.bytes_not_written,
-                     &(pvt->ast_channel.bytes_not_written[tmp]),
-                     pvt->ast_channel.bytes_not_written_len);
-               }
-            }
-         }
-         if (pvt->ast_channel.bytes_not_written_len <= 0) {
-            written = snd_pcm_writei(pvt->ast_channel.snd_playback.card, pos, to_write / SAMPLE_SIZE);
-            if (written < 0) {
-               if (alsa_input_snd_card_handle_error(&(pvt->ast_channel.snd_playback), written, "snd_pcm_writei")) {
-                  /* Critical error */
-                  alsa_input_critical_error(pvt, false);
-               }
-               break;
-            }
-            tmp = (written * SAMPLE_SIZE);
-            pos += tmp;
-            to_write -= tmp;
-         }
-         if (to_write <= 0) {
-            break;
-         }
-         tmp = (pvt->ast_channel.bytes_not_written_len + to_write) % SAMPLE_SIZE;
-         if (tmp > 0) {
-            if (tmp <= to_write) {
-               pos += (to_write - tmp);
-               memcpy(pvt->ast_channel.bytes_not_written, pos, tmp);
-               pos += tmp;
-               to_write -= tmp;
-            }
-            else {
-               /* tmp > todo */
-               memmove(pvt->ast_channel.bytes_not_written,
-                  &(pvt->ast_channel.bytes_not_written[pvt->ast_channel.bytes_not_written_len + to_write - tmp]),
-                  tmp - to_write);
-               memcpy(&(pvt->ast_channel.bytes_not_written[tmp - to_write]), pos, to_write);
-               pos += to_write;
-               to_write = 0;
-            }
-         }
-         pvt->ast_channel.bytes_not_written_len = tmp;
-         if (to_write > 0) {
-            ast_log(AST_LOG_WARNING, "Only wrote %lu of %lu bytes of audio data to line %lu\n",
-               (unsigned long)(frame->datalen - to_write), (unsigned long)(frame->datalen),
-               (unsigned long)(pvt->index_line + 1));
-         }
-      } while (false);
-
-      alsa_input_read_data(pvt, true, false);
-#ifdef DEBUG
-      alsa_input_assert(pvt->owner_lock_count > 0);
-      pvt->owner_lock_count -= 1;
-#endif /* DEBUG */
+   buf[0] = '\0';
+   for (i = 0; ((i < AI_STATS_LATENCY_BUCKETS) && (len < size)); i += 1) {
+      int n = snprintf(&(buf[len]), size - len, "%s%lu", (i > 0) ? sep : "", stats->latency[i]);
+      if (n < 0) {
+         break;
+      }
+      len += n;
    }
-   return (ret);
 }
 
-/*!
- * \brief Hangup (and possibly destroy) the channel
- *
- * \note The channel is locked when this function gets called.
- */
-static int alsa_input_chan_hangup(struct ast_channel *ast)
+/*
+ Sends the manager event AlsaInputStats with the statistics of a line, when
+ a call ends on the line
+*/
+static void alsa_input_stats_manager_event(const alsa_input_pvt_t *pvt,
+   const char *channel_name)
 {
-   alsa_input_pvt_t *pvt = alsa_input_ast_channel_tech_pvt(ast);
+   alsa_input_stats_t stats;
+   unsigned long recovered = alsa_input_stats_get(pvt, &(stats));
+   char capture_delay[64];
+   char playback_delay[64];
+   char latency[AI_STATS_LATENCY_BUCKETS * 24];
+
+   alsa_input_stats_delay_format(pvt, &(stats.capture_delay), capture_delay, sizeof(capture_delay));
+   alsa_input_stats_delay_format(pvt, &(stats.playback_delay), playback_delay, sizeof(playback_delay));
+   alsa_input_stats_latency_format(&(stats), ",", latency, sizeof(latency));
+   manager_event(EVENT_FLAG_REPORTING, "AlsaInputStats",
+      "Channel: %s\r\n"
+      "Line: %lu\r\n"
+      "CaptureFrames: %lu\r\n"
+      "CaptureDropped: %lu\r\n"
+      "CaptureQueueMax: %lu\r\n"
+      "CaptureXruns: %lu\r\n"
+      "CaptureDelay: %s\r\n"
+      "PlaybackFrames: %lu\r\n"
+      "PlaybackDropped: %lu\r\n"
+      "PlaybackXruns: %lu\r\n"
+      "PlaybackConcealed: %lu\r\n"
+      "PlaybackDelay: %s\r\n"
+      "ErrorsRecovered: %lu\r\n"
+      "QueueFailures: %lu\r\n"
+      "LatencyFirstBound: %d\r\n"
+      "Latency: %s\r\n",
+      channel_name, (unsigned long)(pvt->index_line + 1),
+      stats.capture_frames, stats.capture_dropped, stats.capture_queue_max,
+      stats.capture_xruns, capture_delay,
+      stats.playback_frames, stats.playback_dropped, stats.playback_xruns,
+      stats.concealed, playback_delay,
+      recovered, stats.queue_failures,
+      AI_STATS_LATENCY_FIRST_MS, latency);
+}
 
-   alsa_input_pr_debug("alsa_input_chan_hangup(ast='%s')\n", alsa_input_ast_channel_name(ast));
+/* Must be called with pvt->owner locked */
+static inline void alsa_input_reset_pvt_monitor_state(alsa_input_pvt_t *pvt)
+{
+   alsa_input_pr_debug("alsa_input_reset_pvt_monitor_state()\n");
 
-   if ((NULL == pvt) || (pvt->owner != ast)) {
-      alsa_input_pr_debug("Channel '%s' unlink or link to another line\n", alsa_input_ast_channel_name(ast));
-      if ((NULL != pvt) && (NULL == pvt->owner)) {
-         alsa_input_ast_channel_tech_pvt_set(ast, NULL);
-      }
-   }
-   else {
-#ifdef DEBUG
-      pvt->owner_lock_count += 1;
-      alsa_input_assert(pvt->owner_lock_count > 0);
-#endif /* DEBUG */
-      /*
-       Here the channel is locked and we get the monitor lock.
-       In the monitor we get the monitor lock and then only TRY to lock the channel
-       IMHO no deadlock can occur
-      */
-      alsa_input_monitor_lock(pvt->channel);
-      alsa_input_unlink_from_ast_channel(pvt, AI_EV_AST_HANGUP, false);
-      alsa_input_assert(NULL == pvt->owner);
-      alsa_input_monitor_unlock(pvt->channel);
-#ifdef DEBUG
-      alsa_input_assert(pvt->owner_lock_count > 0);
-      pvt->owner_lock_count -= 1;
-#endif /* DEBUG */
-   }
-   alsa_input_pr_debug("'%s' hung up\n", alsa_input_ast_channel_name(ast));
-   ast_setstate(ast, AST_STATE_DOWN);
+   alsa_input_assert((NULL == pvt->owner) || (pvt->owner_lock_count > 0));
 
-   return (0);
+   pvt->ast_channel.digits[0] = '\0';
+   pvt->ast_channel.digits_len = 0;
+   pvt->ast_channel.search_extension = false;
+   pvt->ast_channel.dtmf_sent = NONE;
 }
 
-static void alsa_input_close_devices(alsa_input_chan_t *t)
+/*
+ Sends the command AI_AUDIO_CMD_TONE to the audio thread : from now on and
+ until the audio thread acknowledges the command, alsa_input_chan_write()
+ can't queue voice.
+ Must be called with pvt->owner locked.
+*/
+static void alsa_input_audio_send_tone(alsa_input_pvt_t *pvt,
+   const alsa_input_tone_def_t *tone_def, size_t tone_duration_in_bytes,
+   bool drop_playback)
 {
-   alsa_input_pvt_t *pvt;
+   alsa_input_audio_cmd_t cmd;
+
+   memset(&(cmd), 0, sizeof(cmd));
+   cmd.kind = AI_AUDIO_CMD_TONE;
+   cmd.tone_def = tone_def;
+   cmd.tone_duration_in_bytes = tone_duration_in_bytes;
+   cmd.drop_playback = drop_playback;
+   pvt->ast_channel.playback_seq += 1;
+   cmd.playback_seq = pvt->ast_channel.playback_seq;
+   alsa_input_audio_send(pvt, &(cmd));
+}
 
-   alsa_input_assert(!AST_LIST_EMPTY(&(t->pvt_list)));
+/*
+ Must be called with pvt->owner locked
+*/
+static void alsa_input_turn_buzzer_on(alsa_input_pvt_t *pvt)
+{
+   alsa_input_pr_debug("alsa_input_turn_buzzer_on()\n");
 
-   /* We hangup all lines if they have an owner */
-   alsa_input_pr_debug("Freeing resources of the lines\n");
-   AST_LIST_TRAVERSE(&(t->pvt_list), pvt, list) {
-      if (NULL != pvt->ast_channel.snd_capture.card) {
-         alsa_input_snd_card_deinit(&(pvt->ast_channel.snd_capture));
-         pvt->monitor.fd_snd_capture = -1;
-      }
-      if (NULL != pvt->ast_channel.snd_playback.card) {
-         alsa_input_snd_card_deinit(&(pvt->ast_channel.snd_playback));
-      }
-      if (pvt->monitor.fd_pipe >= 0) {
-         close(pvt->monitor.fd_pipe);
-         pvt->monitor.fd_pipe = -1;
-      }
-      if (pvt->monitor.fd_input >= 0) {
-         close(pvt->monitor.fd_input);
-         pvt->monitor.fd_input = -1;
-      }
-      if (pvt->monitor.fd_output >= 0) {
-         close(pvt->monitor.fd_output);
-         pvt->monitor.fd_output = -1;
-      }
+   alsa_input_assert((NULL == pvt->owner) || (pvt->owner_lock_count > 0));
+
+   if (pvt->monitor.fd_output >= 0) {
+      struct input_event event;
+      event.type = EV_SND;
+      event.code = SND_BELL;
+      event.value = 1;
+      write(pvt->monitor.fd_output, &(event), sizeof(event));
    }
+   pvt->ast_channel.buzzer_is_on = true;
+   pvt->ast_channel.wait_start = alsa_input_clock_ms();
+   alsa_input_pr_debug("Line %lu should be ringing\n", (unsigned long)(pvt->index_line + 1));
 }
 
-static int alsa_input_open_devices(alsa_input_chan_t *t)
+/*
+ Must be called with pvt->owner locked
+*/
+static void alsa_input_turn_buzzer_off(alsa_input_pvt_t *pvt)
 {
-   int ret = AST_MODULE_LOAD_SUCCESS;
+   alsa_input_pr_debug("alsa_input_turn_buzzer_off()\n");
 
-   alsa_input_assert(!AST_LIST_EMPTY(&(t->pvt_list)));
+   alsa_input_assert((NULL == pvt->owner) || (pvt->owner_lock_count > 0));
 
-   do { /* Empty loop */
-      alsa_input_pvt_t *pvt;
+   if (pvt->monitor.fd_output >= 0) {
+      struct input_event event;
+      event.type = EV_SND;
+      event.code = SND_BELL;
+      event.value = 0;
+      write(pvt->monitor.fd_output, &(event), sizeof(event));
+   }
+   pvt->ast_channel.buzzer_is_on = false;
+   pvt->ast_channel.wait_start = alsa_input_clock_ms();
+   alsa_input_pr_debug("Line %lu should not ring anymore\n", (unsigned long)(pvt->index_line + 1));
+}
 
-      /* Finally init the state of the lines */
-      AST_LIST_TRAVERSE(&(t->pvt_list), pvt, list) {
-         if (alsa_input_snd_card_init(&(pvt->ast_channel.snd_capture),
-            pvt->line_cfg->snd_capture_dev_name, SND_PCM_STREAM_CAPTURE,
-            &(pvt->monitor.fd_snd_capture))) {
-            ast_log(AST_LOG_ERROR, "Problem opening ALSA capture device '%s'\n", pvt->line_cfg->snd_capture_dev_name);
-            ret = AST_MODULE_LOAD_FAILURE;
-            break;
-         }
+static void alsa_input_set_line_tone(alsa_input_pvt_t *pvt,
+   alsa_input_tone_t tone, size_t tone_duration);
 
-         if (alsa_input_snd_card_init(&(pvt->ast_channel.snd_playback),
-            pvt->line_cfg->snd_playback_dev_name, SND_PCM_STREAM_PLAYBACK,
-            NULL)) {
-            ast_log(AST_LOG_ERROR, "Problem opening ALSA playback device '%s'\n", pvt->line_cfg->snd_playback_dev_name);
-            ret = AST_MODULE_LOAD_FAILURE;
-            break;
-         }
+/* Must be called with pvt->owner locked */
+static void alsa_input_set_new_state(alsa_input_pvt_t *pvt,
+   alsa_input_state_t new_state, alsa_input_event_t cause)
+{
+   alsa_input_pr_debug("alsa_input_set_new_state(new_state=%d, cause=%d)\n",
+      (int)(new_state), (int)(cause));
 
-         if ('\0' != pvt->line_cfg->ev_in_dev_name[0]) {
-            pvt->monitor.fd_input = open(pvt->line_cfg->ev_in_dev_name, O_RDONLY | O_NONBLOCK);
-            if (pvt->monitor.fd_input < 0) {
-               ast_log(AST_LOG_ERROR, "Problem opening input event device '%s' ('%s')\n",
-                  pvt->line_cfg->ev_in_dev_name, strerror(errno));
-               ret = AST_MODULE_LOAD_FAILURE;
-               break;
-            }
-         }
-         else {
-            int fds[2];
-            if (pipe2(fds, O_CLOEXEC | O_DIRECT | O_NONBLOCK)) {
-               ast_log(AST_LOG_ERROR, "Problem opening pipe to send and receive console events\n");
-               ret = AST_MODULE_LOAD_FAILURE;
-               break;
-            }
-            else {
-               pvt->monitor.fd_input = fds[0];
-               pvt->monitor.fd_pipe = fds[1];
-            }
-         }
+   alsa_input_assert((NULL == pvt->owner) || (pvt->owner_lock_count > 0));
 
-         if ('\0' != pvt->line_cfg->ev_out_dev_name[0]) {
-            pvt->monitor.fd_output = open(pvt->line_cfg->ev_out_dev_name, O_WRONLY | O_NONBLOCK);
-            if (pvt->monitor.fd_output < 0) {
-               ast_log(AST_LOG_ERROR, "Problem opening output event device '%s' ('%s')\n",
-                  pvt->line_cfg->ev_out_dev_name, strerror(errno));
-               ret = AST_MODULE_LOAD_FAILURE;
-               break;
-            }
+   if (new_state != pvt->ast_channel.state) {
+      if (((AI_ST_OFF_TALKING == new_state)
+           || (AI_ST_OFF_WAITING_ANSWER == new_state))
+          && (AI_ST_OFF_TALKING != pvt->ast_channel.state)
+          && (AI_ST_OFF_WAITING_ANSWER != pvt->ast_channel.state)) {
+         /*
+          Start capture if not muted, playback will be started the
+          next call of alsa_input_chan_write() */
+         pvt->ast_channel.snd_capture_muted = false;
+         alsa_input_audio_drain_frames(pvt);
+         alsa_input_audio_send_simple(pvt, AI_AUDIO_CMD_CAPTURE_START);
+      }
+      else if (AI_ST_ON_RINGING == new_state) {
+         alsa_input_turn_buzzer_on(pvt);
+      }
+      if (((AI_ST_OFF_TALKING == pvt->ast_channel.state)
+           || (AI_ST_OFF_WAITING_ANSWER == pvt->ast_channel.state))
+          && (AI_ST_OFF_TALKING != new_state)
+          && (AI_ST_OFF_WAITING_ANSWER != new_state)) {
+         /* Stop capture and playback */
+         pvt->ast_channel.snd_capture_muted = true;
+         alsa_input_audio_send_simple(pvt, AI_AUDIO_CMD_CAPTURE_STOP);
+         alsa_input_audio_drain_frames(pvt);
+         if (AI_TONE_NONE == pvt->ast_channel.tone) {
+            alsa_input_audio_send_tone(pvt, NULL, 0, true);
          }
       }
-   } while (0);
-
-   if (AST_MODULE_LOAD_SUCCESS != ret) {
-      alsa_input_close_devices(t);
-   }
-
-   return (ret);
-}
-
-static void alsa_input_hangup_all_lines(alsa_input_chan_t *t, bool monitor_is_really_stopped)
-{
-   alsa_input_pvt_t *pvt;
-
-   /* We hangup all lines if they have an owner */
-   alsa_input_pr_debug("Hanging up all the lines\n");
-   alsa_input_assert(!t->monitor.run);
-   alsa_input_monitor_lock(t);
-   AST_LIST_TRAVERSE(&(t->pvt_list), pvt, list) {
-      struct ast_channel *ast = pvt->owner;
-      if (NULL != ast) {
-         if (!monitor_is_really_stopped) {
-            if (ast_channel_trylock(ast)) {
-               continue;
-            }
+      else if (AI_ST_ON_RINGING == pvt->ast_channel.state) {
+         alsa_input_turn_buzzer_off(pvt);
+      }
+      if (pvt->line_cfg->dtmf_detect) {
+         if (AI_ST_OFF_DIALING == new_state) {
+            /* Digits dialed are detected in the captured samples */
+            alsa_input_audio_send_simple(pvt, AI_AUDIO_CMD_DETECT_START);
          }
-         else {
-            ast_channel_lock(ast);
+         else if ((AI_ST_OFF_DIALING == pvt->ast_channel.state)
+                  && (AI_ST_OFF_TALKING != new_state)
+                  && (AI_ST_OFF_WAITING_ANSWER != new_state)) {
+            alsa_input_audio_send_simple(pvt, AI_AUDIO_CMD_CAPTURE_STOP);
          }
-#ifdef DEBUG
-         alsa_input_assert(0 == pvt->owner_lock_count);
-         pvt->owner_lock_count += 1;
-#endif /* DEBUG */
-         alsa_input_queue_hangup(pvt, AI_EV_AST_HANGUP);
-         /* ast_channel_unlock(ast) is done in alsa_input_queue_hangup() */
-         alsa_input_assert((NULL == pvt->owner) && (0 == pvt->owner_lock_count));
       }
    }
-   alsa_input_monitor_unlock(t);
-}
-
-static alsa_input_pvt_t *alsa_input_add_pvt(alsa_input_chan_t *t, size_t index_line)
-{
-   /* Make a alsa_input_pvt_t structure for this interface */
-   alsa_input_pvt_t *tmp;
-
-   alsa_input_assert((NULL != t) && (!t->monitor.run) && (AST_PTHREADT_NULL == t->monitor.thread));
 
-   alsa_input_monitor_lock(t);
-   do { /* Empty loop */
-      tmp = ast_calloc(1, sizeof(*tmp));
-      if (NULL == tmp) {
-         ast_log(AST_LOG_ERROR, "Unable to allocate memory for line\n");
+   switch (new_state) {
+      case AI_ST_DISCONNECTED: {
+         alsa_input_assert((AI_STATUS_DISCONNECTED == pvt->ast_channel.status)
+            && (NULL == pvt->owner));
+         alsa_input_assert(AI_EV_DISCONNECTED == cause);
+         alsa_input_set_line_tone(pvt, AI_TONE_NONE, 0);
+         alsa_input_reset_pvt_monitor_state(pvt);
+         pvt->ast_channel.snd_capture_muted = true;
+         alsa_input_audio_drain_frames(pvt);
          break;
       }
+      case AI_ST_ON_IDLE: {
+         alsa_input_assert((AI_STATUS_ON_HOOK == pvt->ast_channel.status)
+            && (NULL == pvt->owner));
+         alsa_input_assert((AI_EV_AST_HANGUP == cause)
+            || (AI_EV_INTERNAL_ERROR == cause)
+            || (AI_EV_ON_HOOK == cause));
+         alsa_input_set_line_tone(pvt, AI_TONE_NONE, 0);
+         alsa_input_reset_pvt_monitor_state(pvt);
+         pvt->ast_channel.snd_capture_muted = true;
+         alsa_input_audio_drain_frames(pvt);
+         break;
+      }
+      case AI_ST_ON_PRE_RINGING: {
+         alsa_input_assert((AI_STATUS_ON_HOOK == pvt->ast_channel.status)
+            && (NULL != pvt->owner));
+         alsa_input_assert((AI_ST_ON_IDLE == pvt->ast_channel.state)
+            && (AI_EV_AST_REQUEST == cause));
+         break;
+      }
+      case AI_ST_ON_RINGING: {
+         alsa_input_assert((AI_STATUS_ON_HOOK == pvt->ast_channel.status)
+            && (NULL != pvt->owner));
+         alsa_input_assert((AI_ST_ON_PRE_RINGING == pvt->ast_channel.state)
+            && (AI_EV_AST_CALL == cause));
+         break;
+      }
+      case AI_ST_OFF_DIALING: {
+         alsa_input_assert((AI_STATUS_OFF_HOOK == pvt->ast_channel.status)
+            && (NULL == pvt->owner) && (pvt->line_cfg->monitor_dialing));
+         alsa_input_assert((AI_ST_ON_IDLE == pvt->ast_channel.state)
+            && (AI_EV_OFF_HOOK == cause));
+         alsa_input_set_line_tone(pvt, AI_TONE_WAITING_DIAL, 0);
+         alsa_input_reset_pvt_monitor_state(pvt);
+         /*
+          We start searching alsa_input_default_extension ('s') after
+          pvt->line_cfg->dialing_timeout_1st_digit milliseconds
+         */
+         pvt->ast_channel.search_extension = true;
+         pvt->ast_channel.wait_start = alsa_input_clock_ms();
+         break;
+      }
+      case AI_ST_OFF_WAITING_ANSWER: {
+         alsa_input_assert((AI_STATUS_OFF_HOOK == pvt->ast_channel.status)
+            && (NULL != pvt->owner));
+         alsa_input_assert(((AI_ST_ON_IDLE == pvt->ast_channel.state)
+            && (AI_EV_OFF_HOOK == cause) && (!pvt->line_cfg->monitor_dialing))
+                    || ((AI_ST_OFF_DIALING == pvt->ast_channel.state)
+            && (AI_EV_EXT_FOUND == cause)));
+         alsa_input_set_line_tone(pvt, AI_TONE_NONE, 0);
+         /*
+          We forget all digits dialed
+         */
+         alsa_input_reset_pvt_monitor_state(pvt);
+         break;
+      }
+      case AI_ST_OFF_TALKING: {
+         alsa_input_assert((AI_STATUS_OFF_HOOK == pvt->ast_channel.status)
+            && (NULL != pvt->owner));
+         alsa_input_assert(((AI_ST_ON_RINGING == pvt->ast_channel.state)
+            && (AI_EV_OFF_HOOK == cause))
+                    || ((AI_ST_OFF_WAITING_ANSWER == pvt->ast_channel.state)
+            && (AI_EV_AST_ANSWER == cause)));
+         alsa_input_set_line_tone(pvt, AI_TONE_NONE, 0);
+         break;
+      }
+      case AI_ST_OFF_NO_SERVICE: {
+         alsa_input_assert((AI_STATUS_OFF_HOOK == pvt->ast_channel.status)
+            && (NULL == pvt->owner));
+         alsa_input_assert(((AI_ST_OFF_DIALING == pvt->ast_channel.state) && (AI_EV_NO_EXT_CAN_BE_FOUND == cause))
+            || (AI_EV_AST_HANGUP == cause)
+            || (AI_EV_INTERNAL_ERROR == cause));
+         if (AI_EV_AST_HANGUP == cause) {
+            alsa_input_set_line_tone(pvt, AI_TONE_BUSY, 0);
+         }
+         else {
+            alsa_input_set_line_tone(pvt, AI_TONE_INVALID, 0);
+         }
+         alsa_input_reset_pvt_monitor_state(pvt);
+         pvt->ast_channel.snd_capture_muted = true;
+         alsa_input_audio_drain_frames(pvt);
+         /*
+          Store time this state was entered to hook on the phone after
+          DELAY_AUTO_HOOK_ON
+         */
+         pvt->ast_channel.wait_start = alsa_input_clock_ms();
+         break;
+      }
+   }
+   if (new_state != pvt->ast_channel.state) {
+      pvt->ast_channel.state = new_state;
+      /*
+       State can be changed by a thread other than the monitor, so we
+       ask the monitor to take care of the line
+      */
+      alsa_input_monitor_kick(pvt);
+   }
+}
 
-      memset(tmp, 0, sizeof(*tmp));
-
-      tmp->channel = t;
-      tmp->index_line = index_line;
-      tmp->line_cfg = &(t->config.line_cfgs[index_line]);
-      tmp->owner = NULL;
-#ifdef DEBUG
-      tmp->owner_lock_count = 0;
-#endif /* DEBUG */
-      tmp->monitor.fd_snd_capture = -1;
-      tmp->monitor.fd_input = -1;
-      tmp->monitor.fd_output = -1;
-      tmp->monitor.fd_pipe = -1;
-      tmp->monitor.events_len_in_bytes = 0;
-      alsa_input_reset_pvt_monitor_state(tmp);
-      tmp->ast_channel.snd_capture.card = NULL;
-      tmp->ast_channel.snd_playback.card = NULL;
-      tmp->ast_channel.status = AI_STATUS_ON_HOOK;
-      tmp->ast_channel.snd_capture_muted = true;
-      tmp->ast_channel.tone = AI_TONE_NONE;
-      tmp->ast_channel.tone_duration_in_bytes = 0;
-      tmp->ast_channel.tone_bytes_generated = 0;
-      tmp->ast_channel.state = AI_ST_ON_IDLE;
-      alsa_input_reset_buf_fr_to_queue(tmp);
-      alsa_input_reset_buf_bytes_not_written(tmp);
-      tmp->monitor.last_known_state = tmp->ast_channel.state;
-      tmp->monitor.last_known_snd_capture_muted = tmp->ast_channel.snd_capture_muted;
-      AST_LIST_INSERT_TAIL(&(t->pvt_list), tmp, list);
-   } while (false);
-   alsa_input_monitor_unlock(t);
-
-   return (tmp);
+/* Must be called with pvt->owner and monitor.lock locked */
+static void alsa_input_unlink_from_ast_channel(alsa_input_pvt_t *pvt,
+   alsa_input_event_t cause, bool unlock_ast_channel)
+{
+   struct ast_channel *ast = pvt->owner;
+
+   alsa_input_pr_debug("alsa_input_unlink_from_ast_channel(cause=%d)\n",
+      (int)(cause));
+
+   alsa_input_assert((pvt->channel->monitor.lock_count > 0)
+      && (NULL != pvt->owner) && (pvt->owner_lock_count > 0));
+   /* Asterisk must no longer wait for our frames */
+   ast_channel_set_fd(ast, 0, -1);
+   alsa_input_ast_channel_tech_pvt_set(ast, NULL);
+   pvt->owner = NULL;
+   ast_setstate(ast, AST_STATE_DOWN);
+   /* Set state before unlocking the channel */
+   if (AI_STATUS_OFF_HOOK == pvt->ast_channel.status) {
+      alsa_input_set_new_state(pvt, AI_ST_OFF_NO_SERVICE, cause);
+   }
+   else if (AI_STATUS_ON_HOOK == pvt->ast_channel.status) {
+      alsa_input_set_new_state(pvt, AI_ST_ON_IDLE, cause);
+   }
+   else {
+      alsa_input_assert(AI_STATUS_DISCONNECTED == pvt->ast_channel.status);
+      alsa_input_set_new_state(pvt, AI_ST_DISCONNECTED, AI_EV_DISCONNECTED);
+   }
+   alsa_input_pr_debug("Line %lu unlink from channel '%s'.\n",
+      (unsigned long)(pvt->index_line + 1), alsa_input_ast_channel_name(ast));
+   ast_module_unref(ast_module_info->self);
+   if (unlock_ast_channel) {
+#ifdef DEBUG
+      alsa_input_assert(pvt->owner_lock_count > 0);
+      pvt->owner_lock_count -= 1;
+#endif /* DEBUG */
+      ast_channel_unlock(ast);
+   }
 }
 
-static struct ast_channel *alsa_input_chan_request(const char *type,
-#if (AST_VERSION < 110)
-   format_t cap,
-#else /* (AST_VERSION >= 110) */
-   alsa_input_ast_format_cap *cap,
-#endif /* (AST_VERSION >= 110)*/
-#if (AST_VERSION > 110)
-   const struct ast_assigned_ids *assigned_ids,
-#endif /* (AST_VERSION > 110) */
-   const struct ast_channel *requestor,
-#if (AST_VERSION < 110)
-   void *addr,
-#else /* (AST_VERSION >= 110) */
-   const char *addr,
-#endif /* (AST_VERSION >= 110)*/
-   int *cause);
+/*
+ Must be called with pvt->owner and monitor.lock locked.
+ When exiting pvt->owner has been unlocked, pvt->owner is set to NULL.
+*/
+static void alsa_input_queue_hangup(alsa_input_pvt_t *pvt,
+   alsa_input_event_t cause)
+{
+   struct ast_channel *ast = pvt->owner;
 
-static alsa_input_chan_t alsa_input_chan = {
-   .chan_tech = {
-      .type = alsa_input_chan_type,
-      .description = alsa_input_chan_desc,
-      .requester = alsa_input_chan_request,
-      .send_digit_begin = alsa_input_chan_digit_begin,
-      .send_digit_end = alsa_input_chan_digit_end,
-      .call = alsa_input_chan_call,
-      .hangup = alsa_input_chan_hangup,
-      .answer = alsa_input_chan_answer,
-      .read = alsa_input_chan_read,
-      .write = alsa_input_chan_write,
-      .indicate = alsa_input_chan_indicate,
-      .fixup = alsa_input_chan_fixup
-   },
-   .channel_registered = false,
-};
+   alsa_input_pr_debug("alsa_input_queue_hangup(cause=%d)\n", (int)(cause));
 
-/*!
- * \brief Requester - to set up call data structures (pvt's)
- *
- * \param type type of channel to request
- * \param cap Format capabilities for requested channel
- * \param requestor channel asking for data
- * \param addr destination of the call
- * \param cause Cause of failure
- *
- * \details
- * Request a channel of a given type, with addr as optional information used
- * by the low level module
- *
- * \retval NULL failure
- * \retval non-NULL channel on success
- */
-static struct ast_channel *alsa_input_chan_request(const char *type,
-#if (AST_VERSION < 110)
-   format_t cap,
-#else /* (AST_VERSION >= 110) */
-   alsa_input_ast_format_cap *cap,
-#endif /* (AST_VERSION >= 110)*/
-#if (AST_VERSION > 110)
-   const struct ast_assigned_ids *assigned_ids,
-#endif /* (AST_VERSION > 110) */
-   const struct ast_channel *requestor,
-#if (AST_VERSION < 110)
-   void *_addr,
-#else /* (AST_VERSION >= 110) */
-   const char *addr,
-#endif /* (AST_VERSION >= 110)*/
-   int *cause)
+   alsa_input_assert((pvt->channel->monitor.lock_count > 0)
+      && (NULL != pvt->owner) && (pvt->owner_lock_count > 0));
+
+   alsa_input_unlink_from_ast_channel(pvt, cause, true);
+   alsa_input_assert(NULL == pvt->owner);
+   if (ast_queue_hangup(ast)) {
+      ast_log(AST_LOG_WARNING, "Unable to queue hangup on line '%s'\n", alsa_input_ast_channel_name(ast));
+      __atomic_add_fetch(&(pvt->stats.queue_failures), 1, __ATOMIC_RELAXED);
+   }
+}
+
+/*
+ Must be called with pvt->owner and monitor.lock locked
+*/
+static void alsa_input_disconnect_line(alsa_input_pvt_t *pvt)
 {
-   struct ast_channel *ret = NULL;
-   alsa_input_chan_t *t = &(alsa_input_chan);
-   alsa_input_pvt_t *pvt;
-#if (AST_VERSION < 110)
-   const char *addr = _addr;
-#endif /* (AST_VERSION < 110) */
+   alsa_input_pr_debug("alsa_input_disconnect_line()\n");
 
-   alsa_input_pr_debug("alsa_input_chan_request(type='%s', addr='%s')\n", type, addr);
+   alsa_input_assert((pvt->channel->monitor.lock_count > 0)
+      && ((NULL == pvt->owner) || (pvt->owner_lock_count > 0))
+      && (AI_STATUS_DISCONNECTED == pvt->ast_channel.status));
 
-   if (ast_strlen_zero(addr)) {
-      ast_log(AST_LOG_WARNING, "Unable to create channel with empty destination.\n");
-      *cause = AST_CAUSE_CHANNEL_UNACCEPTABLE;
+   if (NULL != pvt->owner) {
+      alsa_input_queue_hangup(pvt, AI_EV_DISCONNECTED);
+      alsa_input_assert(NULL == pvt->owner);
    }
    else {
-      /* Search for an unowned channel */
-      alsa_input_monitor_lock(t);
-      *cause = AST_CAUSE_CHANNEL_UNACCEPTABLE;
-      AST_LIST_TRAVERSE(&(t->pvt_list), pvt, list) {
-         char tmp[16];
-         size_t length;
-         sprintf(tmp, "%lu", (unsigned long)(pvt->index_line + 1));
-         length = strlen(tmp);
-         if ((0 == strncmp(addr, tmp, length)) && (!isalnum(addr[length]))) {
-#if (AST_VERSION < 110)
-            if (alsa_input_ast_format_cap_iscompatible_cap(&(cap), alsa_input_get_chan_tech_cap(&(pvt->channel->chan_tech)))) {
-#else /* (AST_VERSION >= 110) */
-            if (alsa_input_ast_format_cap_iscompatible_cap(cap, alsa_input_get_chan_tech_cap(&(pvt->channel->chan_tech)))) {
-#endif /* (AST_VERSION >= 110)*/
-               if ((NULL == pvt->owner) && (AI_STATUS_ON_HOOK == pvt->ast_channel.status)) {
-                  alsa_input_assert(AI_ST_ON_IDLE == pvt->ast_channel.state);
-                  alsa_input_new(pvt, AI_ST_ON_PRE_RINGING, AI_EV_AST_REQUEST,
+      alsa_input_set_new_state(pvt, AI_ST_DISCONNECTED, AI_EV_DISCONNECTED);
+   }
+   pvt->monitor.last_known_state = pvt->ast_channel.state;
+   /* Closes sound devices : they are owned by the audio thread */
+   alsa_input_audio_send_close(pvt);
+   if (pvt->monitor.fd_pipe >= 0) {
+      close(pvt->monitor.fd_pipe);
+      pvt->monitor.fd_pipe = -1;
+   }
+   if (pvt->monitor.fd_input >= 0) {
+      alsa_input_monitor_unregister_fd(pvt->channel, pvt->monitor.fd_input);
+      close(pvt->monitor.fd_input);
+      pvt->monitor.fd_input = -1;
+      alsa_input_assert(pvt->channel->monitor.lines_connected > 0);
+      pvt->channel->monitor.lines_connected -= 1;
+   }
+   pvt->monitor.revents_input = 0;
+   if (pvt->monitor.fd_output >= 0) {
+      close(pvt->monitor.fd_output);
+      pvt->monitor.fd_output = -1;
+   }
+}
+
+/*
+ Must be called with pvt->owner locked
+*/
+static void alsa_input_critical_error(alsa_input_pvt_t *pvt,
+   bool monitor_is_locked)
+{
+   alsa_input_pr_debug("alsa_input_critical_error()\n");
+   alsa_input_assert((NULL == pvt->owner) || (pvt->owner_lock_count > 0));
+   ast_log(AST_LOG_ERROR, "Line %lu : critical error dectected, so line is disconnected\n", (unsigned long)(pvt->index_line + 1));
+   pvt->ast_channel.status = AI_STATUS_DISCONNECTED;
+   if (monitor_is_locked) {
+      alsa_input_disconnect_line(pvt);
+   }
+   else {
+      if (NULL != pvt->owner) {
+         ast_hangup(pvt->owner);
+      }
+   }
+}
+
+/* Must be called with pvt->owner locked */
+static void alsa_input_set_line_tone(alsa_input_pvt_t *pvt,
+   alsa_input_tone_t tone, size_t tone_duration)
+{
+   const alsa_input_tone_def_t *tone_def = NULL;
+
+   alsa_input_pr_debug("alsa_input_set_line_tone(tone=%d, tone_duration=%lu)\n",
+      (int)(tone), (long)(tone_duration));
+
+   alsa_input_assert((NULL == pvt->owner) || (pvt->owner_lock_count > 0));
+
+   switch (tone) {
+      case AI_TONE_NONE: {
+         tone_duration = 0;
+         break;
+      }
+      case AI_TONE_WAITING_DIAL: {
+         tone_def = &(pvt->line_cfg->tones->dial[pvt->rate]);
+         break;
+      }
+      case AI_TONE_INVALID: {
+         tone_def = &(pvt->line_cfg->tones->invalid[pvt->rate]);
+         break;
+      }
+      case AI_TONE_BUSY: {
+         tone_def = &(pvt->line_cfg->tones->busy[pvt->rate]);
+         break;
+      }
+      case AI_TONE_DTMF_0: {
+         tone_def = &(alsa_input_tone_dtmf_0[pvt->rate]);
+         break;
+      }
+      case AI_TONE_DTMF_1: {
+         tone_def = &(alsa_input_tone_dtmf_1[pvt->rate]);
+         break;
+      }
+      case AI_TONE_DTMF_2: {
+         tone_def = &(alsa_input_tone_dtmf_2[pvt->rate]);
+         break;
+      }
+      case AI_TONE_DTMF_3: {
+         tone_def = &(alsa_input_tone_dtmf_3[pvt->rate]);
+         break;
+      }
+      case AI_TONE_DTMF_4: {
+         tone_def = &(alsa_input_tone_dtmf_4[pvt->rate]);
+         break;
+      }
+      case AI_TONE_DTMF_5: {
+         tone_def = &(alsa_input_tone_dtmf_5[pvt->rate]);
+         break;
+      }
+      case AI_TONE_DTMF_6: {
+         tone_def = &(alsa_input_tone_dtmf_6[pvt->rate]);
+         break;
+      }
+      case AI_TONE_DTMF_7: {
+         tone_def = &(alsa_input_tone_dtmf_7[pvt->rate]);
+         break;
+      }
+      case AI_TONE_DTMF_8: {
+         tone_def = &(alsa_input_tone_dtmf_8[pvt->rate]);
+         break;
+      }
+      case AI_TONE_DTMF_9: {
+         tone_def = &(alsa_input_tone_dtmf_9[pvt->rate]);
+         break;
+      }
+      case AI_TONE_DTMF_ASTER: {
+         tone_def = &(alsa_input_tone_dtmf_aster[pvt->rate]);
+         break;
+      }
+      case AI_TONE_DTMF_POUND: {
+         tone_def = &(alsa_input_tone_dtmf_pound[pvt->rate]);
+         break;
+      }
+      case AI_TONE_DTMF_A: {
+         tone_def = &(alsa_input_tone_dtmf_A[pvt->rate]);
+         break;
+      }
+      case AI_TONE_DTMF_B: {
+         tone_def = &(alsa_input_tone_dtmf_B[pvt->rate]);
+         break;
+      }
+      case AI_TONE_DTMF_C: {
+         tone_def = &(alsa_input_tone_dtmf_C[pvt->rate]);
+         break;
+      }
+      case AI_TONE_DTMF_D: {
+         tone_def = &(alsa_input_tone_dtmf_D[pvt->rate]);
+         break;
+      }
+      default: {
+         alsa_input_assert(false);
+         tone = AI_TONE_NONE;
+         break;
+      }
+   }
+   pvt->ast_channel.tone = tone;
+   /*
+    The audio thread plays the tone. When not in conversation, stopping the
+    tone also stops the playback device
+   */
+   alsa_input_audio_send_tone(pvt, tone_def, tone_duration * alsa_input_rate_samples_per_ms(pvt->rate) * SAMPLE_SIZE,
+      (AI_TONE_NONE == tone)
+      && (AI_ST_OFF_TALKING != pvt->ast_channel.state)
+      && (AI_ST_OFF_WAITING_ANSWER != pvt->ast_channel.state));
+}
+
+/* Must be called with monitor.lock locked */
+static void alsa_input_new(alsa_input_pvt_t *pvt,
+   alsa_input_state_t state, alsa_input_event_t cause,
 #if (AST_VERSION <= 110)
-                     ((NULL != requestor) ? alsa_input_ast_channel_linkedid(requestor) : NULL),
+   const char *linkedid,
 #else /* (AST_VERSION > 110) */
-                     assigned_ids, requestor,
+   const struct ast_assigned_ids *assigned_ids,
+   const struct ast_channel *requestor,
 #endif /* (AST_VERSION > 110) */
-                     NULL);
-                  ret = pvt->owner;
-               }
-               else {
-                  alsa_input_pr_debug("Channel is busy\n");
-                  *cause = AST_CAUSE_BUSY;
+   bool *try_to_lock_ast_channel)
+{
+   enum ast_channel_state ast_state;
+   struct ast_channel *tmp = NULL;
+
+   alsa_input_pr_debug("alsa_input_new(state=%d, cause=%d)\n",
+      (int)(state), (int)(cause));
+
+   alsa_input_assert((pvt->channel->monitor.lock_count > 0)
+                     && (NULL == pvt->owner));
+
+   switch (state) {
+      case AI_ST_OFF_WAITING_ANSWER: {
+         /*
+          We don't set AST_STATE_UP right now, because it makes Asterisk
+          believe that the call is already answered : in function
+          ast_channel_alloc(), Asterisk call ast_cdr_init() and test if state
+          is AST_STATE_UP to pass AST_CDR_ANSWERED or AST_CDR_NOANSWER
+         */
+         ast_state = AST_STATE_RING;
+         alsa_input_assert((cause == AI_EV_OFF_HOOK) || (cause == AI_EV_EXT_FOUND));
+         break;
+      }
+      case AI_ST_ON_PRE_RINGING: {
+         ast_state = AST_STATE_DOWN;
+         alsa_input_assert(cause == AI_EV_AST_REQUEST);
+         break;
+      }
+      default: {
+         alsa_input_assert(false);
+         ast_state = AST_STATE_DOWN;
+         break;
+      }
+   }
+   alsa_input_assert(pvt->ast_channel.digits_len < ARRAY_LEN(pvt->ast_channel.digits));
+   if (pvt->ast_channel.digits_len <= 0) {
+      alsa_input_assert(ARRAY_LEN(alsa_input_default_extension) <= ARRAY_LEN(pvt->ast_channel.digits));
+      strcpy(pvt->ast_channel.digits, alsa_input_default_extension);
+   }
+   else {
+      pvt->ast_channel.digits[pvt->ast_channel.digits_len] = '\0';
+   }
+   /*
+    The file descriptor we provide to poll (for ast_waitfor()) only signals
+    the voice frames captured : as DTMFs and control frames are queued with
+    ast_queue_frame(), it's important to set parameter needqueue to true.
+    That way if Asterisk can't create a timer (eg because there's no timing
+    interfaces) it will at least create an "alert" pipe whose read end is polled
+    in ast_waitfor() and whose write end is written each time we queue a frame
+    (in ast_queue_frame()). read end of the pipe is read in ast_read().
+    If Asterisk can create a timer and if its name is "timerfd", it will not
+    create the "alert" pipe.
+    Asterisk uses the timer by setting it in continuous mode in
+    ast_queue_frame() and unsetting from continuous mode in ast_read()
+    The file descriptor provided by the timer is used in ast_waitfor().
+   */
+   tmp = ast_channel_alloc(1, ast_state,
+      ('\0' != pvt->line_cfg->cid_num[0]) ? pvt->line_cfg->cid_num : NULL,
+      ('\0' != pvt->line_cfg->cid_name[0]) ? pvt->line_cfg->cid_name : NULL,
+      "" /* acctcode */, pvt->ast_channel.digits, pvt->line_cfg->context,
+#if (AST_VERSION <= 110)
+      linkedid, 0,
+#else /* (AST_VERSION > 110) */
+      assigned_ids, requestor, AST_AMA_NONE,
+#endif /* (AST_VERSION > 110) */
+      "%s/%lu", pvt->channel->chan_tech.type, (unsigned long)(pvt->index_line + 1));
+   if (NULL != tmp) {
+      bool hangup = false;
+
+      /* From version 12.0, ast_channel_alloc() returned an ast_channel locked */
+#if (AST_VERSION <= 110)
+      /*
+       We can safely lock channel (without fear of a deadlock because
+       monitor.lock is locked), for 2 reasons :
+       - channel_tech is not set
+       - pvt->owner is still NULL
+      */
+      ast_channel_lock(tmp);
+#endif /* (AST_VERSION <= 110) */
+#ifdef DEBUG
+      pvt->owner_lock_count += 1;
+      alsa_input_assert(pvt->owner_lock_count > 0);
+#endif /* DEBUG */
+
+      alsa_input_ast_channel_tech_set(tmp, &(pvt->channel->chan_tech));
+
+      /*
+       Only the rate of the sound devices is offered : Asterisk translates
+       (or not, if the peer supports it) to the format of the peer
+      */
+      alsa_input_ast_channel_nativeformats_set(tmp, pvt->cap);
+      /* Asterisk calls alsa_input_chan_read() when a frame has been captured */
+      ast_channel_set_fd(tmp, 0, pvt->audio.fd_frames);
+      alsa_input_ast_channel_set_rawreadformat(tmp, pvt->format);
+      alsa_input_ast_channel_set_rawwriteformat(tmp, pvt->format);
+      alsa_input_ast_channel_set_readformat(tmp, pvt->format);
+      alsa_input_ast_channel_set_writeformat(tmp, pvt->format);
+      /* no need to call ast_setstate: the channel_alloc already did its job */
+      alsa_input_ast_channel_exten_set(tmp, pvt->ast_channel.digits);
+      if (!ast_strlen_zero(pvt->channel->config.language)) {
+         alsa_input_ast_channel_language_set(tmp, pvt->channel->config.language);
+      }
+      if (AST_STATE_RING == ast_state) {
+         alsa_input_ast_channel_rings_set(tmp, 1);
+      }
+      /* Don't use ast_set_callerid() here because it will
+       * generate a NewCallerID event before the NewChannel event */
+      if (!ast_strlen_zero(pvt->line_cfg->cid_num)) {
+         alsa_input_ast_channel_caller(tmp)->ani.number.valid = 1;
+         ast_free(alsa_input_ast_channel_caller(tmp)->ani.number.str);
+         alsa_input_ast_channel_caller(tmp)->ani.number.str = ast_strdup(pvt->line_cfg->cid_num);
+      }
+      ast_jb_configure(tmp, &(pvt->line_cfg->jb_conf));
+
+      alsa_input_ast_channel_tech_pvt_set(tmp, pvt);
+      ast_module_ref(ast_module_info->self);
+      pvt->owner = tmp;
+
+      /*
+       Set internal state before starting channel's thread
+      */
+      alsa_input_set_new_state(pvt, state, cause);
+
+      /* Unset pvt->owner before unlocking channel (see below) */
+      pvt->owner = NULL;
+#ifdef DEBUG
+      alsa_input_assert(pvt->owner_lock_count > 0);
+      pvt->owner_lock_count -= 1;
+#endif /* DEBUG */
+      ast_channel_unlock(tmp);
+
+      if ((!hangup) && (AST_STATE_DOWN != ast_state) && (ast_pbx_start(tmp))) {
+         ast_log(AST_LOG_ERROR, "Unable to start PBX on '%s'\n", alsa_input_ast_channel_name(tmp));
+         hangup = true;
+      }
+      /*
+       Here we can still safely lock channel (without fear of a deadlock
+       because monitor.lock is locked), as pvt->owner is still NULL
+      */
+      alsa_input_assert(NULL == pvt->owner);
+      ast_channel_lock(tmp);
+#ifdef DEBUG
+      pvt->owner_lock_count += 1;
+      alsa_input_assert(pvt->owner_lock_count > 0);
+#endif /* DEBUG */
+      pvt->owner = tmp;
+      if (hangup) {
+         alsa_input_unlink_from_ast_channel(pvt, AI_EV_INTERNAL_ERROR, true);
+         alsa_input_assert(NULL == pvt->owner);
+         /* ast_channel_unlock(tmp) is done in alsa_input_unlink_from_ast_channel() */
+         /*
+          Calling ast_hangup() means that we call indirectly
+          alsa_input_chan_hangup().
+          As the association between the ast_channel and the tech_pvt
+          is already removed alsa_input_chan_hangup() will do nothing.
+          Of course in alsa_input_chan_hangup(), we must check that the
+          ast_channel has a valid tech_pvt
+         */
+         ast_hangup(tmp);
+         tmp = NULL;
+      }
+      else {
+         if ((NULL == try_to_lock_ast_channel) || (!(*try_to_lock_ast_channel))) {
+#ifdef DEBUG
+            alsa_input_assert(pvt->owner_lock_count > 0);
+            pvt->owner_lock_count -= 1;
+#endif /* DEBUG */
+            ast_channel_unlock(pvt->owner);
+         }
+      }
+   }
+   else {
+      ast_log(AST_LOG_ERROR, "Unable to allocate ast_channel structure\n");
+      if (AST_STATE_DOWN != ast_state) {
+         alsa_input_assert(AI_ST_OFF_WAITING_ANSWER == state);
+         /* We signals the user that there's a problem */
+         alsa_input_set_new_state(pvt, AI_ST_OFF_NO_SERVICE, AI_EV_INTERNAL_ERROR);
+      }
+      else {
+         alsa_input_assert(AI_ST_ON_PRE_RINGING == state);
+         alsa_input_set_new_state(pvt, AI_ST_ON_IDLE, AI_EV_INTERNAL_ERROR);
+      }
+   }
+}
+
+/* Must be call with pvt->owner locked. */
+static int alsa_input_setup(alsa_input_pvt_t *pvt,
+   const alsa_input_ast_format *format, enum ast_channel_state ast_state,
+   alsa_input_event_t cause)
+{
+   int ret = 0;
+
+   alsa_input_pr_debug("alsa_input_setup(ast_state=%d)\n",
+      (int)(ast_state));
+
+   alsa_input_assert((NULL != pvt->owner) && (pvt->owner_lock_count > 0));
+   do { /* Empty loop */
+      if (NULL == format) {
+         ast_log(AST_LOG_WARNING, "No format specified\n");
+         ret = -1;
+         break;
+      }
+      if (!alsa_input_ast_formats_are_equal(pvt->format, format)) {
+         ast_log(AST_LOG_WARNING, "Can't do format '%s'\n", alsa_input_ast_format_get_name(format));
+         ret = -1;
+         break;
+      }
+      alsa_input_set_new_state(pvt, AI_ST_OFF_TALKING, cause);
+      ast_setstate(pvt->owner, ast_state);
+   } while (0);
+
+   return (ret);
+}
+
+/*
+ Gets the oldest frame captured by the audio thread and puts it in
+ pvt->ast_channel.frame. The data of the frame point directly to the slot
+ of the ring, the slot is given back to the audio thread at the next call
+ (Asterisk doesn't use the frame returned by alsa_input_chan_read() after
+ the next call).
+ Must be called with pvt->owner locked (we are the consumer of the ring).
+ Return true if a frame is ready in pvt->ast_channel.frame
+*/
+static bool alsa_input_audio_pop_frame(alsa_input_pvt_t *pvt)
+{
+   bool ret = false;
+   uint64_t val;
+   unsigned int head;
+   unsigned int tail;
+
+   alsa_input_assert((NULL != pvt->owner) && (pvt->owner_lock_count > 0));
+
+   /*
+    Reset the counter of the eventfd before looking at the ring : a frame
+    pushed after this point writes the eventfd again
+   */
+   if (read(pvt->audio.fd_frames, &(val), sizeof(val)) < 0) {
+      /* Nothing to do, counter is already null */
+   }
+   tail = pvt->audio.frames_tail;
+   if (pvt->ast_channel.frame_held) {
+      /* Release the frame returned by the previous call */
+      tail += 1;
+      __atomic_store_n(&(pvt->audio.frames_tail), tail, __ATOMIC_RELEASE);
+      pvt->ast_channel.frame_held = false;
+   }
+   head = __atomic_load_n(&(pvt->audio.frames_head), __ATOMIC_ACQUIRE);
+   if (head != tail) {
+      alsa_input_audio_frame_t *fr = &(pvt->audio.frames[tail & (pvt->audio.frames_len - 1)]);
+
+      if (fr->cng) {
+         /* Start of a silence */
+         pvt->ast_channel.frame.data.ptr = NULL;
+         pvt->ast_channel.frame.datalen = 0;
+         pvt->ast_channel.frame.samples = 0;
+         pvt->ast_channel.frame.frametype = AST_FRAME_CNG;
+         pvt->ast_channel.frame.subclass.integer = fr->cng_level;
+         pvt->ast_channel.frame.offset = 0;
+      }
+      else {
+         pvt->ast_channel.frame.data.ptr = &(fr->buf[AST_FRIENDLY_OFFSET]);
+         pvt->ast_channel.frame.datalen = fr->len;
+         pvt->ast_channel.frame.samples = pvt->ast_channel.frame.datalen / SAMPLE_SIZE;
+         pvt->ast_channel.frame.frametype = AST_FRAME_VOICE;
+         alsa_input_ast_set_frame_format(&(pvt->ast_channel.frame), pvt->format);
+         pvt->ast_channel.frame.offset = AST_FRIENDLY_OFFSET;
+      }
+      pvt->ast_channel.frame.src = alsa_input_chan_type;
+      pvt->ast_channel.frame.mallocd = 0;
+      pvt->ast_channel.frame.delivery = ast_tv(0,0);
+      pvt->ast_channel.frame_held = true;
+      if ((head - tail) > 1) {
+         /* Other frames are waiting : Asterisk must call us again */
+         val = 1;
+         if (write(pvt->audio.fd_frames, &(val), sizeof(val)) < 0) {
+            alsa_input_pr_debug("Unable to write eventfd ('%s')\n", strerror(errno));
+         }
+      }
+      ret = true;
+   }
+
+   return (ret);
+}
+
+/*
+ Asks the monitor to service the line being serviced again at time deadline
+ (see alsa_input_clock_ms()). If several deadlines are asked during the
+ servicing of the line, the nearest one is kept.
+*/
+static inline void alsa_input_schedule_pvt(
+   alsa_input_monitor_prms_t *monitor_prms, int64_t deadline)
+{
+   /* alsa_input_pr_debug("alsa_input_schedule_pvt(deadline=%lld)\n",
+      (long long)(deadline)); */
+
+   alsa_input_assert(NULL != monitor_prms);
+   if (deadline < monitor_prms->deadline) {
+      monitor_prms->deadline = deadline;
+   }
+}
+
+/*
+ Must be called with pvt->owner and monitor.lock locked.
+*/
+static void alsa_input_handle_status_change(alsa_input_pvt_t *pvt,
+   alsa_input_monitor_prms_t *monitor_prms, alsa_input_status_t new_status)
+{
+   alsa_input_pr_debug("alsa_input_handle_status_change(new_status=%d)\n",
+      (int)(new_status));
+
+   alsa_input_assert((pvt->channel->monitor.lock_count > 0)
+      && ((NULL == pvt->owner) || (pvt->owner_lock_count > 0))
+      && (NULL != monitor_prms) && (monitor_prms->channel_is_locked));
+
+   alsa_input_assert(((AI_STATUS_OFF_HOOK == new_status) || (AI_STATUS_ON_HOOK == new_status))
+      && (new_status != pvt->ast_channel.status));
+
+   pvt->ast_channel.status = new_status;
+
+   /* Handle status change */
+   if (AI_STATUS_OFF_HOOK == new_status) {
+      if ((AI_ST_ON_RINGING == pvt->ast_channel.state)
+          || (AI_ST_ON_PRE_RINGING == pvt->ast_channel.state)) {
+         alsa_input_assert(NULL != pvt->owner);
+         /*
+          alsa_input_chan_request() has created the channel.
+          Either alsa_input_chan_call() has been called so the phone
+          is ringing and the user picked up the phone to answer
+          the call or alsa_input_chan_call() has not been called and
+          the user picked up the phone to make a call.
+          In this latter case there's a conflict, so we hang
+          up the channel created by alsa_input_chan_request()
+          and emit the tone busy to the user.
+         */
+         bool hangup = true;
+         if (AI_ST_ON_RINGING == pvt->ast_channel.state) {
+            alsa_input_assert(AST_STATE_RINGING == alsa_input_ast_channel_state(pvt->owner));
+            /* The user wants to answer the call */
+            if (alsa_input_setup(pvt, alsa_input_ast_channel_rawreadformat(pvt->owner), AST_STATE_UP, AI_EV_OFF_HOOK)) {
+               ast_log(AST_LOG_ERROR, "Unable to answer the call on '%s'\n", alsa_input_ast_channel_name(pvt->owner));
+            }
+            else {
+               if (ast_queue_control(pvt->owner, AST_CONTROL_ANSWER)) {
+                  ast_log(AST_LOG_ERROR, "Unable to answer the call on '%s'\n", alsa_input_ast_channel_name(pvt->owner));
+                  __atomic_add_fetch(&(pvt->stats.queue_failures), 1, __ATOMIC_RELAXED);
+               }
+               else {
+                  alsa_input_pr_debug("Call answered on '%s'\n", alsa_input_ast_channel_name(pvt->owner));
+                  hangup = false;
+               }
+            }
+         }
+         else {
+            alsa_input_assert(AI_ST_ON_PRE_RINGING == pvt->ast_channel.state);
+            /*
+             The user wants to make a call but that's not possible as
+             there's an incoming call pending
+            */
+         }
+         if (hangup) {
+            alsa_input_queue_hangup(pvt, AI_EV_INTERNAL_ERROR);
+            /* ast_channel_unlock(pvt->owner) is done in alsa_input_queue_hangup() */
+            alsa_input_assert((NULL == pvt->owner) && (AI_ST_OFF_NO_SERVICE == pvt->ast_channel.state));
+         }
+      }
+      else {
+         alsa_input_assert((AI_ST_ON_IDLE == pvt->ast_channel.state)
+            && (NULL == pvt->owner));
+         /* The user has picked up the phone to make a call */
+         if (pvt->line_cfg->monitor_dialing) {
+            /*
+             We do not create an ast_channel now
+             We just change the tone to AI_TONE_WAITING_DIAL, and
+             wait for digits dialed by the user.
+             When the digits will form a valid extension then we will
+             create the ast_channel dedicated to handle the call
+            */
+            alsa_input_set_new_state(pvt, AI_ST_OFF_DIALING, AI_EV_OFF_HOOK);
+         }
+         else { /* (!pvt->line_cfg->monitor_dialing) */
+            /*
+             We create an ast_channel now.
+            */
+            pvt->ast_channel.digits_len = 0;
+            alsa_input_new(pvt, AI_ST_OFF_WAITING_ANSWER, AI_EV_OFF_HOOK,
+#if (AST_VERSION > 110)
+               NULL,
+#endif /* (AST_VERSION > 110) */
+               NULL, &(monitor_prms->channel_is_locked));
+         }
+      }
+   }
+   else { /* (AI_STATUS_OFF_HOOK != new_status) */
+      /* Gone on hook, so notify hangup */
+      if (NULL != pvt->owner) {
+         alsa_input_queue_hangup(pvt, AI_EV_ON_HOOK);
+         /* ast_channel_unlock(pvt->owner) is done in alsa_input_queue_hangup() */
+         alsa_input_assert(NULL == pvt->owner);
+      }
+      else {
+         alsa_input_set_new_state(pvt, AI_ST_ON_IDLE, AI_EV_ON_HOOK);
+      }
+   }
+}
+
+/*
+ Must be called with pvt->owner and monitor.lock locked.
+*/
+static void alsa_input_handle_mute_change(alsa_input_pvt_t *pvt,
+   alsa_input_monitor_prms_t *monitor_prms)
+{
+   alsa_input_pr_debug("alsa_input_handle_mute_change()\n");
+
+   alsa_input_assert((pvt->channel->monitor.lock_count > 0)
+      && ((NULL == pvt->owner) || (pvt->owner_lock_count > 0))
+      && (NULL != monitor_prms) && (monitor_prms->channel_is_locked));
+
+   if ((AI_ST_OFF_TALKING == pvt->ast_channel.state)
+       || (AI_ST_OFF_WAITING_ANSWER == pvt->ast_channel.state)) {
+      /* Toggle mute */
+      if (pvt->ast_channel.snd_capture_muted) {
+         alsa_input_pr_debug("Line %lu is unmuted\n",
+            (unsigned long)(pvt->index_line + 1));
+         pvt->ast_channel.snd_capture_muted = false;
+         alsa_input_audio_send_simple(pvt, AI_AUDIO_CMD_CAPTURE_START);
+      }
+      else {
+         alsa_input_pr_debug("Line %lu is muted\n",
+            (unsigned long)(pvt->index_line + 1));
+         pvt->ast_channel.snd_capture_muted = true;
+         alsa_input_audio_send_simple(pvt, AI_AUDIO_CMD_CAPTURE_STOP);
+      }
+      alsa_input_audio_drain_frames(pvt);
+   }
+}
+
+/*
+ Changes the playback volume of the line by steps volume steps. The new
+ gain applies to the voice queued from now on and to the tones.
+ Must be called with monitor.lock locked.
+*/
+static void alsa_input_change_volume(alsa_input_pvt_t *pvt, int steps)
+{
+   int volume = pvt->monitor.volume + (steps * pvt->line_cfg->volume_step);
+
+   alsa_input_assert(pvt->channel->monitor.lock_count > 0);
+
+   if (volume > AI_VOLUME_MAX) {
+      volume = AI_VOLUME_MAX;
+   }
+   if (volume < AI_VOLUME_MIN) {
+      volume = AI_VOLUME_MIN;
+   }
+   pvt->monitor.volume = volume;
+   __atomic_store_n(&(pvt->audio.play_gain), alsa_input_gain_from_db(volume), __ATOMIC_RELAXED);
+   ast_verb(3, "Line %lu : volume %d dB\n", (unsigned long)(pvt->index_line + 1), volume);
+}
+
+/*
+ Must be called with monitor.lock locked and pvt->owner set to NULL.
+*/
+static void alsa_input_search_extension(alsa_input_pvt_t *pvt,
+   alsa_input_monitor_prms_t *monitor_prms, bool ignore_timeout)
+{
+   /* alsa_input_pr_debug("alsa_input_search_extension(ignore_timeout=%d)\n",
+      (int)(ignore_timeout)); */
+
+   alsa_input_assert((pvt->channel->monitor.lock_count > 0)
+      && (NULL == pvt->owner) && (pvt->line_cfg->monitor_dialing)
+      && (NULL != monitor_prms) && (monitor_prms->channel_is_locked)
+      && (AI_ST_OFF_DIALING == pvt->ast_channel.state));
+
+   do { /* Empty loop */
+      if (!pvt->ast_channel.search_extension) {
+         break;
+      }
+      alsa_input_assert(pvt->ast_channel.digits_len < ARRAY_LEN(pvt->ast_channel.digits));
+      if (pvt->ast_channel.digits_len <= 0) {
+         if ((!ignore_timeout) && (pvt->line_cfg->dialing_timeout_1st_digit > 0)) {
+            int64_t deadline = pvt->ast_channel.wait_start + pvt->line_cfg->dialing_timeout_1st_digit;
+            if (monitor_prms->now < deadline) {
+               alsa_input_schedule_pvt(monitor_prms, deadline);
+               break;
+            }
+         }
+         alsa_input_assert(ARRAY_LEN(alsa_input_default_extension) <= ARRAY_LEN(pvt->ast_channel.digits));
+         strcpy(pvt->ast_channel.digits, alsa_input_default_extension);
+      }
+      else {
+         if ((!ignore_timeout) && (pvt->line_cfg->dialing_timeout > 0)) {
+            int64_t deadline = pvt->ast_channel.wait_start + pvt->line_cfg->dialing_timeout;
+            if (monitor_prms->now < deadline) {
+               alsa_input_schedule_pvt(monitor_prms, deadline);
+               break;
+            }
+         }
+         pvt->ast_channel.digits[pvt->ast_channel.digits_len] = '\0';
+      }
+      pvt->ast_channel.search_extension = false;
+      /* We test if, with these numbers, the extension is valid */
+      alsa_input_pr_debug("Searching for extension '%s' in context '%s'\n",
+         pvt->ast_channel.digits, pvt->line_cfg->context);
+      /*
+       Reset flag search_extension to false to stop
+       searching for an extension while no new digit is
+       dialed
+      */
+      if (ast_exists_extension(NULL, pvt->line_cfg->context, pvt->ast_channel.digits, 1, pvt->line_cfg->cid_num)) {
+         /* It's a valid extension in its context, get moving! */
+         alsa_input_pr_debug("Extension '%s' found in context '%s'\n", pvt->ast_channel.digits, pvt->line_cfg->context);
+         alsa_input_new(pvt, AI_ST_OFF_WAITING_ANSWER, AI_EV_EXT_FOUND,
+#if (AST_VERSION > 110)
+            NULL,
+#endif /* (AST_VERSION > 110) */
+            NULL, &(monitor_prms->channel_is_locked));
+      }
+      else {
+         if (!ast_canmatch_extension(NULL, pvt->line_cfg->context, pvt->ast_channel.digits, 1, pvt->line_cfg->cid_num)) {
+            /* It's not a valid extension */
+            alsa_input_pr_debug("Extension '%s' can't match anything in '%s'\n",
+               pvt->ast_channel.digits, pvt->line_cfg->context);
+            /* We signals the user that there's a problem */
+            alsa_input_set_new_state(pvt, AI_ST_OFF_NO_SERVICE, AI_EV_NO_EXT_CAN_BE_FOUND);
+         }
+         else if (pvt->ast_channel.digits_len >= (ARRAY_LEN(pvt->ast_channel.digits) - 1)) {
+            /*
+             We overrun maximum length of extension without
+             matching anything
+            */
+            alsa_input_pr_debug("Extension '%s' can't match anything in '%s' and reaches maximum length\n",
+               pvt->ast_channel.digits, pvt->line_cfg->context);
+            /* We signals the user that there's a problem */
+            alsa_input_set_new_state(pvt, AI_ST_OFF_NO_SERVICE, AI_EV_NO_EXT_CAN_BE_FOUND);
+         }
+      }
+   } while (false);
+}
+
+/*
+ Must be called with pvt->owner and monitor.lock locked.
+*/
+static void alsa_input_try_to_send_dtmf(alsa_input_pvt_t *pvt,
+   alsa_input_monitor_prms_t *monitor_prms)
+{
+   bool send_a_null_frame = false;
+
+   alsa_input_assert((pvt->channel->monitor.lock_count > 0)
+      && (NULL != pvt->owner) && (pvt->owner_lock_count > 0)
+      && (NULL != monitor_prms) && (monitor_prms->channel_is_locked)
+      && ((AI_ST_OFF_TALKING == pvt->ast_channel.state)
+          || (AI_ST_OFF_WAITING_ANSWER == pvt->ast_channel.state)));
+
+   if (NONE != pvt->ast_channel.dtmf_sent) {
+      if (ON == pvt->ast_channel.dtmf_sent) {
+         if (monitor_prms->now < (pvt->ast_channel.wait_start + MIN_DTMF_DURATION)) {
+            alsa_input_schedule_pvt(monitor_prms, pvt->ast_channel.wait_start + MIN_DTMF_DURATION);
+         }
+         else {
+            pvt->ast_channel.dtmf_sent = OFF;
+            pvt->ast_channel.wait_start = monitor_prms->now;
+            alsa_input_schedule_pvt(monitor_prms, pvt->ast_channel.wait_start + MIN_TIME_BETWEEN_DTMF);
+            send_a_null_frame = true;
+         }
+      }
+      else {
+         alsa_input_assert(OFF == pvt->ast_channel.dtmf_sent);
+         if (monitor_prms->now < (pvt->ast_channel.wait_start + MIN_TIME_BETWEEN_DTMF)) {
+            alsa_input_schedule_pvt(monitor_prms, pvt->ast_channel.wait_start + MIN_TIME_BETWEEN_DTMF);
+         }
+         else {
+            pvt->ast_channel.dtmf_sent = NONE;
+            send_a_null_frame = true;
+         }
+      }
+   }
+   if (send_a_null_frame) {
+      /*
+       As we only send AST_FRAME_DTMF, we send a null frame
+       for Asterisk to properly generate AST_FRAME_DTMF_BEGIN
+       and AST_FRAME_DTMF_END (it does it only when processing
+       a frame)
+      */
+      if (ast_queue_frame(pvt->owner, &(ast_null_frame))) {
+         ast_log(AST_LOG_WARNING, "Can't queue null frame for line %lu\n", (unsigned long)(pvt->index_line + 1));
+         __atomic_add_fetch(&(pvt->stats.queue_failures), 1, __ATOMIC_RELAXED);
+      }
+   }
+   if ((NONE == pvt->ast_channel.dtmf_sent) && (pvt->ast_channel.digits_len > 0)) {
+      int ret;
+      pvt->ast_channel.frame_to_queue.datalen = 0;
+      pvt->ast_channel.frame_to_queue.samples = 0;
+      pvt->ast_channel.frame_to_queue.data.ptr =  NULL;
+      pvt->ast_channel.frame_to_queue.src = alsa_input_chan_type;
+      pvt->ast_channel.frame_to_queue.offset = 0;
+      pvt->ast_channel.frame_to_queue.mallocd = 0;
+      pvt->ast_channel.frame_to_queue.delivery = ast_tv(0,0);
+      pvt->ast_channel.frame_to_queue.frametype = AST_FRAME_DTMF;
+      pvt->ast_channel.frame_to_queue.subclass.integer = pvt->ast_channel.digits[0];
+      ret = ast_queue_frame(pvt->owner, &(pvt->ast_channel.frame_to_queue));
+      ast_frfree(&(pvt->ast_channel.frame_to_queue));
+      if (ret) {
+         ast_log(AST_LOG_WARNING, "Unable to queue a digit on line %lu\n", (unsigned long)(pvt->index_line + 1));
+         __atomic_add_fetch(&(pvt->stats.queue_failures), 1, __ATOMIC_RELAXED);
+      }
+      else {
+         alsa_input_pr_debug("DTMF '%c' sent\n", (int)(pvt->ast_channel.frame_to_queue.subclass.integer));
+         pvt->ast_channel.dtmf_sent = ON;
+         pvt->ast_channel.wait_start = monitor_prms->now;
+         alsa_input_schedule_pvt(monitor_prms, pvt->ast_channel.wait_start + MIN_DTMF_DURATION);
+         pvt->ast_channel.digits_len -= 1;
+         if (pvt->ast_channel.digits_len > 0) {
+            memmove(pvt->ast_channel.digits, &(pvt->ast_channel.digits[1]), pvt->ast_channel.digits_len);
+         }
+      }
+   }
+}
+
+/*
+ Must be called with pvt->owner and monitor.lock locked.
+*/
+static void alsa_input_handle_digit(alsa_input_pvt_t *pvt,
+   alsa_input_monitor_prms_t *monitor_prms, char digit)
+{
+   alsa_input_pr_debug("alsa_input_handle_digits(digit='%c')\n",
+      (char)(digit));
+
+   alsa_input_assert((pvt->channel->monitor.lock_count > 0)
+      && ((NULL == pvt->owner) || (pvt->owner_lock_count > 0))
+      && (NULL != monitor_prms) && (monitor_prms->channel_is_locked));
+
+   if ((AI_ST_OFF_TALKING == pvt->ast_channel.state)
+       || (AI_ST_OFF_WAITING_ANSWER == pvt->ast_channel.state)) {
+      alsa_input_assert(NULL != pvt->owner);
+      if (pvt->ast_channel.digits_len < ARRAY_LEN(pvt->ast_channel.digits)) {
+         pvt->ast_channel.digits[pvt->ast_channel.digits_len] = digit;
+         pvt->ast_channel.digits_len += 1;
+      }
+   }
+   else if (AI_ST_OFF_DIALING == pvt->ast_channel.state) {
+      alsa_input_assert((NULL == pvt->owner) && (pvt->line_cfg->monitor_dialing));
+      do { /* Empty loop */
+         /* We search for an extension before adding new digit */
+         alsa_input_search_extension(pvt, monitor_prms, false);
+         if ((AI_ST_OFF_DIALING != pvt->ast_channel.state) || (!monitor_prms->channel_is_locked)) {
+            break;
+         }
+         if (pvt->ast_channel.digits_len < (ARRAY_LEN(pvt->ast_channel.digits) - 1)) {
+            if (0 == pvt->ast_channel.digits_len) {
+               /* We switch off the AI_TONE_WAITING_DIAL tone */
+               alsa_input_set_line_tone(pvt, AI_TONE_NONE, 0);
+            }
+            /*
+             If the digit is equal to pvt->line_cfg->search_extension_trigger,
+             we search for an extension now, without adding the digit
+            */
+            alsa_input_assert('\0' != digit);
+            if (/* ('\0' != pvt->line_cfg->search_extension_trigger)
+                && */(digit == pvt->line_cfg->search_extension_trigger)) {
+               pvt->ast_channel.search_extension = true;
+               alsa_input_search_extension(pvt, monitor_prms, true);
+               alsa_input_assert(!pvt->ast_channel.search_extension);
+               if ((AI_ST_OFF_DIALING != pvt->ast_channel.state) || (!monitor_prms->channel_is_locked)) {
+                  break;
+               }
+            }
+            pvt->ast_channel.digits[pvt->ast_channel.digits_len] = digit;
+            pvt->ast_channel.digits_len += 1;
+            /* If there's no timeout, we search for an extension now */
+            if (pvt->line_cfg->dialing_timeout <= 0) {
+               pvt->ast_channel.search_extension = true;
+               alsa_input_search_extension(pvt, monitor_prms, true);
+               alsa_input_assert(!pvt->ast_channel.search_extension);
+               if ((AI_ST_OFF_DIALING != pvt->ast_channel.state) || (!monitor_prms->channel_is_locked)) {
+                  break;
+               }
+            }
+            else {
+               /*
+                We set the flag saying we can search for an extension
+                and we update the time last digit was dialed
+               */
+               pvt->ast_channel.search_extension = true;
+               pvt->ast_channel.wait_start = monitor_prms->now;
+               alsa_input_schedule_pvt(monitor_prms, pvt->ast_channel.wait_start + pvt->line_cfg->dialing_timeout);
+            }
+         }
+      } while (false);
+   }
+}
+
+/*
+ Must be called with pvt->owner and monitor.lock locked.
+*/
+static void alsa_input_monitor_pvt(alsa_input_pvt_t *pvt,
+   alsa_input_monitor_prms_t *monitor_prms)
+{
+   /* alsa_input_pr_debug("alsa_input_monitor_pvt()\n"); */
+
+   alsa_input_assert((pvt->channel->monitor.lock_count > 0)
+      && ((NULL == pvt->owner) || (pvt->owner_lock_count > 0))
+      && (NULL != monitor_prms) && (monitor_prms->channel_is_locked));
+
+   if ((AI_ST_OFF_TALKING == pvt->ast_channel.state)
+       || (AI_ST_OFF_WAITING_ANSWER == pvt->ast_channel.state)) {
+      alsa_input_assert(NULL != pvt->owner);
+      /* Voice frames are delivered by the audio thread */
+      alsa_input_try_to_send_dtmf(pvt, monitor_prms);
+   }
+   else if (AI_ST_OFF_DIALING == pvt->ast_channel.state) {
+      alsa_input_assert((NULL == pvt->owner) && (pvt->line_cfg->monitor_dialing));
+      alsa_input_search_extension(pvt, monitor_prms, false);
+   }
+   else if (AI_ST_OFF_NO_SERVICE == pvt->ast_channel.state) {
+      if (monitor_prms->now < (pvt->ast_channel.wait_start + DELAY_AUTO_HOOK_ON)) {
+         alsa_input_schedule_pvt(monitor_prms, pvt->ast_channel.wait_start + DELAY_AUTO_HOOK_ON);
+      }
+      else {
+         alsa_input_handle_status_change(pvt, monitor_prms, AI_STATUS_ON_HOOK);
+      }
+   }
+   else if (AI_ST_ON_RINGING == pvt->ast_channel.state) {
+      if (pvt->ast_channel.buzzer_is_on) {
+         if (monitor_prms->now < (pvt->ast_channel.wait_start + RING_CADENCE_ON)) {
+            alsa_input_schedule_pvt(monitor_prms, pvt->ast_channel.wait_start + RING_CADENCE_ON);
+         }
+         else {
+            alsa_input_turn_buzzer_off(pvt);
+            alsa_input_assert(!pvt->ast_channel.buzzer_is_on);
+            alsa_input_schedule_pvt(monitor_prms, pvt->ast_channel.wait_start + RING_CADENCE_OFF);
+         }
+      }
+      else {
+         if (monitor_prms->now < (pvt->ast_channel.wait_start + RING_CADENCE_OFF)) {
+            alsa_input_schedule_pvt(monitor_prms, pvt->ast_channel.wait_start + RING_CADENCE_OFF);
+         }
+         else {
+            alsa_input_turn_buzzer_on(pvt);
+            alsa_input_assert(pvt->ast_channel.buzzer_is_on);
+            alsa_input_schedule_pvt(monitor_prms, pvt->ast_channel.wait_start + RING_CADENCE_ON);
+         }
+      }
+   }
+   if ((AI_TONE_NONE != pvt->ast_channel.tone) && (alsa_input_audio_playback_is_free(pvt))) {
+      /* The audio thread has played the whole tone */
+      alsa_input_set_line_tone(pvt, AI_TONE_NONE, 0);
+   }
+}
+
+static inline void alsa_input_monitor_lock(alsa_input_chan_t *t)
+{
+   ast_mutex_lock(&(t->monitor.lock));
+#ifdef DEBUG
+   alsa_input_assert(0 == t->monitor.lock_count);
+   t->monitor.lock_count += 1;
+#endif /* DEBUG */
+}
+
+static inline void alsa_input_monitor_unlock(alsa_input_chan_t *t)
+{
+#ifdef DEBUG
+   t->monitor.lock_count -= 1;
+   alsa_input_assert(0 == t->monitor.lock_count);
+#endif /* DEBUG */
+   ast_mutex_unlock(&(t->monitor.lock));
+}
+
+static inline void alsa_input_prepare_start_monitor(alsa_input_chan_t *t)
+{
+   alsa_input_assert(!t->monitor.run);
+   t->monitor.run = true;
+}
+
+static inline void alsa_input_prepare_stop_monitor(alsa_input_chan_t *t)
+{
+   t->monitor.run = false;
+}
+
+/*
+ Adds a line to the list of lines to service during the current pass of the
+ monitor, if not already in the list.
+ Must be called with monitor.lock locked.
+*/
+static inline void alsa_input_monitor_add_to_pass(alsa_input_pvt_t **list,
+   alsa_input_pvt_t *pvt)
+{
+   if (!pvt->monitor.in_pass) {
+      pvt->monitor.in_pass = true;
+      pvt->monitor.next_service = *list;
+      *list = pvt;
+   }
+}
+
+static inline void alsa_input_monitor_heap_swap(alsa_input_chan_t *t,
+   size_t i, size_t j)
+{
+   alsa_input_pvt_t *pvt = t->monitor.heap[i];
+
+   t->monitor.heap[i] = t->monitor.heap[j];
+   t->monitor.heap[i]->monitor.heap_index = i;
+   t->monitor.heap[j] = pvt;
+   pvt->monitor.heap_index = j;
+}
+
+/* Moves the item at position i of the heap to its place */
+static void alsa_input_monitor_heap_fix(alsa_input_chan_t *t, size_t i)
+{
+   while (i > 0) {
+      size_t parent = (i - 1) / 2;
+      if (t->monitor.heap[parent]->monitor.deadline <= t->monitor.heap[i]->monitor.deadline) {
+         break;
+      }
+      alsa_input_monitor_heap_swap(t, i, parent);
+      i = parent;
+   }
+   for (;;) {
+      size_t smallest = i;
+      size_t child = (2 * i) + 1;
+      if ((child < t->monitor.heap_len)
+          && (t->monitor.heap[child]->monitor.deadline < t->monitor.heap[smallest]->monitor.deadline)) {
+         smallest = child;
+      }
+      child += 1;
+      if ((child < t->monitor.heap_len)
+          && (t->monitor.heap[child]->monitor.deadline < t->monitor.heap[smallest]->monitor.deadline)) {
+         smallest = child;
+      }
+      if (smallest == i) {
+         break;
+      }
+      alsa_input_monitor_heap_swap(t, i, smallest);
+      i = smallest;
+   }
+}
+
+/*
+ Sets the deadline of a line : the line is inserted in the heap, moved in
+ the heap or removed from the heap (if deadline is AI_NO_DEADLINE).
+ Must be called from the monitor thread.
+*/
+static void alsa_input_monitor_set_deadline(alsa_input_pvt_t *pvt,
+   int64_t deadline)
+{
+   alsa_input_chan_t *t = pvt->channel;
+   size_t i = pvt->monitor.heap_index;
+
+   if (AI_NOT_IN_HEAP == i) {
+      if (AI_NO_DEADLINE != deadline) {
+         /* heap is allocated with one item per line so it can't overflow */
+         alsa_input_assert(t->monitor.heap_len < t->config.line_count);
+         pvt->monitor.deadline = deadline;
+         i = t->monitor.heap_len;
+         t->monitor.heap[i] = pvt;
+         pvt->monitor.heap_index = i;
+         t->monitor.heap_len += 1;
+         alsa_input_monitor_heap_fix(t, i);
+      }
+   }
+   else if (AI_NO_DEADLINE != deadline) {
+      if (deadline != pvt->monitor.deadline) {
+         pvt->monitor.deadline = deadline;
+         alsa_input_monitor_heap_fix(t, i);
+      }
+   }
+   else {
+      size_t last = t->monitor.heap_len - 1;
+      pvt->monitor.deadline = AI_NO_DEADLINE;
+      if (i != last) {
+         alsa_input_monitor_heap_swap(t, i, last);
+      }
+      t->monitor.heap_len = last;
+      pvt->monitor.heap_index = AI_NOT_IN_HEAP;
+      if (i != last) {
+         alsa_input_monitor_heap_fix(t, i);
+      }
+   }
+}
+
+/*
+ Arms the timerfd of the monitor on the nearest deadline of the lines, or
+ disarms it if no line has a deadline.
+ Must be called from the monitor thread.
+*/
+static void alsa_input_monitor_arm_timer(alsa_input_chan_t *t)
+{
+   int64_t deadline = AI_NO_DEADLINE;
+
+   if (t->monitor.heap_len > 0) {
+      deadline = t->monitor.heap[0]->monitor.deadline;
+   }
+   if (deadline != t->monitor.timer_deadline) {
+      struct itimerspec its;
+      memset(&(its), 0, sizeof(its));
+      if (AI_NO_DEADLINE != deadline) {
+         /* A null it_value would disarm the timer */
+         if (deadline <= 0) {
+            its.it_value.tv_nsec = 1;
+         }
+         else {
+            its.it_value.tv_sec = deadline / 1000;
+            its.it_value.tv_nsec = (deadline % 1000) * 1000000;
+         }
+      }
+      if (timerfd_settime(t->monitor.fd_timer, TFD_TIMER_ABSTIME, &(its), NULL)) {
+         ast_log(AST_LOG_ERROR, "timerfd_settime() failed: '%s'\n", strerror(errno));
+      }
+      else {
+         t->monitor.timer_deadline = deadline;
+      }
+   }
+}
+
+/*
+ Handles input events received and does periodic tasks for a line.
+ Must be called with monitor.lock locked.
+ On return, monitor_prms->deadline is the time at which the line must be
+ serviced again or AI_NO_DEADLINE.
+*/
+static void alsa_input_monitor_service_pvt(alsa_input_pvt_t *pvt,
+   alsa_input_monitor_prms_t *monitor_prms)
+{
+   unsigned int dtmf_head;
+   unsigned int dtmf_tail;
+   uint32_t revents;
+
+   alsa_input_assert(pvt->channel->monitor.lock_count > 0);
+
+   monitor_prms->deadline = AI_NO_DEADLINE;
+
+   /* If line is disconnected ignore it */
+   if (AI_ST_DISCONNECTED == pvt->monitor.last_known_state) {
+      pvt->monitor.revents_input = 0;
+      /* Unless a reload gave it other devices */
+      if ((NULL != pvt->reload.pending_cfg) && (!pvt->reload.reopening)) {
+         alsa_input_devices_request(pvt);
+      }
+      return;
+   }
+
+   if (NULL != pvt->owner) {
+      if (ast_channel_trylock(pvt->owner)) {
+         /*
+          Because the channel is locked in another thread,
+          we can't handle input events or read data.
+          The only thing we can do is set a short deadline to retry
+          quickly. Events already returned by epoll_wait() are kept.
+         */
+         alsa_input_schedule_pvt(monitor_prms, monitor_prms->now + alsa_input_monitor_short_timeout);
+         return;
+      }
+#ifdef DEBUG
+      alsa_input_assert(0 == pvt->owner_lock_count);
+      pvt->owner_lock_count += 1;
+#endif /* DEBUG */
+   }
+   monitor_prms->channel_is_locked = true;
+
+   do { /* Empty loop */
+      /* Update monitor status if changes occured in other threads */
+      if (pvt->monitor.last_known_state != pvt->ast_channel.state) {
+         pvt->monitor.last_known_state = pvt->ast_channel.state;
+         if (AI_ST_DISCONNECTED == pvt->ast_channel.state) {
+            alsa_input_disconnect_line(pvt);
+            alsa_input_assert(NULL == pvt->owner);
+         }
+      }
+
+      if (AI_ST_DISCONNECTED == pvt->monitor.last_known_state) {
+         break;
+      }
+
+      /* Configuration given by a reload while the channel was locked */
+      alsa_input_apply_next_cfg(pvt);
+      /*
+       Other devices given by a reload : they are reopened once the line is
+       idle, and no input event is waiting
+      */
+      if ((NULL != pvt->reload.pending_cfg) && (NULL == pvt->owner)
+          && (AI_ST_ON_IDLE == pvt->ast_channel.state)
+          && (pvt->monitor.events_tail == pvt->monitor.events_synced)) {
+         alsa_input_pr_debug("Line %lu : disconnected to reopen its devices\n",
+            (unsigned long)(pvt->index_line + 1));
+         pvt->ast_channel.status = AI_STATUS_DISCONNECTED;
+         alsa_input_disconnect_line(pvt);
+         alsa_input_devices_request(pvt);
+         break;
+      }
+
+      /*
+       We register file descriptors with EPOLLIN only, but epoll_wait() can
+       return (EPOLLERR | EPOLLHUP), so handle these events
+      */
+      revents = pvt->monitor.revents_input;
+      pvt->monitor.revents_input = 0;
+      if ((revents & (EPOLLERR | EPOLLHUP))) {
+         alsa_input_pr_debug("Line %lu : epoll_wait() returned an error for input event device (revents == %u)\n",
+            (unsigned long)(pvt->index_line + 1), (unsigned int)(revents));
+         alsa_input_critical_error(pvt, true);
+         alsa_input_assert((NULL == pvt->owner)
+            && (AI_ST_DISCONNECTED == pvt->ast_channel.state)
+            && (AI_ST_DISCONNECTED == pvt->monitor.last_known_state));
+         break;
+      }
+      /* The audio thread reports the errors of the sound devices */
+      if (__atomic_exchange_n(&(pvt->audio.critical_error), 0, __ATOMIC_ACQ_REL)) {
+         alsa_input_critical_error(pvt, true);
+         alsa_input_assert((NULL == pvt->owner)
+            && (AI_ST_DISCONNECTED == pvt->ast_channel.state)
+            && (AI_ST_DISCONNECTED == pvt->monitor.last_known_state));
+         break;
+      }
+
+      alsa_input_assert(monitor_prms->channel_is_locked);
+
+      /* *** Handle the whole packets of input events received *** */
+      while ((pvt->monitor.events_tail != pvt->monitor.events_synced) && (monitor_prms->channel_is_locked)) {
+         const struct input_event *ev = &(pvt->monitor.events[pvt->monitor.events_tail % AI_INPUT_EVENTS_LEN]);
+         char digit = '\0';
+
+         pvt->monitor.events_tail += 1;
+         /* alsa_input_pr_debug("Line %lu : event received (type=%u, code=%u, value=%ld)\n",
+            (unsigned long)(pvt->index_line + 1), (unsigned int)(ev->type),
+            (unsigned int)(ev->code), (long)(ev->value)); */
+         if (EV_SYN == ev->type) {
+            if (SYN_DROPPED == ev->code) {
+               /* The kernel buffer overflowed : ignore the packet, it is incomplete */
+               alsa_input_pr_debug("Line %lu : input events dropped by the kernel\n",
+                  (unsigned long)(pvt->index_line + 1));
+               pvt->monitor.events_dropping = true;
+            }
+            else if (SYN_REPORT == ev->code) {
+               pvt->monitor.events_dropping = false;
+            }
+            continue;
+         }
+         if ((pvt->monitor.events_dropping) || (EV_KEY != ev->type) || (0 == ev->value)) {
+            /* alsa_input_pr_debug("Line %lu : event ignored (type or value not handled)\n",
+               (unsigned long)(pvt->index_line + 1)); */
+            continue;
+         }
+         if (KEY_ENTER == ev->code) {
+            /* Off hook */
+            alsa_input_pr_debug("Line %lu : key 'off hook' pressed\n",
+               (unsigned long)(pvt->index_line + 1));
+            if (AI_STATUS_ON_HOOK == pvt->ast_channel.status) {
+               alsa_input_handle_status_change(pvt, monitor_prms, AI_STATUS_OFF_HOOK);
+            }
+            else {
+               alsa_input_pr_debug("Line %lu : event ignored because phone is already off hook\n",
+                     (unsigned long)(pvt->index_line + 1));
+            }
+            continue;
+         }
+         if (AI_STATUS_OFF_HOOK != pvt->ast_channel.status) {
+            /* When on hook no other key than KEY_ENTER can trigger an action */
+            alsa_input_pr_debug("Line %lu : event ignored because phone is on hook\n",
+                  (unsigned long)(pvt->index_line + 1));
+            continue;
+         }
+         if (KEY_ESC == ev->code) {
+            alsa_input_pr_debug("Line %lu : key 'on hook' pressed\n",
+                  (unsigned long)(pvt->index_line + 1));
+            alsa_input_handle_status_change(pvt, monitor_prms, AI_STATUS_ON_HOOK);
+            continue;
+         }
+         else if (KEY_MUTE == ev->code) {
+            alsa_input_pr_debug("Line %lu : key 'mute' pressed\n",
+                  (unsigned long)(pvt->index_line + 1));
+            alsa_input_handle_mute_change(pvt, monitor_prms);
+            continue;
+         }
+         else if ((KEY_VOLUMEUP == ev->code) || (KEY_VOLUMEDOWN == ev->code)) {
+            alsa_input_pr_debug("Line %lu : key 'volume %s' pressed\n",
+                  (unsigned long)(pvt->index_line + 1),
+                  (KEY_VOLUMEUP == ev->code) ? "up" : "down");
+            alsa_input_change_volume(pvt, (KEY_VOLUMEUP == ev->code) ? 1 : -1);
+            continue;
+         }
+         else if ((ev->code >= KEY_NUMERIC_0) && (ev->code <= KEY_NUMERIC_9)) {
+            digit = (ev->code - KEY_NUMERIC_0) + '0';
+         }
+         else if (KEY_NUMERIC_STAR == ev->code) {
+            /* Star key */
+            digit = '*';
+         }
+         else if (KEY_NUMERIC_POUND == ev->code) {
+            /* Pound key */
+            digit = '#';
+         }
+         else if (KEY_A == ev->code) {
+            digit = 'A';
+         }
+         else if (KEY_B == ev->code) {
+            digit = 'B';
+         }
+         else if (KEY_C == ev->code) {
+            digit = 'C';
+         }
+         else if (KEY_D == ev->code) {
+            digit = 'D';
+         }
+         if ('\0' == digit) {
+            alsa_input_pr_debug("Line %lu : event ignored (code %u not handled)\n",
+               (unsigned long)(pvt->index_line + 1), (unsigned int)(ev->code));
+            continue;
+         }
+         alsa_input_pr_debug("Line %lu : key '%c' pressed\n",
+               (unsigned long)(pvt->index_line + 1), (char)(digit));
+         alsa_input_handle_digit(pvt, monitor_prms, digit);
+      }
+      if (!monitor_prms->channel_is_locked) {
+         break;
+      }
+
+      /* *** Handle digits detected by the audio thread *** */
+      dtmf_tail = pvt->audio.dtmf_tail;
+      dtmf_head = __atomic_load_n(&(pvt->audio.dtmf_head), __ATOMIC_ACQUIRE);
+      while ((dtmf_tail != dtmf_head) && (monitor_prms->channel_is_locked)) {
+         char digit = pvt->audio.dtmf_digits[dtmf_tail % AI_DTMF_DIGITS_LEN];
+         dtmf_tail += 1;
+         if (AI_STATUS_OFF_HOOK != pvt->ast_channel.status) {
+            continue;
+         }
+         alsa_input_pr_debug("Line %lu : DTMF '%c' detected\n",
+               (unsigned long)(pvt->index_line + 1), (char)(digit));
+         alsa_input_handle_digit(pvt, monitor_prms, digit);
+      }
+      __atomic_store_n(&(pvt->audio.dtmf_tail), dtmf_tail, __ATOMIC_RELEASE);
+      if (!monitor_prms->channel_is_locked) {
+         break;
+      }
+
+      /* Do periodic tasks */
+      alsa_input_monitor_pvt(pvt, monitor_prms);
+   } while (false);
+
+   if (monitor_prms->channel_is_locked) {
+      if (NULL != pvt->owner) {
+#ifdef DEBUG
+         pvt->owner_lock_count -= 1;
+         alsa_input_assert(0 == pvt->owner_lock_count);
+#endif /* DEBUG */
+         ast_channel_unlock(pvt->owner);
+      }
+      monitor_prms->channel_is_locked = false;
+   }
+}
+
+/*
+ Accounts count input events written at events_head of the ring of a line:
+ they can be handled up to the last SYN_REPORT.
+ Must be called with monitor.lock locked.
+*/
+static void alsa_input_monitor_events_added(alsa_input_pvt_t *pvt, unsigned int count)
+{
+   unsigned int head = pvt->monitor.events_head;
+   unsigned int end = head + count;
+
+   alsa_input_assert((end - pvt->monitor.events_tail) <= AI_INPUT_EVENTS_LEN);
+   for (; head != end; head += 1) {
+      const struct input_event *ev = &(pvt->monitor.events[head % AI_INPUT_EVENTS_LEN]);
+
+      if ((EV_SYN == ev->type) && (SYN_REPORT == ev->code)) {
+         pvt->monitor.events_synced = head + 1;
+      }
+   }
+   pvt->monitor.events_head = end;
+   if ((end - pvt->monitor.events_tail) >= AI_INPUT_EVENTS_LEN) {
+      /* The ring is full : don't wait any more for a SYN_REPORT */
+      pvt->monitor.events_synced = end;
+   }
+}
+
+/*
+ Reads input events available on the input event device of a line.
+ All the free space of the ring is filled with a single call to readv().
+ Must be called with monitor.lock locked.
+*/
+static void alsa_input_monitor_read_input(alsa_input_pvt_t *pvt)
+{
+   alsa_input_assert(pvt->channel->monitor.lock_count > 0);
+
+   if (pvt->monitor.fd_input < 0) {
+      return;
+   }
+   if (pvt->monitor.fd_pipe >= 0) {
+      /*
+       If fd_input is connected to the pipe, input events
+       are already in array pvt->monitor.events
+       Just call read() to handle EPOLLIN event but ignore the data
+      */
+      __u8 dummy[64];
+      while (read(pvt->monitor.fd_input, dummy, sizeof(dummy)) > 0) {
+      }
+   }
+   else {
+      unsigned int free_count = AI_INPUT_EVENTS_LEN - (pvt->monitor.events_head - pvt->monitor.events_tail);
+      unsigned int start = pvt->monitor.events_head % AI_INPUT_EVENTS_LEN;
+      unsigned int first_count = (free_count < (AI_INPUT_EVENTS_LEN - start)) ? free_count : (AI_INPUT_EVENTS_LEN - start);
+      struct iovec iov[2];
+      ssize_t rb;
+
+      if (0 == free_count) {
+         return;
+      }
+      iov[0].iov_base = &(pvt->monitor.events[start]);
+      iov[0].iov_len = first_count * sizeof(pvt->monitor.events[0]);
+      iov[1].iov_base = &(pvt->monitor.events[0]);
+      iov[1].iov_len = (free_count - first_count) * sizeof(pvt->monitor.events[0]);
+      rb = readv(pvt->monitor.fd_input, iov, (free_count > first_count) ? 2 : 1);
+      if (rb > 0) {
+         /* evdev returns whole events only */
+         alsa_input_assert(0 == (rb % sizeof(pvt->monitor.events[0])));
+         alsa_input_monitor_events_added(pvt, (unsigned int)(rb / sizeof(pvt->monitor.events[0])));
+      }
+   }
+}
+
+static void *alsa_input_do_monitor(void *data)
+{
+   alsa_input_chan_t *t = (alsa_input_chan_t *)(data);
+   alsa_input_monitor_prms_t monitor_prms;
+
+   monitor_prms.channel_is_locked = false;
+
+   alsa_input_pr_debug("Entering monitor's thread\n");
+
+   while (t->monitor.run) {
+      int nfds;
+      int i;
+      alsa_input_pvt_t *to_service = NULL;
+      alsa_input_pvt_t *pvt;
+
+      alsa_input_monitor_lock(t);
+      if (t->monitor.lines_connected <= 0) {
+         bool reopening = false;
+
+         /* Lines being reopened by the devices thread will be connected again */
+         AST_LIST_TRAVERSE(&(t->pvt_list), pvt, list) {
+            if (pvt->reload.reopening) {
+               reopening = true;
+               break;
+            }
+         }
+         if (!reopening) {
+            /* No connected lines, so we exit the loop and stop the monitor */
+            alsa_input_prepare_stop_monitor(t);
+            alsa_input_monitor_unlock(t);
+            break;
+         }
+      }
+      alsa_input_monitor_unlock(t);
+
+      /*
+       Wait for data on one of the file descriptors. There's no timeout :
+       the timerfd is armed on the nearest deadline of the lines, and
+       alsa_input_stop_monitor() wakes us up through the eventfd
+      */
+      nfds = epoll_wait(t->monitor.epfd, t->monitor.events, t->monitor.events_len, -1);
+      if ((nfds < 0) && (EINTR != errno)) {
+         ast_log(AST_LOG_ERROR, "epoll_wait() failed: '%s'\n", strerror(errno));
+      }
+
+      alsa_input_monitor_lock(t);
+
+      /* The clock is read once for all the lines serviced in this pass */
+      monitor_prms.now = alsa_input_clock_ms();
+
+      /* Lines with events on their file descriptors */
+      for (i = 0; (i < nfds); i += 1) {
+         const struct epoll_event *ev = &(t->monitor.events[i]);
+         alsa_input_monitor_src_t *src = (alsa_input_monitor_src_t *)(ev->data.ptr);
+         if (AI_SRC_WAKEUP == src->kind) {
+            /* The monitor has been kicked : get the lines concerned */
+            uint64_t val;
+            if (read(t->monitor.fd_wakeup, &(val), sizeof(val)) < 0) {
+               alsa_input_pr_debug("Unable to read eventfd ('%s')\n", strerror(errno));
+            }
+            pvt = __atomic_exchange_n(&(t->monitor.kicked), NULL, __ATOMIC_ACQ_REL);
+            while (NULL != pvt) {
+               alsa_input_pvt_t *next = pvt->monitor.next_kicked;
+               __atomic_store_n(&(pvt->monitor.kicked), 0, __ATOMIC_RELEASE);
+               alsa_input_monitor_add_to_pass(&(to_service), pvt);
+               pvt = next;
+            }
+            continue;
+         }
+         if (AI_SRC_TIMER == src->kind) {
+            /* Lines whose deadline is reached are taken from the heap below */
+            uint64_t val;
+            if (read(t->monitor.fd_timer, &(val), sizeof(val)) < 0) {
+               alsa_input_pr_debug("Unable to read timerfd ('%s')\n", strerror(errno));
+            }
+            /* The timer has expired so it's no longer armed */
+            t->monitor.timer_deadline = AI_NO_DEADLINE;
+            continue;
+         }
+         alsa_input_assert(AI_SRC_INPUT == src->kind);
+         pvt = src->pvt;
+         pvt->monitor.revents_input |= ev->events;
+         /* Reading input events doesn't require to lock the channel */
+         if ((ev->events & EPOLLIN)) {
+            alsa_input_monitor_read_input(pvt);
+         }
+         alsa_input_monitor_add_to_pass(&(to_service), pvt);
+      }
+
+      /* Lines whose deadline is reached */
+      while ((t->monitor.heap_len > 0)
+             && (t->monitor.heap[0]->monitor.deadline <= monitor_prms.now)) {
+         pvt = t->monitor.heap[0];
+         alsa_input_monitor_set_deadline(pvt, AI_NO_DEADLINE);
+         alsa_input_monitor_add_to_pass(&(to_service), pvt);
+      }
+
+      /*
+       Service only the lines concerned. Deadlines are computed from the
+       state of the line, so servicing a line before its deadline (because
+       of an event) gives again the same deadline
+      */
+      while (NULL != to_service) {
+         pvt = to_service;
+         to_service = pvt->monitor.next_service;
+         pvt->monitor.in_pass = false;
+         alsa_input_monitor_service_pvt(pvt, &(monitor_prms));
+         alsa_input_monitor_set_deadline(pvt, monitor_prms.deadline);
+      }
+
+      alsa_input_monitor_arm_timer(t);
+
+      /* Configurations replaced by a reload */
+      if (NULL != t->monitor.retired) {
+         alsa_input_reclaim_line_cfgs(t, false);
+      }
+
+      alsa_input_monitor_unlock(t);
+   }
+
+   alsa_input_pr_debug("Exiting monitor's thread\n");
+
+   return (NULL);
+}
+
+static int alsa_input_stop_monitor(alsa_input_chan_t *t)
+{
+   int ret = 0;
+
+   alsa_input_pr_debug("Stopping the monitor\n");
+
+   do { /* Empty loop */
+      if (t->monitor.thread == pthread_self()) {
+         ast_log(AST_LOG_ERROR, "Cannot kill myself\n");
+         ret = -1;
+         break;
+      }
+      if ((AST_PTHREADT_NULL != t->monitor.thread) && (AST_PTHREADT_STOP != t->monitor.thread)) {
+         /* Stops the monitor thread */
+         alsa_input_prepare_stop_monitor(t);
+         /*
+          Don't send signal SIGURG with pthread_kill() because
+          epoll_wait() called by monitor thread,
+          if interrupted by signal, could end returning -ERESTARTSYS.
+          As the signal handler in Asterisk has the flags SA_RESTART,
+          the syscall would be retried and the monitor will stay
+          blocked on epoll_wait(). Instead we write the eventfd of the
+          monitor
+         */
+         alsa_input_monitor_wakeup(t);
+         alsa_input_pr_debug("Calling pthread_join()\n");
+         ret = pthread_join(t->monitor.thread, NULL);
+         if (ret) {
+            ast_log(AST_LOG_ERROR, "pthread_join() failed: %d, %d\n", ret, errno);
+         }
+         else {
+            alsa_input_pr_debug("Monitor stopped\n");
+         }
+         t->monitor.thread = AST_PTHREADT_NULL;
+         ret = 0;
+      }
+      else {
+         alsa_input_pr_debug("Monitor not running\n");
+      }
+   } while (false);
+
+   return (ret);
+}
+
+static int alsa_input_start_monitor(alsa_input_chan_t *t)
+{
+   int ret = 0;
+
+   alsa_input_pr_debug("Starting the monitor\n");
+
+   do { /* Empty loop */
+      /* If we're supposed to be stopped -- stay stopped */
+      if (AST_PTHREADT_STOP == t->monitor.thread) {
+         ret = 0;
+         break;
+      }
+      alsa_input_assert((AST_PTHREADT_NULL == t->monitor.thread) && (!t->monitor.run));
+      alsa_input_prepare_start_monitor(t);
+      /* Start a new monitor */
+      if (ast_pthread_create_background(&(t->monitor.thread), NULL, alsa_input_do_monitor, t) < 0) {
+         ast_log(AST_LOG_ERROR, "Unable to start monitor thread.\n");
+         t->monitor.thread = AST_PTHREADT_NULL;
+         ret = -1;
+         break;
+      }
+      alsa_input_assert((AST_PTHREADT_STOP != t->monitor.thread) && (AST_PTHREADT_NULL != t->monitor.thread));
+      ret = 0;
+   } while (false);
+
+   return (ret);
+}
+
+/*
+ Adds a user (a line capturing or playing) to a shared device : the device is
+ started and registered in the epoll set of the audio thread for the first
+ one
+*/
+static int alsa_input_audio_shared_acquire(alsa_input_chan_t *t,
+   alsa_input_snd_shared_t *sh)
+{
+   if (sh->failed) {
+      return (-1);
+   }
+   if (0 == sh->users) {
+      if (SND_PCM_STREAM_CAPTURE == sh->stream) {
+         alsa_input_snd_card_start(&(sh->card));
+         if (alsa_input_epoll_add(t->audio.epfd, sh->fd, EPOLLIN, &(sh->src))) {
+            return (-1);
+         }
+      }
+      else {
+         sh->buf_len = 0;
+         if (alsa_input_epoll_add(t->audio.epfd, sh->fd, EPOLLOUT, &(sh->src))) {
+            return (-1);
+         }
+      }
+   }
+   sh->users += 1;
+   return (0);
+}
+
+/* Removes a user from a shared device, the device is stopped for the last one */
+static void alsa_input_audio_shared_release(alsa_input_chan_t *t,
+   alsa_input_snd_shared_t *sh)
+{
+   alsa_input_assert(sh->users > 0);
+   sh->users -= 1;
+   if ((0 == sh->users) && (!sh->failed)) {
+      alsa_input_epoll_del(t->audio.epfd, sh->fd);
+      if (SND_PCM_STREAM_CAPTURE == sh->stream) {
+         alsa_input_snd_card_stop(&(sh->card));
+      }
+      /* A playback device plays what has been written, then underruns */
+   }
+}
+
+/*
+ Called by the audio thread when a critical error occurs on a sound device :
+ the audio thread stops using the devices of the line and asks the monitor
+ to disconnect the line
+*/
+static void alsa_input_audio_critical_error(alsa_input_pvt_t *pvt)
+{
+   alsa_input_chan_t *t = pvt->channel;
+
+   if (pvt->audio.capturing) {
+      if (NULL != pvt->audio.shared_capture) {
+         alsa_input_audio_shared_release(t, pvt->audio.shared_capture);
+      }
+      else {
+         alsa_input_epoll_del(t->audio.epfd, pvt->audio.fd_snd_capture);
+      }
+      pvt->audio.capturing = false;
+   }
+   if (pvt->audio.playback_polled) {
+      if (NULL != pvt->audio.shared_playback) {
+         alsa_input_audio_shared_release(t, pvt->audio.shared_playback);
+      }
+      else {
+         alsa_input_epoll_del(t->audio.epfd, pvt->audio.fd_snd_playback);
+      }
+      pvt->audio.playback_polled = false;
+   }
+   /* The devices are no more used until they are closed */
+   pvt->audio.failed = true;
+   pvt->audio.tone_def = NULL;
+   __atomic_store_n(&(pvt->audio.playback_ack), pvt->audio.playback_seq, __ATOMIC_RELEASE);
+   __atomic_store_n(&(pvt->audio.critical_error), 1, __ATOMIC_RELEASE);
+   alsa_input_monitor_kick(pvt);
+}
+
+/*
+ Called by the audio thread when a critical error occurs on a shared sound
+ device : all the lines using it are disconnected
+*/
+static void alsa_input_audio_shared_failed(alsa_input_chan_t *t,
+   alsa_input_snd_shared_t *sh)
+{
+   unsigned int c;
+
+   if ((sh->users > 0) && (!sh->failed)) {
+      alsa_input_epoll_del(t->audio.epfd, sh->fd);
+   }
+   sh->failed = true;
+   for (c = 0; (c < sh->channels); c += 1) {
+      alsa_input_pvt_t *pvt = sh->lines[c];
+      if ((NULL != pvt) && (!pvt->audio.failed)) {
+         alsa_input_audio_critical_error(pvt);
+      }
+   }
+}
+
+/* Return true if the line has a playback device that can be used */
+static inline bool alsa_input_audio_can_play(const alsa_input_pvt_t *pvt)
+{
+   if (pvt->audio.failed) {
+      return (false);
+   }
+   if (NULL != pvt->audio.shared_playback) {
+      return (!pvt->audio.shared_playback->failed);
+   }
+   return (NULL != pvt->audio.snd_playback.card);
+}
+
+/*
+ Registers (or unregisters) the sound playback device in the epoll set of
+ the audio thread. It's polled while a tone is playing or voice is queued
+*/
+static void alsa_input_audio_poll_playback(alsa_input_pvt_t *pvt, bool poll)
+{
+   if (poll == pvt->audio.playback_polled) {
+      return;
+   }
+   if (poll) {
+      if (!alsa_input_audio_can_play(pvt)) {
+         return;
+      }
+      if (NULL != pvt->audio.shared_playback) {
+         if (alsa_input_audio_shared_acquire(pvt->channel, pvt->audio.shared_playback)) {
+            alsa_input_audio_critical_error(pvt);
+            return;
+         }
+      }
+      else if (alsa_input_epoll_add(pvt->channel->audio.epfd, pvt->audio.fd_snd_playback, EPOLLOUT, &(pvt->audio.src_playback))) {
+         alsa_input_audio_critical_error(pvt);
+         return;
+      }
+      pvt->audio.playback_polled = true;
+   }
+   else {
+      if (NULL != pvt->audio.shared_playback) {
+         alsa_input_audio_shared_release(pvt->channel, pvt->audio.shared_playback);
+      }
+      else {
+         alsa_input_epoll_del(pvt->channel->audio.epfd, pvt->audio.fd_snd_playback);
+      }
+      pvt->audio.playback_polled = false;
+   }
+}
+
+/*
+ Drops the voice queued in the playback ring. Must only be called when the
+ producer can't queue samples (a tone is being started or stopped, or
+ the line is closed)
+*/
+static void alsa_input_audio_flush_playback(alsa_input_pvt_t *pvt)
+{
+   __atomic_store_n(&(pvt->audio.play_tail),
+      __atomic_load_n(&(pvt->audio.play_head), __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+   __atomic_store_n(&(pvt->audio.play_idle), 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ Stops the concealment of the voice until voice is played again (a tone is
+ started or stopped, or the concealment gave up) : the playback device
+ wakes up the audio thread for each period again
+*/
+static void alsa_input_audio_conceal_stop(alsa_input_pvt_t *pvt)
+{
+   if (NULL != pvt->audio.plc) {
+      alsa_input_plc_reset(pvt->audio.plc);
+   }
+   if (NULL != pvt->audio.snd_playback.card) {
+      alsa_input_snd_card_set_avail_min(&(pvt->audio.snd_playback), pvt->audio.snd_playback.period_size);
+   }
+}
+
+/*
+ Adds a measure of the delay of a sound device to the statistics (only the
+ audio thread writes them)
+*/
+static void alsa_input_stats_delay_add(alsa_input_stats_delay_t *d,
+   unsigned long delay)
+{
+   if ((0 == d->count) || (delay < d->min)) {
+      __atomic_store_n(&(d->min), delay, __ATOMIC_RELAXED);
+   }
+   if (delay > d->max) {
+      __atomic_store_n(&(d->max), delay, __ATOMIC_RELAXED);
+   }
+   __atomic_store_n(&(d->sum), d->sum + delay, __ATOMIC_RELAXED);
+   __atomic_store_n(&(d->last), delay, __ATOMIC_RELAXED);
+   __atomic_store_n(&(d->count), d->count + 1, __ATOMIC_RELAXED);
+}
+
+/* Counts an underrun of the playback device, unless it was left to run dry */
+static inline void alsa_input_audio_underrun(alsa_input_pvt_t *pvt)
+{
+   if (!pvt->audio.play_drained) {
+      __atomic_add_fetch(&(pvt->stats.playback_xruns), 1, __ATOMIC_RELAXED);
+   }
+}
+
+static void alsa_input_audio_start_capture(alsa_input_pvt_t *pvt)
+{
+   if ((pvt->audio.capturing) || (pvt->audio.failed)) {
+      return;
+   }
+   pvt->audio.offset_capture = 0;
+   alsa_input_dtmf_reset(&(pvt->audio.dtmf));
+   alsa_input_vad_reset(&(pvt->audio.vad), alsa_input_audio_line_cfg(pvt));
+   if (NULL != pvt->audio.aec) {
+      alsa_input_aec_restart(pvt->audio.aec);
+   }
+   if (NULL != pvt->audio.ns) {
+      alsa_input_ns_restart(pvt->audio.ns);
+   }
+   if (NULL != pvt->audio.shared_capture) {
+      if (alsa_input_audio_shared_acquire(pvt->channel, pvt->audio.shared_capture)) {
+         alsa_input_audio_critical_error(pvt);
+         return;
+      }
+   }
+   else {
+      if (NULL == pvt->audio.snd_capture.card) {
+         return;
+      }
+      alsa_input_snd_card_start(&(pvt->audio.snd_capture));
+      if (alsa_input_epoll_add(pvt->channel->audio.epfd, pvt->audio.fd_snd_capture, EPOLLIN, &(pvt->audio.src_capture))) {
+         alsa_input_audio_critical_error(pvt);
+         return;
+      }
+   }
+   pvt->audio.capturing = true;
+}
+
+static void alsa_input_audio_stop_capture(alsa_input_pvt_t *pvt)
+{
+   if (!pvt->audio.capturing) {
+      return;
+   }
+   if (NULL != pvt->audio.shared_capture) {
+      alsa_input_audio_shared_release(pvt->channel, pvt->audio.shared_capture);
+      pvt->audio.capturing = false;
+      return;
+   }
+   /*
+    Sound input device can return POLLERR after call of snd_pcm_drop(),
+    so we unregister it first
+   */
+   alsa_input_epoll_del(pvt->channel->audio.epfd, pvt->audio.fd_snd_capture);
+   pvt->audio.capturing = false;
+   alsa_input_snd_card_stop(&(pvt->audio.snd_capture));
+}
+
+/*
+ Stops the tone and releases the playback device for alsa_input_chan_write()
+*/
+static void alsa_input_audio_end_tone(alsa_input_pvt_t *pvt,
+   bool drop_playback)
+{
+   alsa_input_audio_poll_playback(pvt, false);
+   pvt->audio.tone_def = NULL;
+   pvt->audio.play_drained = true;
+   if ((drop_playback) && (NULL != pvt->audio.snd_playback.card)) {
+      alsa_input_snd_card_stop(&(pvt->audio.snd_playback));
+   }
+   __atomic_store_n(&(pvt->audio.playback_ack), pvt->audio.playback_seq, __ATOMIC_RELEASE);
+}
+
+static void alsa_input_audio_set_tone(alsa_input_pvt_t *pvt,
+   const alsa_input_audio_cmd_t *cmd)
+{
+   pvt->audio.playback_seq = cmd->playback_seq;
+   /*
+    alsa_input_chan_write() doesn't queue voice until the command is
+    acknowledged : the voice queued before the tone is dropped
+   */
+   alsa_input_audio_flush_playback(pvt);
+   alsa_input_audio_conceal_stop(pvt);
+   if ((NULL == cmd->tone_def) || (!alsa_input_audio_can_play(pvt))) {
+      alsa_input_audio_end_tone(pvt, cmd->drop_playback);
+      return;
+   }
+   pvt->audio.tone_def = cmd->tone_def;
+   alsa_input_tone_state_init(&(pvt->audio.tone_state), cmd->tone_def);
+   pvt->audio.tone_duration_in_bytes = cmd->tone_duration_in_bytes;
+   pvt->audio.tone_bytes_generated = 0;
+   pvt->audio.tone_buf_len = 0;
+   pvt->audio.offset_tone_buf = 0;
+   /* The tone is written each time the playback device can accept samples */
+   alsa_input_audio_poll_playback(pvt, true);
+}
+
+/* Handles the commands sent to the audio thread for a line */
+static void alsa_input_audio_handle_cmds(alsa_input_pvt_t *pvt)
+{
+   unsigned int tail = pvt->audio.cmds_tail;
+   unsigned int head = __atomic_load_n(&(pvt->audio.cmds_head), __ATOMIC_ACQUIRE);
+
+   while (tail != head) {
+      const alsa_input_audio_cmd_t *cmd = &(pvt->audio.cmds[tail % AI_AUDIO_CMDS_LEN]);
+      switch (cmd->kind) {
+         case AI_AUDIO_CMD_CAPTURE_START: {
+            if ((pvt->audio.capturing) && (!pvt->audio.capture_deliver)) {
+               /* The partial frame captured for detection only is dropped */
+               pvt->audio.offset_capture = 0;
+            }
+            pvt->audio.capture_deliver = true;
+            alsa_input_audio_start_capture(pvt);
+            break;
+         }
+         case AI_AUDIO_CMD_DETECT_START: {
+            pvt->audio.capture_deliver = false;
+            alsa_input_audio_start_capture(pvt);
+            break;
+         }
+         case AI_AUDIO_CMD_CAPTURE_STOP: {
+            alsa_input_audio_stop_capture(pvt);
+            break;
+         }
+         case AI_AUDIO_CMD_TONE: {
+            alsa_input_audio_set_tone(pvt, cmd);
+            break;
+         }
+         case AI_AUDIO_CMD_PLAYBACK: {
+            /* Voice is written when no tone is playing */
+            if (NULL == pvt->audio.tone_def) {
+               alsa_input_audio_poll_playback(pvt, true);
+            }
+            break;
+         }
+         case AI_AUDIO_CMD_CLOSE: {
+            alsa_input_audio_stop_capture(pvt);
+            alsa_input_audio_end_tone(pvt, false);
+            alsa_input_audio_flush_playback(pvt);
+            alsa_input_audio_conceal_stop(pvt);
+            if (NULL != pvt->audio.snd_capture.card) {
+               alsa_input_snd_card_deinit(&(pvt->audio.snd_capture));
+               pvt->audio.fd_snd_capture = -1;
+            }
+            if (NULL != pvt->audio.snd_playback.card) {
+               alsa_input_snd_card_deinit(&(pvt->audio.snd_playback));
+               pvt->audio.fd_snd_playback = -1;
+            }
+            /* Shared devices stay open for the other lines */
+            if (NULL != pvt->audio.shared_capture) {
+               pvt->audio.shared_capture->lines[pvt->audio.channel_capture] = NULL;
+               pvt->audio.shared_capture = NULL;
+            }
+            if (NULL != pvt->audio.shared_playback) {
+               pvt->audio.shared_playback->lines[pvt->audio.channel_playback] = NULL;
+               pvt->audio.shared_playback = NULL;
+            }
+            /* The devices thread can reopen the line */
+            __atomic_store_n(&(pvt->audio.close_ack), cmd->close_seq, __ATOMIC_RELEASE);
+            if (pvt->channel->devices.fd_wakeup >= 0) {
+               uint64_t val = 1;
+               if (write(pvt->channel->devices.fd_wakeup, &(val), sizeof(val)) < 0) {
+                  alsa_input_pr_debug("Unable to wake up the devices thread ('%s')\n", strerror(errno));
+               }
+            }
+            break;
+         }
+         default: {
+            alsa_input_assert(false);
+            break;
+         }
+      }
+      tail += 1;
+   }
+   __atomic_store_n(&(pvt->audio.cmds_tail), tail, __ATOMIC_RELEASE);
+}
+
+/*
+ Return the events of a sound device, as returned by
+ snd_pcm_poll_descriptors_revents()
+*/
+static unsigned short alsa_input_audio_snd_revents(alsa_input_snd_card_t *t,
+   int fd, short events, uint32_t revents)
+{
+   struct pollfd pfd;
+   unsigned short snd_revents;
+   int err;
+
+   pfd.fd = fd;
+   pfd.events = events;
+   pfd.revents = (short)(revents);
+   err = snd_pcm_poll_descriptors_revents(t->card, &(pfd), 1, &(snd_revents));
+   if (err) {
+      ast_log(AST_LOG_ERROR, "snd_pcm_poll_descriptors_revents() failed: '%s'\n", snd_strerror(err));
+      snd_revents = POLLERR;
+   }
+   return (snd_revents);
+}
+
+/*
+ Return where the next captured samples of the line must be stored : in the
+ frame being captured, or in buf_dropped if the ring of frames is full
+*/
+static inline __u8 *alsa_input_audio_capture_ptr(alsa_input_pvt_t *pvt)
+{
+   if (pvt->audio.capture_dropping) {
+      return (pvt->audio.buf_dropped + pvt->audio.offset_capture);
+   }
+   return (&(pvt->audio.frames[pvt->audio.frames_head & (pvt->audio.frames_len - 1)].buf[AST_FRIENDLY_OFFSET + pvt->audio.offset_capture]));
+}
+
+static __u8 *alsa_input_audio_capture_buf(alsa_input_pvt_t *pvt)
+{
+   unsigned int head = pvt->audio.frames_head;
+
+   if (0 == pvt->audio.offset_capture) {
+      /*
+       If alsa_input_chan_read() doesn't read the frames quickly enough,
+       the new frame is dropped but we must still read the device. The
+       frames are dropped too when capture only runs for DTMF detection
+      */
+      pvt->audio.capture_dropping = ((!pvt->audio.capture_deliver)
+         || ((head - __atomic_load_n(&(pvt->audio.frames_tail), __ATOMIC_ACQUIRE)) >= pvt->audio.frames_len));
+   }
+   return (alsa_input_audio_capture_ptr(pvt));
+}
+
+/*
+ Runs the DTMF detector on len bytes captured and hands the digit detected
+ to the monitor
+*/
+static void alsa_input_audio_detect_dtmf(alsa_input_pvt_t *pvt, size_t len)
+{
+   const __u8 *data = alsa_input_audio_capture_ptr(pvt);
+   char digit;
+
+   digit = alsa_input_dtmf_process(&(pvt->audio.dtmf), (const int16_t *)data, len / SAMPLE_SIZE);
+   if ('\0' != digit) {
+      unsigned int head = pvt->audio.dtmf_head;
+
+      if ((head - __atomic_load_n(&(pvt->audio.dtmf_tail), __ATOMIC_ACQUIRE)) < AI_DTMF_DIGITS_LEN) {
+         pvt->audio.dtmf_digits[head % AI_DTMF_DIGITS_LEN] = digit;
+         __atomic_store_n(&(pvt->audio.dtmf_head), head + 1, __ATOMIC_RELEASE);
+      }
+      alsa_input_monitor_kick(pvt);
+   }
+}
+
+/*
+ Stores count samples written to the playback device in the reference of
+ the echo canceller
+*/
+static void alsa_input_audio_played(alsa_input_pvt_t *pvt,
+   const int16_t *samples, size_t count)
+{
+   size_t head = pvt->audio.ref_head;
+
+   if (NULL == pvt->audio.aec) {
+      return;
+   }
+   if (count > pvt->audio.ref_size) {
+      samples += count - pvt->audio.ref_size;
+      head += count - pvt->audio.ref_size;
+      count = pvt->audio.ref_size;
+   }
+   while (count > 0) {
+      size_t offset = head & (pvt->audio.ref_size - 1);
+      size_t n = pvt->audio.ref_size - offset;
+
+      if (n > count) {
+         n = count;
+      }
+      memcpy(&(pvt->audio.ref_buf[offset]), samples, n * SAMPLE_SIZE);
+      samples += n;
+      head += n;
+      count -= n;
+   }
+   pvt->audio.ref_head = head;
+}
+
+/*
+ Returns the number of samples written to the playback device of the line
+ and not yet played
+*/
+static size_t alsa_input_audio_playback_delay(alsa_input_pvt_t *pvt)
+{
+   alsa_input_snd_shared_t *sh = pvt->audio.shared_playback;
+
+   if (NULL != sh) {
+      if (sh->failed) {
+         return (0);
+      }
+      /* Frames pulled from the lines but not yet written count too */
+      return (alsa_input_snd_card_delay(&(sh->card), SND_PCM_STREAM_PLAYBACK) + sh->buf_len);
+   }
+   return (alsa_input_snd_card_delay(&(pvt->audio.snd_playback), SND_PCM_STREAM_PLAYBACK));
+}
+
+/*
+ Returns the number of samples captured by the capture device of the line
+ and not yet read
+*/
+static size_t alsa_input_audio_capture_delay(alsa_input_pvt_t *pvt)
+{
+   alsa_input_snd_shared_t *sh = pvt->audio.shared_capture;
+
+   if (NULL != sh) {
+      return ((sh->failed) ? 0 : alsa_input_snd_card_delay(&(sh->card), SND_PCM_STREAM_CAPTURE));
+   }
+   return (alsa_input_snd_card_delay(&(pvt->audio.snd_capture), SND_PCM_STREAM_CAPTURE));
+}
+
+/*
+ Removes the echo of the sound played from len bytes captured. The
+ reference is taken from the samples written to the playback device, at
+ the position the delays of both devices give : the sample being played is
+ the one written playback delay samples ago, and the last sample captured
+ was heard capture delay samples ago
+*/
+static void alsa_input_audio_cancel_echo(alsa_input_pvt_t *pvt, size_t len)
+{
+   alsa_input_aec_t *aec = pvt->audio.aec;
+   int16_t *data = (int16_t *)(alsa_input_audio_capture_ptr(pvt));
+   size_t count = len / SAMPLE_SIZE;
+   size_t head = pvt->audio.ref_head;
+   size_t play_delay = alsa_input_audio_playback_delay(pvt);
+   size_t pos = pvt->audio.ref_pos;
+   size_t i;
+
+   /*
+    The position is followed from chunk to chunk, and set again when the
+    delays drift from it by more than a block. When nothing is played, it
+    runs past ref_head (silence)
+   */
+   if ((play_delay > 0) || (pvt->audio.playback_polled)) {
+      size_t target = head - play_delay - alsa_input_audio_capture_delay(pvt) - count
+         - (AI_AEC_MARGIN_MS * alsa_input_rate_samples_per_ms(pvt->rate));
+      size_t drift = (target > pos) ? (target - pos) : (pos - target);
+      if (drift > aec->block) {
+         pos = target;
+      }
+   }
+   for (i = 0; (i < count); i += 1) {
+      size_t j = pos + i;
+      /* Samples not yet written, or overwritten, are silence */
+      if ((head - j - 1) < pvt->audio.ref_size) {
+         pvt->audio.ref_chunk[i] = pvt->audio.ref_buf[j & (pvt->audio.ref_size - 1)];
+      }
+      else {
+         pvt->audio.ref_chunk[i] = 0;
+      }
+   }
+   pvt->audio.ref_pos = pos + count;
+   alsa_input_aec_process(aec, data, pvt->audio.ref_chunk, count);
+}
+
+/*
+ Runs the voice activity detector on the frame being captured, which is
+ full. Return false if the frame must be dropped : during silences, only a
+ comfort noise frame is delivered when they start (AI_VAD_CNG)
+*/
+static bool alsa_input_audio_vad(alsa_input_pvt_t *pvt)
+{
+   alsa_input_audio_frame_t *fr = &(pvt->audio.frames[pvt->audio.frames_head & (pvt->audio.frames_len - 1)]);
+   size_t count = pvt->audio.offset_capture / SAMPLE_SIZE;
+   bool was_talking = pvt->audio.vad.talking;
+   alsa_input_vad_mode_t mode = alsa_input_audio_line_cfg(pvt)->vad;
+
+   fr->cng = false;
+   if (AI_VAD_NONE == mode) {
+      return (true);
+   }
+   if (alsa_input_vad_process(&(pvt->audio.vad), (const int16_t *)(&(fr->buf[AST_FRIENDLY_OFFSET])),
+      count, count / alsa_input_rate_samples_per_ms(pvt->rate))) {
+      return (true);
+   }
+   if ((AI_VAD_CNG == mode) && (was_talking)) {
+      int level = -lrintf(pvt->audio.vad.noise);
+
+      fr->cng = true;
+      fr->cng_level = (level < 0) ? 0 : ((level > 127) ? 127 : level);
+      return (true);
+   }
+   return (false);
+}
+
+/*
+ Accounts len bytes stored at alsa_input_audio_capture_buf() : when the
+ frame is full, it's delivered to alsa_input_chan_read()
+*/
+static void alsa_input_audio_captured(alsa_input_pvt_t *pvt, size_t len)
+{
+   const alsa_input_line_config_t *line_cfg = alsa_input_audio_line_cfg(pvt);
+
+   if (NULL != pvt->audio.aec) {
+      alsa_input_audio_cancel_echo(pvt, len);
+   }
+   if (line_cfg->dtmf_detect) {
+      alsa_input_audio_detect_dtmf(pvt, len);
+   }
+   if ((NULL != pvt->audio.ns) && (pvt->audio.capture_deliver)) {
+      alsa_input_ns_process(pvt->audio.ns,
+         (int16_t *)(alsa_input_audio_capture_ptr(pvt)), len / SAMPLE_SIZE);
+   }
+   if ((line_cfg->agc) && (pvt->audio.capture_deliver)) {
+      alsa_input_agc_process(&(pvt->audio.agc),
+         (int16_t *)(alsa_input_audio_capture_ptr(pvt)), len / SAMPLE_SIZE);
+   }
+   pvt->audio.offset_capture += len;
+   if (pvt->audio.offset_capture >= pvt->audio.frame_size) {
+      /* Frame is full, frames of silence may be dropped */
+      if (pvt->audio.capture_dropping) {
+         if (pvt->audio.capture_deliver) {
+            __atomic_add_fetch(&(pvt->stats.capture_dropped), 1, __ATOMIC_RELAXED);
+         }
+      }
+      else if (alsa_input_audio_vad(pvt)) {
+         unsigned int head = pvt->audio.frames_head;
+         unsigned long waiting = head + 1 - __atomic_load_n(&(pvt->audio.frames_tail), __ATOMIC_ACQUIRE);
+         uint64_t val = 1;
+         pvt->audio.frames[head & (pvt->audio.frames_len - 1)].len = pvt->audio.offset_capture;
+         __atomic_store_n(&(pvt->audio.frames_head), head + 1, __ATOMIC_RELEASE);
+         __atomic_add_fetch(&(pvt->stats.capture_frames), 1, __ATOMIC_RELAXED);
+         if (waiting > pvt->stats.capture_queue_max) {
+            __atomic_store_n(&(pvt->stats.capture_queue_max), waiting, __ATOMIC_RELAXED);
+         }
+         if (write(pvt->audio.fd_frames, &(val), sizeof(val)) < 0) {
+            alsa_input_pr_debug("Unable to write eventfd ('%s')\n", strerror(errno));
+         }
+      }
+      pvt->audio.offset_capture = 0;
+   }
+}
+
+/*
+ Reads as much data as possible coming from the sound capture device and
+ delivers the frames to alsa_input_chan_read()
+*/
+static void alsa_input_audio_read_capture(alsa_input_pvt_t *pvt,
+   uint32_t revents)
+{
+   unsigned short snd_revents;
+
+   if (!pvt->audio.capturing) {
+      return;
+   }
+   snd_revents = alsa_input_audio_snd_revents(&(pvt->audio.snd_capture),
+      pvt->audio.fd_snd_capture, POLLIN, revents);
+   if ((snd_revents & (POLLHUP | POLLNVAL))) {
+      alsa_input_pr_debug("Line %lu : epoll_wait() returned an error for sound input device (revents == %u)\n",
+         (unsigned long)(pvt->index_line + 1), (unsigned int)(snd_revents));
+      alsa_input_audio_critical_error(pvt);
+      return;
+   }
+   /* POLLERR (overrun) is handled by alsa_input_snd_card_read() below */
+
+   for (;;) {
+      snd_pcm_state_t state;
+      snd_pcm_sframes_t read;
+      __u8 *buf = alsa_input_audio_capture_buf(pvt);
+
+      state = snd_pcm_state(pvt->audio.snd_capture.card);
+      if (SND_PCM_STATE_XRUN == state) {
+         __atomic_add_fetch(&(pvt->stats.capture_xruns), 1, __ATOMIC_RELAXED);
+      }
+      if ((state != SND_PCM_STATE_PREPARED) && (state != SND_PCM_STATE_RUNNING)) {
+         int err = snd_pcm_prepare(pvt->audio.snd_capture.card);
+         if (err) {
+            ast_log(AST_LOG_ERROR, "snd_pcm_prepare() failed: '%s'\n", snd_strerror(err));
+         }
+      }
+
+      read = alsa_input_snd_card_read(&(pvt->audio.snd_capture), buf,
+         (pvt->audio.frame_size - pvt->audio.offset_capture) / SAMPLE_SIZE);
+      if (read < 0) {
+         if (-EPIPE == read) {
+            __atomic_add_fetch(&(pvt->stats.capture_xruns), 1, __ATOMIC_RELAXED);
+         }
+         if (alsa_input_snd_card_handle_error(&(pvt->audio.snd_capture), read, "alsa_input_snd_card_read")) {
+            /* Critical error */
+            alsa_input_audio_critical_error(pvt);
+         }
+         break;
+      }
+      if (0 == read) {
+         break;
+      }
+
+      alsa_input_audio_captured(pvt, read * SAMPLE_SIZE);
+   }
+   if (pvt->audio.capturing) {
+      alsa_input_stats_delay_add(&(pvt->stats.capture_delay),
+         alsa_input_snd_card_delay(&(pvt->audio.snd_capture), SND_PCM_STREAM_CAPTURE));
+   }
+}
+
+/*
+ Generates samples of the tone in tone_buf if there's not enough. Return
+ false if the whole tone has been played
+*/
+static bool alsa_input_audio_fill_tone_buf(alsa_input_pvt_t *pvt)
+{
+   /* We test if there is samples to write */
+   if (pvt->audio.tone_buf_len < SAMPLE_SIZE) {
+      /*
+       * Not enough data, we generate some samples, but we must be careful about
+       * tone duration asked
+       */
+      size_t len_needed;
+
+      if (pvt->audio.tone_buf_len > 0) {
+         memmove(pvt->audio.tone_buf,
+            &(pvt->audio.tone_buf[pvt->audio.offset_tone_buf]),
+            pvt->audio.tone_buf_len);
+      }
+      pvt->audio.offset_tone_buf = 0;
+
+      len_needed = pvt->audio.frame_size - pvt->audio.tone_buf_len;
+      if (pvt->audio.tone_duration_in_bytes > 0) {
+         if ((pvt->audio.tone_bytes_generated + len_needed) > pvt->audio.tone_duration_in_bytes) {
+            len_needed = pvt->audio.tone_duration_in_bytes - pvt->audio.tone_bytes_generated;
+         }
+      }
+      if (len_needed > 0) {
+         size_t tmp = alsa_input_generate_tone_data(&(pvt->audio.tone_state),
+               &(pvt->audio.tone_buf[pvt->audio.tone_buf_len]),
+               len_needed);
+         alsa_input_gain_apply((int16_t *)(&(pvt->audio.tone_buf[pvt->audio.tone_buf_len])),
+            tmp / SAMPLE_SIZE, __atomic_load_n(&(pvt->audio.play_gain), __ATOMIC_RELAXED));
+         pvt->audio.tone_buf_len += tmp;
+         pvt->audio.tone_bytes_generated += tmp;
+      }
+   }
+   return (pvt->audio.tone_buf_len >= SAMPLE_SIZE);
+}
+
+/*
+ Called when the playback ring is found empty (tail is play_tail) : the
+ playback device is no more polled for voice until alsa_input_chan_write()
+ queues samples and sees play_idle set. Return false if samples have been
+ queued meanwhile (the device is polled again)
+*/
+static bool alsa_input_audio_voice_idle(alsa_input_pvt_t *pvt, size_t tail)
+{
+   alsa_input_audio_poll_playback(pvt, false);
+   __atomic_store_n(&(pvt->audio.play_idle), 1, __ATOMIC_SEQ_CST);
+   if ((__atomic_load_n(&(pvt->audio.play_head), __ATOMIC_SEQ_CST) != tail)
+       && (__atomic_exchange_n(&(pvt->audio.play_idle), 0, __ATOMIC_SEQ_CST))) {
+      /* Samples queued meanwhile, without AI_AUDIO_CMD_PLAYBACK */
+      alsa_input_audio_poll_playback(pvt, true);
+      return (false);
+   }
+   return (true);
+}
+
+/*
+ Called when the playback ring is found empty while voice is played on a
+ dedicated playback device : once the device holds only a period (the audio
+ thread is woken up then, see avail_min), a period of concealment is
+ written so that the device doesn't underrun. Return false if there's
+ nothing to conceal, the device is then no more polled for voice
+*/
+static bool alsa_input_audio_conceal(alsa_input_pvt_t *pvt)
+{
+   alsa_input_plc_t *plc = pvt->audio.plc;
+   alsa_input_snd_card_t *card = &(pvt->audio.snd_playback);
+   size_t count = pvt->audio.frame_size / SAMPLE_SIZE;
+   snd_pcm_uframes_t wake = card->buffer_size - card->period_size;
+   snd_pcm_sframes_t avail;
+   snd_pcm_sframes_t written;
+
+   if ((NULL == plc) || (!plc->armed)) {
+      return (false);
+   }
+   if (alsa_input_plc_expired(plc)) {
+      /* Enough silence : the device is left to run dry */
+      alsa_input_audio_conceal_stop(pvt);
+      pvt->audio.play_drained = true;
+      return (false);
+   }
+   if (SND_PCM_STATE_RUNNING != snd_pcm_state(card->card)) {
+      /* Not started yet (or already underrun) : it waits for the voice */
+      return (false);
+   }
+   alsa_input_snd_card_set_avail_min(card, wake);
+   avail = snd_pcm_avail_update(card->card);
+   if ((avail >= 0) && ((snd_pcm_uframes_t)(avail) < wake)) {
+      /* More than a period to play */
+      return (true);
+   }
+
+   alsa_input_plc_generate(plc, pvt->audio.plc_buf, count);
+   written = alsa_input_snd_card_write(card, (const __u8 *)(pvt->audio.plc_buf), count);
+   if (written < 0) {
+      if (alsa_input_snd_card_handle_error(card, written, "alsa_input_snd_card_write")) {
+         /* Critical error */
+         alsa_input_audio_critical_error(pvt);
+      }
+      return (true);
+   }
+   alsa_input_audio_played(pvt, pvt->audio.plc_buf, written);
+   __atomic_add_fetch(&(pvt->stats.concealed), 1, __ATOMIC_RELAXED);
+   return (true);
+}
+
+/*
+ Writes as many samples of the tone as the sound playback device can accept
+*/
+static void alsa_input_audio_write_tone(alsa_input_pvt_t *pvt,
+   uint32_t revents)
+{
+   unsigned short snd_revents;
+
+   if ((!pvt->audio.playback_polled) || (NULL == pvt->audio.tone_def)) {
+      return;
+   }
+   snd_revents = alsa_input_audio_snd_revents(&(pvt->audio.snd_playback),
+      pvt->audio.fd_snd_playback, POLLOUT, revents);
+   if ((snd_revents & (POLLHUP | POLLNVAL))) {
+      alsa_input_pr_debug("Line %lu : epoll_wait() returned an error for sound output device (revents == %u)\n",
+         (unsigned long)(pvt->index_line + 1), (unsigned int)(snd_revents));
+      alsa_input_audio_critical_error(pvt);
+      return;
+   }
+   /* POLLERR (underrun) is handled by alsa_input_snd_card_write() below */
+
+   for (;;) {
+      if (alsa_input_audio_fill_tone_buf(pvt)) {
+         snd_pcm_state_t state;
+         snd_pcm_sframes_t written;
+         size_t tmp;
+
+         /* We test if playback card is started */
+         state = snd_pcm_state(pvt->audio.snd_playback.card);
+         if (SND_PCM_STATE_XRUN == state) {
+            alsa_input_audio_underrun(pvt);
+         }
+         if ((state != SND_PCM_STATE_PREPARED) && (state != SND_PCM_STATE_RUNNING)) {
+            int err = snd_pcm_prepare(pvt->audio.snd_playback.card);
+            if (err) {
+               ast_log(AST_LOG_ERROR, "snd_pcm_prepare() failed: '%s'\n", snd_strerror(err));
+            }
+         }
+         written = alsa_input_snd_card_write(&(pvt->audio.snd_playback),
+            &(pvt->audio.tone_buf[pvt->audio.offset_tone_buf]),
+            pvt->audio.tone_buf_len / SAMPLE_SIZE);
+         if (written < 0) {
+            if (-EPIPE == written) {
+               alsa_input_audio_underrun(pvt);
+            }
+            if (alsa_input_snd_card_handle_error(&(pvt->audio.snd_playback), written, "alsa_input_snd_card_write")) {
+               /* Critical error */
+               alsa_input_audio_critical_error(pvt);
+            }
+            break;
+         }
+         pvt->audio.play_drained = false;
+         alsa_input_audio_played(pvt,
+            (const int16_t *)(&(pvt->audio.tone_buf[pvt->audio.offset_tone_buf])), written);
+         tmp = (written * SAMPLE_SIZE);
+         pvt->audio.offset_tone_buf += tmp;
+         pvt->audio.tone_buf_len -= tmp;
+         if (pvt->audio.tone_buf_len >= SAMPLE_SIZE) {
+            /* Device is full */
+            break;
+         }
+      }
+      else {
+         /* The whole tone has been written : the monitor will stop it */
+         alsa_input_audio_end_tone(pvt, false);
+         alsa_input_monitor_kick(pvt);
+         break;
+      }
+   }
+}
+
+/*
+ Writes the voice queued by alsa_input_chan_write(). The sound playback
+ device is polled with EPOLLOUT, so it's called each time the device can
+ accept a period (avail_min is the period size)
+*/
+static void alsa_input_audio_write_voice(alsa_input_pvt_t *pvt,
+   uint32_t revents)
+{
+   unsigned short snd_revents;
+   bool voice_written = false;
+
+   if (!pvt->audio.playback_polled) {
+      return;
+   }
+   snd_revents = alsa_input_audio_snd_revents(&(pvt->audio.snd_playback),
+      pvt->audio.fd_snd_playback, POLLOUT, revents);
+   if ((snd_revents & (POLLHUP | POLLNVAL))) {
+      alsa_input_pr_debug("Line %lu : epoll_wait() returned an error for sound output device (revents == %u)\n",
+         (unsigned long)(pvt->index_line + 1), (unsigned int)(snd_revents));
+      alsa_input_audio_critical_error(pvt);
+      return;
+   }
+   /* POLLERR (underrun) is handled by alsa_input_snd_card_write() below */
+
+   for (;;) {
+      size_t tail = pvt->audio.play_tail;
+      size_t len = __atomic_load_n(&(pvt->audio.play_head), __ATOMIC_SEQ_CST) - tail;
+      size_t offset;
+      snd_pcm_state_t state;
+      snd_pcm_sframes_t written;
+
+      if (0 == len) {
+         /* Nothing more to play, unless the voice missing is concealed */
+         if (alsa_input_audio_conceal(pvt)) {
+            break;
+         }
+         if (!alsa_input_audio_voice_idle(pvt, tail)) {
+            continue;
+         }
+         break;
+      }
+
+      /* Only the contiguous part of the ring is written */
+      offset = tail & (pvt->audio.play_size - 1);
+      if ((offset + len) > pvt->audio.play_size) {
+         len = pvt->audio.play_size - offset;
+      }
+      if (NULL != pvt->audio.plc) {
+         alsa_input_plc_resume(pvt->audio.plc, (int16_t *)(&(pvt->audio.play_buf[offset])), len / SAMPLE_SIZE);
+      }
+
+      state = snd_pcm_state(pvt->audio.snd_playback.card);
+      if (SND_PCM_STATE_XRUN == state) {
+         alsa_input_audio_underrun(pvt);
+      }
+      if ((state != SND_PCM_STATE_PREPARED) && (state != SND_PCM_STATE_RUNNING)) {
+         int err = snd_pcm_prepare(pvt->audio.snd_playback.card);
+         if (err) {
+            ast_log(AST_LOG_ERROR, "snd_pcm_prepare() failed: '%s'\n", snd_strerror(err));
+         }
+      }
+      written = alsa_input_snd_card_write(&(pvt->audio.snd_playback),
+         &(pvt->audio.play_buf[offset]), len / SAMPLE_SIZE);
+      if (written < 0) {
+         if (-EPIPE == written) {
+            alsa_input_audio_underrun(pvt);
+         }
+         if (alsa_input_snd_card_handle_error(&(pvt->audio.snd_playback), written, "alsa_input_snd_card_write")) {
+            /* Critical error */
+            alsa_input_audio_critical_error(pvt);
+         }
+         break;
+      }
+      pvt->audio.play_drained = false;
+      voice_written = true;
+      alsa_input_audio_played(pvt, (const int16_t *)(&(pvt->audio.play_buf[offset])), written);
+      if (NULL != pvt->audio.plc) {
+         alsa_input_plc_played(pvt->audio.plc, (const int16_t *)(&(pvt->audio.play_buf[offset])), written);
+      }
+      __atomic_store_n(&(pvt->audio.play_tail), tail + (written * SAMPLE_SIZE), __ATOMIC_RELEASE);
+      if ((size_t)(written * SAMPLE_SIZE) < len) {
+         /* Device is full */
+         break;
+      }
+   }
+   if (voice_written) {
+      alsa_input_stats_delay_add(&(pvt->stats.playback_delay),
+         alsa_input_snd_card_delay(&(pvt->audio.snd_playback), SND_PCM_STREAM_PLAYBACK));
+   }
+}
+
+/* Return true if the line has samples to play : a tone, or voice queued */
+static inline bool alsa_input_audio_has_playback(const alsa_input_pvt_t *pvt)
+{
+   return ((NULL != pvt->audio.tone_def)
+      || (__atomic_load_n(&(pvt->audio.play_head), __ATOMIC_ACQUIRE) != pvt->audio.play_tail));
+}
+
+/*
+ Copies at most count samples to play on the line (tone or voice) to dst,
+ for a shared playback device. If conceal is true and the voice queued
+ runs out, the rest is concealed. Return the number of samples copied
+*/
+static size_t alsa_input_audio_pull_playback(alsa_input_pvt_t *pvt,
+   int16_t *dst, size_t count, bool conceal)
+{
+   size_t done = 0;
+
+   if (NULL != pvt->audio.tone_def) {
+      while (done < count) {
+         size_t n;
+
+         if (!alsa_input_audio_fill_tone_buf(pvt)) {
+            /* The whole tone has been written : the monitor will stop it */
+            alsa_input_audio_end_tone(pvt, false);
+            alsa_input_monitor_kick(pvt);
+            break;
+         }
+         n = pvt->audio.tone_buf_len / SAMPLE_SIZE;
+         if (n > (count - done)) {
+            n = count - done;
+         }
+         memcpy(&(dst[done]), &(pvt->audio.tone_buf[pvt->audio.offset_tone_buf]), n * SAMPLE_SIZE);
+         pvt->audio.offset_tone_buf += (n * SAMPLE_SIZE);
+         pvt->audio.tone_buf_len -= (n * SAMPLE_SIZE);
+         done += n;
+      }
+   }
+   else {
+      while (done < count) {
+         size_t tail = pvt->audio.play_tail;
+         size_t len = __atomic_load_n(&(pvt->audio.play_head), __ATOMIC_SEQ_CST) - tail;
+         size_t offset;
+
+         if (0 == len) {
+            alsa_input_plc_t *plc = pvt->audio.plc;
+
+            if ((NULL != plc) && (plc->armed)) {
+               if (alsa_input_plc_expired(plc)) {
+                  /* Enough silence : the line stops playing */
+                  alsa_input_plc_reset(plc);
+               }
+               else if (conceal) {
+                  alsa_input_plc_generate(plc, &(dst[done]), count - done);
+                  __atomic_add_fetch(&(pvt->stats.concealed), 1, __ATOMIC_RELAXED);
+                  done = count;
+                  break;
+               }
+            }
+            if (!alsa_input_audio_voice_idle(pvt, tail)) {
+               continue;
+            }
+            break;
+         }
+         offset = tail & (pvt->audio.play_size - 1);
+         if ((offset + len) > pvt->audio.play_size) {
+            len = pvt->audio.play_size - offset;
+         }
+         if (len > ((count - done) * SAMPLE_SIZE)) {
+            len = (count - done) * SAMPLE_SIZE;
+         }
+         memcpy(&(dst[done]), &(pvt->audio.play_buf[offset]), len);
+         __atomic_store_n(&(pvt->audio.play_tail), tail + len, __ATOMIC_RELEASE);
+         if (NULL != pvt->audio.plc) {
+            alsa_input_plc_resume(pvt->audio.plc, &(dst[done]), len / SAMPLE_SIZE);
+            alsa_input_plc_played(pvt->audio.plc, &(dst[done]), len / SAMPLE_SIZE);
+         }
+         done += (len / SAMPLE_SIZE);
+      }
+   }
+   return (done);
+}
+
+/* Handles the commands sent to the audio thread for the lines of a shared device */
+static void alsa_input_audio_shared_handle_cmds(alsa_input_snd_shared_t *sh)
+{
+   unsigned int c;
+
+   for (c = 0; (c < sh->channels); c += 1) {
+      if (NULL != sh->lines[c]) {
+         alsa_input_audio_handle_cmds(sh->lines[c]);
+      }
+   }
+}
+
+/*
+ Updates the statistics of the lines using a shared device (capturing or
+ playing) : counts an xrun if xrun is true, else adds the delay of the device
+*/
+static void alsa_input_audio_shared_stats(alsa_input_snd_shared_t *sh,
+   bool xrun)
+{
+   unsigned long delay = 0;
+   unsigned int c;
+
+   if ((!xrun) && ((sh->failed) || (0 == sh->users))) {
+      return;
+   }
+   if (!xrun) {
+      delay = alsa_input_snd_card_delay(&(sh->card), sh->stream);
+   }
+   for (c = 0; (c < sh->channels); c += 1) {
+      alsa_input_pvt_t *pvt = sh->lines[c];
+      if (NULL == pvt) {
+         continue;
+      }
+      if (SND_PCM_STREAM_CAPTURE == sh->stream) {
+         if (!pvt->audio.capturing) {
+            continue;
+         }
+         if (xrun) {
+            __atomic_add_fetch(&(pvt->stats.capture_xruns), 1, __ATOMIC_RELAXED);
+         }
+         else {
+            alsa_input_stats_delay_add(&(pvt->stats.capture_delay), delay);
+         }
+      }
+      else {
+         if (!pvt->audio.playback_polled) {
+            continue;
+         }
+         if (xrun) {
+            alsa_input_audio_underrun(pvt);
+         }
+         else {
+            alsa_input_stats_delay_add(&(pvt->stats.playback_delay), delay);
+         }
+      }
+   }
+}
+
+/*
+ Reads as many periods as possible from a shared capture device : each
+ period is split between the lines capturing
+*/
+static void alsa_input_audio_read_shared(alsa_input_chan_t *t,
+   alsa_input_snd_shared_t *sh, uint32_t revents)
+{
+   unsigned short snd_revents;
+
+   if ((sh->failed) || (0 == sh->users)) {
+      return;
+   }
+   snd_revents = alsa_input_audio_snd_revents(&(sh->card), sh->fd, POLLIN, revents);
+   if ((snd_revents & (POLLHUP | POLLNVAL))) {
+      alsa_input_pr_debug("epoll_wait() returned an error for shared sound input device '%s' (revents == %u)\n",
+         sh->dev_name, (unsigned int)(snd_revents));
+      alsa_input_audio_shared_failed(t, sh);
+      return;
+   }
+
+   for (;;) {
+      snd_pcm_state_t state;
+      snd_pcm_sframes_t read;
+      size_t done = 0;
+
+      state = snd_pcm_state(sh->card.card);
+      if ((state != SND_PCM_STATE_PREPARED) && (state != SND_PCM_STATE_RUNNING)) {
+         int err = snd_pcm_prepare(sh->card.card);
+         if (err) {
+            ast_log(AST_LOG_ERROR, "snd_pcm_prepare() failed: '%s'\n", snd_strerror(err));
+         }
+      }
+      read = alsa_input_snd_card_read(&(sh->card), (__u8 *)(sh->buf), sh->buf_frames);
+      if ((SND_PCM_STATE_XRUN == state) || (-EPIPE == read)) {
+         alsa_input_audio_shared_stats(sh, true);
+      }
+      if (read < 0) {
+         if (alsa_input_snd_card_handle_error(&(sh->card), read, "alsa_input_snd_card_read")) {
+            /* Critical error */
+            alsa_input_audio_shared_failed(t, sh);
+         }
+         break;
+      }
+      if (0 == read) {
+         break;
+      }
+
+      /* Split in chunks that fit in the frames being captured */
+      while (done < (size_t)(read)) {
+         size_t n = read - done;
+         unsigned int c;
+
+         for (c = 0; (c < sh->channels); c += 1) {
+            alsa_input_pvt_t *pvt = sh->lines[c];
+            if ((NULL != pvt) && (pvt->audio.capturing)) {
+               size_t room = (pvt->audio.frame_size - pvt->audio.offset_capture) / SAMPLE_SIZE;
+               sh->ptrs[c] = (int16_t *)(alsa_input_audio_capture_buf(pvt));
+               if (n > room) {
+                  n = room;
+               }
+            }
+            else {
+               /* Channel not used */
+               sh->ptrs[c] = &(sh->planes[c * sh->buf_frames]);
+            }
+         }
+         alsa_input_deinterleave(&(sh->buf[done * sh->channels]), sh->channels, n, sh->ptrs);
+         for (c = 0; (c < sh->channels); c += 1) {
+            alsa_input_pvt_t *pvt = sh->lines[c];
+            if ((NULL != pvt) && (pvt->audio.capturing)) {
+               alsa_input_audio_captured(pvt, n * SAMPLE_SIZE);
+            }
+         }
+         done += n;
+      }
+   }
+   alsa_input_audio_shared_stats(sh, false);
+}
+
+/*
+ Writes periods to a shared playback device while it can accept them : each
+ period merges what the lines are playing, silence for the others
+*/
+static void alsa_input_audio_write_shared(alsa_input_chan_t *t,
+   alsa_input_snd_shared_t *sh, uint32_t revents)
+{
+   unsigned short snd_revents;
+
+   if ((sh->failed) || (0 == sh->users)) {
+      return;
+   }
+   snd_revents = alsa_input_audio_snd_revents(&(sh->card), sh->fd, POLLOUT, revents);
+   if ((snd_revents & (POLLHUP | POLLNVAL))) {
+      alsa_input_pr_debug("epoll_wait() returned an error for shared sound output device '%s' (revents == %u)\n",
+         sh->dev_name, (unsigned int)(snd_revents));
+      alsa_input_audio_shared_failed(t, sh);
+      return;
+   }
+
+   for (;;) {
+      snd_pcm_state_t state;
+      snd_pcm_sframes_t written;
+
+      state = snd_pcm_state(sh->card.card);
+      if (0 == sh->buf_len) {
+         bool pulled = false;
+         bool queued = false;
+         bool tone = false;
+         unsigned int c;
+
+         /*
+          When no line has samples to play, the lines playing voice conceal
+          it once the running device holds only a period (the audio thread
+          is woken up then, see avail_min)
+         */
+         for (c = 0; (c < sh->channels); c += 1) {
+            alsa_input_pvt_t *pvt = sh->lines[c];
+            if ((NULL != pvt) && (pvt->audio.playback_polled)) {
+               queued = (queued || alsa_input_audio_has_playback(pvt));
+               tone = (tone || (NULL != pvt->audio.tone_def));
+            }
+         }
+         if (tone) {
+            alsa_input_snd_card_set_avail_min(&(sh->card), sh->card.period_size);
+         }
+         else if ((!queued) && (SND_PCM_STATE_RUNNING == state)) {
+            snd_pcm_uframes_t wake = sh->card.buffer_size - sh->card.period_size;
+            snd_pcm_sframes_t avail;
+
+            alsa_input_snd_card_set_avail_min(&(sh->card), wake);
+            avail = snd_pcm_avail_update(sh->card.card);
+            if ((avail >= 0) && ((snd_pcm_uframes_t)(avail) < wake)) {
+               break;
+            }
+         }
+
+         for (c = 0; (c < sh->channels); c += 1) {
+            alsa_input_pvt_t *pvt = sh->lines[c];
+            size_t n = 0;
+
+            sh->ptrs[c] = &(sh->planes[c * sh->buf_frames]);
+            if ((NULL != pvt) && (pvt->audio.playback_polled)) {
+               n = alsa_input_audio_pull_playback(pvt, sh->ptrs[c], sh->buf_frames,
+                  (queued || (SND_PCM_STATE_RUNNING == state)));
+               if (n > 0) {
+                  pulled = true;
+               }
+            }
+            memset(&(sh->ptrs[c][n]), 0, (sh->buf_frames - n) * SAMPLE_SIZE);
+         }
+         if (!pulled) {
+            break;
+         }
+         /* The silence that completes the period is played too */
+         for (c = 0; (c < sh->channels); c += 1) {
+            if (NULL != sh->lines[c]) {
+               alsa_input_audio_played(sh->lines[c], sh->ptrs[c], sh->buf_frames);
+            }
+         }
+         alsa_input_interleave((const int16_t * const *)(sh->ptrs), sh->channels, sh->buf_frames, sh->buf);
+         sh->buf_len = sh->buf_frames;
+         sh->buf_offset = 0;
+      }
+
+      if (SND_PCM_STATE_XRUN == state) {
+         alsa_input_audio_shared_stats(sh, true);
+      }
+      if ((state != SND_PCM_STATE_PREPARED) && (state != SND_PCM_STATE_RUNNING)) {
+         int err = snd_pcm_prepare(sh->card.card);
+         if (err) {
+            ast_log(AST_LOG_ERROR, "snd_pcm_prepare() failed: '%s'\n", snd_strerror(err));
+         }
+      }
+      written = alsa_input_snd_card_write(&(sh->card),
+         (const __u8 *)(&(sh->buf[sh->buf_offset * sh->channels])), sh->buf_len);
+      if (-EPIPE == written) {
+         alsa_input_audio_shared_stats(sh, true);
+      }
+      if (written < 0) {
+         if (alsa_input_snd_card_handle_error(&(sh->card), written, "alsa_input_snd_card_write")) {
+            /* Critical error */
+            alsa_input_audio_shared_failed(t, sh);
+         }
+         break;
+      }
+      sh->buf_offset += written;
+      sh->buf_len -= written;
+      if ((sh->buf_len > 0) || (0 == sh->users)) {
+         /* Device is full, or no more polled : what's left is dropped then */
+         if (0 == sh->users) {
+            sh->buf_len = 0;
+         }
+         break;
+      }
+   }
+   alsa_input_audio_shared_stats(sh, false);
+}
+
+/*
+ Sets the scheduling policy and the CPU affinity of the audio thread, as
+ asked in the configuration
+*/
+static void alsa_input_audio_set_scheduling(alsa_input_chan_t *t)
+{
+   int err;
+
+   if (t->config.audio_thread_priority > 0) {
+      struct sched_param param;
+      memset(&(param), 0, sizeof(param));
+      param.sched_priority = t->config.audio_thread_priority;
+      err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &(param));
+      if (err) {
+         ast_log(AST_LOG_WARNING, "Unable to set priority %d (SCHED_FIFO) of the audio thread: '%s'\n",
+            t->config.audio_thread_priority, strerror(err));
+      }
+   }
+   if (t->config.audio_thread_cpu >= 0) {
+      cpu_set_t cpus;
+      CPU_ZERO(&(cpus));
+      CPU_SET(t->config.audio_thread_cpu, &(cpus));
+      err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &(cpus));
+      if (err) {
+         ast_log(AST_LOG_WARNING, "Unable to bind the audio thread to CPU %d: '%s'\n",
+            t->config.audio_thread_cpu, strerror(err));
+      }
+   }
+}
+
+static void *alsa_input_do_audio(void *data)
+{
+   alsa_input_chan_t *t = (alsa_input_chan_t *)(data);
+
+   alsa_input_pr_debug("Entering audio thread\n");
+
+   alsa_input_audio_set_scheduling(t);
+
+   while (t->audio.run) {
+      int nfds;
+      int i;
+
+      nfds = epoll_wait(t->audio.epfd, t->audio.events, t->audio.events_len, -1);
+      if ((nfds < 0) && (EINTR != errno)) {
+         ast_log(AST_LOG_ERROR, "epoll_wait() failed: '%s'\n", strerror(errno));
+      }
+
+      for (i = 0; (i < nfds); i += 1) {
+         const struct epoll_event *ev = &(t->audio.events[i]);
+         alsa_input_monitor_src_t *src = (alsa_input_monitor_src_t *)(ev->data.ptr);
+         alsa_input_pvt_t *pvt = src->pvt;
+         switch (src->kind) {
+            case AI_SRC_WAKEUP: {
+               /* Commands have been sent */
+               uint64_t val;
+               if (read(t->audio.fd_wakeup, &(val), sizeof(val)) < 0) {
+                  alsa_input_pr_debug("Unable to read eventfd ('%s')\n", strerror(errno));
+               }
+               AST_LIST_TRAVERSE(&(t->pvt_list), pvt, list) {
+                  alsa_input_audio_handle_cmds(pvt);
+               }
+               break;
+            }
+            case AI_SRC_CAPTURE: {
+               /* A command stopping the capture can be pending */
+               alsa_input_audio_handle_cmds(pvt);
+               alsa_input_audio_read_capture(pvt, ev->events);
+               break;
+            }
+            case AI_SRC_PLAYBACK: {
+               /* A command stopping the tone can be pending */
+               alsa_input_audio_handle_cmds(pvt);
+               if (NULL != pvt->audio.tone_def) {
+                  alsa_input_audio_write_tone(pvt, ev->events);
+               }
+               else {
+                  alsa_input_audio_write_voice(pvt, ev->events);
+               }
+               break;
+            }
+            case AI_SRC_SHARED_CAPTURE: {
+               alsa_input_audio_shared_handle_cmds(src->shared);
+               alsa_input_audio_read_shared(t, src->shared, ev->events);
+               break;
+            }
+            case AI_SRC_SHARED_PLAYBACK: {
+               alsa_input_audio_shared_handle_cmds(src->shared);
+               alsa_input_audio_write_shared(t, src->shared, ev->events);
+               break;
+            }
+            default: {
+               alsa_input_assert(false);
+               break;
+            }
+         }
+      }
+      __atomic_add_fetch(&(t->audio.passes), 1, __ATOMIC_RELEASE);
+      /* Pairs with the fence of alsa_input_publish_line_cfg() */
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   }
+
+   alsa_input_pr_debug("Exiting audio thread\n");
+
+   return (NULL);
+}
+
+static void alsa_input_stop_audio(alsa_input_chan_t *t)
+{
+   int ret;
+
+   alsa_input_pr_debug("Stopping the audio thread\n");
+
+   if (AST_PTHREADT_NULL == t->audio.thread) {
+      alsa_input_pr_debug("Audio thread not running\n");
+      return;
+   }
+   t->audio.run = false;
+   if (t->audio.fd_wakeup >= 0) {
+      uint64_t val = 1;
+      if (write(t->audio.fd_wakeup, &(val), sizeof(val)) < 0) {
+         alsa_input_pr_debug("Unable to wake up the audio thread ('%s')\n", strerror(errno));
+      }
+   }
+   ret = pthread_join(t->audio.thread, NULL);
+   if (ret) {
+      ast_log(AST_LOG_ERROR, "pthread_join() failed: %d, %d\n", ret, errno);
+   }
+   t->audio.thread = AST_PTHREADT_NULL;
+}
+
+static int alsa_input_start_audio(alsa_input_chan_t *t)
+{
+   int ret = 0;
+
+   alsa_input_pr_debug("Starting the audio thread\n");
+
+   alsa_input_assert((AST_PTHREADT_NULL == t->audio.thread) && (!t->audio.run));
+   t->audio.run = true;
+   if (ast_pthread_create_background(&(t->audio.thread), NULL, alsa_input_do_audio, t) < 0) {
+      ast_log(AST_LOG_ERROR, "Unable to start audio thread.\n");
+      t->audio.run = false;
+      t->audio.thread = AST_PTHREADT_NULL;
+      ret = -1;
+   }
+
+   return (ret);
+}
+
+static inline alsa_input_pvt_t *alsa_input_get_pvt(struct ast_channel *ast)
+{
+   alsa_input_pvt_t *pvt = alsa_input_ast_channel_tech_pvt(ast);
+
+   if ((NULL == pvt) || (pvt->owner != ast)) {
+      ast_log(AST_LOG_WARNING, "Channel '%s' unlink or link to another line\n", alsa_input_ast_channel_name(ast));
+      pvt = NULL;
+   }
+   return (pvt);
+}
+
+/*!
+ * \brief Make a call
+ * \note The channel is locked when this function gets called.
+ * \param ast which channel to make the call on
+ * \param addr destination of the call
+ * \param timeout time to wait on for connect (Doesn't seem to be used.)
+ * \retval 0 on success
+ * \retval -1 on failure
+ */
+static int alsa_input_chan_call(struct ast_channel *ast,
+#if (AST_VERSION < 110)
+   char *addr,
+#else /* (AST_VERSION >= 110) */
+   const char *addr,
+#endif /* (AST_VERSION >= 110)*/
+   int timeout)
+{
+   int ret = -1;
+   alsa_input_pvt_t *pvt = alsa_input_get_pvt(ast);
+
+   alsa_input_pr_debug("alsa_input_chan_call(ast='%s', addr='%s', timeout=%d)\n", alsa_input_ast_channel_name(ast), addr, (int)(timeout));
+
+   if (NULL != pvt) {
+#ifdef DEBUG
+      pvt->owner_lock_count += 1;
+      alsa_input_assert(pvt->owner_lock_count > 0);
+#endif /* DEBUG */
+      do { /* Empty loop */
+         /* If phone is off hook, call() is not allowed */
+         if (AI_STATUS_ON_HOOK != pvt->ast_channel.status) {
+            ast_log(AST_LOG_NOTICE, "'%s' is busy\n", alsa_input_ast_channel_name(ast));
+            ast_setstate(ast, AST_STATE_BUSY);
+            ast_queue_control(ast, AST_CONTROL_BUSY);
+         }
+         else {
+            char number[20];
+            char name[80];
+            enum ast_channel_state ast_state = alsa_input_ast_channel_state(ast);
+
+            if ((AST_STATE_DOWN != ast_state) && (AST_STATE_RESERVED != ast_state)) {
+               ast_log(AST_LOG_WARNING, "alsa_input_chan_call() called on '%s', neither down nor reserved\n",
+                  alsa_input_ast_channel_name(ast));
+               break;
+            }
+
+            /* the standard format of ast->callerid is:  "name" <number>, but not always complete */
+            if ((!alsa_input_ast_channel_connected(ast)->id.name.valid)
+                || (ast_strlen_zero(alsa_input_ast_channel_connected(ast)->id.name.str))) {
+               strcpy(name, "unknown");
+            }
+            else {
+               ast_copy_string(name, alsa_input_ast_channel_connected(ast)->id.name.str, sizeof(name));
+            }
+
+            number[0] = '\0';
+            if ((alsa_input_ast_channel_connected(ast)->id.number.valid) && (alsa_input_ast_channel_connected(ast)->id.number.str)) {
+               ast_copy_string(number, alsa_input_ast_channel_connected(ast)->id.number.str, sizeof(number));
+            }
+
+            alsa_input_pr_debug("Ringing '%s' on '%s' (with CID '%s', '%s')\n",
+               addr, alsa_input_ast_channel_name(ast), number, name);
+
+            ast_setstate(ast, AST_STATE_RINGING);
+            ast_queue_control(ast, AST_CONTROL_RINGING);
+            alsa_input_set_new_state(pvt, AI_ST_ON_RINGING, AI_EV_AST_CALL);
+            ret = 0;
+         }
+      } while (false);
+#ifdef DEBUG
+      alsa_input_assert(pvt->owner_lock_count > 0);
+      pvt->owner_lock_count -= 1;
+#endif /* DEBUG */
+   }
+
+   return (ret);
+}
+
+/*!
+ * \brief Answer the channel
+ *
+ * \note The channel is locked when this function gets called.
+ */
+static int alsa_input_chan_answer(struct ast_channel *ast)
+{
+   int ret = -1;
+   alsa_input_pvt_t *pvt = alsa_input_get_pvt(ast);
+
+   /* Remote end has answered the call */
+   alsa_input_pr_debug("alsa_input_chan_answer(ast='%s')\n", alsa_input_ast_channel_name(ast));
+
+   if (NULL != pvt) {
+#ifdef DEBUG
+      pvt->owner_lock_count += 1;
+      alsa_input_assert(pvt->owner_lock_count > 0);
+#endif /* DEBUG */
+      /* If phone not off hook, answer() is not allowed */
+      if ((AI_ST_OFF_TALKING != pvt->ast_channel.state)
+          && (AI_ST_OFF_WAITING_ANSWER != pvt->ast_channel.state)) {
+         ast_log(AST_LOG_WARNING, "Channel '%s' can't answer now, because not off hook or not in the correct state\n", alsa_input_ast_channel_name(ast));
+      }
+      else {
+         /* We accept that answer() can be called if AI_ST_OFF_TALKING == pvt->ast_channel.state */
+         ret = 0;
+         if (AI_ST_OFF_WAITING_ANSWER == pvt->ast_channel.state) {
+            ret = alsa_input_setup(pvt, alsa_input_ast_channel_rawreadformat(pvt->owner), AST_STATE_UP, AI_EV_AST_ANSWER);
+            if (!ret) {
+               alsa_input_ast_channel_rings_set(pvt->owner, 0);
+            }
+         }
+      }
+#ifdef DEBUG
+      alsa_input_assert(pvt->owner_lock_count > 0);
+      pvt->owner_lock_count -= 1;
+#endif /* DEBUG */
+   }
+   return (ret);
+}
+
+/*!
+ * \brief Fix up a channel:  If a channel is consumed, this is called.  Basically update any ->owner links
+ *
+ * \note The channel is locked when this function gets called.
+ */
+static int alsa_input_chan_fixup(struct ast_channel *old_chan, struct ast_channel *new_chan)
+{
+   alsa_input_pvt_t *pvt = alsa_input_get_pvt(old_chan);
+
+   alsa_input_pr_debug("alsa_input_chan_fixup(oldchan='%s', newchan='%s')\n",
+      alsa_input_ast_channel_name(old_chan), alsa_input_ast_channel_name(new_chan));
+
+   if (NULL != pvt) {
+#ifdef DEBUG
+      pvt->owner_lock_count += 1;
+      alsa_input_assert(pvt->owner_lock_count > 0);
+#endif /* DEBUG */
+      /*
+       Here the channel is locked and we get the monitor lock.
+       In the monitor we get the monitor lock and then only TRY to lock the channel
+       IMHO no deadlock can occur
+      */
+      alsa_input_monitor_lock(pvt->channel);
+      pvt->owner = new_chan;
+      alsa_input_monitor_unlock(pvt->channel);
+#ifdef DEBUG
+      alsa_input_assert(pvt->owner_lock_count > 0);
+      pvt->owner_lock_count -= 1;
+#endif /* DEBUG */
+   }
+
+   return (0);
+}
+
+/*!
+ * \brief Start sending a literal DTMF digit
+ *
+ * \note The channel is not locked when this function gets called.
+ */
+static int alsa_input_chan_digit_begin(struct ast_channel *ast, char digit)
+{
+   alsa_input_pr_debug("alsa_input_chan_digit_begin(ast='%s', digit='%c')\n", alsa_input_ast_channel_name(ast), (char)(digit));
+
+   /* Done in alsa_input_chan_digit_end() */
+
+   return (0);
+}
+
+/*!
+ * \brief Stop sending a literal DTMF digit
+ *
+ * \note The channel is not locked when this function gets called.
+ */
+static int alsa_input_chan_digit_end(struct ast_channel *ast, char digit, unsigned int duration)
+{
+   int ret = 0;
+   alsa_input_pvt_t *pvt;
+   alsa_input_tone_t tone;
+
+   alsa_input_pr_debug("alsa_input_chan_digit_end(ast='%s', digit='%c', duration=%u)\n",
+      alsa_input_ast_channel_name(ast), (char)(digit), (unsigned int)(duration));
+
+   ast_channel_lock(ast);
+   pvt = alsa_input_get_pvt(ast);
+   if (NULL == pvt) {
+      ret = -1;
+   }
+   else {
+#ifdef DEBUG
+      pvt->owner_lock_count += 1;
+      alsa_input_assert(pvt->owner_lock_count > 0);
+#endif /* DEBUG */
+      if ((AI_ST_OFF_TALKING != pvt->ast_channel.state)
+          && (AI_ST_OFF_WAITING_ANSWER != pvt->ast_channel.state)) {
+         ast_log(AST_LOG_WARNING, "Can't send a DTMF while not off hook or not in the correct state\n");
+         ret = -1;
+      }
+      else {
+         switch (digit) {
+            case '0': {
+               tone = AI_TONE_DTMF_0;
+               break;
+            }
+            case '1': {
+               tone = AI_TONE_DTMF_1;
+               break;
+            }
+            case '2': {
+               tone = AI_TONE_DTMF_2;
+               break;
+            }
+            case '3': {
+               tone = AI_TONE_DTMF_3;
+               break;
+            }
+            case '4': {
+               tone = AI_TONE_DTMF_4;
+               break;
+            }
+            case '5': {
+               tone = AI_TONE_DTMF_5;
+               break;
+            }
+            case '6': {
+               tone = AI_TONE_DTMF_6;
+               break;
+            }
+            case '7': {
+               tone = AI_TONE_DTMF_7;
+               break;
+            }
+            case '8': {
+               tone = AI_TONE_DTMF_8;
+               break;
+            }
+            case '9': {
+               tone = AI_TONE_DTMF_9;
+               break;
+            }
+            case '*': {
+               tone = AI_TONE_DTMF_ASTER;
+               break;
+            }
+            case '#': {
+               tone = AI_TONE_DTMF_POUND;
+               break;
+            }
+            case 'A': {
+               tone = AI_TONE_DTMF_A;
+               break;
+            }
+            case 'B': {
+               tone = AI_TONE_DTMF_B;
+               break;
+            }
+            case 'C': {
+               tone = AI_TONE_DTMF_C;
+               break;
+            }
+            case 'D': {
+               tone = AI_TONE_DTMF_D;
+               break;
+            }
+            default: {
+               ast_log(AST_LOG_WARNING, "Unknown digit '%c'\n", (char)(digit));
+               ret = -1;
+               break;
+            }
+         }
+         if (!ret) {
+            alsa_input_pr_debug("Playing DTMF digit '%c'\n", (char)(digit));
+            alsa_input_set_line_tone(pvt, tone, duration);
+         }
+      }
+#ifdef DEBUG
+      alsa_input_assert(pvt->owner_lock_count > 0);
+      pvt->owner_lock_count -= 1;
+#endif /* DEBUG */
+   }
+
+   ast_channel_unlock(ast);
+
+   return (ret);
+}
+
+/*!
+ * \brief Indicate a particular condition (e.g. AST_CONTROL_BUSY or AST_CONTROL_RINGING or AST_CONTROL_CONGESTION
+ *
+ * \note The channel is locked when this function gets called.
+ */
+static int alsa_input_chan_indicate(struct ast_channel *ast, int condition, const void *data, size_t datalen)
+{
+   int ret = 0;
+   alsa_input_pvt_t *pvt = alsa_input_get_pvt(ast);
+
+   if (NULL == pvt) {
+      ret = -1;
+   }
+   else {
+#ifdef DEBUG
+      pvt->owner_lock_count += 1;
+      alsa_input_assert(pvt->owner_lock_count > 0);
+#endif /* DEBUG */
+      if ((AI_ST_OFF_TALKING != pvt->ast_channel.state)
+          && (AI_ST_OFF_WAITING_ANSWER != pvt->ast_channel.state)) {
+         ast_log(AST_LOG_WARNING, "Can't indicate a condition while not off hook or not in the correct state\n");
+      }
+      else {
+         switch (condition) {
+            case AST_CONTROL_BUSY:
+            case AST_CONTROL_CONGESTION:
+            case AST_CONTROL_RINGING:
+            case AST_CONTROL_INCOMPLETE:
+#if (AST_VERSION >= 110)
+            case AST_CONTROL_PVT_CAUSE_CODE:
+#endif /* (AST_VERSION >= 110) */
+            case -1: {
+               ret = -1;  /* Ask for inband indications */
+               break;
+            }
+            case AST_CONTROL_PROGRESS:
+            case AST_CONTROL_PROCEEDING:
+            case AST_CONTROL_VIDUPDATE:
+            case AST_CONTROL_SRCUPDATE: {
+               break;
+            }
+            case AST_CONTROL_HOLD: {
+               ast_verbose(" << Channel Has Been Placed on Hold >> \n");
+               ast_moh_start(ast, data, ('\0' != pvt->line_cfg->moh_interpret[0]) ? pvt->line_cfg->moh_interpret : NULL);
+               break;
+            }
+            case AST_CONTROL_UNHOLD: {
+               ast_verbose(" << Channel Has Been Retrieved from Hold >> \n");
+               ast_moh_stop(ast);
+               break;
+            }
+            default: {
+               ast_log(AST_LOG_WARNING, "Don't know how to indicate condition %d on '%s'\n",
+                  (int)(condition), alsa_input_ast_channel_name(ast));
+               ret = -1;
+               break;
+            }
+         }
+      }
+#ifdef DEBUG
+      alsa_input_assert(pvt->owner_lock_count > 0);
+      pvt->owner_lock_count -= 1;
+#endif /* DEBUG */
+   }
+
+   return (ret);
+}
+
+/*!
+ * \brief Read a frame, in standard format (see frame.h)
+ *
+ * \note The channel is locked when this function gets called.
+ * It's called when the file descriptor 0 of the channel (the eventfd
+ * pvt->audio.fd_frames written by the audio thread) is readable
+ */
+static struct ast_frame *alsa_input_chan_read(struct ast_channel *ast)
+{
+   struct ast_frame *ret = &(ast_null_frame);
+   alsa_input_pvt_t *pvt = alsa_input_get_pvt(ast);
+
+   /* alsa_input_pr_debug("alsa_input_chan_read(ast='%s')\n", alsa_input_ast_channel_name(ast)); */
+   if (NULL != pvt) {
+#ifdef DEBUG
+      pvt->owner_lock_count += 1;
+      alsa_input_assert(pvt->owner_lock_count > 0);
+#endif /* DEBUG */
+      do { /* Empty loop */
+         if ((AI_ST_OFF_TALKING != pvt->ast_channel.state)
+             && (AI_ST_OFF_WAITING_ANSWER != pvt->ast_channel.state)) {
+            /* Don't try to receive audio on-hook */
+            ast_log(AST_LOG_WARNING, "Trying to receive audio while not off hook or not in the correct state\n");
+            alsa_input_audio_drain_frames(pvt);
+            break;
+         }
+
+         if (alsa_input_audio_pop_frame(pvt)) {
+            ret = &(pvt->ast_channel.frame);
+         }
+         else {
+            ret = &(ast_null_frame);
+         }
+      } while (0);
+#ifdef DEBUG
+      alsa_input_assert(pvt->owner_lock_count > 0);
+      pvt->owner_lock_count -= 1;
+#endif /* DEBUG */
+   }
+   return (ret);
+}
+
+/*!
+ * \brief Write a frame, in standard format (see frame.h)
+ *
+ * \note The channel is locked when this function gets called.
+ */
+static int alsa_input_chan_write(struct ast_channel *ast, struct ast_frame *frame)
+{
+   int ret = 0;
+   alsa_input_pvt_t *pvt = alsa_input_get_pvt(ast);
+
+   /* alsa_input_pr_debug("alsa_input_chan_write(ast='%s')\n", alsa_input_ast_channel_name(ast)); */
+   if (NULL != pvt) {
+#ifdef DEBUG
+      pvt->owner_lock_count += 1;
+      alsa_input_assert(pvt->owner_lock_count > 0);
+#endif /* DEBUG */
+
+      do { /* Empty loop */
+         size_t waiting;
+         size_t queued;
+
+         /* Write a frame of (presumably voice) data */
+         if (AST_FRAME_VOICE != frame->frametype) {
+            ast_log(AST_LOG_WARNING, "Don't know what to do with frame type %d\n", (int)(frame->frametype));
+            break;
+         }
+
+         if (frame->datalen <= 0) {
+            alsa_input_pr_debug("Void frame\n");
+            break;
+         }
+
+         if (!alsa_input_ast_formats_are_equal(pvt->format, alsa_input_ast_get_frame_format(frame))) {
+            ast_log(AST_LOG_WARNING, "Cannot handle frames in '%s' format\n",
+               alsa_input_ast_format_get_name(alsa_input_ast_get_frame_format(frame)));
+            ret = -1;
+            break;
+         }
+
+         if ((AI_ST_OFF_TALKING != pvt->ast_channel.state)
+             && (AI_ST_OFF_WAITING_ANSWER != pvt->ast_channel.state)) {
+            /* Don't try to receive audio on-hook */
+            ast_log(AST_LOG_WARNING, "Trying to receive audio while not off hook or not in the correct state\n");
+            break;
+         }
+
+         if (AI_TONE_NONE != pvt->ast_channel.tone) {
+            if (!alsa_input_audio_playback_is_free(pvt)) {
+               /* Don't try to send audio when emitting a tone */
+               /* alsa_input_pr_debug("Trying to send audio while emitting a tone\n"); */
+               break;
+            }
+            /* The audio thread has played the whole tone */
+            alsa_input_set_line_tone(pvt, AI_TONE_NONE, 0);
+         }
+
+         if (!alsa_input_audio_playback_is_free(pvt)) {
+            /* The audio thread has not yet acknowledged the end of the tone */
+            break;
+         }
+
+         /*
+          The samples are only queued : the audio thread writes them to the
+          sound playback device. The frame is played after the samples
+          already queued and those the device holds
+         */
+         waiting = pvt->audio.play_head - __atomic_load_n(&(pvt->audio.play_tail), __ATOMIC_ACQUIRE);
+         queued = alsa_input_audio_queue_playback(pvt, frame->data.ptr, frame->datalen);
+         __atomic_add_fetch(&(pvt->stats.playback_frames), 1, __ATOMIC_RELAXED);
+         alsa_input_stats_latency_add(pvt, (waiting / SAMPLE_SIZE)
+            + __atomic_load_n(&(pvt->stats.playback_delay.last), __ATOMIC_RELAXED));
+         if (queued < (size_t)(frame->datalen)) {
+            alsa_input_pr_debug("Playback buffer of line %lu full, only queued %lu of %lu bytes of audio data\n",
+               (unsigned long)(pvt->index_line + 1), (unsigned long)(queued),
+               (unsigned long)(frame->datalen));
+            __atomic_add_fetch(&(pvt->stats.playback_dropped), 1, __ATOMIC_RELAXED);
+         }
+      } while (false);
+
+#ifdef DEBUG
+      alsa_input_assert(pvt->owner_lock_count > 0);
+      pvt->owner_lock_count -= 1;
+#endif /* DEBUG */
+   }
+   return (ret);
+}
+
+/*!
+ * \brief Hangup (and possibly destroy) the channel
+ *
+ * \note The channel is locked when this function gets called.
+ */
+static int alsa_input_chan_hangup(struct ast_channel *ast)
+{
+   alsa_input_pvt_t *pvt = alsa_input_ast_channel_tech_pvt(ast);
+
+   alsa_input_pr_debug("alsa_input_chan_hangup(ast='%s')\n", alsa_input_ast_channel_name(ast));
+
+   if ((NULL == pvt) || (pvt->owner != ast)) {
+      alsa_input_pr_debug("Channel '%s' unlink or link to another line\n", alsa_input_ast_channel_name(ast));
+      if ((NULL != pvt) && (NULL == pvt->owner)) {
+         alsa_input_ast_channel_tech_pvt_set(ast, NULL);
+      }
+   }
+   else {
+#ifdef DEBUG
+      pvt->owner_lock_count += 1;
+      alsa_input_assert(pvt->owner_lock_count > 0);
+#endif /* DEBUG */
+      /*
+       Here the channel is locked and we get the monitor lock.
+       In the monitor we get the monitor lock and then only TRY to lock the channel
+       IMHO no deadlock can occur
+      */
+      alsa_input_monitor_lock(pvt->channel);
+      alsa_input_unlink_from_ast_channel(pvt, AI_EV_AST_HANGUP, false);
+      alsa_input_assert(NULL == pvt->owner);
+      alsa_input_monitor_unlock(pvt->channel);
+      alsa_input_stats_manager_event(pvt, alsa_input_ast_channel_name(ast));
+#ifdef DEBUG
+      alsa_input_assert(pvt->owner_lock_count > 0);
+      pvt->owner_lock_count -= 1;
+#endif /* DEBUG */
+   }
+   alsa_input_pr_debug("'%s' hung up\n", alsa_input_ast_channel_name(ast));
+   ast_setstate(ast, AST_STATE_DOWN);
+
+   return (0);
+}
+
+/*
+ Sets the rate of the line and what depends on it. Must be called while the
+ audio thread doesn't use the line and the line has no owner
+*/
+static void alsa_input_set_pvt_rate(alsa_input_pvt_t *pvt, alsa_input_rate_t rate)
+{
+   alsa_input_assert(rate <= pvt->line_cfg->max_rate);
+   pvt->rate = rate;
+   pvt->format = alsa_input_rate_format(rate);
+   alsa_input_assert(NULL != pvt->format);
+   alsa_input_ast_format_cap_remove_by_type(pvt->cap, AST_MEDIA_TYPE_UNKNOWN);
+   alsa_input_ast_format_cap_append_format(pvt->cap, pvt->format);
+   pvt->audio.frame_size = (size_t)(pvt->line_cfg->period_ms) * alsa_input_rate_samples_per_ms(rate) * SAMPLE_SIZE;
+   pvt->audio.play_depth = (size_t)(pvt->line_cfg->playback_buffer_ms) * alsa_input_rate_samples_per_ms(rate) * SAMPLE_SIZE;
+   alsa_input_dtmf_init(&(pvt->audio.dtmf), rate, pvt->line_cfg);
+   alsa_input_agc_init(&(pvt->audio.agc), rate, pvt->line_cfg);
+}
+
+/*
+ Closes the sound devices of a line, used only by the audio thread (see
+ alsa_input_close_line_devices()). The eventfd of the frames, polled by
+ the channel, is kept for the reopening of the line
+*/
+static void alsa_input_close_line_snd(alsa_input_pvt_t *pvt)
+{
+   if (NULL != pvt->audio.snd_capture.card) {
+      alsa_input_snd_card_deinit(&(pvt->audio.snd_capture));
+      pvt->audio.fd_snd_capture = -1;
+   }
+   if (NULL != pvt->audio.snd_playback.card) {
+      alsa_input_snd_card_deinit(&(pvt->audio.snd_playback));
+      pvt->audio.fd_snd_playback = -1;
+   }
+   pvt->audio.capturing = false;
+   pvt->audio.playback_polled = false;
+   pvt->audio.shared_capture = NULL;
+   pvt->audio.shared_playback = NULL;
+}
+
+/*
+ Closes the event devices of a line (or the pipe of the console), used by
+ the monitor and the console commands.
+ Must be called with monitor.lock locked (unless the monitor is stopped).
+*/
+static void alsa_input_close_line_events(alsa_input_chan_t *t, alsa_input_pvt_t *pvt)
+{
+   if (pvt->monitor.fd_pipe >= 0) {
+      close(pvt->monitor.fd_pipe);
+      pvt->monitor.fd_pipe = -1;
+   }
+   if (pvt->monitor.fd_input >= 0) {
+      alsa_input_monitor_unregister_fd(t, pvt->monitor.fd_input);
+      close(pvt->monitor.fd_input);
+      pvt->monitor.fd_input = -1;
+   }
+   if (pvt->monitor.fd_output >= 0) {
+      close(pvt->monitor.fd_output);
+      pvt->monitor.fd_output = -1;
+   }
+}
+
+/*
+ Closes the devices of a line, which the audio thread doesn't use : it's
+ stopped, or the line is disconnected and its sound devices have been
+ closed by AI_AUDIO_CMD_CLOSE
+*/
+static void alsa_input_close_line_devices(alsa_input_chan_t *t, alsa_input_pvt_t *pvt)
+{
+   alsa_input_close_line_snd(pvt);
+   if (pvt->audio.fd_frames >= 0) {
+      close(pvt->audio.fd_frames);
+      pvt->audio.fd_frames = -1;
+   }
+   alsa_input_close_line_events(t, pvt);
+}
+
+static void alsa_input_close_devices(alsa_input_chan_t *t)
+{
+   alsa_input_pvt_t *pvt;
+
+   alsa_input_assert(!AST_LIST_EMPTY(&(t->pvt_list)));
+
+   /* We hangup all lines if they have an owner */
+   alsa_input_pr_debug("Freeing resources of the lines\n");
+   AST_LIST_TRAVERSE(&(t->pvt_list), pvt, list) {
+      /* The audio thread is stopped, we can release its devices */
+      alsa_input_close_line_devices(t, pvt);
+   }
+   while (NULL != t->audio.shared) {
+      alsa_input_snd_shared_t *sh = t->audio.shared;
+      t->audio.shared = sh->next;
+      alsa_input_snd_card_deinit(&(sh->card));
+      ast_free(sh->lines);
+      ast_free(sh->buf);
+      ast_free(sh->planes);
+      ast_free(sh->ptrs);
+      ast_free(sh);
+   }
+   t->monitor.lines_connected = 0;
+}
+
+/*
+ Return the shared sound device dev_name used for stream, created (but not
+ opened) if it's not found
+*/
+static alsa_input_snd_shared_t *alsa_input_get_shared(alsa_input_chan_t *t,
+   const char *dev_name, snd_pcm_stream_t stream)
+{
+   alsa_input_snd_shared_t *sh;
+
+   for (sh = t->audio.shared; (NULL != sh); sh = sh->next) {
+      if ((stream == sh->stream) && (!strcmp(dev_name, sh->dev_name))) {
+         return (sh);
+      }
+   }
+   sh = ast_calloc(1, sizeof(*sh));
+   if (NULL == sh) {
+      return (NULL);
+   }
+   sh->lines = ast_calloc(AI_SHARED_MAX_CHANNELS, sizeof(sh->lines[0]));
+   if (NULL == sh->lines) {
+      ast_free(sh);
+      return (NULL);
+   }
+   sh->dev_name = dev_name;
+   sh->stream = stream;
+   sh->fd = -1;
+   sh->src.pvt = NULL;
+   sh->src.shared = sh;
+   sh->src.kind = (SND_PCM_STREAM_CAPTURE == stream) ? AI_SRC_SHARED_CAPTURE : AI_SRC_SHARED_PLAYBACK;
+   sh->rate = AI_RATE_COUNT;
+   sh->channels = 0;
+   sh->users = 0;
+   sh->failed = false;
+   sh->next = t->audio.shared;
+   t->audio.shared = sh;
+   return (sh);
+}
+
+/*
+ Attaches the line to the channel (starting from 1) of a shared sound device
+*/
+static int alsa_input_attach_shared(alsa_input_chan_t *t, alsa_input_pvt_t *pvt,
+   const char *dev_name, snd_pcm_stream_t stream, unsigned int channel)
+{
+   alsa_input_snd_shared_t *sh = alsa_input_get_shared(t, dev_name, stream);
+
+   if (NULL == sh) {
+      ast_log(AST_LOG_ERROR, "Unable to allocate memory for shared device '%s'\n", dev_name);
+      return (-1);
+   }
+   alsa_input_assert((channel > 0) && (channel <= AI_SHARED_MAX_CHANNELS));
+   if (NULL != sh->lines[channel - 1]) {
+      ast_log(AST_LOG_ERROR, "Lines %lu and %lu use the same channel %u of device '%s'\n",
+         (unsigned long)(sh->lines[channel - 1]->index_line + 1),
+         (unsigned long)(pvt->index_line + 1), channel, dev_name);
+      return (-1);
+   }
+   sh->lines[channel - 1] = pvt;
+   if (channel > sh->channels) {
+      sh->channels = channel;
+   }
+   if (SND_PCM_STREAM_CAPTURE == stream) {
+      /* The rate must suit all the lines */
+      if ((AI_RATE_COUNT == sh->rate) || (pvt->line_cfg->max_rate < sh->rate)) {
+         sh->rate = pvt->line_cfg->max_rate;
+      }
+      pvt->audio.shared_capture = sh;
+      pvt->audio.channel_capture = channel - 1;
+   }
+   else {
+      pvt->audio.shared_playback = sh;
+      pvt->audio.channel_playback = channel - 1;
+   }
+   return (0);
+}
+
+/*
+ Opens a shared sound device at rate sh->rate (or a lower one if
+ rate_fallback is true). Access, period and number of periods are the ones
+ of the first line using the device
+*/
+static int alsa_input_open_shared(alsa_input_snd_shared_t *sh, bool rate_fallback)
+{
+   const alsa_input_line_config_t *line_cfg = NULL;
+   unsigned int channels = sh->channels;
+   unsigned int c;
+
+   for (c = 0; ((c < sh->channels) && (NULL == line_cfg)); c += 1) {
+      if (NULL != sh->lines[c]) {
+         line_cfg = sh->lines[c]->line_cfg;
+      }
+   }
+   alsa_input_assert(NULL != line_cfg);
+   if (alsa_input_snd_card_init(&(sh->card), sh->dev_name, sh->stream,
+      line_cfg->snd_mmap, &(channels), &(sh->rate), rate_fallback,
+      AI_RESAMPLE_NONE, line_cfg->period_ms, line_cfg->periods, &(sh->fd))) {
+      ast_log(AST_LOG_ERROR, "Problem opening shared ALSA %s device '%s'\n",
+         (SND_PCM_STREAM_CAPTURE == sh->stream) ? "capture" : "playback", sh->dev_name);
+      return (-1);
+   }
+   sh->channels = channels;
+   sh->buf_frames = sh->card.period_size;
+   sh->buf = ast_calloc(sh->buf_frames * sh->channels, SAMPLE_SIZE);
+   sh->planes = ast_calloc(sh->buf_frames * sh->channels, SAMPLE_SIZE);
+   sh->ptrs = ast_calloc(sh->channels, sizeof(sh->ptrs[0]));
+   if ((NULL == sh->buf) || (NULL == sh->planes) || (NULL == sh->ptrs)) {
+      ast_log(AST_LOG_ERROR, "Unable to allocate memory for shared device '%s'\n", sh->dev_name);
+      return (-1);
+   }
+   ast_verb(3, "Shared device '%s' opened with %u channels at %u Hz\n",
+      sh->dev_name, sh->channels, alsa_input_rate_values[sh->rate]);
+   return (0);
+}
+
+/*
+ Opens the event devices of a line (or the pipe of the console, if there's
+ no input event device) in *fd_input, *fd_pipe and *fd_output, -1 if not
+ used. They aren't registered in the epoll set of the monitor.
+ Return 0 or -1 : the descriptors already opened are then closed
+*/
+static int alsa_input_open_line_events(const alsa_input_line_config_t *line_cfg,
+   int *fd_input, int *fd_pipe, int *fd_output)
+{
+   int ret = 0;
+
+   *fd_input = -1;
+   *fd_pipe = -1;
+   *fd_output = -1;
+
+   do { /* Empty loop */
+      if ('\0' != line_cfg->ev_in_dev_name[0]) {
+         *fd_input = open(line_cfg->ev_in_dev_name, O_RDONLY | O_NONBLOCK);
+         if (*fd_input < 0) {
+            ast_log(AST_LOG_ERROR, "Problem opening input event device '%s' ('%s')\n",
+               line_cfg->ev_in_dev_name, strerror(errno));
+            ret = -1;
+            break;
+         }
+      }
+      else {
+         int fds[2];
+         if (pipe2(fds, O_CLOEXEC | O_DIRECT | O_NONBLOCK)) {
+            ast_log(AST_LOG_ERROR, "Problem opening pipe to send and receive console events\n");
+            ret = -1;
+            break;
+         }
+         else {
+            *fd_input = fds[0];
+            *fd_pipe = fds[1];
+         }
+      }
+
+      if ('\0' != line_cfg->ev_out_dev_name[0]) {
+         *fd_output = open(line_cfg->ev_out_dev_name, O_WRONLY | O_NONBLOCK);
+         if (*fd_output < 0) {
+            ast_log(AST_LOG_ERROR, "Problem opening output event device '%s' ('%s')\n",
+               line_cfg->ev_out_dev_name, strerror(errno));
+            ret = -1;
+            break;
+         }
+      }
+   } while (false);
+
+   if (0 != ret) {
+      if (*fd_input >= 0) {
+         close(*fd_input);
+         *fd_input = -1;
+      }
+      if (*fd_pipe >= 0) {
+         close(*fd_pipe);
+         *fd_pipe = -1;
+      }
+   }
+
+   return (ret);
+}
+
+/*
+ Opens the sound devices of a line and allocates its filters (see
+ alsa_input_open_line_devices()).
+ Return 0 or -1 : the devices already opened are then left open
+*/
+static int alsa_input_open_line_snd(alsa_input_pvt_t *pvt)
+{
+   int ret = 0;
+   alsa_input_rate_t rate;
+   unsigned int channels = 1;
+   alsa_input_snd_shared_t *sh;
+
+   do { /* Empty loop */
+      /*
+       The eventfd of the frames is kept when the line is reopened, the
+       frames signaled before the disconnection are forgotten
+      */
+      if (pvt->audio.fd_frames >= 0) {
+         uint64_t val;
+
+         if (read(pvt->audio.fd_frames, &(val), sizeof(val)) < 0) {
+            /* Nothing to do, counter is already null */
+         }
+      }
+      else {
+         pvt->audio.fd_frames = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+         if (pvt->audio.fd_frames < 0) {
+            ast_log(AST_LOG_ERROR, "Unable to create eventfd for line %lu ('%s')\n",
+               (unsigned long)(pvt->index_line + 1), strerror(errno));
+            ret = -1;
+            break;
+         }
+      }
+
+      /*
+       The capture device chooses the rate (the highest it supports, not
+       above 'max_rate'), the playback device must use the same one
+      */
+      if (NULL != pvt->audio.shared_capture) {
+         rate = pvt->audio.shared_capture->rate;
+      }
+      else {
+         rate = pvt->line_cfg->max_rate;
+         if (alsa_input_snd_card_init(&(pvt->audio.snd_capture),
+            pvt->line_cfg->snd_capture_dev_name, SND_PCM_STREAM_CAPTURE,
+            pvt->line_cfg->snd_mmap, &(channels), &(rate), true,
+            pvt->line_cfg->resample_quality, pvt->line_cfg->period_ms,
+            pvt->line_cfg->periods, &(pvt->audio.fd_snd_capture))) {
+            ast_log(AST_LOG_ERROR, "Problem opening ALSA capture device '%s'\n", pvt->line_cfg->snd_capture_dev_name);
+            ret = -1;
+            break;
+         }
+      }
+
+      sh = pvt->audio.shared_playback;
+      if (NULL != sh) {
+         /* Opened at the rate of the first line, the others must use the same */
+         if (NULL == sh->card.card) {
+            sh->rate = rate;
+            if (alsa_input_open_shared(sh, false)) {
+               ret = -1;
+               break;
+            }
+         }
+         else if (sh->rate != rate) {
+            ast_log(AST_LOG_ERROR, "Line %lu uses rate %u but shared device '%s' uses %u\n",
+               (unsigned long)(pvt->index_line + 1), alsa_input_rate_values[rate],
+               sh->dev_name, alsa_input_rate_values[sh->rate]);
+            ret = -1;
+            break;
+         }
+      }
+      else if (alsa_input_snd_card_init(&(pvt->audio.snd_playback),
+         pvt->line_cfg->snd_playback_dev_name, SND_PCM_STREAM_PLAYBACK,
+         pvt->line_cfg->snd_mmap, &(channels), &(rate), false,
+         pvt->line_cfg->resample_quality, pvt->line_cfg->period_ms,
+         pvt->line_cfg->periods, &(pvt->audio.fd_snd_playback))) {
+         ast_log(AST_LOG_ERROR, "Problem opening ALSA playback device '%s'\n", pvt->line_cfg->snd_playback_dev_name);
+         ret = -1;
+         break;
+      }
+      alsa_input_set_pvt_rate(pvt, rate);
+      ast_verb(3, "Line %lu uses %u Hz sound devices\n",
+         (unsigned long)(pvt->index_line + 1), alsa_input_rate_values[rate]);
+
+      if (pvt->line_cfg->echo_cancel) {
+         pvt->audio.aec = alsa_input_aec_alloc(alsa_input_rate_values[rate], pvt->line_cfg->echo_tail_ms);
+         if (NULL == pvt->audio.aec) {
+            ast_log(AST_LOG_ERROR, "Unable to allocate echo canceller for line %lu\n",
+               (unsigned long)(pvt->index_line + 1));
+            ret = -1;
+            break;
+         }
+      }
+      if (pvt->line_cfg->noise_suppress) {
+         pvt->audio.ns = alsa_input_ns_alloc(alsa_input_rate_values[rate], pvt->line_cfg->noise_reduction);
+         if (NULL == pvt->audio.ns) {
+            ast_log(AST_LOG_ERROR, "Unable to allocate noise suppressor for line %lu\n",
+               (unsigned long)(pvt->index_line + 1));
+            ret = -1;
+            break;
+         }
+      }
+      if (pvt->line_cfg->plc) {
+         pvt->audio.plc = alsa_input_plc_alloc(alsa_input_rate_values[rate]);
+         if (NULL == pvt->audio.plc) {
+            ast_log(AST_LOG_ERROR, "Unable to allocate loss concealment for line %lu\n",
+               (unsigned long)(pvt->index_line + 1));
+            ret = -1;
+            break;
+         }
+      }
+
+   } while (false);
+
+   return (ret);
+}
+
+/*
+ Opens the devices of a line (see alsa_input_open_devices()). The input
+ event device isn't registered in the epoll set of the monitor.
+ Return 0 or -1 : the devices already opened are then left open
+*/
+static int alsa_input_open_line_devices(alsa_input_pvt_t *pvt)
+{
+   if (alsa_input_open_line_snd(pvt)) {
+      return (-1);
+   }
+   return (alsa_input_open_line_events(pvt->line_cfg, &(pvt->monitor.fd_input),
+      &(pvt->monitor.fd_pipe), &(pvt->monitor.fd_output)));
+}
+
+static int alsa_input_open_devices(alsa_input_chan_t *t)
+{
+   int ret = AST_MODULE_LOAD_SUCCESS;
+
+   alsa_input_assert(!AST_LIST_EMPTY(&(t->pvt_list)));
+
+   do { /* Empty loop */
+      alsa_input_pvt_t *pvt;
+      alsa_input_snd_shared_t *sh;
+
+      /* Lines using a channel of a multi-channel device */
+      AST_LIST_TRAVERSE(&(t->pvt_list), pvt, list) {
+         if ((pvt->line_cfg->snd_capture_channel > 0)
+             && (alsa_input_attach_shared(t, pvt, pvt->line_cfg->snd_capture_dev_name,
+                    SND_PCM_STREAM_CAPTURE, pvt->line_cfg->snd_capture_channel))) {
+            ret = AST_MODULE_LOAD_FAILURE;
+            break;
+         }
+         if ((pvt->line_cfg->snd_playback_channel > 0)
+             && (alsa_input_attach_shared(t, pvt, pvt->line_cfg->snd_playback_dev_name,
+                    SND_PCM_STREAM_PLAYBACK, pvt->line_cfg->snd_playback_channel))) {
+            ret = AST_MODULE_LOAD_FAILURE;
+            break;
+         }
+      }
+      if (AST_MODULE_LOAD_SUCCESS != ret) {
+         break;
+      }
+      /* Shared capture devices choose the rate of their lines */
+      for (sh = t->audio.shared; (NULL != sh); sh = sh->next) {
+         if ((SND_PCM_STREAM_CAPTURE == sh->stream) && (alsa_input_open_shared(sh, true))) {
+            ret = AST_MODULE_LOAD_FAILURE;
+            break;
+         }
+      }
+      if (AST_MODULE_LOAD_SUCCESS != ret) {
+         break;
+      }
+
+      /* Finally init the state of the lines */
+      AST_LIST_TRAVERSE(&(t->pvt_list), pvt, list) {
+         if (alsa_input_open_line_devices(pvt)) {
+            /* A multi-channel device is shared with the other lines */
+            if ((pvt->line_cfg->snd_capture_channel > 0) || (pvt->line_cfg->snd_playback_channel > 0)) {
+               ret = AST_MODULE_LOAD_FAILURE;
+               break;
+            }
+            /*
+             The phone is unplugged : the line is disconnected until its
+             devices are plugged (see alsa_input_devices_hotplug())
+            */
+            ast_log(AST_LOG_WARNING, "Line %lu : unable to open its devices, line stays disconnected until they are plugged\n",
+               (unsigned long)(pvt->index_line + 1));
+            alsa_input_close_line_snd(pvt);
+            alsa_input_close_line_events(t, pvt);
+            pvt->ast_channel.status = AI_STATUS_DISCONNECTED;
+            pvt->ast_channel.state = AI_ST_DISCONNECTED;
+            pvt->monitor.last_known_state = pvt->ast_channel.state;
+            continue;
+         }
+
+         /*
+          Input event device stays registered in the epoll set of the monitor
+          until the line is disconnected. Sound devices are registered in the
+          epoll set of the audio thread, only when they are used
+         */
+         if (alsa_input_monitor_register_fd(t, pvt->monitor.fd_input, &(pvt->monitor.src_input))) {
+            ret = AST_MODULE_LOAD_FAILURE;
+            break;
+         }
+         t->monitor.lines_connected += 1;
+      }
+   } while (0);
+
+   if (AST_MODULE_LOAD_SUCCESS != ret) {
+      alsa_input_close_devices(t);
+   }
+
+   return (ret);
+}
+
+static void alsa_input_hangup_all_lines(alsa_input_chan_t *t, bool monitor_is_really_stopped)
+{
+   alsa_input_pvt_t *pvt;
+
+   /* We hangup all lines if they have an owner */
+   alsa_input_pr_debug("Hanging up all the lines\n");
+   alsa_input_assert(!t->monitor.run);
+   alsa_input_monitor_lock(t);
+   AST_LIST_TRAVERSE(&(t->pvt_list), pvt, list) {
+      struct ast_channel *ast = pvt->owner;
+      if (NULL != ast) {
+         if (!monitor_is_really_stopped) {
+            if (ast_channel_trylock(ast)) {
+               continue;
+            }
+         }
+         else {
+            ast_channel_lock(ast);
+         }
+#ifdef DEBUG
+         alsa_input_assert(0 == pvt->owner_lock_count);
+         pvt->owner_lock_count += 1;
+#endif /* DEBUG */
+         alsa_input_queue_hangup(pvt, AI_EV_AST_HANGUP);
+         /* ast_channel_unlock(ast) is done in alsa_input_queue_hangup() */
+         alsa_input_assert((NULL == pvt->owner) && (0 == pvt->owner_lock_count));
+      }
+   }
+   alsa_input_monitor_unlock(t);
+}
+
+/*
+ Frees the buffers of the audio thread and the filters allocated when the
+ devices are opened
+*/
+static void alsa_input_free_pvt_buffers(alsa_input_pvt_t *pvt)
+{
+   ast_free(pvt->audio.frames);
+   pvt->audio.frames = NULL;
+   ast_free(pvt->audio.frames_data);
+   pvt->audio.frames_data = NULL;
+   ast_free(pvt->audio.buf_dropped);
+   pvt->audio.buf_dropped = NULL;
+   ast_free(pvt->audio.tone_buf);
+   pvt->audio.tone_buf = NULL;
+   ast_free(pvt->audio.play_buf);
+   pvt->audio.play_buf = NULL;
+   alsa_input_aec_free(pvt->audio.aec);
+   pvt->audio.aec = NULL;
+   alsa_input_ns_free(pvt->audio.ns);
+   pvt->audio.ns = NULL;
+   alsa_input_plc_free(pvt->audio.plc);
+   pvt->audio.plc = NULL;
+   ast_free(pvt->audio.plc_buf);
+   pvt->audio.plc_buf = NULL;
+   ast_free(pvt->audio.ref_buf);
+   pvt->audio.ref_buf = NULL;
+   ast_free(pvt->audio.ref_chunk);
+   pvt->audio.ref_chunk = NULL;
+}
+
+static void alsa_input_free_pvt(alsa_input_pvt_t *pvt)
+{
+#if (AST_VERSION >= 110)
+   if (NULL != pvt->cap) {
+      alsa_input_ast_format_cap_destroy(pvt->cap);
+   }
+#endif /* (AST_VERSION >= 110) */
+   alsa_input_free_pvt_buffers(pvt);
+   ast_free(pvt->reload.next_cfg);
+   ast_free(pvt->reload.pending_cfg);
+   /* Configuration given by a reload */
+   if ((pvt->line_cfg < pvt->channel->config.line_cfgs)
+       || (pvt->line_cfg >= &(pvt->channel->config.line_cfgs[pvt->channel->config.line_count]))) {
+      ast_free((alsa_input_line_config_t *)(pvt->line_cfg));
+   }
+   ast_free(pvt);
+}
+
+/*
+ Allocates the buffers of the audio thread, whose size depends on the
+ parameters 'period_ms', 'playback_buffer_ms' and 'max_rate' of the line :
+ they are large enough for any rate the sound devices may use
+*/
+static int alsa_input_alloc_pvt_buffers(alsa_input_pvt_t *pvt)
+{
+   unsigned int i;
+   size_t frame_size_max;
+   size_t play_depth_max;
+
+   frame_size_max = (size_t)(pvt->line_cfg->period_ms) * alsa_input_rate_samples_per_ms(pvt->line_cfg->max_rate) * SAMPLE_SIZE;
+   pvt->audio.frames_len = AI_AUDIO_FRAMES_MIN;
+   while ((pvt->audio.frames_len * (unsigned int)(pvt->line_cfg->period_ms)) < AI_AUDIO_FRAMES_MS) {
+      pvt->audio.frames_len <<= 1;
+   }
+   /* The ring holds at least the duration asked, rounded to a power of 2 */
+   play_depth_max = (size_t)(pvt->line_cfg->playback_buffer_ms) * alsa_input_rate_samples_per_ms(pvt->line_cfg->max_rate) * SAMPLE_SIZE;
+   pvt->audio.play_size = SAMPLE_SIZE;
+   while (pvt->audio.play_size < play_depth_max) {
+      pvt->audio.play_size <<= 1;
+   }
+
+   pvt->audio.frames = ast_calloc(pvt->audio.frames_len, sizeof(pvt->audio.frames[0]));
+   pvt->audio.frames_data = ast_calloc(pvt->audio.frames_len, AST_FRIENDLY_OFFSET + frame_size_max);
+   pvt->audio.buf_dropped = ast_calloc(1, frame_size_max);
+   pvt->audio.tone_buf = ast_calloc(1, frame_size_max);
+   pvt->audio.play_buf = ast_calloc(1, pvt->audio.play_size);
+   if ((NULL == pvt->audio.frames) || (NULL == pvt->audio.frames_data)
+       || (NULL == pvt->audio.buf_dropped) || (NULL == pvt->audio.tone_buf)
+       || (NULL == pvt->audio.play_buf)) {
+      return (-1);
+   }
+   for (i = 0; (i < pvt->audio.frames_len); i += 1) {
+      pvt->audio.frames[i].len = 0;
+      pvt->audio.frames[i].buf = &(pvt->audio.frames_data[i * (AST_FRIENDLY_OFFSET + frame_size_max)]);
+   }
+
+   if (pvt->line_cfg->plc) {
+      pvt->audio.plc_buf = ast_calloc(1, frame_size_max);
+      if (NULL == pvt->audio.plc_buf) {
+         return (-1);
+      }
+   }
+
+   if (pvt->line_cfg->echo_cancel) {
+      /*
+       The reference must cover the buffers of both devices, a period being
+       captured and the tail of the echo canceller
+      */
+      size_t ref_ms = (2 * ((size_t)(pvt->line_cfg->periods) + 1) * pvt->line_cfg->period_ms)
+         + pvt->line_cfg->echo_tail_ms + AI_AEC_MARGIN_MS;
+      size_t ref_max = ref_ms * alsa_input_rate_samples_per_ms(pvt->line_cfg->max_rate);
+
+      pvt->audio.ref_size = 1;
+      while (pvt->audio.ref_size < ref_max) {
+         pvt->audio.ref_size <<= 1;
+      }
+      pvt->audio.ref_buf = ast_calloc(pvt->audio.ref_size, SAMPLE_SIZE);
+      pvt->audio.ref_chunk = ast_calloc(1, frame_size_max);
+      if ((NULL == pvt->audio.ref_buf) || (NULL == pvt->audio.ref_chunk)) {
+         return (-1);
+      }
+   }
+
+   return (0);
+}
+
+/*
+ Reopens the devices of a line disconnected to apply the configuration
+ given by a reload (pvt->reload.pending_cfg) : once the audio thread has
+ closed its sound devices, the devices of the new configuration are opened
+ and the line is connected again. As it waits for the devices, it's only
+ called by the devices thread, once the audio thread has acknowledged
+ AI_AUDIO_CMD_CLOSE (see alsa_input_devices_pass()).
+*/
+static void alsa_input_reopen_line(alsa_input_chan_t *t, alsa_input_pvt_t *pvt)
+{
+   int ret = 0;
+   int fd_input = -1;
+   int fd_pipe = -1;
+   int fd_output = -1;
+   bool restart_monitor;
+
+   alsa_input_monitor_lock(t);
+   alsa_input_assert((pvt->reload.reopening) && (AI_ST_DISCONNECTED == pvt->ast_channel.state));
+   if (NULL != pvt->reload.pending_cfg) {
+      alsa_input_publish_line_cfg(pvt, pvt->reload.pending_cfg);
+      pvt->reload.pending_cfg = NULL;
+      /* Obsoleted by the whole configuration */
+      ast_free(pvt->reload.next_cfg);
+      pvt->reload.next_cfg = NULL;
+   }
+   alsa_input_monitor_unlock(t);
+
+   /*
+    The line is disconnected : the audio thread has closed its sound
+    devices (see alsa_input_devices_pass()) and no other thread uses them,
+    nor its buffers, whose size depends on the new configuration. The
+    devices are opened without the lock, only the descriptors used by the
+    monitor and the console commands are replaced with it
+   */
+   alsa_input_close_line_snd(pvt);
+   alsa_input_free_pvt_buffers(pvt);
+   pvt->audio.failed = false;
+   if ((alsa_input_alloc_pvt_buffers(pvt)) || (alsa_input_open_line_snd(pvt))
+       || (alsa_input_open_line_events(pvt->line_cfg, &(fd_input), &(fd_pipe), &(fd_output)))) {
+      ret = -1;
+   }
+
+   alsa_input_monitor_lock(t);
+   alsa_input_close_line_events(t, pvt);
+   if (0 == ret) {
+      pvt->monitor.fd_input = fd_input;
+      pvt->monitor.fd_pipe = fd_pipe;
+      pvt->monitor.fd_output = fd_output;
+      /* Events read from the old input event device are forgotten */
+      pvt->monitor.events_head = 0;
+      pvt->monitor.events_tail = 0;
+      pvt->monitor.events_synced = 0;
+      pvt->monitor.events_dropping = false;
+      pvt->monitor.revents_input = 0;
+      if (alsa_input_monitor_register_fd(t, pvt->monitor.fd_input, &(pvt->monitor.src_input))) {
+         ret = -1;
+      }
+   }
+   if (0 == ret) {
+      t->monitor.lines_connected += 1;
+      pvt->ast_channel.status = AI_STATUS_ON_HOOK;
+      pvt->ast_channel.state = AI_ST_ON_IDLE;
+      pvt->monitor.last_known_state = pvt->ast_channel.state;
+      alsa_input_reset_pvt_monitor_state(pvt);
+      ast_verb(3, "Line %lu : devices reopened\n", (unsigned long)(pvt->index_line + 1));
+   }
+   else {
+      ast_log(AST_LOG_ERROR, "Line %lu : unable to reopen its devices, line stays disconnected\n",
+         (unsigned long)(pvt->index_line + 1));
+      alsa_input_close_line_events(t, pvt);
+      alsa_input_close_line_snd(pvt);
+   }
+   pvt->reload.reopening = false;
+   /* A reload may have given another configuration meanwhile */
+   alsa_input_monitor_kick(pvt);
+   alsa_input_reclaim_line_cfgs(t, false);
+   restart_monitor = ((0 == ret) && (!t->monitor.run));
+   alsa_input_monitor_unlock(t);
+
+   /* The monitor stops once no line is connected */
+   if ((restart_monitor) && (AST_PTHREADT_STOP != t->monitor.thread)) {
+      if (AST_PTHREADT_NULL != t->monitor.thread) {
+         pthread_join(t->monitor.thread, NULL);
+         t->monitor.thread = AST_PTHREADT_NULL;
+      }
+      alsa_input_start_monitor(t);
+   }
+}
+
+/*
+ Returns true unless dev_name is a device ("hw:" or "plughw:") of a sound
+ card not present
+*/
+static bool alsa_input_snd_card_present(const char *dev_name)
+{
+   char card[32];
+   const char *s;
+   size_t len;
+
+   if (!strncmp(dev_name, "hw:", 3)) {
+      s = dev_name + 3;
+   }
+   else if (!strncmp(dev_name, "plughw:", 7)) {
+      s = dev_name + 7;
+   }
+   else {
+      return (true);
+   }
+   if (!strncmp(s, "CARD=", 5)) {
+      s += 5;
+   }
+   len = strcspn(s, ",");
+   if ((0 == len) || (len >= sizeof(card))) {
+      return (true);
+   }
+   memcpy(card, s, len);
+   card[len] = '\0';
+   return ((snd_card_get_index(card) >= 0) ? true : false);
+}
+
+/*
+ Returns true if the devices of a line are present. The names should not
+ depend on the order in which the devices are plugged : links of
+ /dev/input/by-id (serial number) or /dev/input/by-path (USB port) for the
+ event devices, id of the card ("hw:CARD=...") for the sound devices
+*/
+static bool alsa_input_line_devices_present(const alsa_input_line_config_t *line_cfg)
+{
+   if (('\0' != line_cfg->ev_in_dev_name[0]) && (access(line_cfg->ev_in_dev_name, R_OK))) {
+      return (false);
+   }
+   if (('\0' != line_cfg->ev_out_dev_name[0]) && (access(line_cfg->ev_out_dev_name, W_OK))) {
+      return (false);
+   }
+   return ((alsa_input_snd_card_present(line_cfg->snd_capture_dev_name))
+      && (alsa_input_snd_card_present(line_cfg->snd_playback_dev_name)));
+}
+
+/*
+ Watches the directories of the devices. Called again after each change,
+ as the directories of the links are created with the first device
+*/
+static void alsa_input_devices_watch(alsa_input_chan_t *t)
+{
+   static const char *const dirs[] = {
+      "/dev/input", "/dev/input/by-id", "/dev/input/by-path", "/dev/snd"
+   };
+   size_t i;
+
+   if (t->devices.fd_inotify < 0) {
+      return;
+   }
+   for (i = 0; (i < ARRAY_LEN(dirs)); i += 1) {
+      /* Fails for the directories that don't exist yet */
+      inotify_add_watch(t->devices.fd_inotify, dirs[i], IN_CREATE | IN_ATTRIB | IN_MOVED_TO | IN_ONLYDIR);
+   }
+}
+
+/*
+ Asks to reopen the lines disconnected whose devices are present again.
+ Lines sharing a multi-channel sound device are left alone : the device is
+ shared with the other lines.
+*/
+static void alsa_input_devices_hotplug(alsa_input_chan_t *t)
+{
+   alsa_input_pvt_t *pvt;
+
+   alsa_input_monitor_lock(t);
+   AST_LIST_TRAVERSE(&(t->pvt_list), pvt, list) {
+      if ((AI_ST_DISCONNECTED != pvt->monitor.last_known_state) || (pvt->reload.reopening)
+          || (pvt->line_cfg->snd_capture_channel > 0) || (pvt->line_cfg->snd_playback_channel > 0)) {
+         continue;
+      }
+      if (alsa_input_line_devices_present((NULL != pvt->reload.pending_cfg) ? pvt->reload.pending_cfg : pvt->line_cfg)) {
+         ast_verb(3, "Line %lu : devices plugged again\n", (unsigned long)(pvt->index_line + 1));
+         alsa_input_devices_request(pvt);
+      }
+   }
+   alsa_input_monitor_unlock(t);
+}
+
+/*
+ Reopens the lines asked by alsa_input_devices_request() whose sound devices
+ have been closed by the audio thread. The others are reopened when the
+ audio thread acknowledges AI_AUDIO_CMD_CLOSE, as it wakes us up.
+*/
+static void alsa_input_devices_pass(alsa_input_chan_t *t)
+{
+   alsa_input_pvt_t *pvt;
+
+   AST_LIST_TRAVERSE(&(t->pvt_list), pvt, list) {
+      if ((t->devices.run) && (__atomic_load_n(&(pvt->reload.requested), __ATOMIC_ACQUIRE))
+          && (__atomic_load_n(&(pvt->audio.close_ack), __ATOMIC_ACQUIRE) == __atomic_load_n(&(pvt->reload.close_seq), __ATOMIC_RELAXED))) {
+         __atomic_store_n(&(pvt->reload.requested), 0, __ATOMIC_RELAXED);
+         alsa_input_reopen_line(t, pvt);
+      }
+   }
+}
+
+static void *alsa_input_do_devices(void *data)
+{
+   alsa_input_chan_t *t = (alsa_input_chan_t *)(data);
+   struct pollfd fds[2];
+   int timeout = -1;
+
+   alsa_input_pr_debug("Entering devices thread\n");
+
+   alsa_input_devices_watch(t);
+   fds[0].fd = t->devices.fd_wakeup;
+   fds[0].events = POLLIN;
+   /* Ignored by poll() if -1 */
+   fds[1].fd = t->devices.fd_inotify;
+   fds[1].events = POLLIN;
+   while (t->devices.run) {
+      int nfds;
+
+      nfds = poll(fds, ARRAY_LEN(fds), timeout);
+      if (nfds < 0) {
+         if (EINTR != errno) {
+            ast_log(AST_LOG_ERROR, "poll() failed: '%s'\n", strerror(errno));
+            break;
+         }
+         continue;
+      }
+      if (0 == nfds) {
+         /* The devices have settled */
+         timeout = -1;
+         alsa_input_devices_hotplug(t);
+         continue;
+      }
+      if ((fds[1].revents & POLLIN)) {
+         char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+         /* Only the time of the last change matters */
+         while (read(t->devices.fd_inotify, buf, sizeof(buf)) > 0) {
+         }
+         alsa_input_devices_watch(t);
+         timeout = AI_HOTPLUG_SETTLE_MS;
+      }
+      if ((fds[0].revents & POLLIN)) {
+         uint64_t val;
+
+         if (read(t->devices.fd_wakeup, &(val), sizeof(val)) < 0) {
+            alsa_input_pr_debug("Unable to read eventfd ('%s')\n", strerror(errno));
+         }
+         alsa_input_devices_pass(t);
+      }
+   }
+
+   alsa_input_pr_debug("Exiting devices thread\n");
+
+   return (NULL);
+}
+
+static void alsa_input_stop_devices(alsa_input_chan_t *t)
+{
+   int ret;
+
+   alsa_input_pr_debug("Stopping the devices thread\n");
+
+   if (AST_PTHREADT_NULL == t->devices.thread) {
+      alsa_input_pr_debug("Devices thread not running\n");
+      return;
+   }
+   t->devices.run = false;
+   if (t->devices.fd_wakeup >= 0) {
+      uint64_t val = 1;
+      if (write(t->devices.fd_wakeup, &(val), sizeof(val)) < 0) {
+         alsa_input_pr_debug("Unable to wake up the devices thread ('%s')\n", strerror(errno));
+      }
+   }
+   ret = pthread_join(t->devices.thread, NULL);
+   if (ret) {
+      ast_log(AST_LOG_ERROR, "pthread_join() failed: %d, %d\n", ret, errno);
+   }
+   t->devices.thread = AST_PTHREADT_NULL;
+}
+
+static int alsa_input_start_devices(alsa_input_chan_t *t)
+{
+   int ret = 0;
+
+   alsa_input_pr_debug("Starting the devices thread\n");
+
+   alsa_input_assert((AST_PTHREADT_NULL == t->devices.thread) && (!t->devices.run));
+   t->devices.run = true;
+   if (ast_pthread_create_background(&(t->devices.thread), NULL, alsa_input_do_devices, t) < 0) {
+      ast_log(AST_LOG_ERROR, "Unable to start devices thread.\n");
+      t->devices.run = false;
+      t->devices.thread = AST_PTHREADT_NULL;
+      ret = -1;
+   }
+
+   return (ret);
+}
+
+static alsa_input_pvt_t *alsa_input_add_pvt(alsa_input_chan_t *t, size_t index_line)
+{
+   /* Make a alsa_input_pvt_t structure for this interface */
+   alsa_input_pvt_t *tmp;
+
+   alsa_input_assert((NULL != t) && (!t->monitor.run) && (AST_PTHREADT_NULL == t->monitor.thread));
+
+   alsa_input_monitor_lock(t);
+   do { /* Empty loop */
+      tmp = ast_calloc(1, sizeof(*tmp));
+      if (NULL == tmp) {
+         ast_log(AST_LOG_ERROR, "Unable to allocate memory for line\n");
+         break;
+      }
+
+      memset(tmp, 0, sizeof(*tmp));
+
+      tmp->channel = t;
+      tmp->index_line = index_line;
+      tmp->line_cfg = &(t->config.line_cfgs[index_line]);
+      tmp->owner = NULL;
+#ifdef DEBUG
+      tmp->owner_lock_count = 0;
+#endif /* DEBUG */
+      tmp->monitor.fd_input = -1;
+      tmp->monitor.fd_output = -1;
+      tmp->monitor.fd_pipe = -1;
+      tmp->monitor.events_head = 0;
+      tmp->monitor.events_tail = 0;
+      tmp->monitor.events_synced = 0;
+      tmp->monitor.events_dropping = false;
+      tmp->monitor.src_input.pvt = tmp;
+      tmp->monitor.src_input.kind = AI_SRC_INPUT;
+      tmp->monitor.revents_input = 0;
+      tmp->monitor.in_pass = false;
+      tmp->monitor.next_service = NULL;
+      tmp->monitor.kicked = 0;
+      tmp->monitor.next_kicked = NULL;
+      tmp->monitor.deadline = AI_NO_DEADLINE;
+      tmp->monitor.heap_index = AI_NOT_IN_HEAP;
+      tmp->reload.next_cfg = NULL;
+      tmp->reload.pending_cfg = NULL;
+      tmp->reload.reopening = false;
+      tmp->reload.requested = 0;
+      tmp->reload.close_seq = 0;
+      tmp->monitor.volume = tmp->line_cfg->volume;
+      tmp->audio.play_gain = alsa_input_gain_from_db(tmp->monitor.volume);
+      tmp->audio.cmds_head = 0;
+      tmp->audio.cmds_tail = 0;
+      tmp->audio.frames_head = 0;
+      tmp->audio.frames_tail = 0;
+      tmp->audio.fd_frames = -1;
+      tmp->audio.snd_capture.card = NULL;
+      tmp->audio.snd_playback.card = NULL;
+      tmp->audio.fd_snd_capture = -1;
+      tmp->audio.fd_snd_playback = -1;
+      tmp->audio.src_capture.pvt = tmp;
+      tmp->audio.src_capture.kind = AI_SRC_CAPTURE;
+      tmp->audio.src_playback.pvt = tmp;
+      tmp->audio.src_playback.kind = AI_SRC_PLAYBACK;
+      tmp->audio.failed = false;
+      tmp->audio.capturing = false;
+      tmp->audio.offset_capture = 0;
+      tmp->audio.capture_dropping = false;
+      tmp->audio.playback_polled = false;
+#if (AST_VERSION < 110)
+      tmp->cap = &(tmp->cap_value);
+#else /* (AST_VERSION >= 110) */
+      tmp->cap = alsa_input_ast_format_cap_alloc();
+#endif /* (AST_VERSION >= 110) */
+      if ((NULL == tmp->cap) || alsa_input_alloc_pvt_buffers(tmp)) {
+         ast_log(AST_LOG_ERROR, "Unable to allocate memory for line\n");
+         alsa_input_free_pvt(tmp);
+         tmp = NULL;
+         break;
+      }
+      /* Until the sound devices are opened */
+      alsa_input_set_pvt_rate(tmp, AI_RATE_8000);
+      tmp->audio.play_head = 0;
+      tmp->audio.play_tail = 0;
+      tmp->audio.play_idle = 1;
+      tmp->audio.play_drained = true;
+      memset(&(tmp->stats), 0, sizeof(tmp->stats));
+      tmp->audio.tone_def = NULL;
+      tmp->audio.tone_duration_in_bytes = 0;
+      tmp->audio.tone_bytes_generated = 0;
+      tmp->audio.tone_buf_len = 0;
+      tmp->audio.offset_tone_buf = 0;
+      tmp->audio.playback_seq = 0;
+      tmp->audio.playback_ack = 0;
+      tmp->audio.close_ack = 0;
+      tmp->audio.critical_error = 0;
+      tmp->ast_channel.wait_start = 0;
+      alsa_input_reset_pvt_monitor_state(tmp);
+      tmp->ast_channel.status = AI_STATUS_ON_HOOK;
+      tmp->ast_channel.snd_capture_muted = true;
+      tmp->ast_channel.tone = AI_TONE_NONE;
+      tmp->ast_channel.playback_seq = 0;
+      tmp->ast_channel.frame_held = false;
+      tmp->ast_channel.state = AI_ST_ON_IDLE;
+      tmp->monitor.last_known_state = tmp->ast_channel.state;
+      AST_LIST_INSERT_TAIL(&(t->pvt_list), tmp, list);
+   } while (false);
+   alsa_input_monitor_unlock(t);
+
+   return (tmp);
+}
+
+static struct ast_channel *alsa_input_chan_request(const char *type,
+#if (AST_VERSION < 110)
+   format_t cap,
+#else /* (AST_VERSION >= 110) */
+   alsa_input_ast_format_cap *cap,
+#endif /* (AST_VERSION >= 110)*/
+#if (AST_VERSION > 110)
+   const struct ast_assigned_ids *assigned_ids,
+#endif /* (AST_VERSION > 110) */
+   const struct ast_channel *requestor,
+#if (AST_VERSION < 110)
+   void *addr,
+#else /* (AST_VERSION >= 110) */
+   const char *addr,
+#endif /* (AST_VERSION >= 110)*/
+   int *cause);
+
+static alsa_input_chan_t alsa_input_chan = {
+   .chan_tech = {
+      .type = alsa_input_chan_type,
+      .description = alsa_input_chan_desc,
+      .requester = alsa_input_chan_request,
+      .send_digit_begin = alsa_input_chan_digit_begin,
+      .send_digit_end = alsa_input_chan_digit_end,
+      .call = alsa_input_chan_call,
+      .hangup = alsa_input_chan_hangup,
+      .answer = alsa_input_chan_answer,
+      .read = alsa_input_chan_read,
+      .write = alsa_input_chan_write,
+      .indicate = alsa_input_chan_indicate,
+      .fixup = alsa_input_chan_fixup
+   },
+   .channel_registered = false,
+};
+
+/*!
+ * \brief Requester - to set up call data structures (pvt's)
+ *
+ * \param type type of channel to request
+ * \param cap Format capabilities for requested channel
+ * \param requestor channel asking for data
+ * \param addr destination of the call
+ * \param cause Cause of failure
+ *
+ * \details
+ * Request a channel of a given type, with addr as optional information used
+ * by the low level module
+ *
+ * \retval NULL failure
+ * \retval non-NULL channel on success
+ */
+static struct ast_channel *alsa_input_chan_request(const char *type,
+#if (AST_VERSION < 110)
+   format_t cap,
+#else /* (AST_VERSION >= 110) */
+   alsa_input_ast_format_cap *cap,
+#endif /* (AST_VERSION >= 110)*/
+#if (AST_VERSION > 110)
+   const struct ast_assigned_ids *assigned_ids,
+#endif /* (AST_VERSION > 110) */
+   const struct ast_channel *requestor,
+#if (AST_VERSION < 110)
+   void *_addr,
+#else /* (AST_VERSION >= 110) */
+   const char *addr,
+#endif /* (AST_VERSION >= 110)*/
+   int *cause)
+{
+   struct ast_channel *ret = NULL;
+   alsa_input_chan_t *t = &(alsa_input_chan);
+   alsa_input_pvt_t *pvt;
+#if (AST_VERSION < 110)
+   const char *addr = _addr;
+#endif /* (AST_VERSION < 110) */
+
+   alsa_input_pr_debug("alsa_input_chan_request(type='%s', addr='%s')\n", type, addr);
+
+   if (ast_strlen_zero(addr)) {
+      ast_log(AST_LOG_WARNING, "Unable to create channel with empty destination.\n");
+      *cause = AST_CAUSE_CHANNEL_UNACCEPTABLE;
+   }
+   else {
+      /* Search for an unowned channel */
+      alsa_input_monitor_lock(t);
+      *cause = AST_CAUSE_CHANNEL_UNACCEPTABLE;
+      AST_LIST_TRAVERSE(&(t->pvt_list), pvt, list) {
+         char tmp[16];
+         size_t length;
+         sprintf(tmp, "%lu", (unsigned long)(pvt->index_line + 1));
+         length = strlen(tmp);
+         if ((0 == strncmp(addr, tmp, length)) && (!isalnum(addr[length]))) {
+#if (AST_VERSION < 110)
+            if (alsa_input_ast_format_cap_iscompatible_cap(&(cap), alsa_input_get_chan_tech_cap(&(pvt->channel->chan_tech)))) {
+#else /* (AST_VERSION >= 110) */
+            if (alsa_input_ast_format_cap_iscompatible_cap(cap, alsa_input_get_chan_tech_cap(&(pvt->channel->chan_tech)))) {
+#endif /* (AST_VERSION >= 110)*/
+               if ((NULL == pvt->owner) && (AI_STATUS_ON_HOOK == pvt->ast_channel.status)) {
+                  alsa_input_assert(AI_ST_ON_IDLE == pvt->ast_channel.state);
+                  alsa_input_new(pvt, AI_ST_ON_PRE_RINGING, AI_EV_AST_REQUEST,
+#if (AST_VERSION <= 110)
+                     ((NULL != requestor) ? alsa_input_ast_channel_linkedid(requestor) : NULL),
+#else /* (AST_VERSION > 110) */
+                     assigned_ids, requestor,
+#endif /* (AST_VERSION > 110) */
+                     NULL);
+                  ret = pvt->owner;
+               }
+               else {
+                  alsa_input_pr_debug("Channel is busy\n");
+                  *cause = AST_CAUSE_BUSY;
+               }
+            }
+            else {
+#if (AST_VERSION <= 110)
+               char buf[256];
+               ast_log(AST_LOG_WARNING, "Asked to get a channel of unsupported format '%s'\n", ast_getformatname_multiple(buf, sizeof(buf), cap));
+#else /* (AST_VERSION > 110) */
+               struct ast_str *buf = ast_str_alloca(256);
+               ast_log(AST_LOG_WARNING, "Asked to get a channel of unsupported format '%s'\n", ast_format_cap_get_names(cap, &(buf)));
+#endif /* (AST_VERSION > 110) */
+            }
+            break;
+         }
+      }
+      alsa_input_monitor_unlock(t);
+   }
+   return (ret);
+}
+
+/* Must be called with monitor.lock locked */
+static int alsa_input_write_input_event(alsa_input_pvt_t *pvt, __u16 ev_type, __u16 ev_code)
+{
+   int ret = -1;
+   __u8 c;
+   struct input_event *ev;
+
+   /*
+    We write the event, followed by a SYN_REPORT that ends the packet,
+    directly in the ring pvt->monitor.events, and just write a single
+    byte to generate POLLIN event for the file descriptor connected to
+    the other end of the pipe
+   */
+   alsa_input_assert((pvt->channel->monitor.lock_count > 0) && (pvt->monitor.fd_pipe >= 0));
+   if ((pvt->monitor.events_head - pvt->monitor.events_tail + 2) <= AI_INPUT_EVENTS_LEN) {
+      ev = &(pvt->monitor.events[pvt->monitor.events_head % AI_INPUT_EVENTS_LEN]);
+      memset(ev, 0, sizeof(*ev));
+      ev->type = ev_type;
+      ev->code = ev_code;
+      ev->value = 1;
+      ev = &(pvt->monitor.events[(pvt->monitor.events_head + 1) % AI_INPUT_EVENTS_LEN]);
+      memset(ev, 0, sizeof(*ev));
+      ev->type = EV_SYN;
+      ev->code = SYN_REPORT;
+      alsa_input_monitor_events_added(pvt, 2);
+      ret = 0;
+   }
+   else {
+      ast_log(AST_LOG_ERROR, "Error writing input_event\n");
+      ret = -1;
+   }
+   c = 0;
+   write(pvt->monitor.fd_pipe, &(c), sizeof(c));
+
+   return (ret);
+}
+
+static char *alsa_input_cli_press(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+   char *ret = CLI_SUCCESS;
+   alsa_input_chan_t *t = &(alsa_input_chan);
+   bool do_unlock = false;
+
+   switch (cmd) {
+      case CLI_INIT: {
+         e->command = "ai press";
+         e->usage =
+            "Usage: ai press line [on|off|mute|volup|voldown]\n"
+            "       Press key for line 'line':\n"
+            "       - 'on' hook key\n"
+            "       - 'off' hook key\n"
+            "       - 'mute' key\n"
+            "       - 'volup' and 'voldown' volume keys\n";
+         return (NULL);
+      }
+      case CLI_GENERATE: {
+         return (NULL);
+      }
+   }
+
+   do { /* Empty loop */
+      alsa_input_pvt_t *pvt;
+      int tmp;
+      char str_status[64];
+      char *f;
+      __u16 code;
+
+      if (4 != a->argc) {
+         ret = CLI_SHOWUSAGE;
+         break;
+      }
+
+      /* We parse the special key */
+      ast_copy_string(str_status, a->argv[3], ARRAY_LEN(str_status));
+      f = ast_strip(str_status);
+      if (!strcasecmp(f, "on")) {
+         code = KEY_ESC;
+      }
+      else if (!strcasecmp(f, "off")) {
+         code = KEY_ENTER;
+      }
+      else if (!strcasecmp(f, "mute")) {
+         code = KEY_MUTE;
+      }
+      else if (!strcasecmp(f, "volup")) {
+         code = KEY_VOLUMEUP;
+      }
+      else if (!strcasecmp(f, "voldown")) {
+         code = KEY_VOLUMEDOWN;
+      }
+      else {
+         ast_cli(a->fd, "Invalid key '%s'\n", f);
+         ret = CLI_FAILURE;
+         break;
+      }
+
+      /* We parse the line number */
+      if ((1 != sscanf(a->argv[2], " %10d ", &(tmp))) || (tmp <= 0)) {
+         ast_cli(a->fd, "Invalid line '%s'\n", a->argv[2]);
+         ret = CLI_FAILURE;
+         break;
+      }
+      tmp -= 1;
+
+      alsa_input_monitor_lock(t);
+      do_unlock = true;
+      AST_LIST_TRAVERSE(&(t->pvt_list), pvt, list) {
+         if (pvt->index_line == ((size_t)(tmp))) {
+            break;
+         }
+      }
+      if ((NULL == pvt) || (pvt->monitor.fd_pipe < 0)) {
+         ast_cli(a->fd, "Invalid line '%d'\n", (int)(tmp + 1));
+         ret = CLI_FAILURE;
+         break;
+      }
+
+      /* We change the status of the line */
+      if (alsa_input_write_input_event(pvt, EV_KEY, code)) {
+         ret = CLI_FAILURE;
+         break;
+      }
+   } while (false);
+
+   if (do_unlock) {
+      alsa_input_monitor_unlock(t);
+      do_unlock = false;
+   }
+
+   return (ret);
+}
+
+static char *alsa_input_cli_dial(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+   char *ret = CLI_SUCCESS;
+   alsa_input_chan_t *t = &(alsa_input_chan);
+   bool do_unlock = false;
+
+   switch (cmd) {
+      case CLI_INIT: {
+         e->command = "ai dial";
+         e->usage =
+            "Usage: ai dial line [digits]\n"
+            "       Dials the digits\n";
+         return (NULL);
+      }
+      case CLI_GENERATE: {
+         return (NULL);
+      }
+   }
+
+   do { /* Empty loop */
+      alsa_input_pvt_t *pvt;
+      int tmp;
+      const char *f;
+      __u16 code;
+
+      if (4 != a->argc) {
+         ret = CLI_SHOWUSAGE;
+         break;
+      }
+
+      /* We parse the line number */
+      if ((1 != sscanf(a->argv[2], " %10d ", &(tmp))) || (tmp <= 0)) {
+         ast_cli(a->fd, "Invalid line '%s'\n", a->argv[2]);
+         ret = CLI_FAILURE;
+         break;
+      }
+      tmp -= 1;
+
+      alsa_input_monitor_lock(t);
+      do_unlock = true;
+      AST_LIST_TRAVERSE(&(t->pvt_list), pvt, list) {
+         if (pvt->index_line == ((size_t)(tmp))) {
+            break;
+         }
+      }
+      if ((NULL == pvt) || (pvt->monitor.fd_pipe < 0)) {
+         ast_cli(a->fd, "Invalid line '%d'\n", (int)(tmp + 1));
+         ret = CLI_FAILURE;
+         break;
+      }
+
+      /* We parse the digits */
+      f = a->argv[3];
+      for (f = a->argv[3]; ('\0' != *f); f += 1) {
+         if (isspace(*f)) {
+            continue;
+         }
+         code = KEY_RESERVED;
+         if ((*f >= '0') && (*f <= '9')) {
+            code = KEY_NUMERIC_0 + (*f - '0');
+         }
+         else if ('*' == *f) {
+            code = KEY_NUMERIC_STAR;
+         }
+         else if ('#' == *f) {
+            code = KEY_NUMERIC_POUND;
+         }
+         else if (('A' == *f) || ('a' == *f)) {
+            code = KEY_A;
+         }
+         else if (('B' == *f) || ('b' == *f)) {
+            code = KEY_B;
+         }
+         else if (('C' == *f) || ('c' == *f)) {
+            code = KEY_C;
+         }
+         else if (('D' == *f) || ('d' == *f)) {
+            code = KEY_D;
+         }
+         else {
+            break;
+         }
+         if (alsa_input_write_input_event(pvt, EV_KEY, code)) {
+            ret = CLI_FAILURE;
+            break;
+         }
+      }
+      if ('\0' != *f) {
+         if (KEY_RESERVED == code) {
+            ast_cli(a->fd, "Invalid digit '%c'\n", (char)(*f));
+         }
+         ret = CLI_FAILURE;
+         break;
+      }
+   } while (false);
+
+   if (do_unlock) {
+      alsa_input_monitor_unlock(t);
+      do_unlock = false;
+   }
+
+   return (ret);
+}
+
+/* Shows the statistics of a line (see alsa_input_stats_t) */
+static void alsa_input_cli_show_line_stats(int fd, const alsa_input_pvt_t *pvt)
+{
+   alsa_input_stats_t stats;
+   unsigned long recovered = alsa_input_stats_get(pvt, &(stats));
+   char delay[64];
+   char latency[AI_STATS_LATENCY_BUCKETS * 24];
+   unsigned long bound = AI_STATS_LATENCY_FIRST_MS;
+   unsigned int i;
+
+   ast_cli(fd, "Line %lu (%u Hz)\n", (unsigned long)(pvt->index_line + 1), alsa_input_rate_values[pvt->rate]);
+   alsa_input_stats_delay_format(pvt, &(stats.capture_delay), delay, sizeof(delay));
+   ast_cli(fd, "  Capture  : %lu frames queued, %lu dropped, at most %lu waiting, %lu overruns\n",
+      stats.capture_frames, stats.capture_dropped, stats.capture_queue_max, stats.capture_xruns);
+   ast_cli(fd, "             delay min/avg/max %s ms\n", delay);
+   alsa_input_stats_delay_format(pvt, &(stats.playback_delay), delay, sizeof(delay));
+   ast_cli(fd, "  Playback : %lu frames queued, %lu dropped, %lu underruns, %lu periods concealed\n",
+      stats.playback_frames, stats.playback_dropped, stats.playback_xruns, stats.concealed);
+   ast_cli(fd, "             delay min/avg/max %s ms\n", delay);
+   ast_cli(fd, "  Errors   : %lu recovered by the sound devices, %lu frames refused by Asterisk\n",
+      recovered, stats.queue_failures);
+   ast_cli(fd, "  Latency from alsa_input_chan_write() to the device (frames) :\n");
+   for (i = 0; (i < AI_STATS_LATENCY_BUCKETS); i += 1) {
+      if (i < (AI_STATS_LATENCY_BUCKETS - 1)) {
+         snprintf(latency, sizeof(latency), "< %lu ms", bound);
+      }
+      else {
+         snprintf(latency, sizeof(latency), ">= %lu ms", bound >> 1);
+      }
+      ast_cli(fd, "    %-10s %lu\n", latency, stats.latency[i]);
+      bound <<= 1;
+   }
+}
+
+static char *alsa_input_cli_show_stats(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+   char *ret = CLI_SUCCESS;
+   alsa_input_chan_t *t = &(alsa_input_chan);
+   bool do_unlock = false;
+
+   switch (cmd) {
+      case CLI_INIT: {
+         e->command = "ai show stats";
+         e->usage =
+            "Usage: ai show stats [line]\n"
+            "       Shows the statistics of line 'line', or of all the lines :\n"
+            "       frames, xruns and delay of the sound devices, errors, and\n"
+            "       latency of the voice played\n";
+         return (NULL);
+      }
+      case CLI_GENERATE: {
+         return (NULL);
+      }
+   }
+
+   do { /* Empty loop */
+      alsa_input_pvt_t *pvt;
+      int tmp = -1;
+      bool found = false;
+
+      if ((3 != a->argc) && (4 != a->argc)) {
+         ret = CLI_SHOWUSAGE;
+         break;
+      }
+
+      /* We parse the line number */
+      if (4 == a->argc) {
+         if ((1 != sscanf(a->argv[3], " %10d ", &(tmp))) || (tmp <= 0)) {
+            ast_cli(a->fd, "Invalid line '%s'\n", a->argv[3]);
+            ret = CLI_FAILURE;
+            break;
+         }
+         tmp -= 1;
+      }
+
+      alsa_input_monitor_lock(t);
+      do_unlock = true;
+      AST_LIST_TRAVERSE(&(t->pvt_list), pvt, list) {
+         if ((tmp < 0) || (pvt->index_line == ((size_t)(tmp)))) {
+            alsa_input_cli_show_line_stats(a->fd, pvt);
+            found = true;
+         }
+      }
+      if ((tmp >= 0) && (!found)) {
+         ast_cli(a->fd, "Invalid line '%d'\n", (int)(tmp + 1));
+         ret = CLI_FAILURE;
+         break;
+      }
+   } while (false);
+
+   if (do_unlock) {
+      alsa_input_monitor_unlock(t);
+      do_unlock = false;
+   }
+
+   return (ret);
+}
+
+static struct ast_cli_entry cli_alsa_input[] = {
+   AST_CLI_DEFINE(alsa_input_cli_press, "Press a special key"),
+   AST_CLI_DEFINE(alsa_input_cli_dial, "Dial digits"),
+   AST_CLI_DEFINE(alsa_input_cli_show_stats, "Show the statistics of the lines"),
+};
+
+/*
+ Reads the configuration file into config, whose array line_cfgs is
+ allocated. Return 0, or -1 if the configuration is invalid.
+ Used by load_module() and alsa_input_reload_module()
+*/
+static int alsa_input_read_config(alsa_input_chan_t *t, struct ast_config *cfg,
+   alsa_input_chan_config_t *config)
+{
+   int ret = 0;
+   size_t i;
+
+   config->language[0] = '\0';
+   config->line_count = 0;
+   config->line_cfgs = NULL;
+   config->audio_thread_priority = 10;
+   config->audio_thread_cpu = -1;
+
+   do { /* Empty loop */
+      struct ast_variable *v;
+
+      for (v = ast_variable_browse(cfg, "general"); (NULL != v); v = v->next) {
+         if (!strcasecmp(v->name, "lines")) {
+            int tmp;
+            if ((1 != sscanf(v->value, " %10d ", &(tmp))) || (tmp <= 0) || (tmp > MAX_LINES)) {
+               ast_log(AST_LOG_ERROR, "Invalid value for variable 'lines' in section 'interfaces' of config file '%s'\n",
+                  alsa_input_cfg_file);
+               ret = -1;
+               break;
+            }
+            config->line_count = (size_t)(tmp);
+         }
+         else if (!strcasecmp(v->name, "language")) {
+            ast_copy_string(config->language, v->value, sizeof(config->language));
+         }
+         else if (!strcasecmp(v->name, "audio_thread_priority")) {
+            int tmp;
+            if ((1 != sscanf(v->value, " %10d ", &(tmp))) || (tmp < 0) || (tmp > 99)) {
+               ast_log(AST_LOG_ERROR, "Invalid value for variable 'audio_thread_priority' in section 'general' of config file '%s'\n",
+                  alsa_input_cfg_file);
+               ret = -1;
+               break;
+            }
+            config->audio_thread_priority = tmp;
+         }
+         else if (!strcasecmp(v->name, "audio_thread_cpu")) {
+            int tmp;
+            if ((1 != sscanf(v->value, " %10d ", &(tmp))) || (tmp < -1) || (tmp >= CPU_SETSIZE)) {
+               ast_log(AST_LOG_ERROR, "Invalid value for variable 'audio_thread_cpu' in section 'general' of config file '%s'\n",
+                  alsa_input_cfg_file);
+               ret = -1;
+               break;
+            }
+            config->audio_thread_cpu = tmp;
+         }
+         else {
+            ast_log(AST_LOG_WARNING, "Unknown variable '%s' in section 'interfaces' of config_file '%s'\n",
+               v->name, alsa_input_cfg_file);
+         }
+      }
+
+      if (0 != ret) {
+         break;
+      }
+
+      if (config->line_count <= 0) {
+         ast_log(AST_LOG_ERROR, "Missing variable 'lines' in section 'general' of config file '%s'\n",
+            alsa_input_cfg_file);
+         ret = -1;
+         break;
+      }
+
+      /* Now that we know the number of lines, we allocate their configuration */
+      config->line_cfgs = ast_calloc(config->line_count, sizeof(config->line_cfgs[0]));
+      if (NULL == config->line_cfgs) {
+         ast_log(AST_LOG_ERROR, "Unable to allocate memory for %lu lines\n",
+            (unsigned long)(config->line_count));
+         ret = -1;
+         break;
+      }
+      for (i = 0; (i < config->line_count); i += 1) {
+         alsa_input_line_config_t *line_cfg = &(config->line_cfgs[i]);
+         memcpy(&(line_cfg->jb_conf), &(default_jb_conf), sizeof(line_cfg->jb_conf));
+         line_cfg->enable = false;
+         line_cfg->snd_capture_dev_name[0] = '\0';
+         line_cfg->snd_playback_dev_name[0] = '\0';
+         line_cfg->ev_in_dev_name[0] = '\0';
+         line_cfg->ev_out_dev_name[0] = '\0';
+         line_cfg->monitor_dialing = false;
+         line_cfg->search_extension_trigger = '\0';
+         line_cfg->dialing_timeout_1st_digit = 5000;
+         line_cfg->dialing_timeout = 3000;
+         snprintf(line_cfg->context, ARRAY_LEN(line_cfg->context), "ai-line-%d", (int)(i + 1));
+         snprintf(line_cfg->cid_name, ARRAY_LEN(line_cfg->cid_name), "line%d", (int)(i + 1));
+         snprintf(line_cfg->cid_num, ARRAY_LEN(line_cfg->cid_num), "00-00-00-%02d", (int)(i + 1));
+         ast_copy_string(line_cfg->moh_interpret, "default", ARRAY_LEN(line_cfg->moh_interpret));
+         line_cfg->playback_buffer_ms = 120;
+         line_cfg->plc = true;
+         line_cfg->snd_mmap = false;
+         line_cfg->period_ms = DEFAULT_PERIOD_MS;
+         line_cfg->periods = DEFAULT_PERIODS;
+         line_cfg->max_rate = AI_RATE_8000;
+         line_cfg->resample_quality = AI_RESAMPLE_MEDIUM;
+         line_cfg->snd_capture_channel = 0;
+         line_cfg->snd_playback_channel = 0;
+         line_cfg->tone_zone[0] = '\0';
+         line_cfg->tones = &(alsa_input_tone_zone_builtin);
+         line_cfg->dtmf_detect = false;
+         line_cfg->dtmf_threshold = -36;
+         line_cfg->dtmf_normal_twist = 8;
+         line_cfg->dtmf_reverse_twist = 4;
+         line_cfg->echo_cancel = false;
+         line_cfg->echo_tail_ms = 64;
+         line_cfg->noise_suppress = false;
+         line_cfg->noise_reduction = 12;
+         line_cfg->agc = false;
+         line_cfg->agc_target = -18;
+         line_cfg->agc_max_gain = 18;
+         line_cfg->volume = 0;
+         line_cfg->volume_step = 3;
+         line_cfg->vad = AI_VAD_NONE;
+         line_cfg->vad_threshold = 9;
+      }
+
+      for (i = 0; (i < config->line_count); i += 1) {
+         char section[64];
+         alsa_input_line_config_t *line_cfg = &(config->line_cfgs[i]);
+
+         snprintf(section, ARRAY_LEN(section), "line%d", (int)(i + 1));
+         for (v = ast_variable_browse(cfg, section); (NULL != v); v = v->next) {
+            if (!ast_jb_read_conf(&(line_cfg->jb_conf), v->name, v->value)) {
+               continue;
+            }
+            if (!strcasecmp(v->name, "enable")) {
+               if (ast_true(v->value)) {
+                  line_cfg->enable = true;
+               }
+               else {
+                  line_cfg->enable = false;
+                  /* Stop parsing section */
+                  break;
+               }
+            }
+            else if (!strcasecmp(v->name, "context")) {
+               ast_copy_string(line_cfg->context, v->value, ARRAY_LEN(line_cfg->context));
+            }
+            else if (!strcasecmp(v->name, "snd_capture_device")) {
+               ast_copy_string(line_cfg->snd_capture_dev_name, v->value, sizeof(line_cfg->snd_capture_dev_name));
+            }
+            else if (!strcasecmp(v->name, "snd_playback_device")) {
+               ast_copy_string(line_cfg->snd_playback_dev_name, v->value, sizeof(line_cfg->snd_playback_dev_name));
+            }
+            else if ((!strcasecmp(v->name, "snd_capture_channel")) || (!strcasecmp(v->name, "snd_playback_channel"))) {
+               int tmp;
+               if ((1 != sscanf(v->value, " %10d ", &(tmp))) || (tmp < 0) || (tmp > AI_SHARED_MAX_CHANNELS)) {
+                  ast_log(AST_LOG_ERROR, "Invalid value for variable '%s' in section '%s' of config file '%s'\n",
+                     v->name, section, alsa_input_cfg_file);
+                  ret = -1;
+                  break;
+               }
+               if (!strcasecmp(v->name, "snd_capture_channel")) {
+                  line_cfg->snd_capture_channel = tmp;
+               }
+               else {
+                  line_cfg->snd_playback_channel = tmp;
+               }
+            }
+            else if (!strcasecmp(v->name, "event_input_device")) {
+               ast_copy_string(line_cfg->ev_in_dev_name, v->value, sizeof(line_cfg->ev_in_dev_name));
+            }
+            else if (!strcasecmp(v->name, "event_output_device")) {
+               ast_copy_string(line_cfg->ev_out_dev_name, v->value, sizeof(line_cfg->ev_out_dev_name));
+            }
+            else if (!strcasecmp(v->name, "monitor_dialing")) {
+               if (ast_true(v->value)) {
+                  line_cfg->monitor_dialing = true;
+               }
+               else {
+                  line_cfg->monitor_dialing = false;
+               }
+            }
+            else if (!strcasecmp(v->name, "search_extension_trigger")) {
+               char value[32];
+               char *f;
+
+               ast_copy_string(value, v->value, ARRAY_LEN(value));
+               f = ast_strip(value);
+               if (('\0' == f[0]) || ('\0' == f[1])) {
+                  line_cfg->search_extension_trigger = f[0];
+               }
+               else {
+                  ast_log(AST_LOG_ERROR, "Invalid value for variable 'search_extension_trigger' in section '%s' of config file '%s'\n",
+                     section, alsa_input_cfg_file);
+                  ret = -1;
+                  break;
+               }
+            }
+            else if (!strcasecmp(v->name, "dialing_timeout_1st_digit")) {
+               int tmp;
+               if ((1 != sscanf(v->value, " %10d ", &(tmp))) || (tmp < 0)) {
+                  ast_log(AST_LOG_ERROR, "Invalid value for variable 'dialing_timeout_1st_digit' in section '%s' of config file '%s'\n",
+                     section, alsa_input_cfg_file);
+                  ret = -1;
+                  break;
+               }
+               line_cfg->dialing_timeout_1st_digit = tmp;
+            }
+            else if (!strcasecmp(v->name, "dialing_timeout")) {
+               int tmp;
+               if ((1 != sscanf(v->value, " %10d ", &(tmp))) || (tmp < 0)) {
+                  ast_log(AST_LOG_ERROR, "Invalid value for variable 'dialing_timeout' in section '%s' of config file '%s'\n",
+                     section, alsa_input_cfg_file);
+                  ret = -1;
+                  break;
+               }
+               line_cfg->dialing_timeout = tmp;
+            }
+            else if (!strcasecmp(v->name, "caller_id")) {
+               ast_callerid_split(v->value, line_cfg->cid_name,
+                  ARRAY_LEN(line_cfg->cid_name),
+                  line_cfg->cid_num, ARRAY_LEN(line_cfg->cid_num));
+            }
+            else if (!strcasecmp(v->name, "moh_interpret")) {
+               ast_copy_string(line_cfg->moh_interpret, v->value, ARRAY_LEN(line_cfg->moh_interpret));
+            }
+            else if (!strcasecmp(v->name, "playback_buffer_ms")) {
+               int tmp;
+               if ((1 != sscanf(v->value, " %10d ", &(tmp))) || (tmp < 10) || (tmp > 2000)) {
+                  ast_log(AST_LOG_ERROR, "Invalid value for variable 'playback_buffer_ms' in section '%s' of config file '%s'\n",
+                     section, alsa_input_cfg_file);
+                  ret = -1;
+                  break;
+               }
+               line_cfg->playback_buffer_ms = tmp;
+            }
+            else if (!strcasecmp(v->name, "plc")) {
+               line_cfg->plc = ast_true(v->value) ? true : false;
+            }
+            else if (!strcasecmp(v->name, "period_ms")) {
+               int tmp;
+               if ((1 != sscanf(v->value, " %10d ", &(tmp))) || (tmp < 5) || (tmp > 100)) {
+                  ast_log(AST_LOG_ERROR, "Invalid value for variable 'period_ms' in section '%s' of config file '%s'\n",
+                     section, alsa_input_cfg_file);
+                  ret = -1;
+                  break;
+               }
+               line_cfg->period_ms = tmp;
+            }
+            else if (!strcasecmp(v->name, "periods")) {
+               int tmp;
+               if ((1 != sscanf(v->value, " %10d ", &(tmp))) || (tmp < 2) || (tmp > 64)) {
+                  ast_log(AST_LOG_ERROR, "Invalid value for variable 'periods' in section '%s' of config file '%s'\n",
+                     section, alsa_input_cfg_file);
+                  ret = -1;
+                  break;
+               }
+               line_cfg->periods = tmp;
+            }
+            else if (!strcasecmp(v->name, "max_rate")) {
+               int tmp;
+               alsa_input_rate_t r;
+               if (1 != sscanf(v->value, " %10d ", &(tmp))) {
+                  tmp = 0;
+               }
+               for (r = AI_RATE_8000; (r < AI_RATE_COUNT); r += 1) {
+                  if ((unsigned int)(tmp) == alsa_input_rate_values[r]) {
+                     break;
+                  }
+               }
+               if (AI_RATE_COUNT == r) {
+                  ast_log(AST_LOG_ERROR, "Invalid value for variable 'max_rate' in section '%s' of config file '%s'\n",
+                     section, alsa_input_cfg_file);
+                  ret = -1;
+                  break;
+               }
+               /* Before Asterisk 11 there's no 48 kHz format */
+               while (NULL == alsa_input_rate_format(r)) {
+                  r -= 1;
+               }
+               line_cfg->max_rate = r;
+            }
+            else if (!strcasecmp(v->name, "resample_quality")) {
+               if (!strcasecmp(v->value, "none")) {
+                  line_cfg->resample_quality = AI_RESAMPLE_NONE;
+               }
+               else if (!strcasecmp(v->value, "low")) {
+                  line_cfg->resample_quality = AI_RESAMPLE_LOW;
+               }
+               else if (!strcasecmp(v->value, "medium")) {
+                  line_cfg->resample_quality = AI_RESAMPLE_MEDIUM;
+               }
+               else if (!strcasecmp(v->value, "high")) {
+                  line_cfg->resample_quality = AI_RESAMPLE_HIGH;
+               }
+               else {
+                  ast_log(AST_LOG_ERROR, "Invalid value for variable 'resample_quality' in section '%s' of config file '%s'\n",
+                     section, alsa_input_cfg_file);
+                  ret = -1;
+                  break;
+               }
+            }
+            else if (!strcasecmp(v->name, "dtmf_detect")) {
+               line_cfg->dtmf_detect = ast_true(v->value) ? true : false;
+            }
+            else if (!strcasecmp(v->name, "dtmf_threshold")) {
+               int tmp;
+               if ((1 != sscanf(v->value, " %10d ", &(tmp))) || (tmp < -60) || (tmp > 0)) {
+                  ast_log(AST_LOG_ERROR, "Invalid value for variable 'dtmf_threshold' in section '%s' of config file '%s'\n",
+                     section, alsa_input_cfg_file);
+                  ret = -1;
+                  break;
+               }
+               line_cfg->dtmf_threshold = tmp;
+            }
+            else if (!strcasecmp(v->name, "dtmf_normal_twist")) {
+               int tmp;
+               if ((1 != sscanf(v->value, " %10d ", &(tmp))) || (tmp < 0) || (tmp > 20)) {
+                  ast_log(AST_LOG_ERROR, "Invalid value for variable 'dtmf_normal_twist' in section '%s' of config file '%s'\n",
+                     section, alsa_input_cfg_file);
+                  ret = -1;
+                  break;
+               }
+               line_cfg->dtmf_normal_twist = tmp;
+            }
+            else if (!strcasecmp(v->name, "dtmf_reverse_twist")) {
+               int tmp;
+               if ((1 != sscanf(v->value, " %10d ", &(tmp))) || (tmp < 0) || (tmp > 20)) {
+                  ast_log(AST_LOG_ERROR, "Invalid value for variable 'dtmf_reverse_twist' in section '%s' of config file '%s'\n",
+                     section, alsa_input_cfg_file);
+                  ret = -1;
+                  break;
+               }
+               line_cfg->dtmf_reverse_twist = tmp;
+            }
+            else if (!strcasecmp(v->name, "echo_cancel")) {
+               line_cfg->echo_cancel = ast_true(v->value) ? true : false;
+            }
+            else if (!strcasecmp(v->name, "echo_tail_ms")) {
+               int tmp;
+               if ((1 != sscanf(v->value, " %10d ", &(tmp))) || (tmp < 16) || (tmp > 256)) {
+                  ast_log(AST_LOG_ERROR, "Invalid value for variable 'echo_tail_ms' in section '%s' of config file '%s'\n",
+                     section, alsa_input_cfg_file);
+                  ret = -1;
+                  break;
+               }
+               line_cfg->echo_tail_ms = tmp;
+            }
+            else if (!strcasecmp(v->name, "noise_suppress")) {
+               line_cfg->noise_suppress = ast_true(v->value) ? true : false;
+            }
+            else if (!strcasecmp(v->name, "noise_reduction")) {
+               int tmp;
+               if ((1 != sscanf(v->value, " %10d ", &(tmp))) || (tmp < 3) || (tmp > 30)) {
+                  ast_log(AST_LOG_ERROR, "Invalid value for variable 'noise_reduction' in section '%s' of config file '%s'\n",
+                     section, alsa_input_cfg_file);
+                  ret = -1;
+                  break;
+               }
+               line_cfg->noise_reduction = tmp;
+            }
+            else if (!strcasecmp(v->name, "agc")) {
+               line_cfg->agc = ast_true(v->value) ? true : false;
+            }
+            else if (!strcasecmp(v->name, "agc_target")) {
+               int tmp;
+               if ((1 != sscanf(v->value, " %10d ", &(tmp))) || (tmp < -40) || (tmp > -6)) {
+                  ast_log(AST_LOG_ERROR, "Invalid value for variable 'agc_target' in section '%s' of config file '%s'\n",
+                     section, alsa_input_cfg_file);
+                  ret = -1;
+                  break;
+               }
+               line_cfg->agc_target = tmp;
+            }
+            else if (!strcasecmp(v->name, "agc_max_gain")) {
+               int tmp;
+               if ((1 != sscanf(v->value, " %10d ", &(tmp))) || (tmp < 0) || (tmp > 24)) {
+                  ast_log(AST_LOG_ERROR, "Invalid value for variable 'agc_max_gain' in section '%s' of config file '%s'\n",
+                     section, alsa_input_cfg_file);
+                  ret = -1;
+                  break;
+               }
+               line_cfg->agc_max_gain = tmp;
+            }
+            else if (!strcasecmp(v->name, "volume")) {
+               int tmp;
+               if ((1 != sscanf(v->value, " %10d ", &(tmp))) || (tmp < AI_VOLUME_MIN) || (tmp > AI_VOLUME_MAX)) {
+                  ast_log(AST_LOG_ERROR, "Invalid value for variable 'volume' in section '%s' of config file '%s'\n",
+                     section, alsa_input_cfg_file);
+                  ret = -1;
+                  break;
+               }
+               line_cfg->volume = tmp;
+            }
+            else if (!strcasecmp(v->name, "volume_step")) {
+               int tmp;
+               if ((1 != sscanf(v->value, " %10d ", &(tmp))) || (tmp < 1) || (tmp > 6)) {
+                  ast_log(AST_LOG_ERROR, "Invalid value for variable 'volume_step' in section '%s' of config file '%s'\n",
+                     section, alsa_input_cfg_file);
+                  ret = -1;
+                  break;
+               }
+               line_cfg->volume_step = tmp;
+            }
+            else if (!strcasecmp(v->name, "vad")) {
+               if (!strcasecmp(v->value, "cng")) {
+                  line_cfg->vad = AI_VAD_CNG;
+               }
+               else if (!strcasecmp(v->value, "drop")) {
+                  line_cfg->vad = AI_VAD_DROP;
+               }
+               else if (ast_false(v->value)) {
+                  line_cfg->vad = AI_VAD_NONE;
+               }
+               else {
+                  ast_log(AST_LOG_ERROR, "Invalid value for variable 'vad' in section '%s' of config file '%s'\n",
+                     section, alsa_input_cfg_file);
+                  ret = -1;
+                  break;
+               }
+            }
+            else if (!strcasecmp(v->name, "vad_threshold")) {
+               int tmp;
+               if ((1 != sscanf(v->value, " %10d ", &(tmp))) || (tmp < 3) || (tmp > 30)) {
+                  ast_log(AST_LOG_ERROR, "Invalid value for variable 'vad_threshold' in section '%s' of config file '%s'\n",
+                     section, alsa_input_cfg_file);
+                  ret = -1;
+                  break;
+               }
+               line_cfg->vad_threshold = tmp;
+            }
+            else if (!strcasecmp(v->name, "tone_zone")) {
+               ast_copy_string(line_cfg->tone_zone, v->value, sizeof(line_cfg->tone_zone));
+            }
+            else if (!strcasecmp(v->name, "snd_access")) {
+               if (!strcasecmp(v->value, "mmap")) {
+                  line_cfg->snd_mmap = true;
+               }
+               else if (!strcasecmp(v->value, "rw")) {
+                  line_cfg->snd_mmap = false;
+               }
+               else {
+                  ast_log(AST_LOG_ERROR, "Invalid value for variable 'snd_access' in section '%s' of config file '%s'\n",
+                     section, alsa_input_cfg_file);
+                  ret = -1;
+                  break;
                }
             }
             else {
-#if (AST_VERSION <= 110)
-               char buf[256];
-               ast_log(AST_LOG_WARNING, "Asked to get a channel of unsupported format '%s'\n", ast_getformatname_multiple(buf, sizeof(buf), cap));
-#else /* (AST_VERSION > 110) */
-               struct ast_str *buf = ast_str_alloca(256);
-               ast_log(AST_LOG_WARNING, "Asked to get a channel of unsupported format '%s'\n", ast_format_cap_get_names(cap, &(buf)));
-#endif /* (AST_VERSION > 110) */
+               ast_log(AST_LOG_WARNING, "Unknown variable '%s' in section '%s' of config file '%s'\n",
+                  v->name, section, alsa_input_cfg_file);
             }
-            break;
-         }
-      }
-      alsa_input_monitor_unlock(t);
-   }
-   return (ret);
-}
-
-/* Must be called with monitor.lock locked */
-static int alsa_input_write_input_event(alsa_input_pvt_t *pvt, __u16 ev_type, __u16 ev_code)
-{
-   int ret = -1;
-   __u8 c;
-   struct input_event *ev;
-
-   /*
-    We write the event directly in the array pvt->monitor.events, and
-    just write a single byte to generate POLLIN event for
-    the file descriptor connected to the other end of the pipe
-   */
-   alsa_input_assert((pvt->channel->monitor.lock_count > 0) && (pvt->monitor.fd_pipe >= 0));
-   if ((pvt->monitor.events_len_in_bytes + sizeof(*ev)) <= sizeof(pvt->monitor.events)) {
-      alsa_input_assert((sizeof(*ev) == sizeof(pvt->monitor.events[0]))
-         && (0 == (pvt->monitor.events_len_in_bytes % sizeof(pvt->monitor.events[0]))));
-      ev = &(pvt->monitor.events[pvt->monitor.events_len_in_bytes / sizeof(pvt->monitor.events[0])]);
-      memset(ev, 0, sizeof(*ev));
-      ev->type = ev_type;
-      ev->code = ev_code;
-      ev->value = 1;
-      pvt->monitor.events_len_in_bytes += sizeof(*ev);
-      ret = 0;
-   }
-   else {
-      ast_log(AST_LOG_ERROR, "Error writing input_event\n");
-      ret = -1;
-   }
-   c = 0;
-   write(pvt->monitor.fd_pipe, &(c), sizeof(c));
-
-   return (ret);
-}
-
-static char *alsa_input_cli_press(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
-{
-   char *ret = CLI_SUCCESS;
-   alsa_input_chan_t *t = &(alsa_input_chan);
-   bool do_unlock = false;
-
-   switch (cmd) {
-      case CLI_INIT: {
-         e->command = "ai press";
-         e->usage =
-            "Usage: ai press line [on|off|mute]\n"
-            "       Press key for line 'line':\n"
-            "       - 'on' hook key\n"
-            "       - 'off' hook key\n"
-            "       - 'mute' key\n";
-         return (NULL);
-      }
-      case CLI_GENERATE: {
-         return (NULL);
-      }
-   }
-
-   do { /* Empty loop */
-      alsa_input_pvt_t *pvt;
-      int tmp;
-      char str_status[64];
-      char *f;
-      __u16 code;
-
-      if (4 != a->argc) {
-         ret = CLI_SHOWUSAGE;
-         break;
-      }
-
-      /* We parse the special key */
-      ast_copy_string(str_status, a->argv[3], ARRAY_LEN(str_status));
-      f = ast_strip(str_status);
-      if (!strcasecmp(f, "on")) {
-         code = KEY_ESC;
-      }
-      else if (!strcasecmp(f, "off")) {
-         code = KEY_ENTER;
-      }
-      else if (!strcasecmp(f, "mute")) {
-         code = KEY_MUTE;
-      }
-      else {
-         ast_cli(a->fd, "Invalid key '%s'\n", f);
-         ret = CLI_FAILURE;
-         break;
-      }
-
-      /* We parse the line number */
-      if ((1 != sscanf(a->argv[2], " %10d ", &(tmp))) || (tmp <= 0)) {
-         ast_cli(a->fd, "Invalid line '%s'\n", a->argv[2]);
-         ret = CLI_FAILURE;
-         break;
-      }
-      tmp -= 1;
-
-      alsa_input_monitor_lock(t);
-      do_unlock = true;
-      AST_LIST_TRAVERSE(&(t->pvt_list), pvt, list) {
-         if (pvt->index_line == ((size_t)(tmp))) {
-            break;
-         }
-      }
-      if ((NULL == pvt) || (pvt->monitor.fd_pipe < 0)) {
-         ast_cli(a->fd, "Invalid line '%d'\n", (int)(tmp + 1));
-         ret = CLI_FAILURE;
-         break;
-      }
-
-      /* We change the status of the line */
-      if (alsa_input_write_input_event(pvt, EV_KEY, code)) {
-         ret = CLI_FAILURE;
-         break;
-      }
-   } while (false);
-
-   if (do_unlock) {
-      alsa_input_monitor_unlock(t);
-      do_unlock = false;
-   }
-
-   return (ret);
-}
-
-static char *alsa_input_cli_dial(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
-{
-   char *ret = CLI_SUCCESS;
-   alsa_input_chan_t *t = &(alsa_input_chan);
-   bool do_unlock = false;
-
-   switch (cmd) {
-      case CLI_INIT: {
-         e->command = "ai dial";
-         e->usage =
-            "Usage: ai dial line [digits]\n"
-            "       Dials the digits\n";
-         return (NULL);
-      }
-      case CLI_GENERATE: {
-         return (NULL);
-      }
-   }
-
-   do { /* Empty loop */
-      alsa_input_pvt_t *pvt;
-      int tmp;
-      const char *f;
-      __u16 code;
-
-      if (4 != a->argc) {
-         ret = CLI_SHOWUSAGE;
-         break;
-      }
-
-      /* We parse the line number */
-      if ((1 != sscanf(a->argv[2], " %10d ", &(tmp))) || (tmp <= 0)) {
-         ast_cli(a->fd, "Invalid line '%s'\n", a->argv[2]);
-         ret = CLI_FAILURE;
-         break;
-      }
-      tmp -= 1;
-
-      alsa_input_monitor_lock(t);
-      do_unlock = true;
-      AST_LIST_TRAVERSE(&(t->pvt_list), pvt, list) {
-         if (pvt->index_line == ((size_t)(tmp))) {
-            break;
-         }
-      }
-      if ((NULL == pvt) || (pvt->monitor.fd_pipe < 0)) {
-         ast_cli(a->fd, "Invalid line '%d'\n", (int)(tmp + 1));
-         ret = CLI_FAILURE;
-         break;
-      }
-
-      /* We parse the digits */
-      f = a->argv[3];
-      for (f = a->argv[3]; ('\0' != *f); f += 1) {
-         if (isspace(*f)) {
-            continue;
-         }
-         code = KEY_RESERVED;
-         if ((*f >= '0') && (*f <= '9')) {
-            code = KEY_NUMERIC_0 + (*f - '0');
-         }
-         else if ('*' == *f) {
-            code = KEY_NUMERIC_STAR;
-         }
-         else if ('#' == *f) {
-            code = KEY_NUMERIC_POUND;
-         }
-         else if (('A' == *f) || ('a' == *f)) {
-            code = KEY_A;
-         }
-         else if (('B' == *f) || ('b' == *f)) {
-            code = KEY_B;
-         }
-         else if (('C' == *f) || ('c' == *f)) {
-            code = KEY_C;
-         }
-         else if (('D' == *f) || ('d' == *f)) {
-            code = KEY_D;
-         }
-         else {
-            break;
          }
-         if (alsa_input_write_input_event(pvt, EV_KEY, code)) {
-            ret = CLI_FAILURE;
+         if (0 != ret) {
             break;
          }
-      }
-      if ('\0' != *f) {
-         if (KEY_RESERVED == code) {
-            ast_cli(a->fd, "Invalid digit '%c'\n", (char)(*f));
+         if (line_cfg->enable) {
+            if ('\0' == line_cfg->context[0]) {
+               ast_copy_string(line_cfg->context, "default", sizeof(line_cfg->context));
+            }
+            if ('\0' == line_cfg->snd_capture_dev_name[0]) {
+               ast_copy_string(line_cfg->snd_capture_dev_name, "default", sizeof(line_cfg->snd_capture_dev_name));
+            }
+            if ('\0' == line_cfg->snd_playback_dev_name[0]) {
+               ast_copy_string(line_cfg->snd_playback_dev_name, "default", sizeof(line_cfg->snd_playback_dev_name));
+            }
+            if ('\0' != line_cfg->tone_zone[0]) {
+               line_cfg->tones = alsa_input_get_tone_zone(t, line_cfg->tone_zone);
+               if (NULL == line_cfg->tones) {
+                  ast_log(AST_LOG_ERROR, "Invalid value for variable 'tone_zone' in section '%s' of config file '%s'\n",
+                     section, alsa_input_cfg_file);
+                  ret = -1;
+                  break;
+               }
+            }
          }
-         ret = CLI_FAILURE;
-         break;
       }
    } while (false);
 
-   if (do_unlock) {
-      alsa_input_monitor_unlock(t);
-      do_unlock = false;
-   }
-
    return (ret);
 }
 
-static struct ast_cli_entry cli_alsa_input[] = {
-   AST_CLI_DEFINE(alsa_input_cli_press, "Press a special key"),
-   AST_CLI_DEFINE(alsa_input_cli_dial, "Dial digits"),
-};
-
 static int __unload_module(void)
 {
    int ret = 0;
    alsa_input_chan_t *t = &(alsa_input_chan);
    alsa_input_pvt_t *p;
-   size_t i;
    bool unregister_cli = t->channel_registered;
 
    do { /* Empty loop */
+      /* No line is reopened anymore, the monitor isn't restarted */
+      alsa_input_stop_devices(t);
+
       /* Ask the monitor thread to stop */
       alsa_input_prepare_stop_monitor(t);
 
@@ -4507,6 +11700,9 @@ static int __unload_module(void)
        before it stops */
       alsa_input_hangup_all_lines(t, true);
 
+      /* No more ast_channel : we can stop the audio thread */
+      alsa_input_stop_audio(t);
+
       if (unregister_cli) {
          ast_cli_unregister_multiple(cli_alsa_input, ARRAY_LEN(cli_alsa_input));
       }
@@ -4520,13 +11716,63 @@ static int __unload_module(void)
       while (NULL != p) {
          alsa_input_pvt_t *pl = p;
          p = AST_LIST_NEXT(p, list);
-         ast_free(pl);
+         alsa_input_free_pvt(pl);
+      }
+
+      /*
+       We free structures allocated for the monitor, the audio thread and
+       the configuration
+      */
+      alsa_input_reclaim_line_cfgs(t, true);
+      if (t->devices.fd_wakeup >= 0) {
+         close(t->devices.fd_wakeup);
+         t->devices.fd_wakeup = -1;
+      }
+      if (t->devices.fd_inotify >= 0) {
+         close(t->devices.fd_inotify);
+         t->devices.fd_inotify = -1;
+      }
+      if (t->audio.fd_wakeup >= 0) {
+         close(t->audio.fd_wakeup);
+         t->audio.fd_wakeup = -1;
+      }
+      if (t->audio.epfd >= 0) {
+         close(t->audio.epfd);
+         t->audio.epfd = -1;
+      }
+      if (NULL != t->audio.events) {
+         ast_free(t->audio.events);
+         t->audio.events = NULL;
+      }
+      t->audio.events_len = 0;
+      if (t->monitor.fd_timer >= 0) {
+         close(t->monitor.fd_timer);
+         t->monitor.fd_timer = -1;
       }
-
-      /* We free structures allocated for the configuration */
-      for (i = 0; (i < ARRAY_LEN(t->config.line_cfgs)); i += 1) {
-         /* Nothing to do */
+      if (t->monitor.fd_wakeup >= 0) {
+         close(t->monitor.fd_wakeup);
+         t->monitor.fd_wakeup = -1;
+      }
+      if (t->monitor.epfd >= 0) {
+         close(t->monitor.epfd);
+         t->monitor.epfd = -1;
+      }
+      if (NULL != t->monitor.events) {
+         ast_free(t->monitor.events);
+         t->monitor.events = NULL;
+      }
+      t->monitor.events_len = 0;
+      if (NULL != t->monitor.heap) {
+         ast_free(t->monitor.heap);
+         t->monitor.heap = NULL;
       }
+      t->monitor.heap_len = 0;
+      if (NULL != t->config.line_cfgs) {
+         ast_free(t->config.line_cfgs);
+         t->config.line_cfgs = NULL;
+      }
+      t->config.line_count = 0;
+      alsa_input_free_tone_zones(t);
 
 #if (AST_VERSION >= 110)
       if (NULL != t->chan_tech.capabilities) {
@@ -4535,6 +11781,8 @@ static int __unload_module(void)
       }
 #endif /* (AST_VERSION >= 110) */
 
+      alsa_input_free_tones();
+
       ast_mutex_destroy(&(t->monitor.lock));
 
       ret = 0;
@@ -4556,11 +11804,13 @@ static int load_module(void)
    size_t i;
 
    alsa_input_init_cache_ast_format();
-   alsa_input_init_tones();
 
    memset(&(t->config), 0, sizeof(t->config));
    t->config.language[0] = '\0';
    t->config.line_count = 0;
+   t->config.line_cfgs = NULL;
+   t->config.audio_thread_priority = 10;
+   t->config.audio_thread_cpu = -1;
    t->channel_registered = false;
    t->pvt_list.first = NULL;
    t->pvt_list.last = NULL;
@@ -4570,33 +11820,48 @@ static int load_module(void)
 #ifdef DEBUG
    t->monitor.lock_count = 0;
 #endif /* DEBUG */
+   t->monitor.epfd = -1;
+   t->monitor.fd_wakeup = -1;
+   t->monitor.fd_timer = -1;
+   t->monitor.timer_deadline = AI_NO_DEADLINE;
+   t->monitor.src_wakeup.pvt = NULL;
+   t->monitor.src_wakeup.kind = AI_SRC_WAKEUP;
+   t->monitor.src_timer.pvt = NULL;
+   t->monitor.src_timer.kind = AI_SRC_TIMER;
+   t->monitor.heap = NULL;
+   t->monitor.heap_len = 0;
+   t->monitor.events = NULL;
+   t->monitor.events_len = 0;
+   t->monitor.kicked = NULL;
+   t->monitor.lines_connected = 0;
+   t->monitor.retired = NULL;
+   t->audio.run = false;
+   t->audio.thread = AST_PTHREADT_NULL;
+   t->audio.epfd = -1;
+   t->audio.fd_wakeup = -1;
+   t->audio.src_wakeup.pvt = NULL;
+   t->audio.src_wakeup.kind = AI_SRC_WAKEUP;
+   t->audio.events = NULL;
+   t->audio.events_len = 0;
+   t->audio.passes = 0;
+   t->devices.run = false;
+   t->devices.thread = AST_PTHREADT_NULL;
+   t->devices.fd_wakeup = -1;
+   t->devices.fd_inotify = -1;
 #if (AST_VERSION < 110)
    t->chan_tech.capabilities = 0;
 #else /* (AST_VERSION >= 110) */
    t->chan_tech.capabilities = NULL;
 #endif /* (AST_VERSION >= 110)*/
-   for (i = 0; (i < ARRAY_LEN(t->config.line_cfgs)); i += 1) {
-      alsa_input_line_config_t *line_cfg = &(t->config.line_cfgs[i]);
-      memcpy(&(line_cfg->jb_conf), &(default_jb_conf), sizeof(line_cfg->jb_conf));
-      line_cfg->enable = false;
-      line_cfg->snd_capture_dev_name[0] = '\0';
-      line_cfg->snd_playback_dev_name[0] = '\0';
-      line_cfg->ev_in_dev_name[0] = '\0';
-      line_cfg->ev_out_dev_name[0] = '\0';
-      line_cfg->monitor_dialing = false;
-      line_cfg->search_extension_trigger = '\0';
-      line_cfg->dialing_timeout_1st_digit = 5000;
-      line_cfg->dialing_timeout = 3000;
-      sprintf(line_cfg->context, "ai-line-%d", (int)(i + 1));
-      sprintf(line_cfg->cid_name, "line%d", (int)(i + 1));
-      sprintf(line_cfg->cid_num, "00-00-00-%02d", (int)(i + 1));
-      ast_copy_string(line_cfg->moh_interpret, "default", ARRAY_LEN(line_cfg->moh_interpret));
-   }
 
    do { /* Empty loop */
-      struct ast_variable *v;
       struct ast_flags config_flags = { 0 };
 
+      if (alsa_input_init_tones()) {
+         ret = AST_MODULE_LOAD_DECLINE;
+         break;
+      }
+
 #if (AST_VERSION >= 110)
       t->chan_tech.capabilities = alsa_input_ast_format_cap_alloc();
       if (NULL == t->chan_tech.capabilities) {
@@ -4606,6 +11871,10 @@ static int load_module(void)
 #endif /* (AST_VERSION >= 110) */
       alsa_input_ast_format_cap_remove_by_type(alsa_input_get_chan_tech_cap(&(t->chan_tech)), AST_MEDIA_TYPE_UNKNOWN);
       alsa_input_ast_format_cap_append_format(alsa_input_get_chan_tech_cap(&(t->chan_tech)), ast_format_slin);
+      alsa_input_ast_format_cap_append_format(alsa_input_get_chan_tech_cap(&(t->chan_tech)), ast_format_slin16);
+      if (NULL != ast_format_slin48) {
+         alsa_input_ast_format_cap_append_format(alsa_input_get_chan_tech_cap(&(t->chan_tech)), ast_format_slin48);
+      }
 
       alsa_input_pr_debug("Reading configuration file '%s'\n", alsa_input_cfg_file);
 
@@ -4624,139 +11893,37 @@ static int load_module(void)
          break;
       }
 
-      for (v = ast_variable_browse(cfg, "general"); (NULL != v); v = v->next) {
-         if (!strcasecmp(v->name, "lines")) {
-            int tmp;
-            if ((1 != sscanf(v->value, " %10d ", &(tmp))) || (tmp <= 0) || (((size_t)(tmp)) > ARRAY_LEN(t->config.line_cfgs))) {
-               ast_log(AST_LOG_ERROR, "Invalid value for variable 'lines' in section 'interfaces' of config file '%s'\n",
-                  alsa_input_cfg_file);
-               ret = AST_MODULE_LOAD_DECLINE;
-               break;
-            }
-            t->config.line_count = (size_t)(tmp);
-         }
-         else if (!strcasecmp(v->name, "language")) {
-            ast_copy_string(t->config.language, v->value, sizeof(t->config.language));
-         }
-         else {
-            ast_log(AST_LOG_WARNING, "Unknown variable '%s' in section 'interfaces' of config_file '%s'\n",
-               v->name, alsa_input_cfg_file);
-         }
+      if (alsa_input_read_config(t, cfg, &(t->config))) {
+         ret = AST_MODULE_LOAD_DECLINE;
+         break;
       }
 
-      if (AST_MODULE_LOAD_SUCCESS != ret) {
+      /*
+       Input event device of each line plus the eventfd used to wake up the
+       monitor and the timerfd
+      */
+      t->monitor.events_len = t->config.line_count + 2;
+      t->monitor.events = ast_calloc(t->monitor.events_len, sizeof(t->monitor.events[0]));
+      /*
+       2 sound devices per line plus the eventfd used to wake up the audio
+       thread
+      */
+      t->audio.events_len = (2 * t->config.line_count) + 1;
+      t->audio.events = ast_calloc(t->audio.events_len, sizeof(t->audio.events[0]));
+      /* At most one deadline per line */
+      t->monitor.heap = ast_calloc(t->config.line_count, sizeof(t->monitor.heap[0]));
+      if ((NULL == t->monitor.events)
+          || (NULL == t->monitor.heap) || (NULL == t->audio.events)) {
+         ast_log(AST_LOG_ERROR, "Unable to allocate memory for %lu lines\n",
+            (unsigned long)(t->config.line_count));
+         ret = AST_MODULE_LOAD_DECLINE;
          break;
       }
-
       for (i = 0; (i < t->config.line_count); i += 1) {
-         char section[64];
-         alsa_input_line_config_t *line_cfg = &(t->config.line_cfgs[i]);
-
-         snprintf(section, ARRAY_LEN(section), "line%d", (int)(i + 1));
-         for (v = ast_variable_browse(cfg, section); (NULL != v); v = v->next) {
-            if (!ast_jb_read_conf(&(line_cfg->jb_conf), v->name, v->value)) {
-               continue;
-            }
-            if (!strcasecmp(v->name, "enable")) {
-               if (ast_true(v->value)) {
-                  line_cfg->enable = true;
-               }
-               else {
-                  line_cfg->enable = false;
-                  /* Stop parsing section */
-                  break;
-               }
-            }
-            else if (!strcasecmp(v->name, "context")) {
-               ast_copy_string(line_cfg->context, v->value, ARRAY_LEN(line_cfg->context));
-            }
-            else if (!strcasecmp(v->name, "snd_capture_device")) {
-               ast_copy_string(line_cfg->snd_capture_dev_name, v->value, sizeof(line_cfg->snd_capture_dev_name));
-            }
-            else if (!strcasecmp(v->name, "snd_playback_device")) {
-               ast_copy_string(line_cfg->snd_playback_dev_name, v->value, sizeof(line_cfg->snd_playback_dev_name));
-            }
-            else if (!strcasecmp(v->name, "event_input_device")) {
-               ast_copy_string(line_cfg->ev_in_dev_name, v->value, sizeof(line_cfg->ev_in_dev_name));
-            }
-            else if (!strcasecmp(v->name, "event_output_device")) {
-               ast_copy_string(line_cfg->ev_out_dev_name, v->value, sizeof(line_cfg->ev_out_dev_name));
-            }
-            else if (!strcasecmp(v->name, "monitor_dialing")) {
-               if (ast_true(v->value)) {
-                  line_cfg->monitor_dialing = true;
-               }
-               else {
-                  line_cfg->monitor_dialing = false;
-               }
-            }
-            else if (!strcasecmp(v->name, "search_extension_trigger")) {
-               char value[32];
-               char *f;
-
-               ast_copy_string(value, v->value, ARRAY_LEN(value));
-               f = ast_strip(value);
-               if (('\0' == f[0]) || ('\0' == f[1])) {
-                  line_cfg->search_extension_trigger = f[0];
-               }
-               else {
-                  ast_log(AST_LOG_ERROR, "Invalid value for variable 'search_extension_trigger' in section '%s' of config file '%s'\n",
-                     section, alsa_input_cfg_file);
-                  ret = AST_MODULE_LOAD_DECLINE;
-                  break;
-               }
-            }
-            else if (!strcasecmp(v->name, "dialing_timeout_1st_digit")) {
-               int tmp;
-               if ((1 != sscanf(v->value, " %10d ", &(tmp))) || (tmp < 0)) {
-                  ast_log(AST_LOG_ERROR, "Invalid value for variable 'dialing_timeout_1st_digit' in section '%s' of config file '%s'\n",
-                     section, alsa_input_cfg_file);
-                  ret = AST_MODULE_LOAD_DECLINE;
-                  break;
-               }
-               line_cfg->dialing_timeout_1st_digit = tmp;
-            }
-            else if (!strcasecmp(v->name, "dialing_timeout")) {
-               int tmp;
-               if ((1 != sscanf(v->value, " %10d ", &(tmp))) || (tmp < 0)) {
-                  ast_log(AST_LOG_ERROR, "Invalid value for variable 'dialing_timeout' in section '%s' of config file '%s'\n",
-                     section, alsa_input_cfg_file);
-                  ret = AST_MODULE_LOAD_DECLINE;
-                  break;
-               }
-               line_cfg->dialing_timeout = tmp;
-            }
-            else if (!strcasecmp(v->name, "caller_id")) {
-               ast_callerid_split(v->value, line_cfg->cid_name,
-                  ARRAY_LEN(line_cfg->cid_name),
-                  line_cfg->cid_num, ARRAY_LEN(line_cfg->cid_num));
-            }
-            else if (!strcasecmp(v->name, "moh_interpret")) {
-               ast_copy_string(line_cfg->moh_interpret, v->value, ARRAY_LEN(line_cfg->moh_interpret));
-            }
-            else {
-               ast_log(AST_LOG_WARNING, "Unknown variable '%s' in section '%s' of config file '%s'\n",
-                  v->name, section, alsa_input_cfg_file);
-            }
-         }
-         if (AST_MODULE_LOAD_SUCCESS != ret) {
+         if ((t->config.line_cfgs[i].enable) && (NULL == alsa_input_add_pvt(t, i))) {
+            ret = AST_MODULE_LOAD_DECLINE;
             break;
          }
-         if (line_cfg->enable) {
-            if ('\0' == line_cfg->context[0]) {
-               ast_copy_string(line_cfg->context, "default", sizeof(line_cfg->context));
-            }
-            if ('\0' == line_cfg->snd_capture_dev_name[0]) {
-               ast_copy_string(line_cfg->snd_capture_dev_name, "default", sizeof(line_cfg->snd_capture_dev_name));
-            }
-            if ('\0' == line_cfg->snd_playback_dev_name[0]) {
-               ast_copy_string(line_cfg->snd_playback_dev_name, "default", sizeof(line_cfg->snd_playback_dev_name));
-            }
-            if (NULL == alsa_input_add_pvt(t, i)) {
-               ret = AST_MODULE_LOAD_DECLINE;
-               break;
-            }
-         }
       }
       if (AST_MODULE_LOAD_SUCCESS != ret) {
          break;
@@ -4771,11 +11938,77 @@ static int load_module(void)
       ast_config_destroy(cfg);
       cfg = CONFIG_STATUS_FILEINVALID;
 
+      t->monitor.epfd = epoll_create1(EPOLL_CLOEXEC);
+      if (t->monitor.epfd < 0) {
+         ast_log(AST_LOG_ERROR, "epoll_create1() failed: '%s'\n", strerror(errno));
+         ret = AST_MODULE_LOAD_FAILURE;
+         break;
+      }
+      t->monitor.fd_wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+      if (t->monitor.fd_wakeup < 0) {
+         ast_log(AST_LOG_ERROR, "eventfd() failed: '%s'\n", strerror(errno));
+         ret = AST_MODULE_LOAD_FAILURE;
+         break;
+      }
+      if (alsa_input_monitor_register_fd(t, t->monitor.fd_wakeup, &(t->monitor.src_wakeup))) {
+         ret = AST_MODULE_LOAD_FAILURE;
+         break;
+      }
+      t->monitor.fd_timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+      if (t->monitor.fd_timer < 0) {
+         ast_log(AST_LOG_ERROR, "timerfd_create() failed: '%s'\n", strerror(errno));
+         ret = AST_MODULE_LOAD_FAILURE;
+         break;
+      }
+      if (alsa_input_monitor_register_fd(t, t->monitor.fd_timer, &(t->monitor.src_timer))) {
+         ret = AST_MODULE_LOAD_FAILURE;
+         break;
+      }
+
+      t->audio.epfd = epoll_create1(EPOLL_CLOEXEC);
+      if (t->audio.epfd < 0) {
+         ast_log(AST_LOG_ERROR, "epoll_create1() failed: '%s'\n", strerror(errno));
+         ret = AST_MODULE_LOAD_FAILURE;
+         break;
+      }
+      t->audio.fd_wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+      if (t->audio.fd_wakeup < 0) {
+         ast_log(AST_LOG_ERROR, "eventfd() failed: '%s'\n", strerror(errno));
+         ret = AST_MODULE_LOAD_FAILURE;
+         break;
+      }
+      if (alsa_input_epoll_add(t->audio.epfd, t->audio.fd_wakeup, EPOLLIN, &(t->audio.src_wakeup))) {
+         ret = AST_MODULE_LOAD_FAILURE;
+         break;
+      }
+
+      t->devices.fd_wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+      if (t->devices.fd_wakeup < 0) {
+         ast_log(AST_LOG_ERROR, "eventfd() failed: '%s'\n", strerror(errno));
+         ret = AST_MODULE_LOAD_FAILURE;
+         break;
+      }
+      /* Without it, lines disconnected stay disconnected until unloaded */
+      t->devices.fd_inotify = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+      if (t->devices.fd_inotify < 0) {
+         ast_log(AST_LOG_WARNING, "inotify_init1() failed: '%s', devices plugged won't be detected\n", strerror(errno));
+      }
+
       ret = alsa_input_open_devices(t);
       if (AST_MODULE_LOAD_SUCCESS != ret) {
          break;
       }
 
+      /* The audio thread must run before the first command is sent */
+      if (alsa_input_start_audio(t)) {
+         ret = AST_MODULE_LOAD_FAILURE;
+         break;
+      }
+      if (alsa_input_start_devices(t)) {
+         ret = AST_MODULE_LOAD_FAILURE;
+         break;
+      }
+
       alsa_input_pr_debug("Registering channel\n");
 
       /*
@@ -4818,8 +12051,203 @@ static int load_module(void)
    return (ret);
 }
 
+/*
+ Copies the parameters of the sound and event devices (and of the buffers
+ and filters allocated with them), only changed when the line is idle
+*/
+static void alsa_input_copy_device_params(alsa_input_line_config_t *dst,
+   const alsa_input_line_config_t *src)
+{
+   memcpy(dst->snd_capture_dev_name, src->snd_capture_dev_name, sizeof(dst->snd_capture_dev_name));
+   memcpy(dst->snd_playback_dev_name, src->snd_playback_dev_name, sizeof(dst->snd_playback_dev_name));
+   memcpy(dst->ev_in_dev_name, src->ev_in_dev_name, sizeof(dst->ev_in_dev_name));
+   memcpy(dst->ev_out_dev_name, src->ev_out_dev_name, sizeof(dst->ev_out_dev_name));
+   dst->snd_mmap = src->snd_mmap;
+   dst->period_ms = src->period_ms;
+   dst->periods = src->periods;
+   dst->max_rate = src->max_rate;
+   dst->resample_quality = src->resample_quality;
+   dst->snd_capture_channel = src->snd_capture_channel;
+   dst->snd_playback_channel = src->snd_playback_channel;
+   dst->playback_buffer_ms = src->playback_buffer_ms;
+   dst->plc = src->plc;
+   dst->echo_cancel = src->echo_cancel;
+   dst->echo_tail_ms = src->echo_tail_ms;
+   dst->noise_suppress = src->noise_suppress;
+   dst->noise_reduction = src->noise_reduction;
+   /* The capture during dialing depends on them */
+   dst->dtmf_detect = src->dtmf_detect;
+   dst->dtmf_threshold = src->dtmf_threshold;
+   dst->dtmf_normal_twist = src->dtmf_normal_twist;
+   dst->dtmf_reverse_twist = src->dtmf_reverse_twist;
+   dst->agc_target = src->agc_target;
+   dst->agc_max_gain = src->agc_max_gain;
+   dst->monitor_dialing = src->monitor_dialing;
+}
+
+/*
+ Returns true if the parameters copied by alsa_input_copy_device_params()
+ differ
+*/
+static bool alsa_input_device_params_differ(const alsa_input_line_config_t *a,
+   const alsa_input_line_config_t *b)
+{
+   alsa_input_line_config_t tmp;
+
+   memcpy(&(tmp), a, sizeof(tmp));
+   alsa_input_copy_device_params(&(tmp), b);
+   return ((0 != memcmp(&(tmp), a, sizeof(tmp))) ? true : false);
+}
+
+/*
+ Reads the configuration file again. Parameters used only by the monitor
+ and the channels (context, caller id, timeouts, volume...) are applied to
+ the lines at once. Lines whose devices changed keep running, and are
+ reopened with their new devices as soon as they are idle : calls in
+ progress are never torn down.
+ The number of lines, the lines enabled and the audio thread parameters
+ are only read by load_module().
+*/
+static int reload_module(void)
+{
+   int ret = AST_MODULE_LOAD_SUCCESS;
+   alsa_input_chan_t *t = &(alsa_input_chan);
+   struct ast_config *cfg = CONFIG_STATUS_FILEINVALID;
+   alsa_input_chan_config_t config;
+   struct ast_flags config_flags = { 0 };
+
+   memset(&(config), 0, sizeof(config));
+
+   do { /* Empty loop */
+      alsa_input_pvt_t *pvt;
+      size_t i;
+
+      alsa_input_pr_debug("Reading configuration file '%s' again\n", alsa_input_cfg_file);
+
+      cfg = ast_config_load2(alsa_input_cfg_file, alsa_input_chan_type, config_flags);
+      if ((CONFIG_STATUS_FILEINVALID == cfg) || (CONFIG_STATUS_FILEMISSING == cfg)) {
+         cfg = CONFIG_STATUS_FILEINVALID;
+         ast_log(AST_LOG_ERROR, "Unable to load config file '%s', configuration unchanged\n", alsa_input_cfg_file);
+         ret = AST_MODULE_LOAD_DECLINE;
+         break;
+      }
+      if (alsa_input_read_config(t, cfg, &(config))) {
+         ast_log(AST_LOG_ERROR, "Invalid config file '%s', configuration unchanged\n", alsa_input_cfg_file);
+         ret = AST_MODULE_LOAD_DECLINE;
+         break;
+      }
+
+      if ((config.line_count != t->config.line_count)
+          || (config.audio_thread_priority != t->config.audio_thread_priority)
+          || (config.audio_thread_cpu != t->config.audio_thread_cpu)) {
+         ast_log(AST_LOG_WARNING, "Parameters 'lines', 'audio_thread_priority' and 'audio_thread_cpu' are only read when the module is loaded\n");
+      }
+      for (i = 0; (i < config.line_count); i += 1) {
+         if (config.line_cfgs[i].enable != ((i < t->config.line_count) ? t->config.line_cfgs[i].enable : false)) {
+            ast_log(AST_LOG_WARNING, "Line %lu : parameter 'enable' is only read when the module is loaded\n",
+               (unsigned long)(i + 1));
+         }
+      }
+
+      alsa_input_monitor_lock(t);
+      ast_copy_string(t->config.language, config.language, sizeof(t->config.language));
+      AST_LIST_TRAVERSE(&(t->pvt_list), pvt, list) {
+         const alsa_input_line_config_t *new_cfg;
+         const alsa_input_line_config_t *target;
+         alsa_input_line_config_t *live;
+         bool devices_changed;
+
+         if ((pvt->index_line >= config.line_count) || (!config.line_cfgs[pvt->index_line].enable)) {
+            continue;
+         }
+         new_cfg = &(config.line_cfgs[pvt->index_line]);
+         /* Configuration the line will have once the pending one is applied */
+         target = (NULL != pvt->reload.pending_cfg) ? pvt->reload.pending_cfg : pvt->line_cfg;
+         if (0 == memcmp(target, new_cfg, sizeof(*new_cfg))) {
+            continue;
+         }
+         if (pvt->reload.reopening) {
+            /* The devices thread applies the whole configuration */
+            devices_changed = true;
+         }
+         else {
+            devices_changed = alsa_input_device_params_differ(pvt->line_cfg, new_cfg);
+         }
+         if ((devices_changed) && (!pvt->reload.reopening)
+             && ((pvt->line_cfg->snd_capture_channel > 0) || (pvt->line_cfg->snd_playback_channel > 0)
+                 || (new_cfg->snd_capture_channel > 0) || (new_cfg->snd_playback_channel > 0))) {
+            /* The other lines use the same sound devices */
+            ast_log(AST_LOG_WARNING, "Line %lu : sound devices shared with other lines, changes of their parameters need to unload the module\n",
+               (unsigned long)(pvt->index_line + 1));
+            devices_changed = false;
+         }
+         ast_free(pvt->reload.pending_cfg);
+         pvt->reload.pending_cfg = NULL;
+         if (devices_changed) {
+            pvt->reload.pending_cfg = ast_malloc(sizeof(*(pvt->reload.pending_cfg)));
+            if (NULL == pvt->reload.pending_cfg) {
+               continue;
+            }
+            memcpy(pvt->reload.pending_cfg, new_cfg, sizeof(*new_cfg));
+            if (pvt->reload.reopening) {
+               /* The devices thread publishes it */
+               continue;
+            }
+            ast_verb(3, "Line %lu : devices will be reopened once the line is idle\n",
+               (unsigned long)(pvt->index_line + 1));
+            /* The monitor disconnects the line once it's idle */
+            alsa_input_monitor_kick(pvt);
+         }
+
+         /* Other parameters are applied now, with the running devices */
+         live = ast_malloc(sizeof(*live));
+         if (NULL == live) {
+            continue;
+         }
+         memcpy(live, new_cfg, sizeof(*live));
+         alsa_input_copy_device_params(live, pvt->line_cfg);
+         if (0 == memcmp(live, pvt->line_cfg, sizeof(*live))) {
+            ast_free(live);
+            continue;
+         }
+         ast_free(pvt->reload.next_cfg);
+         pvt->reload.next_cfg = NULL;
+         if (NULL == pvt->owner) {
+            alsa_input_publish_line_cfg(pvt, live);
+         }
+         else if (0 == ast_channel_trylock(pvt->owner)) {
+#ifdef DEBUG
+            pvt->owner_lock_count += 1;
+#endif /* DEBUG */
+            alsa_input_publish_line_cfg(pvt, live);
+#ifdef DEBUG
+            pvt->owner_lock_count -= 1;
+#endif /* DEBUG */
+            ast_channel_unlock(pvt->owner);
+         }
+         else {
+            /* The monitor publishes it once it locks the owner */
+            pvt->reload.next_cfg = live;
+            alsa_input_monitor_kick(pvt);
+         }
+      }
+      alsa_input_reclaim_line_cfgs(t, false);
+      alsa_input_monitor_unlock(t);
+
+      ast_verb(2, "Config file '%s' reloaded\n", alsa_input_cfg_file);
+   } while (false);
+
+   ast_free(config.line_cfgs);
+   if (CONFIG_STATUS_FILEINVALID != cfg) {
+      ast_config_destroy(cfg);
+   }
+
+   return (ret);
+}
+
 AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_LOAD_ORDER, "ALSA / Input Channel Driver",
       .load = load_module,
+      .reload = reload_module,
       .unload = unload_module,
       .load_pri = AST_MODPRI_CHANNEL_DRIVER,
    );
@@ -0,0 +1,1158 @@
+/*
+ * Copyright (C) 2015
+ * Gilles Mazoyer <mazoyer.gilles@omega.ovh>
+ *
+ * This is free software, licensed under the GNU General Public License v2.
+ * See /LICENSE for more information.
+ */
+
+/*
+ Minimal Asterisk core : implements the part of the API of Asterisk 13 used
+ by chan_alsa_input.c (see include/asterisk.h) well enough to run the driver
+ without Asterisk. What the PBX would decide is left to the harness (see
+ ast_stub.h).
+*/
+
+#include "ast_stub.h"
+
+#include <stdbool.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+#define AST_STUB_MAX_FDS 4
+#define AST_STUB_MAX_THREADS 16
+#define AST_STUB_MAX_FORMATS 8
+
+ast_stub_hooks_t ast_stub_hooks;
+int ast_stub_log_level = AST_LOG_WARNING;
+
+/*
+ * Reference counted objects
+ */
+
+typedef struct ast_stub_ao2 {
+   int refs;
+   void (*destructor)(void *obj);
+} ast_stub_ao2_t;
+
+static void *ast_stub_ao2_alloc(size_t size, void (*destructor)(void *obj))
+{
+   ast_stub_ao2_t *o = calloc(1, sizeof(*o) + size);
+
+   if (NULL == o) {
+      return (NULL);
+   }
+   o->refs = 1;
+   o->destructor = destructor;
+   return (o + 1);
+}
+
+void ao2_ref(void *obj, int delta)
+{
+   ast_stub_ao2_t *o;
+
+   if (NULL == obj) {
+      return;
+   }
+   o = (ast_stub_ao2_t *)(obj) - 1;
+   if (__atomic_add_fetch(&(o->refs), delta, __ATOMIC_ACQ_REL) > 0) {
+      return;
+   }
+   if (NULL != o->destructor) {
+      o->destructor(obj);
+   }
+   free(o);
+}
+
+/*
+ * Logger
+ */
+
+static const char *ast_stub_log_names[] = {
+   "DEBUG", "VERBOSE", "NOTICE", "WARNING", "ERROR"
+};
+
+void ast_log(int level, const char *fmt, ...)
+{
+   va_list ap;
+
+   if (NULL != ast_stub_hooks.log) {
+      va_start(ap, fmt);
+      ast_stub_hooks.log(level, fmt, ap);
+      va_end(ap);
+   }
+   if (level < ast_stub_log_level) {
+      return;
+   }
+   fprintf(stderr, "[%s] ", ((level >= 0) && ((size_t)(level) < ARRAY_LEN(ast_stub_log_names)))
+      ? ast_stub_log_names[level] : "?");
+   va_start(ap, fmt);
+   vfprintf(stderr, fmt, ap);
+   va_end(ap);
+}
+
+void ast_verbose(const char *fmt, ...)
+{
+   va_list ap;
+
+   if (AST_LOG_VERBOSE < ast_stub_log_level) {
+      return;
+   }
+   va_start(ap, fmt);
+   vfprintf(stderr, fmt, ap);
+   va_end(ap);
+}
+
+void manager_event(int category, const char *event, const char *fmt, ...)
+{
+   va_list ap;
+
+   if (AST_LOG_DEBUG < ast_stub_log_level) {
+      return;
+   }
+   fprintf(stderr, "[EVENT] Event: %s\n", event);
+   va_start(ap, fmt);
+   vfprintf(stderr, fmt, ap);
+   va_end(ap);
+}
+
+/*
+ * Strings
+ */
+
+void ast_copy_string(char *dst, const char *src, size_t size)
+{
+   if (0 == size) {
+      return;
+   }
+   while ((*src) && (size > 1)) {
+      *dst++ = *src++;
+      size -= 1;
+   }
+   *dst = '\0';
+}
+
+char *ast_strip(char *s)
+{
+   size_t len;
+
+   if (NULL == s) {
+      return (NULL);
+   }
+   while (isspace((unsigned char)(*s))) {
+      s += 1;
+   }
+   len = strlen(s);
+   while ((len > 0) && (isspace((unsigned char)(s[len - 1])))) {
+      len -= 1;
+   }
+   s[len] = '\0';
+   return (s);
+}
+
+int ast_true(const char *s)
+{
+   if (ast_strlen_zero(s)) {
+      return (0);
+   }
+   if ((!strcasecmp(s, "yes")) || (!strcasecmp(s, "true")) || (!strcasecmp(s, "y"))
+       || (!strcasecmp(s, "t")) || (!strcasecmp(s, "1")) || (!strcasecmp(s, "on"))) {
+      return (-1);
+   }
+   return (0);
+}
+
+int ast_false(const char *s)
+{
+   if (ast_strlen_zero(s)) {
+      return (0);
+   }
+   if ((!strcasecmp(s, "no")) || (!strcasecmp(s, "false")) || (!strcasecmp(s, "n"))
+       || (!strcasecmp(s, "f")) || (!strcasecmp(s, "0")) || (!strcasecmp(s, "off"))) {
+      return (-1);
+   }
+   return (0);
+}
+
+/* "name" <number>, name <number>, or only a number or a name */
+int ast_callerid_split(const char *src, char *name, int namelen, char *num, int numlen)
+{
+   char *tmp = strdupa(src);
+   char *lt = strchr(tmp, '<');
+   char *n;
+
+   name[0] = '\0';
+   num[0] = '\0';
+   if (NULL != lt) {
+      char *gt = strchr(lt, '>');
+      if (NULL != gt) {
+         *gt = '\0';
+      }
+      ast_copy_string(num, ast_strip(lt + 1), numlen);
+      *lt = '\0';
+      n = ast_strip(tmp);
+   }
+   else {
+      n = ast_strip(tmp);
+      if (('\0' != n[0]) && (strspn(n, "0123456789*#+-") == strlen(n))) {
+         ast_copy_string(num, n, numlen);
+         return (0);
+      }
+   }
+   if (('"' == n[0]) && (strlen(n) >= 2) && ('"' == n[strlen(n) - 1])) {
+      n[strlen(n) - 1] = '\0';
+      n += 1;
+   }
+   ast_copy_string(name, n, namelen);
+   return (0);
+}
+
+/*
+ * Threads
+ */
+
+typedef struct ast_stub_thread {
+   pthread_t thread;
+   pid_t tid;
+   bool running;
+   void *(*start_routine)(void *);
+   void *data;
+} ast_stub_thread_t;
+
+static pthread_mutex_t ast_stub_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static ast_stub_thread_t ast_stub_threads_list[AST_STUB_MAX_THREADS];
+
+static void *ast_stub_thread_start(void *arg)
+{
+   ast_stub_thread_t *th = arg;
+   void *ret;
+
+   pthread_mutex_lock(&(ast_stub_threads_lock));
+   th->thread = pthread_self();
+   th->tid = (pid_t)(syscall(SYS_gettid));
+   pthread_mutex_unlock(&(ast_stub_threads_lock));
+
+   ret = th->start_routine(th->data);
+
+   pthread_mutex_lock(&(ast_stub_threads_lock));
+   th->running = false;
+   pthread_mutex_unlock(&(ast_stub_threads_lock));
+   return (ret);
+}
+
+int ast_pthread_create_background(pthread_t *thread, pthread_attr_t *attr,
+   void *(*start_routine)(void *), void *data)
+{
+   ast_stub_thread_t *th = NULL;
+   size_t i;
+   int ret;
+
+   pthread_mutex_lock(&(ast_stub_threads_lock));
+   for (i = 0; (i < ARRAY_LEN(ast_stub_threads_list)); i += 1) {
+      if (!ast_stub_threads_list[i].running) {
+         th = &(ast_stub_threads_list[i]);
+         memset(th, 0, sizeof(*th));
+         th->running = true;
+         th->start_routine = start_routine;
+         th->data = data;
+         break;
+      }
+   }
+   pthread_mutex_unlock(&(ast_stub_threads_lock));
+   if (NULL == th) {
+      errno = EAGAIN;
+      return (-1);
+   }
+   ret = pthread_create(thread, attr, ast_stub_thread_start, th);
+   if (ret) {
+      th->running = false;
+      errno = ret;
+      return (-1);
+   }
+   return (0);
+}
+
+size_t ast_stub_threads(pthread_t *threads, pid_t *tids, size_t len)
+{
+   size_t count = 0;
+   size_t i;
+
+   pthread_mutex_lock(&(ast_stub_threads_lock));
+   for (i = 0; (i < ARRAY_LEN(ast_stub_threads_list)); i += 1) {
+      if ((!ast_stub_threads_list[i].running) || (0 == ast_stub_threads_list[i].tid)) {
+         continue;
+      }
+      if (count < len) {
+         threads[count] = ast_stub_threads_list[i].thread;
+         tids[count] = ast_stub_threads_list[i].tid;
+      }
+      count += 1;
+   }
+   pthread_mutex_unlock(&(ast_stub_threads_lock));
+   return (count);
+}
+
+/*
+ * Formats
+ */
+
+struct ast_format {
+   const char *name;
+   unsigned int rate;
+};
+
+struct ast_format_cap {
+   struct ast_format *formats[AST_STUB_MAX_FORMATS];
+   size_t count;
+};
+
+static struct ast_format ast_stub_format_slin = { "slin", 8000 };
+static struct ast_format ast_stub_format_slin16 = { "slin16", 16000 };
+static struct ast_format ast_stub_format_slin48 = { "slin48", 48000 };
+
+struct ast_format *ast_format_slin = &(ast_stub_format_slin);
+struct ast_format *ast_format_slin16 = &(ast_stub_format_slin16);
+struct ast_format *ast_format_slin48 = &(ast_stub_format_slin48);
+
+const char *ast_format_get_name(const struct ast_format *format)
+{
+   return (format->name);
+}
+
+unsigned int ast_format_get_sample_rate(const struct ast_format *format)
+{
+   return (format->rate);
+}
+
+enum ast_format_cmp_res ast_format_cmp(const struct ast_format *format1,
+   const struct ast_format *format2)
+{
+   return ((format1 == format2) ? AST_FORMAT_CMP_EQUAL : AST_FORMAT_CMP_NOT_EQUAL);
+}
+
+struct ast_format_cap *ast_format_cap_alloc(enum ast_format_cap_flags flags)
+{
+   return (ast_stub_ao2_alloc(sizeof(struct ast_format_cap), NULL));
+}
+
+int ast_format_cap_append(struct ast_format_cap *cap, struct ast_format *format,
+   unsigned int framing)
+{
+   size_t i;
+
+   for (i = 0; (i < cap->count); i += 1) {
+      if (cap->formats[i] == format) {
+         return (0);
+      }
+   }
+   if (cap->count >= ARRAY_LEN(cap->formats)) {
+      return (-1);
+   }
+   cap->formats[cap->count] = format;
+   cap->count += 1;
+   return (0);
+}
+
+void ast_format_cap_remove_by_type(struct ast_format_cap *cap, enum ast_media_type type)
+{
+   /* Only audio formats are known */
+   cap->count = 0;
+}
+
+int ast_format_cap_iscompatible(const struct ast_format_cap *cap1,
+   const struct ast_format_cap *cap2)
+{
+   size_t i;
+   size_t j;
+
+   for (i = 0; (i < cap1->count); i += 1) {
+      for (j = 0; (j < cap2->count); j += 1) {
+         if (cap1->formats[i] == cap2->formats[j]) {
+            return (1);
+         }
+      }
+   }
+   return (0);
+}
+
+const char *ast_format_cap_get_names(struct ast_format_cap *cap, struct ast_str **buf)
+{
+   struct ast_str *s = *buf;
+   size_t used = 0;
+   size_t i;
+
+   if (s->len < 3) {
+      return ("");
+   }
+   s->str[used++] = '(';
+   for (i = 0; (i < cap->count); i += 1) {
+      int n = snprintf(&(s->str[used]), s->len - used - 1, "%s%s",
+         (i > 0) ? "|" : "", cap->formats[i]->name);
+      if ((n < 0) || ((size_t)(n) >= (s->len - used - 1))) {
+         break;
+      }
+      used += n;
+   }
+   s->str[used++] = ')';
+   s->str[used] = '\0';
+   return (s->str);
+}
+
+/*
+ * Frames
+ */
+
+struct ast_frame ast_null_frame = { .frametype = AST_FRAME_NULL };
+
+/* Frames queued are copied in a single allocation, with their data */
+static struct ast_frame *ast_stub_frdup(const struct ast_frame *f)
+{
+   size_t datalen = ((f->datalen > 0) && (NULL != f->data.ptr)) ? (size_t)(f->datalen) : 0;
+   struct ast_frame *dup = malloc(sizeof(*dup) + AST_FRIENDLY_OFFSET + datalen);
+
+   if (NULL == dup) {
+      return (NULL);
+   }
+   *dup = *f;
+   dup->mallocd = 1;
+   if (datalen > 0) {
+      dup->offset = AST_FRIENDLY_OFFSET;
+      dup->data.ptr = (unsigned char *)(dup + 1) + AST_FRIENDLY_OFFSET;
+      memcpy(dup->data.ptr, f->data.ptr, datalen);
+   }
+   return (dup);
+}
+
+void ast_frfree(struct ast_frame *frame)
+{
+   if ((NULL != frame) && (frame->mallocd)) {
+      free(frame);
+   }
+}
+
+/*
+ * Channels
+ */
+
+typedef struct ast_stub_queued {
+   struct ast_stub_queued *next;
+   struct ast_frame *frame;
+} ast_stub_queued_t;
+
+struct ast_channel {
+   pthread_mutex_t lock;
+   char name[80];
+   enum ast_channel_state state;
+   const struct ast_channel_tech *tech;
+   void *tech_pvt;
+   struct ast_party_caller caller;
+   struct ast_party_connected_line connected;
+   struct ast_format_cap *nativeformats;
+   struct ast_format *rawreadformat;
+   struct ast_format *rawwriteformat;
+   struct ast_format *readformat;
+   struct ast_format *writeformat;
+   char context[AST_MAX_CONTEXT];
+   char exten[AST_MAX_EXTENSION];
+   char language[MAX_LANGUAGE];
+   int rings;
+   int fds[AST_STUB_MAX_FDS];
+   /* Frames queued, fd_alert is readable while there's one */
+   ast_stub_queued_t *queue_first;
+   ast_stub_queued_t *queue_last;
+   int fd_alert;
+   /* epoll set of the harness, or -1 */
+   int epfd;
+   ast_stub_watch_t watch_fds[AST_STUB_MAX_FDS];
+   ast_stub_watch_t watch_alert;
+   void *data;
+};
+
+static int ast_stub_channels;
+
+struct ast_channel *ast_channel_alloc(int needqueue, int state, const char *cid_num,
+   const char *cid_name, const char *acctcode, const char *exten, const char *context,
+   const struct ast_assigned_ids *assignedids, const struct ast_channel *requestor,
+   int amaflag, const char *name_fmt, ...)
+{
+   struct ast_channel *chan = calloc(1, sizeof(*chan));
+   pthread_mutexattr_t attr;
+   va_list ap;
+   size_t i;
+
+   if (NULL == chan) {
+      return (NULL);
+   }
+   chan->fd_alert = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+   if (chan->fd_alert < 0) {
+      free(chan);
+      return (NULL);
+   }
+   /* As with ao2 objects, the lock of a channel is recursive */
+   pthread_mutexattr_init(&(attr));
+   pthread_mutexattr_settype(&(attr), PTHREAD_MUTEX_RECURSIVE);
+   pthread_mutex_init(&(chan->lock), &(attr));
+   pthread_mutexattr_destroy(&(attr));
+
+   va_start(ap, name_fmt);
+   vsnprintf(chan->name, sizeof(chan->name), name_fmt, ap);
+   va_end(ap);
+   chan->state = state;
+   if (!ast_strlen_zero(cid_num)) {
+      chan->caller.id.number.str = strdup(cid_num);
+      chan->caller.id.number.valid = 1;
+   }
+   if (!ast_strlen_zero(cid_name)) {
+      chan->caller.id.name.str = strdup(cid_name);
+      chan->caller.id.name.valid = 1;
+   }
+   ast_copy_string(chan->exten, ast_strlen_zero(exten) ? "s" : exten, sizeof(chan->exten));
+   ast_copy_string(chan->context, ast_strlen_zero(context) ? "default" : context, sizeof(chan->context));
+   for (i = 0; (i < ARRAY_LEN(chan->fds)); i += 1) {
+      chan->fds[i] = -1;
+      chan->watch_fds[i].chan = chan;
+      chan->watch_fds[i].which = i;
+   }
+   chan->watch_alert.chan = chan;
+   chan->watch_alert.which = AST_STUB_WATCH_QUEUE;
+   chan->epfd = -1;
+   __atomic_add_fetch(&(ast_stub_channels), 1, __ATOMIC_RELAXED);
+
+   /* Since Asterisk 12, the channel is returned locked */
+   pthread_mutex_lock(&(chan->lock));
+   return (chan);
+}
+
+int ast_channel_lock(struct ast_channel *chan)
+{
+   return (pthread_mutex_lock(&(chan->lock)));
+}
+
+int ast_channel_trylock(struct ast_channel *chan)
+{
+   return (pthread_mutex_trylock(&(chan->lock)));
+}
+
+int ast_channel_unlock(struct ast_channel *chan)
+{
+   return (pthread_mutex_unlock(&(chan->lock)));
+}
+
+const char *ast_channel_name(const struct ast_channel *chan)
+{
+   return (chan->name);
+}
+
+enum ast_channel_state ast_channel_state(const struct ast_channel *chan)
+{
+   return (chan->state);
+}
+
+const char *ast_channel_linkedid(const struct ast_channel *chan)
+{
+   return (chan->name);
+}
+
+struct ast_party_caller *ast_channel_caller(struct ast_channel *chan)
+{
+   return (&(chan->caller));
+}
+
+struct ast_party_connected_line *ast_channel_connected(struct ast_channel *chan)
+{
+   return (&(chan->connected));
+}
+
+const struct ast_channel_tech *ast_channel_tech(const struct ast_channel *chan)
+{
+   return (chan->tech);
+}
+
+void ast_channel_tech_set(struct ast_channel *chan, const struct ast_channel_tech *value)
+{
+   chan->tech = value;
+}
+
+void *ast_channel_tech_pvt(const struct ast_channel *chan)
+{
+   return (chan->tech_pvt);
+}
+
+void ast_channel_tech_pvt_set(struct ast_channel *chan, void *value)
+{
+   chan->tech_pvt = value;
+}
+
+void ast_channel_nativeformats_set(struct ast_channel *chan, struct ast_format_cap *value)
+{
+   ao2_ref(value, 1);
+   ao2_ref(chan->nativeformats, -1);
+   chan->nativeformats = value;
+}
+
+struct ast_format *ast_channel_rawreadformat(struct ast_channel *chan)
+{
+   return (chan->rawreadformat);
+}
+
+void ast_channel_set_rawreadformat(struct ast_channel *chan, struct ast_format *format)
+{
+   chan->rawreadformat = format;
+}
+
+void ast_channel_set_rawwriteformat(struct ast_channel *chan, struct ast_format *format)
+{
+   chan->rawwriteformat = format;
+}
+
+void ast_channel_set_readformat(struct ast_channel *chan, struct ast_format *format)
+{
+   chan->readformat = format;
+}
+
+void ast_channel_set_writeformat(struct ast_channel *chan, struct ast_format *format)
+{
+   chan->writeformat = format;
+}
+
+void ast_channel_context_set(struct ast_channel *chan, const char *value)
+{
+   ast_copy_string(chan->context, value, sizeof(chan->context));
+}
+
+const char *ast_channel_exten(const struct ast_channel *chan)
+{
+   return (chan->exten);
+}
+
+void ast_channel_exten_set(struct ast_channel *chan, const char *value)
+{
+   ast_copy_string(chan->exten, value, sizeof(chan->exten));
+}
+
+void ast_channel_language_set(struct ast_channel *chan, const char *value)
+{
+   ast_copy_string(chan->language, value, sizeof(chan->language));
+}
+
+void ast_channel_rings_set(struct ast_channel *chan, int value)
+{
+   chan->rings = value;
+}
+
+static int ast_stub_epoll_update(int epfd, int old_fd, int new_fd, void *ptr)
+{
+   struct epoll_event ev;
+
+   if (old_fd >= 0) {
+      epoll_ctl(epfd, EPOLL_CTL_DEL, old_fd, NULL);
+   }
+   if (new_fd < 0) {
+      return (0);
+   }
+   memset(&(ev), 0, sizeof(ev));
+   ev.events = EPOLLIN;
+   ev.data.ptr = ptr;
+   return (epoll_ctl(epfd, EPOLL_CTL_ADD, new_fd, &(ev)));
+}
+
+void ast_channel_set_fd(struct ast_channel *chan, int which, int fd)
+{
+   if ((which < 0) || ((size_t)(which) >= ARRAY_LEN(chan->fds))) {
+      return;
+   }
+   if (chan->epfd >= 0) {
+      ast_stub_epoll_update(chan->epfd, chan->fds[which], fd, &(chan->watch_fds[which]));
+   }
+   chan->fds[which] = fd;
+}
+
+int ast_stub_channel_watch(struct ast_channel *chan, int epfd)
+{
+   chan->epfd = epfd;
+   if (ast_stub_epoll_update(epfd, -1, chan->fd_alert, &(chan->watch_alert))) {
+      return (-1);
+   }
+   return (ast_stub_epoll_update(epfd, -1, chan->fds[0], &(chan->watch_fds[0])));
+}
+
+void ast_stub_channel_set_data(struct ast_channel *chan, void *data)
+{
+   chan->data = data;
+}
+
+void *ast_stub_channel_data(const struct ast_channel *chan)
+{
+   return (chan->data);
+}
+
+int ast_stub_channel_fd(const struct ast_channel *chan, int which)
+{
+   return (chan->fds[which]);
+}
+
+int ast_stub_channel_count(void)
+{
+   return (__atomic_load_n(&(ast_stub_channels), __ATOMIC_RELAXED));
+}
+
+int ast_queue_frame(struct ast_channel *chan, struct ast_frame *frame)
+{
+   ast_stub_queued_t *q = malloc(sizeof(*q));
+   uint64_t val = 1;
+
+   if (NULL == q) {
+      return (-1);
+   }
+   q->frame = ast_stub_frdup(frame);
+   if (NULL == q->frame) {
+      free(q);
+      return (-1);
+   }
+   q->next = NULL;
+   pthread_mutex_lock(&(chan->lock));
+   if (NULL == chan->queue_last) {
+      chan->queue_first = q;
+   }
+   else {
+      chan->queue_last->next = q;
+   }
+   chan->queue_last = q;
+   if (write(chan->fd_alert, &(val), sizeof(val)) < 0) {
+      /* Counter can't overflow */
+   }
+   if (NULL != ast_stub_hooks.frame_queued) {
+      ast_stub_hooks.frame_queued(chan, q->frame);
+   }
+   pthread_mutex_unlock(&(chan->lock));
+   return (0);
+}
+
+int ast_queue_control(struct ast_channel *chan, enum ast_control_frame_type control)
+{
+   struct ast_frame f = { .frametype = AST_FRAME_CONTROL, .subclass.integer = control, .src = "ast_stub" };
+
+   return (ast_queue_frame(chan, &(f)));
+}
+
+int ast_queue_hangup(struct ast_channel *chan)
+{
+   return (ast_queue_control(chan, AST_CONTROL_HANGUP));
+}
+
+struct ast_frame *ast_stub_channel_dequeue(struct ast_channel *chan)
+{
+   ast_stub_queued_t *q = chan->queue_first;
+   struct ast_frame *ret;
+   uint64_t val;
+
+   if (NULL == q) {
+      return (NULL);
+   }
+   chan->queue_first = q->next;
+   if (NULL == chan->queue_first) {
+      chan->queue_last = NULL;
+      if (read(chan->fd_alert, &(val), sizeof(val)) < 0) {
+         /* Counter is already null */
+      }
+   }
+   ret = q->frame;
+   free(q);
+   return (ret);
+}
+
+int ast_setstate(struct ast_channel *chan, enum ast_channel_state state)
+{
+   chan->state = state;
+   return (0);
+}
+
+void ast_hangup(struct ast_channel *chan)
+{
+   struct ast_frame *f;
+   size_t i;
+
+   if (NULL == chan) {
+      return;
+   }
+   pthread_mutex_lock(&(chan->lock));
+   if ((NULL != chan->tech) && (NULL != chan->tech->hangup)) {
+      chan->tech->hangup(chan);
+   }
+   if (NULL != ast_stub_hooks.hangup) {
+      ast_stub_hooks.hangup(chan);
+   }
+   if (chan->epfd >= 0) {
+      for (i = 0; (i < ARRAY_LEN(chan->fds)); i += 1) {
+         ast_stub_epoll_update(chan->epfd, chan->fds[i], -1, NULL);
+      }
+      ast_stub_epoll_update(chan->epfd, chan->fd_alert, -1, NULL);
+   }
+   while (NULL != (f = ast_stub_channel_dequeue(chan))) {
+      ast_frfree(f);
+   }
+   pthread_mutex_unlock(&(chan->lock));
+
+   close(chan->fd_alert);
+   ao2_ref(chan->nativeformats, -1);
+   free(chan->caller.id.number.str);
+   free(chan->caller.id.name.str);
+   free(chan->caller.ani.number.str);
+   free(chan->caller.ani.name.str);
+   pthread_mutex_destroy(&(chan->lock));
+   free(chan);
+   __atomic_sub_fetch(&(ast_stub_channels), 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Channel technologies
+ */
+
+static const struct ast_channel_tech *ast_stub_techs[4];
+
+int ast_channel_register(const struct ast_channel_tech *tech)
+{
+   size_t i;
+
+   for (i = 0; (i < ARRAY_LEN(ast_stub_techs)); i += 1) {
+      if (NULL == ast_stub_techs[i]) {
+         ast_stub_techs[i] = tech;
+         return (0);
+      }
+   }
+   return (-1);
+}
+
+void ast_channel_unregister(const struct ast_channel_tech *tech)
+{
+   size_t i;
+
+   for (i = 0; (i < ARRAY_LEN(ast_stub_techs)); i += 1) {
+      if (tech == ast_stub_techs[i]) {
+         ast_stub_techs[i] = NULL;
+      }
+   }
+}
+
+const struct ast_channel_tech *ast_stub_find_tech(const char *type)
+{
+   size_t i;
+
+   for (i = 0; (i < ARRAY_LEN(ast_stub_techs)); i += 1) {
+      if ((NULL != ast_stub_techs[i]) && (!strcasecmp(ast_stub_techs[i]->type, type))) {
+         return (ast_stub_techs[i]);
+      }
+   }
+   return (NULL);
+}
+
+/*
+ * Jitter buffer, PBX, music on hold and indications
+ */
+
+int ast_jb_read_conf(struct ast_jb_conf *conf, const char *varname, const char *value)
+{
+   /* Parameters of the jitter buffer are accepted and ignored */
+   return (strncasecmp(varname, "jb", 2) ? -1 : 0);
+}
+
+void ast_jb_configure(struct ast_channel *chan, const struct ast_jb_conf *conf)
+{
+}
+
+int ast_pbx_start(struct ast_channel *chan)
+{
+   if (NULL != ast_stub_hooks.pbx_start) {
+      return (ast_stub_hooks.pbx_start(chan));
+   }
+   return (0);
+}
+
+int ast_exists_extension(struct ast_channel *chan, const char *context,
+   const char *exten, int priority, const char *callerid)
+{
+   if (NULL != ast_stub_hooks.exists_extension) {
+      return (ast_stub_hooks.exists_extension(context, exten));
+   }
+   return (0);
+}
+
+int ast_canmatch_extension(struct ast_channel *chan, const char *context,
+   const char *exten, int priority, const char *callerid)
+{
+   if (NULL != ast_stub_hooks.canmatch_extension) {
+      return (ast_stub_hooks.canmatch_extension(context, exten));
+   }
+   return (0);
+}
+
+int ast_moh_start(struct ast_channel *chan, const char *mclass, const char *interpclass)
+{
+   return (0);
+}
+
+void ast_moh_stop(struct ast_channel *chan)
+{
+}
+
+struct ast_tone_zone *ast_get_indication_zone(const char *country)
+{
+   return (NULL);
+}
+
+struct ast_tone_zone_sound *ast_get_indication_tone(const struct ast_tone_zone *zone,
+   const char *indication)
+{
+   return (NULL);
+}
+
+int ast_tone_zone_part_parse(const char *s, struct ast_tone_zone_part *tone_data)
+{
+   return (-1);
+}
+
+/*
+ * Modules
+ */
+
+static int ast_stub_refs;
+
+void ast_module_ref(struct ast_module *mod)
+{
+   __atomic_add_fetch(&(ast_stub_refs), 1, __ATOMIC_RELAXED);
+}
+
+void ast_module_unref(struct ast_module *mod)
+{
+   __atomic_sub_fetch(&(ast_stub_refs), 1, __ATOMIC_RELAXED);
+}
+
+int ast_stub_module_refs(void)
+{
+   return (__atomic_load_n(&(ast_stub_refs), __ATOMIC_RELAXED));
+}
+
+/*
+ * CLI
+ */
+
+static struct ast_cli_entry *ast_stub_cli_entries;
+static int ast_stub_cli_len;
+
+void ast_cli(int fd, const char *fmt, ...)
+{
+   va_list ap;
+
+   va_start(ap, fmt);
+   vdprintf(fd, fmt, ap);
+   va_end(ap);
+}
+
+int ast_cli_register_multiple(struct ast_cli_entry *e, int len)
+{
+   int i;
+
+   for (i = 0; (i < len); i += 1) {
+      /* The handler gives the command and its usage */
+      e[i].handler(&(e[i]), CLI_INIT, NULL);
+   }
+   ast_stub_cli_entries = e;
+   ast_stub_cli_len = len;
+   return (0);
+}
+
+int ast_cli_unregister_multiple(struct ast_cli_entry *e, int len)
+{
+   if (e == ast_stub_cli_entries) {
+      ast_stub_cli_entries = NULL;
+      ast_stub_cli_len = 0;
+   }
+   return (0);
+}
+
+char *ast_stub_cli_command(int fd, const char *line)
+{
+   char *copy = strdupa(line);
+   const char *argv[16];
+   int argc = 0;
+   char *word;
+   int i;
+
+   while ((argc < (int)(ARRAY_LEN(argv))) && (NULL != (word = strsep(&(copy), " \t")))) {
+      if ('\0' != word[0]) {
+         argv[argc++] = word;
+      }
+   }
+   for (i = 0; (i < ast_stub_cli_len); i += 1) {
+      struct ast_cli_entry *e = &(ast_stub_cli_entries[i]);
+      char *command = strdupa(e->command);
+      int n = 0;
+
+      while (NULL != (word = strsep(&(command), " "))) {
+         if ((n >= argc) || (strcmp(word, argv[n]))) {
+            n = -1;
+            break;
+         }
+         n += 1;
+      }
+      if (n > 0) {
+         struct ast_cli_args a = { .fd = fd, .argc = argc, .argv = argv, .line = line };
+         return (e->handler(e, CLI_HANDLER, &(a)));
+      }
+   }
+   return (NULL);
+}
+
+/*
+ * Configuration : a copy of the text given by the harness, parsed when the
+ * module loads it
+ */
+
+typedef struct ast_stub_category {
+   struct ast_stub_category *next;
+   char *name;
+   struct ast_variable *root;
+} ast_stub_category_t;
+
+struct ast_config {
+   ast_stub_category_t *first;
+};
+
+static char *ast_stub_config_filename;
+static char *ast_stub_config_text;
+
+void ast_stub_set_config(const char *filename, const char *text)
+{
+   free(ast_stub_config_filename);
+   free(ast_stub_config_text);
+   ast_stub_config_filename = ast_strdup(filename);
+   ast_stub_config_text = ast_strdup(text);
+}
+
+void ast_config_destroy(struct ast_config *cfg)
+{
+   ast_stub_category_t *cat;
+
+   if ((CONFIG_STATUS_FILEMISSING == cfg) || (CONFIG_STATUS_FILEUNCHANGED == cfg)
+       || (CONFIG_STATUS_FILEINVALID == cfg)) {
+      return;
+   }
+   while (NULL != (cat = cfg->first)) {
+      struct ast_variable *v;
+      cfg->first = cat->next;
+      while (NULL != (v = cat->root)) {
+         cat->root = v->next;
+         /* Name and value are allocated with the variable */
+         free(v);
+      }
+      free(cat->name);
+      free(cat);
+   }
+   free(cfg);
+}
+
+struct ast_config *ast_config_load2(const char *filename, const char *who_asked,
+   struct ast_flags flags)
+{
+   struct ast_config *cfg;
+   ast_stub_category_t *cat = NULL;
+   struct ast_variable *last = NULL;
+   char *text;
+   char *line;
+   bool ok = true;
+
+   if ((NULL == ast_stub_config_text) || (strcmp(filename, ast_stub_config_filename))) {
+      return (CONFIG_STATUS_FILEMISSING);
+   }
+   cfg = calloc(1, sizeof(*cfg));
+   if (NULL == cfg) {
+      return (CONFIG_STATUS_FILEINVALID);
+   }
+   text = strdupa(ast_stub_config_text);
+   while ((ok) && (NULL != (line = strsep(&(text), "\n")))) {
+      char *c = strchr(line, ';');
+      char *eq;
+
+      if (NULL != c) {
+         *c = '\0';
+      }
+      line = ast_strip(line);
+      if ('\0' == line[0]) {
+         continue;
+      }
+      if ('[' == line[0]) {
+         ast_stub_category_t *n;
+         c = strchr(line, ']');
+         n = calloc(1, sizeof(*n));
+         if ((NULL == c) || (NULL == n)) {
+            free(n);
+            ok = false;
+            break;
+         }
+         *c = '\0';
+         n->name = strdup(line + 1);
+         if (NULL == cat) {
+            cfg->first = n;
+         }
+         else {
+            cat->next = n;
+         }
+         cat = n;
+         last = NULL;
+         continue;
+      }
+      eq = strchr(line, '=');
+      if ((NULL == cat) || (NULL == eq)) {
+         ok = false;
+         break;
+      }
+      else {
+         char *name;
+         char *value;
+         struct ast_variable *v;
+         size_t name_len;
+         size_t value_len;
+
+         *eq = '\0';
+         if ('>' == eq[1]) {
+            eq += 1;
+         }
+         name = ast_strip(line);
+         value = ast_strip(eq + 1);
+         name_len = strlen(name) + 1;
+         value_len = strlen(value) + 1;
+         v = calloc(1, sizeof(*v) + name_len + value_len);
+         if (NULL == v) {
+            ok = false;
+            break;
+         }
+         v->name = memcpy((char *)(v + 1), name, name_len);
+         v->value = memcpy((char *)(v + 1) + name_len, value, value_len);
+         if (NULL == last) {
+            cat->root = v;
+         }
+         else {
+            last->next = v;
+         }
+         last = v;
+      }
+   }
+   if (!ok) {
+      ast_config_destroy(cfg);
+      return (CONFIG_STATUS_FILEINVALID);
+   }
+   return (cfg);
+}
+
+struct ast_variable *ast_variable_browse(const struct ast_config *cfg, const char *category)
+{
+   ast_stub_category_t *cat;
+
+   for (cat = cfg->first; (NULL != cat); cat = cat->next) {
+      if (!strcasecmp(cat->name, category)) {
+         return (cat->root);
+      }
+   }
+   return (NULL);
+}
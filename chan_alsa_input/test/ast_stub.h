@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2015
+ * Gilles Mazoyer <mazoyer.gilles@omega.ovh>
+ *
+ * This is free software, licensed under the GNU General Public License v2.
+ * See /LICENSE for more information.
+ */
+
+/*
+ Minimal Asterisk core (ast_stub.c) the channel driver is linked with by the
+ benchmark and the tests. The driver sees the API of <asterisk.h>, this
+ header gives the harness what the PBX would do : the configuration read by
+ the module, the dialplan, the channels created by the driver and the frames
+ it queues on them.
+*/
+
+#ifndef AST_STUB_H
+#define AST_STUB_H
+
+#include <asterisk.h>
+#include <stdarg.h>
+#include <sys/types.h>
+
+/*
+ Decisions of the "PBX", made by the harness. A hook left NULL gives the
+ default behaviour
+*/
+typedef struct ast_stub_hooks {
+   /* Called by ast_pbx_start() (default : nothing is started, returns 0) */
+   int (*pbx_start)(struct ast_channel *chan);
+   /* Dialplan (default : no extension exists, none can match) */
+   int (*exists_extension)(const char *context, const char *exten);
+   int (*canmatch_extension)(const char *context, const char *exten);
+   /*
+    Called by ast_queue_frame(), ast_queue_control() and ast_queue_hangup(),
+    with the channel locked, after the frame is queued
+   */
+   void (*frame_queued)(struct ast_channel *chan, const struct ast_frame *frame);
+   /* Called by ast_hangup() before the channel is destroyed */
+   void (*hangup)(struct ast_channel *chan);
+   /*
+    Called by ast_log() for each message, whatever ast_stub_log_level, before
+    it's formatted (so that debug messages stay cheap)
+   */
+   void (*log)(int level, const char *fmt, va_list ap);
+} ast_stub_hooks_t;
+
+extern ast_stub_hooks_t ast_stub_hooks;
+
+/* Messages logged below this level are dropped (default AST_LOG_WARNING) */
+extern int ast_stub_log_level;
+
+/* Text of the configuration file returned by ast_config_load2() */
+void ast_stub_set_config(const char *filename, const char *text);
+
+/* Channel technology registered with this type, or NULL */
+const struct ast_channel_tech *ast_stub_find_tech(const char *type);
+
+/*
+ Runs a CLI command of the module (e.g. "ai show stats 1"), its output is
+ written to fd. Returns the result of the handler, NULL if no command matches
+*/
+char *ast_stub_cli_command(int fd, const char *line);
+
+/* Number of channels allocated and not yet hung up */
+int ast_stub_channel_count(void);
+
+/* Number of references taken on the module by the driver */
+int ast_stub_module_refs(void);
+
+/* Data of the harness attached to a channel */
+void ast_stub_channel_set_data(struct ast_channel *chan, void *data);
+void *ast_stub_channel_data(const struct ast_channel *chan);
+
+/* File descriptor set by the driver with ast_channel_set_fd(), or -1 */
+int ast_stub_channel_fd(const struct ast_channel *chan, int which);
+
+/*
+ Oldest frame queued on the channel, to be freed with ast_frfree(), or NULL.
+ Must be called with the channel locked
+*/
+struct ast_frame *ast_stub_channel_dequeue(struct ast_channel *chan);
+
+/*
+ What the events returned by epoll_wait() for a watched channel point to :
+ the file descriptor 'which' set by the driver, or AST_STUB_WATCH_QUEUE when
+ frames are queued
+*/
+#define AST_STUB_WATCH_QUEUE (-1)
+
+typedef struct ast_stub_watch {
+   struct ast_channel *chan;
+   int which;
+} ast_stub_watch_t;
+
+/*
+ Registers in epfd (level triggered, EPOLLIN) the file descriptor 0 of the
+ channel, and the one signaling the frames queued. The file descriptors set
+ later by the driver are registered in place of the previous ones, and all
+ are removed when the channel is hung up
+*/
+int ast_stub_channel_watch(struct ast_channel *chan, int epfd);
+
+/*
+ Threads created by the driver with ast_pthread_create_background() and
+ still running : fills at most len entries, returns their count
+*/
+size_t ast_stub_threads(pthread_t *threads, pid_t *tids, size_t len);
+
+#endif /* AST_STUB_H */
@@ -0,0 +1,710 @@
+/*
+ * Copyright (C) 2015
+ * Gilles Mazoyer <mazoyer.gilles@omega.ovh>
+ *
+ * This is free software, licensed under the GNU General Public License v2.
+ * See /LICENSE for more information.
+ */
+
+/*
+ Benchmark of chan_alsa_input without Asterisk and without phone : the
+ driver is linked with a minimal core (ast_stub.c) and with sound devices
+ paced by the clock of the system (snd_stub.c). The keypad of each line is a
+ pipe the benchmark writes input events to (key pressed, key released,
+ EV_SYN), read by the monitor as an event device.
+
+ For each number of lines, three phases are measured :
+ - idle : all the lines on hook
+ - tone : all the lines off hook, playing the dial tone
+ - talk : all the lines in a call ("100#" dialed); the PBX reads each frame
+   captured and writes back a frame of voice, as a bridge would do
+
+ Reported for each phase : CPU used by the monitor and audio threads and by
+ the callbacks read() and write() of the driver (per line, in % of a core),
+ wakeups per second of the monitor and audio threads, and in talk phase the
+ latency of the frames :
+ - capture : from the end of the period captured by the device to the frame
+   returned by read()
+ - playback : from write() to the end of the period played by the device
+
+ The samples captured are stamps of the frame clock (see snd_stub.h); the
+ frames whose stamps don't follow each other (resampling, noise suppressor,
+ AGC, ...) aren't counted. Likewise for the periods played.
+*/
+
+#include "../chan_alsa_input.c"
+
+#include "ast_stub.h"
+#include "snd_stub.h"
+
+#include <getopt.h>
+#include <stdarg.h>
+
+#define BENCH_MAX_LINES 256
+#define BENCH_MAX_SAMPLES (1 << 20)
+#define BENCH_EXTENSION "100"
+
+typedef struct {
+   /* Latencies in frames at the rate of the lines, written by one thread */
+   uint32_t *values;
+   size_t count;
+} bench_latencies_t;
+
+typedef struct {
+   uint64_t cpu_ns;
+   unsigned long switches;
+} bench_thread_sample_t;
+
+typedef struct {
+   uint64_t ns;
+   bench_thread_sample_t monitor;
+   bench_thread_sample_t audio;
+   uint64_t callbacks_ns;
+   unsigned long frames_read;
+   alsa_input_stats_t stats;
+} bench_sample_t;
+
+static struct {
+   /* Options */
+   unsigned int lines[16];
+   size_t lines_count;
+   unsigned int duration_ms;
+   unsigned int warmup_ms;
+   unsigned int rate;
+   unsigned int period_ms;
+   const char *device;
+   bool mmap;
+   char extra[1024];
+
+   /* Write end of the pipe of each line */
+   int fd_keys[BENCH_MAX_LINES];
+
+   /* Thread playing the PBX : reads and writes the frames of the channels */
+   pthread_t core_thread;
+   int core_epfd;
+   int core_fd_stop;
+   /* CPU time spent by the core in the callbacks of the driver */
+   uint64_t callbacks_ns;
+   unsigned long frames_read;
+
+   /* Latencies are recorded while true */
+   bool recording;
+   bench_latencies_t capture;
+   bench_latencies_t playback;
+} bench;
+
+static void bench_fatal(const char *fmt, ...)
+{
+   va_list ap;
+
+   va_start(ap, fmt);
+   fprintf(stderr, "bench_alsa_input: ");
+   vfprintf(stderr, fmt, ap);
+   va_end(ap);
+   exit(1);
+}
+
+static uint64_t bench_clock_ns(clockid_t clock)
+{
+   struct timespec ts;
+
+   clock_gettime(clock, &(ts));
+   return (((uint64_t)(ts.tv_sec) * 1000000000ULL) + (uint64_t)(ts.tv_nsec));
+}
+
+static void bench_sleep_ms(unsigned int ms)
+{
+   struct timespec ts;
+
+   ts.tv_sec = ms / 1000;
+   ts.tv_nsec = (ms % 1000) * 1000000L;
+   while (nanosleep(&(ts), &(ts)) && (EINTR == errno)) {
+   }
+}
+
+static void bench_latency_add(bench_latencies_t *l, uint64_t frames)
+{
+   if ((!__atomic_load_n(&(bench.recording), __ATOMIC_ACQUIRE)) || (l->count >= BENCH_MAX_SAMPLES)) {
+      return;
+   }
+   l->values[l->count] = (uint32_t)(frames);
+   __atomic_store_n(&(l->count), l->count + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * The PBX
+ */
+
+static int bench_pbx_start(struct ast_channel *chan)
+{
+   /* Called by the monitor with the channel locked */
+   if (ast_stub_channel_watch(chan, bench.core_epfd)) {
+      return (-1);
+   }
+   return (0);
+}
+
+static int bench_exists_extension(const char *context, const char *exten)
+{
+   return (!strcmp(exten, BENCH_EXTENSION));
+}
+
+static int bench_canmatch_extension(const char *context, const char *exten)
+{
+   return (!strncmp(exten, BENCH_EXTENSION, strlen(exten)));
+}
+
+/* Answers a frame captured with a frame of voice stamped with the time */
+static void bench_core_read(struct ast_channel *chan)
+{
+   const struct ast_channel_tech *tech = ast_channel_tech(chan);
+   uint64_t start = bench_clock_ns(CLOCK_THREAD_CPUTIME_ID);
+   struct ast_frame *f;
+
+   f = tech->read(chan);
+   if ((NULL != f) && (AST_FRAME_VOICE == f->frametype) && (f->samples > 0)) {
+      const int16_t *samples = f->data.ptr;
+      uint16_t first = (uint16_t)(samples[0]);
+      uint16_t last = (uint16_t)(samples[f->samples - 1]);
+      int16_t echo[AST_FRIENDLY_OFFSET + (48 * 100)];
+      struct ast_frame w;
+      uint64_t now = snd_stub_frames(bench.rate);
+      int16_t stamp = snd_stub_stamp(now);
+      int i;
+
+      bench.frames_read += 1;
+      if ((0 != first) && (((((unsigned int)(last) + 65535) - first) % 65535) == (unsigned int)(f->samples - 1))) {
+         int64_t age = snd_stub_stamp_age((int16_t)(last), now);
+         if (age >= 0) {
+            bench_latency_add(&(bench.capture), age);
+         }
+      }
+
+      memset(&(w), 0, sizeof(w));
+      w.frametype = AST_FRAME_VOICE;
+      w.subclass.format = f->subclass.format;
+      w.samples = f->samples;
+      if ((size_t)(w.samples) > (ARRAY_LEN(echo) - AST_FRIENDLY_OFFSET)) {
+         w.samples = ARRAY_LEN(echo) - AST_FRIENDLY_OFFSET;
+      }
+      w.datalen = w.samples * sizeof(int16_t);
+      w.data.ptr = &(echo[AST_FRIENDLY_OFFSET]);
+      w.src = "bench";
+      for (i = 0; (i < w.samples); i += 1) {
+         echo[AST_FRIENDLY_OFFSET + i] = stamp;
+      }
+      tech->write(chan, &(w));
+   }
+   if (NULL != f) {
+      ast_frfree(f);
+   }
+   bench.callbacks_ns += bench_clock_ns(CLOCK_THREAD_CPUTIME_ID) - start;
+}
+
+/* Returns true if the channel must be hung up */
+static bool bench_core_queue(struct ast_channel *chan)
+{
+   struct ast_frame *f;
+   bool hangup = false;
+
+   while (NULL != (f = ast_stub_channel_dequeue(chan))) {
+      if ((AST_FRAME_CONTROL == f->frametype) && (AST_CONTROL_HANGUP == f->subclass.integer)) {
+         hangup = true;
+      }
+      ast_frfree(f);
+   }
+   return (hangup);
+}
+
+static void *bench_core(void *data)
+{
+   struct epoll_event events[64];
+   struct ast_channel *hangups[BENCH_MAX_LINES];
+
+   for (;;) {
+      size_t hangups_count = 0;
+      size_t i;
+      int nfds;
+      int n;
+
+      nfds = epoll_wait(bench.core_epfd, events, ARRAY_LEN(events), -1);
+      if (nfds < 0) {
+         if (EINTR == errno) {
+            continue;
+         }
+         bench_fatal("epoll_wait() failed: %s\n", strerror(errno));
+      }
+      for (n = 0; (n < nfds); n += 1) {
+         ast_stub_watch_t *w = events[n].data.ptr;
+
+         if (NULL == w) {
+            return (NULL);
+         }
+         ast_channel_lock(w->chan);
+         if (AST_STUB_WATCH_QUEUE == w->which) {
+            if ((bench_core_queue(w->chan)) && (hangups_count < ARRAY_LEN(hangups))) {
+               hangups[hangups_count++] = w->chan;
+            }
+         }
+         else {
+            bench_core_read(w->chan);
+         }
+         ast_channel_unlock(w->chan);
+      }
+      /* The channels hung up are freed : the events returned are handled first */
+      for (i = 0; (i < hangups_count); i += 1) {
+         ast_hangup(hangups[i]);
+      }
+   }
+   return (NULL);
+}
+
+static void bench_played(const char *name, unsigned int rate, int16_t first, int16_t last)
+{
+   int64_t age;
+
+   if ((first != last) || (0 == last)) {
+      /* Tone, concealment or period across two frames */
+      return;
+   }
+   /* Stamps are written at the rate of the lines */
+   age = snd_stub_stamp_age(last, snd_stub_frames(bench.rate));
+   if (age >= 0) {
+      bench_latency_add(&(bench.playback), age);
+   }
+}
+
+/*
+ * Keypads
+ */
+
+static void bench_press(size_t line, __u16 code)
+{
+   struct input_event ev[4];
+
+   memset(ev, 0, sizeof(ev));
+   gettimeofday(&(ev[0].time), NULL);
+   ev[0].type = EV_KEY;
+   ev[0].code = code;
+   ev[0].value = 1;
+   ev[1].time = ev[0].time;
+   ev[1].type = EV_SYN;
+   ev[1].code = SYN_REPORT;
+   ev[2] = ev[0];
+   ev[2].value = 0;
+   ev[3] = ev[1];
+   if (write(bench.fd_keys[line], ev, sizeof(ev)) != (ssize_t)(sizeof(ev))) {
+      bench_fatal("Unable to write the keys of line %lu\n", (unsigned long)(line + 1));
+   }
+}
+
+static void bench_press_all(size_t lines, __u16 code)
+{
+   size_t i;
+
+   for (i = 0; (i < lines); i += 1) {
+      bench_press(i, code);
+   }
+}
+
+static void bench_dial_all(size_t lines, const char *digits)
+{
+   const char *d;
+
+   for (d = digits; ('\0' != *d); d += 1) {
+      __u16 code;
+
+      if ('#' == *d) {
+         code = KEY_NUMERIC_POUND;
+      }
+      else if ('*' == *d) {
+         code = KEY_NUMERIC_STAR;
+      }
+      else {
+         code = KEY_NUMERIC_0 + (*d - '0');
+      }
+      bench_press_all(lines, code);
+      bench_sleep_ms(50);
+   }
+}
+
+/*
+ * Measures
+ */
+
+static void bench_thread_sample(pthread_t thread, pid_t tid, bench_thread_sample_t *s)
+{
+   char path[64];
+   char line[128];
+   clockid_t clock;
+   FILE *f;
+
+   s->cpu_ns = 0;
+   s->switches = 0;
+   if (0 == pthread_getcpuclockid(thread, &(clock))) {
+      s->cpu_ns = bench_clock_ns(clock);
+   }
+   snprintf(path, sizeof(path), "/proc/self/task/%d/status", (int)(tid));
+   f = fopen(path, "r");
+   if (NULL == f) {
+      return;
+   }
+   while (NULL != fgets(line, sizeof(line), f)) {
+      unsigned long n;
+      /* Each wakeup follows a voluntary switch (the thread waits) */
+      if (1 == sscanf(line, "voluntary_ctxt_switches: %lu", &(n))) {
+         s->switches = n;
+      }
+   }
+   fclose(f);
+}
+
+static void bench_stats_sum(alsa_input_stats_t *sum)
+{
+   alsa_input_pvt_t *pvt;
+
+   memset(sum, 0, sizeof(*sum));
+   AST_LIST_TRAVERSE(&(alsa_input_chan.pvt_list), pvt, list) {
+      sum->capture_xruns += __atomic_load_n(&(pvt->stats.capture_xruns), __ATOMIC_RELAXED);
+      sum->playback_xruns += __atomic_load_n(&(pvt->stats.playback_xruns), __ATOMIC_RELAXED);
+      sum->capture_dropped += __atomic_load_n(&(pvt->stats.capture_dropped), __ATOMIC_RELAXED);
+      sum->playback_dropped += __atomic_load_n(&(pvt->stats.playback_dropped), __ATOMIC_RELAXED);
+      sum->concealed += __atomic_load_n(&(pvt->stats.concealed), __ATOMIC_RELAXED);
+   }
+}
+
+static void bench_sample(bench_sample_t *s)
+{
+   pthread_t threads[4];
+   pid_t tids[4];
+   size_t count = ast_stub_threads(threads, tids, ARRAY_LEN(threads));
+   size_t i;
+
+   memset(s, 0, sizeof(*s));
+   s->ns = bench_clock_ns(CLOCK_MONOTONIC);
+   for (i = 0; ((i < count) && (i < ARRAY_LEN(threads))); i += 1) {
+      if (pthread_equal(threads[i], alsa_input_chan.monitor.thread)) {
+         bench_thread_sample(threads[i], tids[i], &(s->monitor));
+      }
+      else if (pthread_equal(threads[i], alsa_input_chan.audio.thread)) {
+         bench_thread_sample(threads[i], tids[i], &(s->audio));
+      }
+   }
+   s->callbacks_ns = __atomic_load_n(&(bench.callbacks_ns), __ATOMIC_RELAXED);
+   s->frames_read = __atomic_load_n(&(bench.frames_read), __ATOMIC_RELAXED);
+   bench_stats_sum(&(s->stats));
+}
+
+static int bench_cmp_u32(const void *a, const void *b)
+{
+   uint32_t x = *(const uint32_t *)(a);
+   uint32_t y = *(const uint32_t *)(b);
+
+   return ((x > y) - (x < y));
+}
+
+/* Percentiles (50, 90, 99, max) in ms, or dashes if nothing was measured */
+static void bench_percentiles(char *buf, size_t len, bench_latencies_t *l)
+{
+   size_t count = __atomic_load_n(&(l->count), __ATOMIC_ACQUIRE);
+   double ms = 1000.0 / bench.rate;
+
+   if (0 == count) {
+      snprintf(buf, len, "%6s %6s %6s %6s", "-", "-", "-", "-");
+      return;
+   }
+   qsort(l->values, count, sizeof(l->values[0]), bench_cmp_u32);
+   snprintf(buf, len, "%6.1f %6.1f %6.1f %6.1f",
+      l->values[(count * 50) / 100] * ms, l->values[(count * 90) / 100] * ms,
+      l->values[(count * 99) / 100] * ms, l->values[count - 1] * ms);
+}
+
+static void bench_measure(const char *phase, size_t lines)
+{
+   bench_sample_t b;
+   bench_sample_t e;
+   double secs;
+   double cpu_monitor;
+   double cpu_audio;
+   double cpu_callbacks;
+   char capture[64];
+   char playback[64];
+
+   bench_sleep_ms(bench.warmup_ms);
+   __atomic_store_n(&(bench.capture.count), 0, __ATOMIC_RELEASE);
+   __atomic_store_n(&(bench.playback.count), 0, __ATOMIC_RELEASE);
+   bench_sample(&(b));
+   __atomic_store_n(&(bench.recording), true, __ATOMIC_RELEASE);
+   bench_sleep_ms(bench.duration_ms);
+   __atomic_store_n(&(bench.recording), false, __ATOMIC_RELEASE);
+   bench_sample(&(e));
+   /* The last latency recorded by each thread is kept */
+   bench_sleep_ms(10);
+
+   secs = (e.ns - b.ns) / 1e9;
+   cpu_monitor = (100.0 * (e.monitor.cpu_ns - b.monitor.cpu_ns)) / (e.ns - b.ns);
+   cpu_audio = (100.0 * (e.audio.cpu_ns - b.audio.cpu_ns)) / (e.ns - b.ns);
+   cpu_callbacks = (100.0 * (e.callbacks_ns - b.callbacks_ns)) / (e.ns - b.ns);
+   bench_percentiles(capture, sizeof(capture), &(bench.capture));
+   bench_percentiles(playback, sizeof(playback), &(bench.playback));
+   printf("%5lu %-5s %8.3f %7.3f %7.3f %7.3f %8.1f %8.1f %8.1f  %s  %s %6lu %6lu %6lu\n",
+      (unsigned long)(lines), phase,
+      (cpu_monitor + cpu_audio + cpu_callbacks) / lines,
+      cpu_monitor, cpu_audio, cpu_callbacks,
+      (e.monitor.switches - b.monitor.switches) / secs,
+      (e.audio.switches - b.audio.switches) / secs,
+      (e.frames_read - b.frames_read) / secs,
+      capture, playback,
+      (e.stats.capture_xruns - b.stats.capture_xruns) + (e.stats.playback_xruns - b.stats.playback_xruns),
+      e.stats.concealed - b.stats.concealed,
+      (e.stats.capture_dropped - b.stats.capture_dropped) + (e.stats.playback_dropped - b.stats.playback_dropped));
+   fflush(stdout);
+}
+
+/* Waits at most timeout_ms for count channels to exist */
+static bool bench_wait_channels(int count, unsigned int timeout_ms)
+{
+   unsigned int waited = 0;
+
+   while (ast_stub_channel_count() != count) {
+      if (waited >= timeout_ms) {
+         return (false);
+      }
+      bench_sleep_ms(10);
+      waited += 10;
+   }
+   return (true);
+}
+
+/*
+ * Runs
+ */
+
+static void bench_config(size_t lines, int *fd_reads)
+{
+   size_t len = 64 + (lines * (1024 + sizeof(bench.extra)));
+   char *text = malloc(len);
+   size_t used;
+   size_t i;
+
+   if (NULL == text) {
+      bench_fatal("Out of memory\n");
+   }
+   used = snprintf(text, len,
+      "[general]\n"
+      "lines = %lu\n"
+      "audio_thread_priority = 0\n", (unsigned long)(lines));
+   for (i = 0; (i < lines); i += 1) {
+      used += snprintf(text + used, len - used,
+         "[line%lu]\n"
+         "enable = 1\n"
+         "context = bench-%lu\n"
+         "snd_capture_device = %s\n"
+         "snd_playback_device = %s\n"
+         "event_input_device = /proc/self/fd/%d\n"
+         "monitor_dialing = 1\n"
+         "search_extension_trigger = #\n"
+         "dialing_timeout_1st_digit = 3600000\n"
+         "max_rate = %u\n"
+         "period_ms = %u\n"
+         "snd_access = %s\n"
+         "%s",
+         (unsigned long)(i + 1), (unsigned long)(i + 1),
+         bench.device, bench.device, fd_reads[i], bench.rate, bench.period_ms,
+         bench.mmap ? "mmap" : "rw", bench.extra);
+   }
+   ast_stub_set_config(alsa_input_cfg_file, text);
+   free(text);
+}
+
+static void bench_run(size_t lines)
+{
+   int fd_reads[BENCH_MAX_LINES];
+   size_t i;
+
+   for (i = 0; (i < lines); i += 1) {
+      int fds[2];
+      if (pipe2(fds, O_CLOEXEC)) {
+         bench_fatal("pipe2() failed: %s\n", strerror(errno));
+      }
+      fd_reads[i] = fds[0];
+      bench.fd_keys[i] = fds[1];
+   }
+   bench_config(lines, fd_reads);
+   if (AST_MODULE_LOAD_SUCCESS != load_module()) {
+      bench_fatal("load_module() failed with %lu lines\n", (unsigned long)(lines));
+   }
+   /* The monitor has opened the pipes as event devices */
+   for (i = 0; (i < lines); i += 1) {
+      close(fd_reads[i]);
+   }
+
+   bench_measure("idle", lines);
+
+   bench_press_all(lines, KEY_ENTER);
+   bench_measure("tone", lines);
+
+   bench_dial_all(lines, BENCH_EXTENSION "#");
+   if (!bench_wait_channels(lines, 5000)) {
+      bench_fatal("Only %d calls of %lu started\n", ast_stub_channel_count(), (unsigned long)(lines));
+   }
+   bench_measure("talk", lines);
+
+   bench_press_all(lines, KEY_ESC);
+   if (!bench_wait_channels(0, 5000)) {
+      bench_fatal("%d calls not hung up\n", ast_stub_channel_count());
+   }
+   if (unload_module()) {
+      bench_fatal("unload_module() failed\n");
+   }
+   for (i = 0; (i < lines); i += 1) {
+      close(bench.fd_keys[i]);
+   }
+   if ((0 != ast_stub_module_refs()) || (0 != snd_stub_open_count())) {
+      bench_fatal("%d module references and %d sound devices left after unload\n",
+         ast_stub_module_refs(), snd_stub_open_count());
+   }
+}
+
+static void bench_usage(void)
+{
+   fprintf(stderr,
+      "Usage: bench_alsa_input [options]\n"
+      "  -l lines      numbers of lines, comma separated (default 1,2,4,8,16,32,64)\n"
+      "  -d ms         duration of each phase measured (default 5000)\n"
+      "  -w ms         warm up before each phase (default 1000)\n"
+      "  -r rate       rate of the lines : max_rate (default 8000)\n"
+      "  -p ms         period_ms (default 20)\n"
+      "  -D device     sound device, 'name:rate' for a device supporting only\n"
+      "                this rate (default 'bench')\n"
+      "  -m            mmap access to the sound devices\n"
+      "  -o name=value parameter added to each line (e.g. -o noise_suppress=yes)\n"
+      "  -v            log the warnings of the driver (-vv : notices, -vvv : all)\n");
+   exit(2);
+}
+
+static void bench_options(int argc, char *argv[])
+{
+   const char *lines = "1,2,4,8,16,32,64";
+   int opt;
+
+   bench.duration_ms = 5000;
+   bench.warmup_ms = 1000;
+   bench.rate = 8000;
+   bench.period_ms = 20;
+   bench.device = "bench";
+   ast_stub_log_level = AST_LOG_ERROR;
+   while (-1 != (opt = getopt(argc, argv, "l:d:w:r:p:D:mo:vh"))) {
+      switch (opt) {
+         case 'l': {
+            lines = optarg;
+            break;
+         }
+         case 'd': {
+            bench.duration_ms = strtoul(optarg, NULL, 10);
+            break;
+         }
+         case 'w': {
+            bench.warmup_ms = strtoul(optarg, NULL, 10);
+            break;
+         }
+         case 'r': {
+            bench.rate = strtoul(optarg, NULL, 10);
+            break;
+         }
+         case 'p': {
+            bench.period_ms = strtoul(optarg, NULL, 10);
+            break;
+         }
+         case 'D': {
+            bench.device = optarg;
+            break;
+         }
+         case 'm': {
+            bench.mmap = true;
+            break;
+         }
+         case 'o': {
+            size_t used = strlen(bench.extra);
+            snprintf(bench.extra + used, sizeof(bench.extra) - used, "%s\n", optarg);
+            break;
+         }
+         case 'v': {
+            if (ast_stub_log_level > AST_LOG_DEBUG) {
+               ast_stub_log_level -= 1;
+            }
+            break;
+         }
+         default: {
+            bench_usage();
+            break;
+         }
+      }
+   }
+   if ((optind != argc) || (0 == bench.duration_ms)
+       || ((8000 != bench.rate) && (16000 != bench.rate) && (48000 != bench.rate))) {
+      bench_usage();
+   }
+   for (;;) {
+      char *end;
+      unsigned long n = strtoul(lines, &(end), 10);
+      if ((0 == n) || (n > BENCH_MAX_LINES) || (bench.lines_count >= ARRAY_LEN(bench.lines))) {
+         bench_usage();
+      }
+      bench.lines[bench.lines_count++] = n;
+      if ('\0' == *end) {
+         break;
+      }
+      if (',' != *end) {
+         bench_usage();
+      }
+      lines = end + 1;
+   }
+}
+
+int main(int argc, char *argv[])
+{
+   struct epoll_event ev;
+   uint64_t val = 1;
+   size_t i;
+
+   bench_options(argc, argv);
+
+   bench.capture.values = malloc(BENCH_MAX_SAMPLES * sizeof(uint32_t));
+   bench.playback.values = malloc(BENCH_MAX_SAMPLES * sizeof(uint32_t));
+   bench.core_epfd = epoll_create1(EPOLL_CLOEXEC);
+   bench.core_fd_stop = eventfd(0, EFD_CLOEXEC);
+   if ((NULL == bench.capture.values) || (NULL == bench.playback.values)
+       || (bench.core_epfd < 0) || (bench.core_fd_stop < 0)) {
+      bench_fatal("Unable to initialize\n");
+   }
+   memset(&(ev), 0, sizeof(ev));
+   ev.events = EPOLLIN;
+   ev.data.ptr = NULL;
+   epoll_ctl(bench.core_epfd, EPOLL_CTL_ADD, bench.core_fd_stop, &(ev));
+   if (pthread_create(&(bench.core_thread), NULL, bench_core, NULL)) {
+      bench_fatal("Unable to create the core thread\n");
+   }
+
+   ast_stub_hooks.pbx_start = bench_pbx_start;
+   ast_stub_hooks.exists_extension = bench_exists_extension;
+   ast_stub_hooks.canmatch_extension = bench_canmatch_extension;
+   snd_stub_played = bench_played;
+
+   printf("# rate %u Hz, period %u ms, device '%s', %s access, %u ms per phase\n",
+      bench.rate, bench.period_ms, bench.device, bench.mmap ? "mmap" : "rw", bench.duration_ms);
+   printf("# cpu: %% of a core (per line, monitor thread, audio thread, read()/write() callbacks)\n");
+   printf("# wake/s: wakeups per second of the monitor and audio threads, frm/s: frames read per second\n");
+   printf("# latency in ms (p50 p90 p99 max), capture: device to read(), playback: write() to device\n");
+   printf("%5s %-5s %8s %7s %7s %7s %8s %8s %8s  %-27s  %-27s %6s %6s %6s\n",
+      "lines", "phase", "cpu/line", "monitor", "audio", "cb",
+      "wake/mon", "wake/aud", "frm/s", "capture", "playback", "xruns", "plc", "drop");
+   for (i = 0; (i < bench.lines_count); i += 1) {
+      bench_run(bench.lines[i]);
+   }
+
+   if (write(bench.core_fd_stop, &(val), sizeof(val)) > 0) {
+      pthread_join(bench.core_thread, NULL);
+   }
+   return (0);
+}
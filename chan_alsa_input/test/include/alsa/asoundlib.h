@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2015
+ * Gilles Mazoyer <mazoyer.gilles@omega.ovh>
+ *
+ * This is free software, licensed under the GNU General Public License v2.
+ * See /LICENSE for more information.
+ */
+
+/*
+ Subset of the PCM API of alsa-lib used by chan_alsa_input.c, implemented by
+ snd_stub.c with sound devices paced by the clock of the system (see there).
+ Names, prototypes and values are the ones of alsa-lib.
+*/
+
+#ifndef SND_STUB_ASOUNDLIB_H
+#define SND_STUB_ASOUNDLIB_H
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef struct _snd_pcm snd_pcm_t;
+typedef struct _snd_pcm_hw_params snd_pcm_hw_params_t;
+typedef struct _snd_pcm_sw_params snd_pcm_sw_params_t;
+typedef unsigned long snd_pcm_uframes_t;
+typedef long snd_pcm_sframes_t;
+
+typedef enum _snd_pcm_stream {
+   SND_PCM_STREAM_PLAYBACK = 0,
+   SND_PCM_STREAM_CAPTURE,
+} snd_pcm_stream_t;
+
+typedef enum _snd_pcm_access {
+   SND_PCM_ACCESS_MMAP_INTERLEAVED = 0,
+   SND_PCM_ACCESS_MMAP_NONINTERLEAVED,
+   SND_PCM_ACCESS_MMAP_COMPLEX,
+   SND_PCM_ACCESS_RW_INTERLEAVED,
+   SND_PCM_ACCESS_RW_NONINTERLEAVED,
+} snd_pcm_access_t;
+
+typedef enum _snd_pcm_format {
+   SND_PCM_FORMAT_S16_LE = 2,
+   SND_PCM_FORMAT_S16_BE = 3,
+} snd_pcm_format_t;
+
+typedef enum _snd_pcm_state {
+   SND_PCM_STATE_OPEN = 0,
+   SND_PCM_STATE_SETUP,
+   SND_PCM_STATE_PREPARED,
+   SND_PCM_STATE_RUNNING,
+   SND_PCM_STATE_XRUN,
+   SND_PCM_STATE_DRAINING,
+   SND_PCM_STATE_PAUSED,
+   SND_PCM_STATE_SUSPENDED,
+   SND_PCM_STATE_DISCONNECTED,
+} snd_pcm_state_t;
+
+typedef struct _snd_pcm_channel_area {
+   void *addr;
+   unsigned int first;
+   unsigned int step;
+} snd_pcm_channel_area_t;
+
+#define SND_PCM_NONBLOCK 0x00000001
+
+const char *snd_strerror(int errnum);
+
+int snd_card_get_index(const char *name);
+
+int snd_pcm_open(snd_pcm_t **pcm, const char *name, snd_pcm_stream_t stream, int mode);
+int snd_pcm_close(snd_pcm_t *pcm);
+
+int snd_pcm_hw_params_malloc(snd_pcm_hw_params_t **ptr);
+void snd_pcm_hw_params_free(snd_pcm_hw_params_t *obj);
+int snd_pcm_hw_params_any(snd_pcm_t *pcm, snd_pcm_hw_params_t *params);
+int snd_pcm_hw_params_set_access(snd_pcm_t *pcm, snd_pcm_hw_params_t *params, snd_pcm_access_t access);
+int snd_pcm_hw_params_set_format(snd_pcm_t *pcm, snd_pcm_hw_params_t *params, snd_pcm_format_t val);
+int snd_pcm_hw_params_set_channels(snd_pcm_t *pcm, snd_pcm_hw_params_t *params, unsigned int val);
+int snd_pcm_hw_params_set_channels_near(snd_pcm_t *pcm, snd_pcm_hw_params_t *params, unsigned int *val);
+int snd_pcm_hw_params_test_rate(snd_pcm_t *pcm, snd_pcm_hw_params_t *params, unsigned int val, int dir);
+int snd_pcm_hw_params_set_rate(snd_pcm_t *pcm, snd_pcm_hw_params_t *params, unsigned int val, int dir);
+int snd_pcm_hw_params_set_rate_near(snd_pcm_t *pcm, snd_pcm_hw_params_t *params, unsigned int *val, int *dir);
+int snd_pcm_hw_params_set_period_size_near(snd_pcm_t *pcm, snd_pcm_hw_params_t *params, snd_pcm_uframes_t *val, int *dir);
+int snd_pcm_hw_params_set_buffer_size_near(snd_pcm_t *pcm, snd_pcm_hw_params_t *params, snd_pcm_uframes_t *val);
+int snd_pcm_hw_params(snd_pcm_t *pcm, snd_pcm_hw_params_t *params);
+
+int snd_pcm_sw_params_malloc(snd_pcm_sw_params_t **ptr);
+void snd_pcm_sw_params_free(snd_pcm_sw_params_t *obj);
+int snd_pcm_sw_params_current(snd_pcm_t *pcm, snd_pcm_sw_params_t *params);
+int snd_pcm_sw_params_set_start_threshold(snd_pcm_t *pcm, snd_pcm_sw_params_t *params, snd_pcm_uframes_t val);
+int snd_pcm_sw_params_set_stop_threshold(snd_pcm_t *pcm, snd_pcm_sw_params_t *params, snd_pcm_uframes_t val);
+int snd_pcm_sw_params_set_avail_min(snd_pcm_t *pcm, snd_pcm_sw_params_t *params, snd_pcm_uframes_t val);
+int snd_pcm_sw_params(snd_pcm_t *pcm, snd_pcm_sw_params_t *params);
+
+int snd_pcm_poll_descriptors_count(snd_pcm_t *pcm);
+int snd_pcm_poll_descriptors(snd_pcm_t *pcm, struct pollfd *pfds, unsigned int space);
+int snd_pcm_poll_descriptors_revents(snd_pcm_t *pcm, struct pollfd *pfds, unsigned int nfds, unsigned short *revents);
+
+int snd_pcm_prepare(snd_pcm_t *pcm);
+int snd_pcm_start(snd_pcm_t *pcm);
+int snd_pcm_drop(snd_pcm_t *pcm);
+int snd_pcm_recover(snd_pcm_t *pcm, int err, int silent);
+int snd_pcm_resume(snd_pcm_t *pcm);
+snd_pcm_state_t snd_pcm_state(snd_pcm_t *pcm);
+int snd_pcm_delay(snd_pcm_t *pcm, snd_pcm_sframes_t *delayp);
+snd_pcm_sframes_t snd_pcm_avail_update(snd_pcm_t *pcm);
+snd_pcm_sframes_t snd_pcm_readi(snd_pcm_t *pcm, void *buffer, snd_pcm_uframes_t size);
+snd_pcm_sframes_t snd_pcm_writei(snd_pcm_t *pcm, const void *buffer, snd_pcm_uframes_t size);
+int snd_pcm_mmap_begin(snd_pcm_t *pcm, const snd_pcm_channel_area_t **areas,
+   snd_pcm_uframes_t *offset, snd_pcm_uframes_t *frames);
+snd_pcm_sframes_t snd_pcm_mmap_commit(snd_pcm_t *pcm, snd_pcm_uframes_t offset, snd_pcm_uframes_t frames);
+
+#endif /* SND_STUB_ASOUNDLIB_H */
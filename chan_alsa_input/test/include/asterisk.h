@@ -0,0 +1,520 @@
+/*
+ * Copyright (C) 2015
+ * Gilles Mazoyer <mazoyer.gilles@omega.ovh>
+ *
+ * This is free software, licensed under the GNU General Public License v2.
+ * See /LICENSE for more information.
+ */
+
+/*
+ Minimal subset of the API of Asterisk 13 used by chan_alsa_input.c, so that
+ the channel driver can be built and run without Asterisk (see ast_stub.c).
+ Only the declarations the driver needs are here, with the same names and
+ prototypes as Asterisk : the headers <asterisk/...> all include this one.
+*/
+
+#ifndef AST_STUB_ASTERISK_H
+#define AST_STUB_ASTERISK_H
+
+#define _GNU_SOURCE 1
+
+#include <alloca.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define ASTERISK_FILE_VERSION(file, version)
+
+#ifndef ARRAY_LEN
+#define ARRAY_LEN(a) (size_t)(sizeof(a) / sizeof(0[a]))
+#endif
+
+/* logger.h */
+#define AST_LOG_DEBUG   0
+#define AST_LOG_VERBOSE 1
+#define AST_LOG_NOTICE  2
+#define AST_LOG_WARNING 3
+#define AST_LOG_ERROR   4
+
+void ast_log(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void ast_verbose(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+#define ast_verb(level, ...) ast_verbose(__VA_ARGS__)
+
+/* utils.h, strings.h */
+#define ast_malloc(len) malloc(len)
+#define ast_calloc(num, len) calloc(num, len)
+#define ast_realloc(p, len) realloc(p, len)
+#define ast_strdup(s) (((s) != NULL) ? strdup(s) : NULL)
+#define ast_strdupa(s) strdupa(s)
+#define ast_free(p) free(p)
+
+int ast_pthread_create_background(pthread_t *thread, pthread_attr_t *attr,
+   void *(*start_routine)(void *), void *data);
+
+static inline int ast_strlen_zero(const char *s)
+{
+   return ((NULL == s) || ('\0' == *s));
+}
+
+void ast_copy_string(char *dst, const char *src, size_t size);
+char *ast_strip(char *s);
+int ast_true(const char *val);
+int ast_false(const char *val);
+
+struct ast_str {
+   size_t len;
+   char str[];
+};
+
+#define ast_str_alloca(init_len) \
+   ({ \
+      struct ast_str *__ast_str_buf = alloca(sizeof(struct ast_str) + (init_len)); \
+      __ast_str_buf->len = (init_len); \
+      __ast_str_buf->str[0] = '\0'; \
+      __ast_str_buf; \
+   })
+
+/* lock.h */
+typedef pthread_mutex_t ast_mutex_t;
+#define ast_mutex_init(m) pthread_mutex_init(m, NULL)
+#define ast_mutex_destroy(m) pthread_mutex_destroy(m)
+#define ast_mutex_lock(m) pthread_mutex_lock(m)
+#define ast_mutex_unlock(m) pthread_mutex_unlock(m)
+
+#define AST_PTHREADT_NULL (pthread_t) -1
+#define AST_PTHREADT_STOP (pthread_t) -2
+
+/* linkedlists.h */
+#define AST_LIST_HEAD_NOLOCK(name, type) \
+struct name { \
+   struct type *first; \
+   struct type *last; \
+}
+#define AST_LIST_ENTRY(type) \
+struct { \
+   struct type *next; \
+}
+#define AST_LIST_FIRST(head) ((head)->first)
+#define AST_LIST_NEXT(elm, field) ((elm)->field.next)
+#define AST_LIST_EMPTY(head) (AST_LIST_FIRST(head) == NULL)
+#define AST_LIST_TRAVERSE(head, var, field) \
+   for ((var) = (head)->first; (var); (var) = (var)->field.next)
+#define AST_LIST_INSERT_TAIL(head, elm, field) do { \
+   if (!(head)->first) { \
+      (head)->first = (elm); \
+      (head)->last = (elm); \
+   } \
+   else { \
+      (head)->last->field.next = (elm); \
+      (head)->last = (elm); \
+   } \
+} while (0)
+
+/* astobj2.h : objects allocated by the stub are reference counted */
+void ao2_ref(void *obj, int delta);
+
+/* time.h */
+static inline struct timeval ast_tv(time_t sec, suseconds_t usec)
+{
+   struct timeval t;
+   t.tv_sec = sec;
+   t.tv_usec = usec;
+   return (t);
+}
+
+/* format.h, format_cache.h, format_cap.h */
+struct ast_format;
+struct ast_format_cap;
+
+enum ast_media_type {
+   AST_MEDIA_TYPE_UNKNOWN = 0,
+   AST_MEDIA_TYPE_AUDIO,
+};
+
+enum ast_format_cmp_res {
+   AST_FORMAT_CMP_EQUAL = 0,
+   AST_FORMAT_CMP_NOT_EQUAL,
+   AST_FORMAT_CMP_SUBSET,
+};
+
+enum ast_format_cap_flags {
+   AST_FORMAT_CAP_FLAG_DEFAULT = 0,
+};
+
+extern struct ast_format *ast_format_slin;
+extern struct ast_format *ast_format_slin16;
+extern struct ast_format *ast_format_slin48;
+
+const char *ast_format_get_name(const struct ast_format *format);
+unsigned int ast_format_get_sample_rate(const struct ast_format *format);
+enum ast_format_cmp_res ast_format_cmp(const struct ast_format *format1,
+   const struct ast_format *format2);
+struct ast_format_cap *ast_format_cap_alloc(enum ast_format_cap_flags flags);
+int ast_format_cap_append(struct ast_format_cap *cap, struct ast_format *format,
+   unsigned int framing);
+void ast_format_cap_remove_by_type(struct ast_format_cap *cap, enum ast_media_type type);
+int ast_format_cap_iscompatible(const struct ast_format_cap *cap1,
+   const struct ast_format_cap *cap2);
+const char *ast_format_cap_get_names(struct ast_format_cap *cap, struct ast_str **buf);
+
+/* frame.h */
+#define AST_FRIENDLY_OFFSET 64
+
+enum ast_frame_type {
+   AST_FRAME_DTMF_END = 1,
+   AST_FRAME_VOICE,
+   AST_FRAME_VIDEO,
+   AST_FRAME_CONTROL,
+   AST_FRAME_NULL,
+   AST_FRAME_IAX,
+   AST_FRAME_TEXT,
+   AST_FRAME_IMAGE,
+   AST_FRAME_HTML,
+   AST_FRAME_CNG,
+   AST_FRAME_MODEM,
+   AST_FRAME_DTMF_BEGIN,
+};
+#define AST_FRAME_DTMF AST_FRAME_DTMF_END
+
+enum ast_control_frame_type {
+   AST_CONTROL_HANGUP = 1,
+   AST_CONTROL_RING = 2,
+   AST_CONTROL_RINGING = 3,
+   AST_CONTROL_ANSWER = 4,
+   AST_CONTROL_BUSY = 5,
+   AST_CONTROL_TAKEOFFHOOK = 6,
+   AST_CONTROL_OFFHOOK = 7,
+   AST_CONTROL_CONGESTION = 8,
+   AST_CONTROL_FLASH = 9,
+   AST_CONTROL_WINK = 10,
+   AST_CONTROL_OPTION = 11,
+   AST_CONTROL_RADIO_KEY = 12,
+   AST_CONTROL_RADIO_UNKEY = 13,
+   AST_CONTROL_PROGRESS = 14,
+   AST_CONTROL_PROCEEDING = 15,
+   AST_CONTROL_HOLD = 16,
+   AST_CONTROL_UNHOLD = 17,
+   AST_CONTROL_VIDUPDATE = 18,
+   AST_CONTROL_T38 = 19,
+   AST_CONTROL_SRCUPDATE = 20,
+   AST_CONTROL_INCOMPLETE = 33,
+   AST_CONTROL_PVT_CAUSE_CODE = 36,
+};
+
+struct ast_frame_subclass {
+   int integer;
+   struct ast_format *format;
+};
+
+struct ast_frame {
+   enum ast_frame_type frametype;
+   struct ast_frame_subclass subclass;
+   int datalen;
+   int samples;
+   int mallocd;
+   size_t mallocd_hdr_len;
+   int offset;
+   const char *src;
+   union {
+      void *ptr;
+      uint32_t uint32;
+      char pad[8];
+   } data;
+   struct timeval delivery;
+   long ts;
+   long len;
+   int seqno;
+};
+
+extern struct ast_frame ast_null_frame;
+
+void ast_frfree(struct ast_frame *frame);
+
+/* channel.h */
+#define AST_MAX_EXTENSION 80
+#define AST_MAX_CONTEXT 80
+#define MAX_LANGUAGE 40
+#define MAX_MUSICCLASS 80
+
+enum ast_channel_state {
+   AST_STATE_DOWN,
+   AST_STATE_RESERVED,
+   AST_STATE_OFFHOOK,
+   AST_STATE_DIALING,
+   AST_STATE_RING,
+   AST_STATE_RINGING,
+   AST_STATE_UP,
+   AST_STATE_BUSY,
+   AST_STATE_DIALING_OFFHOOK,
+   AST_STATE_PRERING,
+};
+
+#define AST_AMA_NONE 0
+
+struct ast_party_name {
+   char *str;
+   int valid;
+};
+
+struct ast_party_number {
+   char *str;
+   int valid;
+};
+
+struct ast_party_id {
+   struct ast_party_name name;
+   struct ast_party_number number;
+};
+
+struct ast_party_caller {
+   struct ast_party_id id;
+   struct ast_party_id ani;
+};
+
+struct ast_party_connected_line {
+   struct ast_party_id id;
+};
+
+struct ast_channel;
+
+struct ast_assigned_ids {
+   const char *uniqueid;
+   const char *uniqueid2;
+};
+
+struct ast_channel_tech {
+   const char * const type;
+   const char * const description;
+   struct ast_format_cap *capabilities;
+   int properties;
+   struct ast_channel *(* const requester)(const char *type, struct ast_format_cap *cap,
+      const struct ast_assigned_ids *assignedids, const struct ast_channel *requestor,
+      const char *addr, int *cause);
+   int (* const send_digit_begin)(struct ast_channel *chan, char digit);
+   int (* const send_digit_end)(struct ast_channel *chan, char digit, unsigned int duration);
+   int (* const call)(struct ast_channel *chan, const char *addr, int timeout);
+   int (* const hangup)(struct ast_channel *chan);
+   int (* const answer)(struct ast_channel *chan);
+   struct ast_frame *(* const read)(struct ast_channel *chan);
+   int (* const write)(struct ast_channel *chan, struct ast_frame *frame);
+   int (* const indicate)(struct ast_channel *c, int condition, const void *data, size_t datalen);
+   int (* const fixup)(struct ast_channel *oldchan, struct ast_channel *newchan);
+};
+
+struct ast_channel *ast_channel_alloc(int needqueue, int state, const char *cid_num,
+   const char *cid_name, const char *acctcode, const char *exten, const char *context,
+   const struct ast_assigned_ids *assignedids, const struct ast_channel *requestor,
+   int amaflag, const char *name_fmt, ...) __attribute__((format(printf, 11, 12)));
+int ast_channel_lock(struct ast_channel *chan);
+int ast_channel_trylock(struct ast_channel *chan);
+int ast_channel_unlock(struct ast_channel *chan);
+
+const char *ast_channel_name(const struct ast_channel *chan);
+enum ast_channel_state ast_channel_state(const struct ast_channel *chan);
+const char *ast_channel_linkedid(const struct ast_channel *chan);
+struct ast_party_caller *ast_channel_caller(struct ast_channel *chan);
+struct ast_party_connected_line *ast_channel_connected(struct ast_channel *chan);
+const struct ast_channel_tech *ast_channel_tech(const struct ast_channel *chan);
+void ast_channel_tech_set(struct ast_channel *chan, const struct ast_channel_tech *value);
+void *ast_channel_tech_pvt(const struct ast_channel *chan);
+void ast_channel_tech_pvt_set(struct ast_channel *chan, void *value);
+void ast_channel_nativeformats_set(struct ast_channel *chan, struct ast_format_cap *value);
+struct ast_format *ast_channel_rawreadformat(struct ast_channel *chan);
+void ast_channel_set_rawreadformat(struct ast_channel *chan, struct ast_format *format);
+void ast_channel_set_rawwriteformat(struct ast_channel *chan, struct ast_format *format);
+void ast_channel_set_readformat(struct ast_channel *chan, struct ast_format *format);
+void ast_channel_set_writeformat(struct ast_channel *chan, struct ast_format *format);
+void ast_channel_context_set(struct ast_channel *chan, const char *value);
+const char *ast_channel_exten(const struct ast_channel *chan);
+void ast_channel_exten_set(struct ast_channel *chan, const char *value);
+void ast_channel_language_set(struct ast_channel *chan, const char *value);
+void ast_channel_rings_set(struct ast_channel *chan, int value);
+void ast_channel_set_fd(struct ast_channel *chan, int which, int fd);
+
+int ast_channel_register(const struct ast_channel_tech *tech);
+void ast_channel_unregister(const struct ast_channel_tech *tech);
+
+int ast_queue_frame(struct ast_channel *chan, struct ast_frame *frame);
+int ast_queue_control(struct ast_channel *chan, enum ast_control_frame_type control);
+int ast_queue_hangup(struct ast_channel *chan);
+int ast_setstate(struct ast_channel *chan, enum ast_channel_state state);
+void ast_hangup(struct ast_channel *chan);
+
+/* causes.h */
+#define AST_CAUSE_BUSY 17
+#define AST_CAUSE_CHANNEL_UNACCEPTABLE 6
+
+/* abstract_jb.h */
+#define AST_JB_IMPL_NAME_SIZE 12
+
+struct ast_jb_conf {
+   unsigned int flags;
+   long max_size;
+   long resync_threshold;
+   char impl[AST_JB_IMPL_NAME_SIZE];
+   long target_extra;
+};
+
+int ast_jb_read_conf(struct ast_jb_conf *conf, const char *varname, const char *value);
+void ast_jb_configure(struct ast_channel *chan, const struct ast_jb_conf *conf);
+
+/* callerid.h */
+int ast_callerid_split(const char *src, char *name, int namelen, char *num, int numlen);
+
+/* pbx.h */
+int ast_pbx_start(struct ast_channel *chan);
+int ast_exists_extension(struct ast_channel *chan, const char *context,
+   const char *exten, int priority, const char *callerid);
+int ast_canmatch_extension(struct ast_channel *chan, const char *context,
+   const char *exten, int priority, const char *callerid);
+
+/* musiconhold.h */
+int ast_moh_start(struct ast_channel *chan, const char *mclass, const char *interpclass);
+void ast_moh_stop(struct ast_channel *chan);
+
+/* indications.h : no zone is known, the driver uses its built-in tones */
+struct ast_tone_zone {
+   char country[16];
+   char description[40];
+};
+
+struct ast_tone_zone_sound {
+   const char *name;
+   const char *data;
+};
+
+struct ast_tone_zone_part {
+   unsigned int freq1;
+   unsigned int freq2;
+   unsigned int time;
+   unsigned int modulate:1;
+   unsigned int midinote:1;
+};
+
+struct ast_tone_zone *ast_get_indication_zone(const char *country);
+struct ast_tone_zone_sound *ast_get_indication_tone(const struct ast_tone_zone *zone,
+   const char *indication);
+int ast_tone_zone_part_parse(const char *s, struct ast_tone_zone_part *tone_data);
+#define ast_tone_zone_unref(zone) ((struct ast_tone_zone *)(NULL))
+#define ast_tone_zone_sound_unref(ts) ((struct ast_tone_zone_sound *)(NULL))
+
+/* cli.h */
+#define CLI_SUCCESS (char *)"0"
+#define CLI_SHOWUSAGE (char *)"1"
+#define CLI_FAILURE (char *)"2"
+
+enum ast_cli_command {
+   CLI_INIT = -2,
+   CLI_GENERATE = -3,
+   CLI_HANDLER = -4,
+};
+
+struct ast_cli_args {
+   const int fd;
+   const int argc;
+   const char * const *argv;
+   const char *line;
+   const char *word;
+   const int pos;
+   int n;
+};
+
+struct ast_cli_entry {
+   const char * const cmda[16];
+   const char * const summary;
+   const char * usage;
+   char *(*handler)(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a);
+   const char *command;
+};
+
+#define AST_CLI_DEFINE(fn, txt, ...) { .handler = fn, .summary = txt, ## __VA_ARGS__ }
+
+void ast_cli(int fd, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+int ast_cli_register_multiple(struct ast_cli_entry *e, int len);
+int ast_cli_unregister_multiple(struct ast_cli_entry *e, int len);
+
+/* config.h */
+struct ast_config;
+
+struct ast_variable {
+   const char *name;
+   const char *value;
+   struct ast_variable *next;
+};
+
+struct ast_flags {
+   unsigned int flags;
+};
+
+#define CONFIG_STATUS_FILEMISSING (void *)0
+#define CONFIG_STATUS_FILEUNCHANGED (void *)-1
+#define CONFIG_STATUS_FILEINVALID (void *)-2
+#define CONFIG_FLAG_FILEUNCHANGED (1 << 1)
+
+struct ast_config *ast_config_load2(const char *filename, const char *who_asked,
+   struct ast_flags flags);
+struct ast_variable *ast_variable_browse(const struct ast_config *config, const char *category);
+void ast_config_destroy(struct ast_config *config);
+
+/* manager.h */
+#define EVENT_FLAG_SYSTEM (1 << 0)
+#define EVENT_FLAG_CALL (1 << 1)
+#define EVENT_FLAG_REPORTING (1 << 9)
+
+void manager_event(int category, const char *event, const char *fmt, ...)
+   __attribute__((format(printf, 3, 4)));
+
+/* module.h */
+enum ast_module_load_result {
+   AST_MODULE_LOAD_SUCCESS = 0,
+   AST_MODULE_LOAD_DECLINE = 1,
+   AST_MODULE_LOAD_SKIP = 2,
+   AST_MODULE_LOAD_PRIORITY = 3,
+   AST_MODULE_LOAD_FAILURE = -1,
+};
+
+#define ASTERISK_GPL_KEY "This paragraph is copyright (c) 2006 by Digium, Inc."
+#define AST_MODFLAG_LOAD_ORDER (1 << 1)
+#define AST_MODPRI_CHANNEL_DRIVER 5
+
+struct ast_module;
+
+struct ast_module_info {
+   struct ast_module *self;
+   int (*load)(void);
+   int (*reload)(void);
+   int (*unload)(void);
+   const char *name;
+   const char *description;
+   const char *key;
+   unsigned int flags;
+   int load_pri;
+};
+
+void ast_module_ref(struct ast_module *mod);
+void ast_module_unref(struct ast_module *mod);
+
+/*
+ As in Asterisk, the module defines its information (and the harness finds
+ load() and unload() there)
+*/
+static const __attribute__((unused)) struct ast_module_info *ast_module_info;
+
+#define AST_MODULE_INFO(keystr, flags_to_set, desc, fields...) \
+   static struct ast_module_info __mod_info = { \
+      .name = "chan_alsa_input", \
+      .description = desc, \
+      .key = keystr, \
+      .flags = flags_to_set, \
+      fields \
+   }; \
+   static const __attribute__((unused)) struct ast_module_info *ast_module_info = &(__mod_info);
+
+#endif /* AST_STUB_ASTERISK_H */
@@ -0,0 +1,2 @@
+/* See <asterisk.h> */
+#include <asterisk.h>
@@ -0,0 +1,931 @@
+/*
+ * Copyright (C) 2015
+ * Gilles Mazoyer <mazoyer.gilles@omega.ovh>
+ *
+ * This is free software, licensed under the GNU General Public License v2.
+ * See /LICENSE for more information.
+ */
+
+/*
+ Sound devices paced by the clock of the system, implementing the PCM API of
+ alsa-lib used by chan_alsa_input.c (see snd_stub.h).
+
+ The "null" and "file" plugins of alsa-lib can't stand in for a sound card
+ here : their poll descriptor is /dev/null or /dev/full (epoll refuses them)
+ and they are always ready, so the audio thread would spin instead of being
+ woken up once per period.
+
+ The poll descriptor of a device is an eventfd : readable (capture) or
+ writable (playback) when the device is ready. A single thread moves the
+ hardware pointers of the running devices at their period boundaries.
+*/
+
+#include "snd_stub.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SND_STUB_RATE_MIN 8000
+#define SND_STUB_RATE_MAX 48000
+#define SND_STUB_CHANNELS_MAX 32
+#define SND_STUB_SAMPLE_SIZE 2
+
+/* Counter of the eventfd of a playback device which isn't ready */
+#define SND_STUB_FULL 0xfffffffffffffffeULL
+
+struct _snd_pcm_hw_params {
+   snd_pcm_access_t access;
+   unsigned int channels;
+   unsigned int rate;
+   unsigned int rate_min;
+   unsigned int rate_max;
+   snd_pcm_uframes_t period_size;
+   snd_pcm_uframes_t buffer_size;
+};
+
+struct _snd_pcm_sw_params {
+   snd_pcm_uframes_t start_threshold;
+   snd_pcm_uframes_t stop_threshold;
+   snd_pcm_uframes_t avail_min;
+};
+
+struct _snd_pcm {
+   struct _snd_pcm *next;
+   pthread_mutex_t lock;
+   char *name;
+   snd_pcm_stream_t stream;
+   snd_pcm_state_t state;
+   struct _snd_pcm_hw_params hw;
+   struct _snd_pcm_sw_params sw;
+   size_t frame_bytes;
+   /* DMA area, also keeps the samples played */
+   uint8_t *buf;
+   snd_pcm_channel_area_t areas[SND_STUB_CHANNELS_MAX];
+   /* Positions since the device was prepared */
+   uint64_t hw_ptr;
+   uint64_t appl_ptr;
+   /* When the device was started, and the frame clock then */
+   uint64_t start_ns;
+   uint64_t start_frames;
+   int fd;
+   bool ready;
+};
+
+snd_stub_played_t snd_stub_played;
+
+static pthread_mutex_t snd_stub_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t snd_stub_cond;
+static pthread_once_t snd_stub_once = PTHREAD_ONCE_INIT;
+static pthread_t snd_stub_clock_thread;
+/* Devices opened, the clock thread is woken up when one is started */
+static struct _snd_pcm *snd_stub_pcms;
+static int snd_stub_pcm_count;
+static bool snd_stub_started;
+static uint64_t snd_stub_epoch_ns;
+
+static uint64_t snd_stub_now_ns(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &(ts));
+   return (((uint64_t)(ts.tv_sec) * 1000000000ULL) + (uint64_t)(ts.tv_nsec));
+}
+
+static uint64_t snd_stub_frames_at(unsigned int rate, uint64_t ns)
+{
+   return (((ns - snd_stub_epoch_ns) * rate) / 1000000000ULL);
+}
+
+static void *snd_stub_clock(void *data);
+
+static void snd_stub_init(void)
+{
+   pthread_condattr_t attr;
+
+   snd_stub_epoch_ns = snd_stub_now_ns();
+   pthread_condattr_init(&(attr));
+   pthread_condattr_setclock(&(attr), CLOCK_MONOTONIC);
+   pthread_cond_init(&(snd_stub_cond), &(attr));
+   pthread_condattr_destroy(&(attr));
+   if (pthread_create(&(snd_stub_clock_thread), NULL, snd_stub_clock, NULL)) {
+      fprintf(stderr, "snd_stub: unable to create the clock thread\n");
+      abort();
+   }
+}
+
+uint64_t snd_stub_frames(unsigned int rate)
+{
+   pthread_once(&(snd_stub_once), snd_stub_init);
+   return (snd_stub_frames_at(rate, snd_stub_now_ns()));
+}
+
+int snd_stub_open_count(void)
+{
+   int ret;
+
+   pthread_mutex_lock(&(snd_stub_lock));
+   ret = snd_stub_pcm_count;
+   pthread_mutex_unlock(&(snd_stub_lock));
+   return (ret);
+}
+
+/* Id of the card unplugged, or empty */
+static char snd_stub_unplugged[32];
+
+void snd_stub_unplug(const char *card)
+{
+   pthread_mutex_lock(&(snd_stub_lock));
+   snprintf(snd_stub_unplugged, sizeof(snd_stub_unplugged), "%s", (NULL != card) ? card : "");
+   pthread_mutex_unlock(&(snd_stub_lock));
+}
+
+/* Returns true if name is a device of the card unplugged */
+static bool snd_stub_is_unplugged(const char *name)
+{
+   const char *s = strstr(name, "CARD=");
+   size_t len;
+   bool ret;
+
+   pthread_mutex_lock(&(snd_stub_lock));
+   len = strlen(snd_stub_unplugged);
+   ret = ((NULL != s) && (len > 0) && (!strncmp(s + 5, snd_stub_unplugged, len))
+      && (('\0' == s[5 + len]) || (',' == s[5 + len])));
+   pthread_mutex_unlock(&(snd_stub_lock));
+   return (ret);
+}
+
+int snd_card_get_index(const char *name)
+{
+   bool unplugged;
+
+   pthread_mutex_lock(&(snd_stub_lock));
+   unplugged = (!strcmp(name, snd_stub_unplugged));
+   pthread_mutex_unlock(&(snd_stub_lock));
+   /* Any other card is present, as card 0 */
+   return ((unplugged) ? -ENODEV : 0);
+}
+
+const char *snd_strerror(int errnum)
+{
+   return (strerror((errnum < 0) ? -errnum : errnum));
+}
+
+/*
+ * State of a device, called with its lock held
+ */
+
+static snd_pcm_sframes_t snd_stub_avail(const snd_pcm_t *pcm)
+{
+   if (SND_PCM_STREAM_CAPTURE == pcm->stream) {
+      return ((snd_pcm_sframes_t)(pcm->hw_ptr - pcm->appl_ptr));
+   }
+   return ((snd_pcm_sframes_t)(pcm->hw.buffer_size - (pcm->appl_ptr - pcm->hw_ptr)));
+}
+
+static bool snd_stub_is_ready(const snd_pcm_t *pcm)
+{
+   switch (pcm->state) {
+      case SND_PCM_STATE_RUNNING: {
+         return (snd_stub_avail(pcm) >= (snd_pcm_sframes_t)(pcm->sw.avail_min));
+      }
+      case SND_PCM_STATE_PREPARED: {
+         /* Nothing can be captured before the device is started */
+         return ((SND_PCM_STREAM_PLAYBACK == pcm->stream)
+            && (snd_stub_avail(pcm) >= (snd_pcm_sframes_t)(pcm->sw.avail_min)));
+      }
+      default: {
+         /* POLLERR */
+         return (true);
+      }
+   }
+}
+
+/* Makes the poll descriptor follow the state of the device */
+static void snd_stub_update(snd_pcm_t *pcm)
+{
+   bool ready = snd_stub_is_ready(pcm);
+   uint64_t val;
+   ssize_t ret;
+
+   if (ready == pcm->ready) {
+      return;
+   }
+   pcm->ready = ready;
+   if (SND_PCM_STREAM_CAPTURE == pcm->stream) {
+      if (ready) {
+         val = 1;
+         ret = write(pcm->fd, &(val), sizeof(val));
+      }
+      else {
+         ret = read(pcm->fd, &(val), sizeof(val));
+      }
+   }
+   else {
+      if (ready) {
+         ret = read(pcm->fd, &(val), sizeof(val));
+      }
+      else {
+         val = SND_STUB_FULL;
+         ret = write(pcm->fd, &(val), sizeof(val));
+      }
+   }
+   if (ret < 0) {
+      fprintf(stderr, "snd_stub: eventfd of '%s' out of sync\n", pcm->name);
+   }
+}
+
+/* Samples of the stamps of the frames captured at [pos, pos + frames) */
+static void snd_stub_capture_fill(const snd_pcm_t *pcm, uint8_t *buf,
+   uint64_t pos, snd_pcm_uframes_t frames)
+{
+   int16_t *samples = (int16_t *)(buf);
+   snd_pcm_uframes_t i;
+   unsigned int c;
+
+   for (i = 0; (i < frames); i += 1) {
+      int16_t stamp = snd_stub_stamp(pcm->start_frames + pos + i);
+      for (c = 0; (c < pcm->hw.channels); c += 1) {
+         *samples++ = stamp;
+      }
+   }
+}
+
+static uint8_t *snd_stub_buf_at(const snd_pcm_t *pcm, uint64_t pos)
+{
+   return (pcm->buf + ((pos % pcm->hw.buffer_size) * pcm->frame_bytes));
+}
+
+static void snd_stub_start_locked(snd_pcm_t *pcm)
+{
+   pcm->state = SND_PCM_STATE_RUNNING;
+   pcm->start_ns = snd_stub_now_ns();
+   pcm->start_frames = snd_stub_frames_at(pcm->hw.rate, pcm->start_ns);
+   /* Pointers are null, the device has just been prepared */
+   snd_stub_update(pcm);
+}
+
+/* Wakes up the clock for a device just started */
+static void snd_stub_kick(void)
+{
+   pthread_mutex_lock(&(snd_stub_lock));
+   snd_stub_started = true;
+   pthread_cond_signal(&(snd_stub_cond));
+   pthread_mutex_unlock(&(snd_stub_lock));
+}
+
+/*
+ Moves the hardware pointer of a running device to the last period boundary
+ before now. Returns when the next boundary is, 0 if the device is stopped
+*/
+static uint64_t snd_stub_advance(snd_pcm_t *pcm, uint64_t now)
+{
+   uint64_t period_ns;
+   uint64_t periods;
+   uint64_t target;
+
+   if (SND_PCM_STATE_RUNNING != pcm->state) {
+      return (0);
+   }
+   period_ns = (pcm->hw.period_size * 1000000000ULL) / pcm->hw.rate;
+   periods = (now - pcm->start_ns) / period_ns;
+   target = periods * pcm->hw.period_size;
+   while (pcm->hw_ptr < target) {
+      uint64_t next = pcm->hw_ptr + pcm->hw.period_size;
+
+      if (SND_PCM_STREAM_CAPTURE == pcm->stream) {
+         if ((next - pcm->appl_ptr) >= pcm->sw.stop_threshold) {
+            /* Overrun */
+            pcm->state = SND_PCM_STATE_XRUN;
+            break;
+         }
+      }
+      else if (next >= pcm->appl_ptr) {
+         /* Underrun once the samples written are played */
+         if (pcm->appl_ptr > pcm->hw_ptr) {
+            if (NULL != snd_stub_played) {
+               snd_stub_played(pcm->name, pcm->hw.rate,
+                  *(const int16_t *)(snd_stub_buf_at(pcm, pcm->hw_ptr)),
+                  *(const int16_t *)(snd_stub_buf_at(pcm, pcm->appl_ptr - 1)));
+            }
+            pcm->hw_ptr = pcm->appl_ptr;
+         }
+         pcm->state = SND_PCM_STATE_XRUN;
+         break;
+      }
+      else if (NULL != snd_stub_played) {
+         snd_stub_played(pcm->name, pcm->hw.rate,
+            *(const int16_t *)(snd_stub_buf_at(pcm, pcm->hw_ptr)),
+            *(const int16_t *)(snd_stub_buf_at(pcm, next - 1)));
+      }
+      pcm->hw_ptr = next;
+   }
+   snd_stub_update(pcm);
+   if (SND_PCM_STATE_RUNNING != pcm->state) {
+      return (0);
+   }
+   return (pcm->start_ns + ((periods + 1) * period_ns));
+}
+
+static void *snd_stub_clock(void *data)
+{
+   pthread_mutex_lock(&(snd_stub_lock));
+   for (;;) {
+      uint64_t now = snd_stub_now_ns();
+      uint64_t wake = now + 1000000000ULL;
+      struct timespec ts;
+      snd_pcm_t *pcm;
+
+      for (pcm = snd_stub_pcms; (NULL != pcm); pcm = pcm->next) {
+         uint64_t next;
+         pthread_mutex_lock(&(pcm->lock));
+         next = snd_stub_advance(pcm, now);
+         pthread_mutex_unlock(&(pcm->lock));
+         if ((0 != next) && (next < wake)) {
+            wake = next;
+         }
+      }
+      if (snd_stub_started) {
+         snd_stub_started = false;
+         continue;
+      }
+      ts.tv_sec = wake / 1000000000ULL;
+      ts.tv_nsec = wake % 1000000000ULL;
+      pthread_cond_timedwait(&(snd_stub_cond), &(snd_stub_lock), &(ts));
+   }
+   return (NULL);
+}
+
+/*
+ * Opening and parameters
+ */
+
+int snd_pcm_open(snd_pcm_t **pcm, const char *name, snd_pcm_stream_t stream, int mode)
+{
+   snd_pcm_t *p;
+
+   pthread_once(&(snd_stub_once), snd_stub_init);
+   if (snd_stub_is_unplugged(name)) {
+      return (-ENODEV);
+   }
+   p = calloc(1, sizeof(*p));
+   if (NULL == p) {
+      return (-ENOMEM);
+   }
+   p->name = strdup(name);
+   /* The eventfd of a playback device is writable (ready) when created */
+   p->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+   if ((NULL == p->name) || (p->fd < 0)) {
+      free(p->name);
+      free(p);
+      return (-ENOMEM);
+   }
+   pthread_mutex_init(&(p->lock), NULL);
+   p->stream = stream;
+   p->state = SND_PCM_STATE_OPEN;
+   p->ready = (SND_PCM_STREAM_PLAYBACK == stream);
+   pthread_mutex_lock(&(p->lock));
+   snd_stub_update(p);
+   pthread_mutex_unlock(&(p->lock));
+
+   pthread_mutex_lock(&(snd_stub_lock));
+   p->next = snd_stub_pcms;
+   snd_stub_pcms = p;
+   snd_stub_pcm_count += 1;
+   pthread_mutex_unlock(&(snd_stub_lock));
+   *pcm = p;
+   return (0);
+}
+
+int snd_pcm_close(snd_pcm_t *pcm)
+{
+   snd_pcm_t **p;
+
+   pthread_mutex_lock(&(snd_stub_lock));
+   for (p = &(snd_stub_pcms); (NULL != *p); p = &((*p)->next)) {
+      if (*p == pcm) {
+         *p = pcm->next;
+         snd_stub_pcm_count -= 1;
+         break;
+      }
+   }
+   pthread_mutex_unlock(&(snd_stub_lock));
+   close(pcm->fd);
+   pthread_mutex_destroy(&(pcm->lock));
+   free(pcm->buf);
+   free(pcm->name);
+   free(pcm);
+   return (0);
+}
+
+int snd_pcm_hw_params_malloc(snd_pcm_hw_params_t **ptr)
+{
+   *ptr = calloc(1, sizeof(**ptr));
+   return ((NULL == *ptr) ? -ENOMEM : 0);
+}
+
+void snd_pcm_hw_params_free(snd_pcm_hw_params_t *obj)
+{
+   free(obj);
+}
+
+int snd_pcm_hw_params_any(snd_pcm_t *pcm, snd_pcm_hw_params_t *params)
+{
+   const char *rate = strchr(pcm->name, ':');
+
+   memset(params, 0, sizeof(*params));
+   params->access = SND_PCM_ACCESS_RW_INTERLEAVED;
+   params->channels = 1;
+   params->rate_min = SND_STUB_RATE_MIN;
+   params->rate_max = SND_STUB_RATE_MAX;
+   /* Only a number after ':' is a rate ("hw:CARD=id,DEV=0" isn't) */
+   if ((NULL != rate) && ('\0' != rate[1]) && (strlen(rate + 1) == strspn(rate + 1, "0123456789"))) {
+      params->rate_min = strtoul(rate + 1, NULL, 10);
+      params->rate_max = params->rate_min;
+   }
+   params->rate = params->rate_min;
+   return (0);
+}
+
+int snd_pcm_hw_params_set_access(snd_pcm_t *pcm, snd_pcm_hw_params_t *params, snd_pcm_access_t access)
+{
+   if ((SND_PCM_ACCESS_MMAP_INTERLEAVED != access) && (SND_PCM_ACCESS_RW_INTERLEAVED != access)) {
+      return (-EINVAL);
+   }
+   params->access = access;
+   return (0);
+}
+
+int snd_pcm_hw_params_set_format(snd_pcm_t *pcm, snd_pcm_hw_params_t *params, snd_pcm_format_t val)
+{
+   return ((SND_PCM_FORMAT_S16_LE == val) ? 0 : -EINVAL);
+}
+
+int snd_pcm_hw_params_set_channels(snd_pcm_t *pcm, snd_pcm_hw_params_t *params, unsigned int val)
+{
+   if ((val < 1) || (val > SND_STUB_CHANNELS_MAX)) {
+      return (-EINVAL);
+   }
+   params->channels = val;
+   return (0);
+}
+
+int snd_pcm_hw_params_set_channels_near(snd_pcm_t *pcm, snd_pcm_hw_params_t *params, unsigned int *val)
+{
+   if (*val < 1) {
+      *val = 1;
+   }
+   if (*val > SND_STUB_CHANNELS_MAX) {
+      *val = SND_STUB_CHANNELS_MAX;
+   }
+   params->channels = *val;
+   return (0);
+}
+
+int snd_pcm_hw_params_test_rate(snd_pcm_t *pcm, snd_pcm_hw_params_t *params, unsigned int val, int dir)
+{
+   return (((val >= params->rate_min) && (val <= params->rate_max)) ? 0 : -EINVAL);
+}
+
+int snd_pcm_hw_params_set_rate(snd_pcm_t *pcm, snd_pcm_hw_params_t *params, unsigned int val, int dir)
+{
+   if (snd_pcm_hw_params_test_rate(pcm, params, val, dir)) {
+      return (-EINVAL);
+   }
+   params->rate = val;
+   return (0);
+}
+
+int snd_pcm_hw_params_set_rate_near(snd_pcm_t *pcm, snd_pcm_hw_params_t *params, unsigned int *val, int *dir)
+{
+   if (*val < params->rate_min) {
+      *val = params->rate_min;
+   }
+   if (*val > params->rate_max) {
+      *val = params->rate_max;
+   }
+   params->rate = *val;
+   if (NULL != dir) {
+      *dir = 0;
+   }
+   return (0);
+}
+
+int snd_pcm_hw_params_set_period_size_near(snd_pcm_t *pcm, snd_pcm_hw_params_t *params, snd_pcm_uframes_t *val, int *dir)
+{
+   if (*val < 16) {
+      *val = 16;
+   }
+   params->period_size = *val;
+   return (0);
+}
+
+int snd_pcm_hw_params_set_buffer_size_near(snd_pcm_t *pcm, snd_pcm_hw_params_t *params, snd_pcm_uframes_t *val)
+{
+   /* Whole number of periods, two at least */
+   snd_pcm_uframes_t periods = *val / params->period_size;
+
+   if (periods < 2) {
+      periods = 2;
+   }
+   *val = periods * params->period_size;
+   params->buffer_size = *val;
+   return (0);
+}
+
+int snd_pcm_hw_params(snd_pcm_t *pcm, snd_pcm_hw_params_t *params)
+{
+   uint8_t *buf;
+   unsigned int c;
+
+   if ((0 == params->period_size) || (params->buffer_size < (2 * params->period_size))) {
+      return (-EINVAL);
+   }
+   buf = calloc(params->buffer_size, params->channels * SND_STUB_SAMPLE_SIZE);
+   if (NULL == buf) {
+      return (-ENOMEM);
+   }
+   pthread_mutex_lock(&(pcm->lock));
+   free(pcm->buf);
+   pcm->buf = buf;
+   pcm->hw = *params;
+   pcm->frame_bytes = params->channels * SND_STUB_SAMPLE_SIZE;
+   for (c = 0; (c < params->channels); c += 1) {
+      pcm->areas[c].addr = buf;
+      pcm->areas[c].first = c * SND_STUB_SAMPLE_SIZE * 8;
+      pcm->areas[c].step = pcm->frame_bytes * 8;
+   }
+   pcm->sw.start_threshold = 1;
+   pcm->sw.stop_threshold = params->buffer_size;
+   pcm->sw.avail_min = params->period_size;
+   /* Like the kernel, the device is prepared by snd_pcm_hw_params() */
+   pcm->state = SND_PCM_STATE_PREPARED;
+   pcm->hw_ptr = 0;
+   pcm->appl_ptr = 0;
+   snd_stub_update(pcm);
+   pthread_mutex_unlock(&(pcm->lock));
+   return (0);
+}
+
+int snd_pcm_sw_params_malloc(snd_pcm_sw_params_t **ptr)
+{
+   *ptr = calloc(1, sizeof(**ptr));
+   return ((NULL == *ptr) ? -ENOMEM : 0);
+}
+
+void snd_pcm_sw_params_free(snd_pcm_sw_params_t *obj)
+{
+   free(obj);
+}
+
+int snd_pcm_sw_params_current(snd_pcm_t *pcm, snd_pcm_sw_params_t *params)
+{
+   pthread_mutex_lock(&(pcm->lock));
+   *params = pcm->sw;
+   pthread_mutex_unlock(&(pcm->lock));
+   return (0);
+}
+
+int snd_pcm_sw_params_set_start_threshold(snd_pcm_t *pcm, snd_pcm_sw_params_t *params, snd_pcm_uframes_t val)
+{
+   params->start_threshold = val;
+   return (0);
+}
+
+int snd_pcm_sw_params_set_stop_threshold(snd_pcm_t *pcm, snd_pcm_sw_params_t *params, snd_pcm_uframes_t val)
+{
+   params->stop_threshold = val;
+   return (0);
+}
+
+int snd_pcm_sw_params_set_avail_min(snd_pcm_t *pcm, snd_pcm_sw_params_t *params, snd_pcm_uframes_t val)
+{
+   params->avail_min = (0 == val) ? 1 : val;
+   return (0);
+}
+
+int snd_pcm_sw_params(snd_pcm_t *pcm, snd_pcm_sw_params_t *params)
+{
+   pthread_mutex_lock(&(pcm->lock));
+   pcm->sw = *params;
+   snd_stub_update(pcm);
+   pthread_mutex_unlock(&(pcm->lock));
+   return (0);
+}
+
+int snd_pcm_poll_descriptors_count(snd_pcm_t *pcm)
+{
+   return (1);
+}
+
+int snd_pcm_poll_descriptors(snd_pcm_t *pcm, struct pollfd *pfds, unsigned int space)
+{
+   if (space < 1) {
+      return (0);
+   }
+   pfds[0].fd = pcm->fd;
+   pfds[0].events = (SND_PCM_STREAM_CAPTURE == pcm->stream) ? POLLIN : POLLOUT;
+   pfds[0].revents = 0;
+   return (1);
+}
+
+int snd_pcm_poll_descriptors_revents(snd_pcm_t *pcm, struct pollfd *pfds, unsigned int nfds, unsigned short *revents)
+{
+   unsigned short ev = (SND_PCM_STREAM_CAPTURE == pcm->stream) ? POLLIN : POLLOUT;
+
+   pthread_mutex_lock(&(pcm->lock));
+   switch (pcm->state) {
+      case SND_PCM_STATE_RUNNING:
+      case SND_PCM_STATE_PREPARED: {
+         *revents = snd_stub_is_ready(pcm) ? ev : 0;
+         break;
+      }
+      case SND_PCM_STATE_DISCONNECTED: {
+         *revents = POLLERR | POLLHUP;
+         break;
+      }
+      default: {
+         *revents = POLLERR | ev;
+         break;
+      }
+   }
+   pthread_mutex_unlock(&(pcm->lock));
+   return (0);
+}
+
+/*
+ * Transfers
+ */
+
+int snd_pcm_prepare(snd_pcm_t *pcm)
+{
+   int ret = 0;
+
+   pthread_mutex_lock(&(pcm->lock));
+   switch (pcm->state) {
+      case SND_PCM_STATE_OPEN:
+      case SND_PCM_STATE_DISCONNECTED: {
+         ret = -EBADFD;
+         break;
+      }
+      case SND_PCM_STATE_RUNNING: {
+         ret = -EBUSY;
+         break;
+      }
+      default: {
+         pcm->state = SND_PCM_STATE_PREPARED;
+         pcm->hw_ptr = 0;
+         pcm->appl_ptr = 0;
+         snd_stub_update(pcm);
+         break;
+      }
+   }
+   pthread_mutex_unlock(&(pcm->lock));
+   return (ret);
+}
+
+int snd_pcm_start(snd_pcm_t *pcm)
+{
+   int ret = 0;
+
+   pthread_mutex_lock(&(pcm->lock));
+   if (SND_PCM_STATE_PREPARED != pcm->state) {
+      ret = -EBADFD;
+   }
+   else {
+      snd_stub_start_locked(pcm);
+   }
+   pthread_mutex_unlock(&(pcm->lock));
+   if (0 == ret) {
+      snd_stub_kick();
+   }
+   return (ret);
+}
+
+int snd_pcm_drop(snd_pcm_t *pcm)
+{
+   int ret = 0;
+
+   pthread_mutex_lock(&(pcm->lock));
+   if ((SND_PCM_STATE_OPEN == pcm->state) || (SND_PCM_STATE_DISCONNECTED == pcm->state)) {
+      ret = -EBADFD;
+   }
+   else {
+      pcm->state = SND_PCM_STATE_SETUP;
+      snd_stub_update(pcm);
+   }
+   pthread_mutex_unlock(&(pcm->lock));
+   return (ret);
+}
+
+int snd_pcm_recover(snd_pcm_t *pcm, int err, int silent)
+{
+   if ((-EPIPE == err) || (-ESTRPIPE == err)) {
+      return (snd_pcm_prepare(pcm));
+   }
+   return (err);
+}
+
+int snd_pcm_resume(snd_pcm_t *pcm)
+{
+   return (-ENOSYS);
+}
+
+snd_pcm_state_t snd_pcm_state(snd_pcm_t *pcm)
+{
+   snd_pcm_state_t state;
+
+   pthread_mutex_lock(&(pcm->lock));
+   state = pcm->state;
+   pthread_mutex_unlock(&(pcm->lock));
+   return (state);
+}
+
+/* Error of a transfer in the state of the device, 0 if it can transfer */
+static int snd_stub_transfer_error(const snd_pcm_t *pcm)
+{
+   switch (pcm->state) {
+      case SND_PCM_STATE_PREPARED:
+      case SND_PCM_STATE_RUNNING: {
+         return (0);
+      }
+      case SND_PCM_STATE_XRUN: {
+         return (-EPIPE);
+      }
+      case SND_PCM_STATE_SUSPENDED: {
+         return (-ESTRPIPE);
+      }
+      case SND_PCM_STATE_DISCONNECTED: {
+         return (-ENODEV);
+      }
+      default: {
+         return (-EBADFD);
+      }
+   }
+}
+
+int snd_pcm_delay(snd_pcm_t *pcm, snd_pcm_sframes_t *delayp)
+{
+   int ret;
+
+   pthread_mutex_lock(&(pcm->lock));
+   ret = snd_stub_transfer_error(pcm);
+   if (0 == ret) {
+      if (SND_PCM_STREAM_CAPTURE == pcm->stream) {
+         *delayp = (snd_pcm_sframes_t)(pcm->hw_ptr - pcm->appl_ptr);
+      }
+      else {
+         *delayp = (snd_pcm_sframes_t)(pcm->appl_ptr - pcm->hw_ptr);
+      }
+   }
+   pthread_mutex_unlock(&(pcm->lock));
+   return (ret);
+}
+
+snd_pcm_sframes_t snd_pcm_avail_update(snd_pcm_t *pcm)
+{
+   snd_pcm_sframes_t ret;
+
+   pthread_mutex_lock(&(pcm->lock));
+   ret = snd_stub_transfer_error(pcm);
+   if (0 == ret) {
+      ret = snd_stub_avail(pcm);
+   }
+   pthread_mutex_unlock(&(pcm->lock));
+   return (ret);
+}
+
+snd_pcm_sframes_t snd_pcm_readi(snd_pcm_t *pcm, void *buffer, snd_pcm_uframes_t size)
+{
+   snd_pcm_sframes_t ret;
+   bool started = false;
+
+   pthread_mutex_lock(&(pcm->lock));
+   do { /* Empty loop */
+      ret = snd_stub_transfer_error(pcm);
+      if (ret) {
+         break;
+      }
+      if ((SND_PCM_STATE_PREPARED == pcm->state) && (size >= pcm->sw.start_threshold)) {
+         snd_stub_start_locked(pcm);
+         started = true;
+      }
+      ret = snd_stub_avail(pcm);
+      if (0 == ret) {
+         ret = -EAGAIN;
+         break;
+      }
+      if ((snd_pcm_uframes_t)(ret) > size) {
+         ret = size;
+      }
+      snd_stub_capture_fill(pcm, buffer, pcm->appl_ptr, ret);
+      pcm->appl_ptr += ret;
+      snd_stub_update(pcm);
+   } while (false);
+   pthread_mutex_unlock(&(pcm->lock));
+   if (started) {
+      snd_stub_kick();
+   }
+   return (ret);
+}
+
+snd_pcm_sframes_t snd_pcm_writei(snd_pcm_t *pcm, const void *buffer, snd_pcm_uframes_t size)
+{
+   const uint8_t *src = buffer;
+   snd_pcm_sframes_t ret;
+   snd_pcm_uframes_t done = 0;
+   bool started = false;
+
+   pthread_mutex_lock(&(pcm->lock));
+   do { /* Empty loop */
+      ret = snd_stub_transfer_error(pcm);
+      if (ret) {
+         break;
+      }
+      ret = snd_stub_avail(pcm);
+      if (0 == ret) {
+         ret = -EAGAIN;
+         break;
+      }
+      if ((snd_pcm_uframes_t)(ret) > size) {
+         ret = size;
+      }
+      /* Two copies at most, if the buffer wraps around */
+      while (done < (snd_pcm_uframes_t)(ret)) {
+         snd_pcm_uframes_t offset = pcm->appl_ptr % pcm->hw.buffer_size;
+         snd_pcm_uframes_t count = ret - done;
+         if (count > (pcm->hw.buffer_size - offset)) {
+            count = pcm->hw.buffer_size - offset;
+         }
+         memcpy(pcm->buf + (offset * pcm->frame_bytes), src + (done * pcm->frame_bytes), count * pcm->frame_bytes);
+         pcm->appl_ptr += count;
+         done += count;
+      }
+      if ((SND_PCM_STATE_PREPARED == pcm->state)
+          && ((pcm->appl_ptr - pcm->hw_ptr) >= pcm->sw.start_threshold)) {
+         snd_stub_start_locked(pcm);
+         started = true;
+      }
+      snd_stub_update(pcm);
+   } while (false);
+   pthread_mutex_unlock(&(pcm->lock));
+   if (started) {
+      snd_stub_kick();
+   }
+   return (ret);
+}
+
+int snd_pcm_mmap_begin(snd_pcm_t *pcm, const snd_pcm_channel_area_t **areas,
+   snd_pcm_uframes_t *offset, snd_pcm_uframes_t *frames)
+{
+   snd_pcm_sframes_t avail;
+   int ret;
+
+   pthread_mutex_lock(&(pcm->lock));
+   do { /* Empty loop */
+      ret = snd_stub_transfer_error(pcm);
+      if (ret) {
+         break;
+      }
+      avail = snd_stub_avail(pcm);
+      *areas = pcm->areas;
+      *offset = pcm->appl_ptr % pcm->hw.buffer_size;
+      if (*frames > (snd_pcm_uframes_t)(avail)) {
+         *frames = avail;
+      }
+      if (*frames > (pcm->hw.buffer_size - *offset)) {
+         *frames = pcm->hw.buffer_size - *offset;
+      }
+      if (SND_PCM_STREAM_CAPTURE == pcm->stream) {
+         snd_stub_capture_fill(pcm, pcm->buf + (*offset * pcm->frame_bytes), pcm->appl_ptr, *frames);
+      }
+   } while (false);
+   pthread_mutex_unlock(&(pcm->lock));
+   return (ret);
+}
+
+snd_pcm_sframes_t snd_pcm_mmap_commit(snd_pcm_t *pcm, snd_pcm_uframes_t offset, snd_pcm_uframes_t frames)
+{
+   snd_pcm_sframes_t ret;
+
+   pthread_mutex_lock(&(pcm->lock));
+   ret = snd_stub_transfer_error(pcm);
+   if (0 == ret) {
+      if (offset != (pcm->appl_ptr % pcm->hw.buffer_size)) {
+         ret = -EPIPE;
+      }
+      else {
+         /* Unlike snd_pcm_writei(), a playback device isn't started */
+         pcm->appl_ptr += frames;
+         ret = frames;
+         snd_stub_update(pcm);
+      }
+   }
+   pthread_mutex_unlock(&(pcm->lock));
+   return (ret);
+}
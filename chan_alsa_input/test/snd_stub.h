@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2015
+ * Gilles Mazoyer <mazoyer.gilles@omega.ovh>
+ *
+ * This is free software, licensed under the GNU General Public License v2.
+ * See /LICENSE for more information.
+ */
+
+/*
+ Sound devices of snd_stub.c, seen by the harness. Any device name can be
+ opened; "name:rate" gives a device that supports only this rate (e.g.
+ "usb:44100" makes the driver resample), other devices support any rate
+ between 8000 and 48000 Hz and 1 to 32 channels.
+
+ The devices are paced by CLOCK_MONOTONIC : the hardware pointer of a running
+ device moves by a period at each period boundary, as with a sound card, and
+ the poll descriptor is ready when avail_min frames are available.
+
+ The samples captured carry a stamp, the position of the frame clock (frames
+ elapsed since the first device was opened, at the rate of the device) when
+ they were captured. Samples played are given to a hook, so that a harness
+ writing stamps taken with snd_stub_frames() measures the latency of the
+ playback path.
+*/
+
+#ifndef SND_STUB_H
+#define SND_STUB_H
+
+#include <alsa/asoundlib.h>
+#include <stdint.h>
+
+/*
+ Called by the clock, without any lock of the driver held, each time a
+ period of a playback device has been played, with its first and last
+ samples (first channel)
+*/
+typedef void (*snd_stub_played_t)(const char *name, unsigned int rate, int16_t first, int16_t last);
+
+extern snd_stub_played_t snd_stub_played;
+
+/* Position of the frame clock at rate */
+uint64_t snd_stub_frames(unsigned int rate);
+
+/* Stamp of a sample at the position frames of the frame clock, never 0 */
+static inline int16_t snd_stub_stamp(uint64_t frames)
+{
+   return ((int16_t)((uint16_t)((frames % 65535) + 1)));
+}
+
+/*
+ Number of frames between the stamp of a sample and the position frames of
+ the frame clock (modulo 65535 frames, more than a second at 48000 Hz), or
+ -1 if the sample isn't a stamp (silence)
+*/
+static inline int64_t snd_stub_stamp_age(int16_t sample, uint64_t frames)
+{
+   uint16_t stamp = (uint16_t)(sample);
+
+   if (0 == stamp) {
+      return (-1);
+   }
+   return ((int64_t)((((frames % 65535) + 65535) - (stamp - 1)) % 65535));
+}
+
+/* Number of devices opened and not yet closed */
+int snd_stub_open_count(void);
+
+/*
+ Unplugs the card whose id is card (NULL plugs it back) : its devices
+ ("hw:CARD=id,...") can't be opened and snd_card_get_index() doesn't find it
+*/
+void snd_stub_unplug(const char *card);
+
+#endif /* SND_STUB_H */
@@ -0,0 +1,1268 @@
+/*
+ * Copyright (C) 2015
+ * Gilles Mazoyer <mazoyer.gilles@omega.ovh>
+ *
+ * This is free software, licensed under the GNU General Public License v2.
+ * See /LICENSE for more information.
+ */
+
+/*
+ Tests of the state machine of the lines of chan_alsa_input, without Asterisk
+ and without phone : the driver is linked with the minimal core of
+ ast_stub.c and the sound devices of snd_stub.c.
+
+ Once the module is loaded, its monitor and audio threads are stopped and
+ the test plays their part synchronously :
+ - the monitor : input events are put in the array of events of the line
+   and the line is serviced with alsa_input_monitor_service_pvt(), again
+   while it's kicked or its deadline is reached (see test_monitor())
+ - the audio thread : the commands sent to the line are taken from its ring
+   and recorded (see test_audio_thread())
+ - the PBX : the frames queued on the channel of the line are taken and
+   recorded, the channel is hung up when asked to (see test_pbx())
+ The clock of the driver is frozen, test_advance() moves it forward, so that
+ the timeouts (dialing, ringing cadence, DTMF durations) are tested without
+ waiting.
+
+ What the line sent is recorded as strings, one character per item :
+ - commands to the audio thread : 'C' capture start, 'D' detection start,
+   'S' capture stop, 'T' tone started, 't' tone stopped, 'P' playback,
+   'X' close
+ - frames queued : the digit of a DTMF, '.' null frame, 'A' answer, 'H'
+   hangup, 'R' ringing, 'B' busy, '?' other frame
+
+ With -t, the throughput of the control path is measured instead : calls
+ are made on all the lines (off hook, "100#", a digit, on hook) and the
+ input events handled per second are reported. Running the test under perf
+ profiles the state machine alone.
+*/
+
+#include <asterisk.h>
+#include <time.h>
+
+/*
+ The clock of the driver is CLOCK_MONOTONIC, frozen by the test once the
+ module is loaded (see test_advance())
+*/
+static struct {
+   int frozen;
+   struct timespec now;
+} test_clock;
+
+static int test_clock_gettime(clockid_t clock, struct timespec *ts)
+{
+   if ((CLOCK_MONOTONIC == clock) && (test_clock.frozen)) {
+      *ts = test_clock.now;
+      return (0);
+   }
+   return (clock_gettime(clock, ts));
+}
+
+#define clock_gettime test_clock_gettime
+#include "../chan_alsa_input.c"
+#undef clock_gettime
+
+#include "ast_stub.h"
+#include "snd_stub.h"
+
+#include <getopt.h>
+#include <stdarg.h>
+
+#define TEST_LINES 2
+#define TEST_EXTENSION "100"
+#define TEST_TRACE_LEN 256
+
+typedef struct {
+   alsa_input_pvt_t *pvt;
+   /* Commands received by the audio thread */
+   char audio[TEST_TRACE_LEN];
+   /* Frames queued on the channel of the line */
+   char queued[TEST_TRACE_LEN];
+   /* Channel of the line, started by the PBX or requested, or NULL */
+   struct ast_channel *chan;
+   /* Time the monitor must service the line again, or AI_NO_DEADLINE */
+   int64_t deadline;
+   /* The line has been kicked since it was last serviced */
+   bool kicked;
+} test_line_t;
+
+static struct {
+   test_line_t lines[TEST_LINES];
+   const char *scenario;
+   unsigned int failures;
+   /* Items are recorded (not in throughput mode) */
+   bool tracing;
+   /* Errors the driver must log next, that don't make the scenario fail */
+   unsigned int errors_expected;
+   /* Options */
+   const char *only;
+   unsigned int throughput_s;
+   /* File descriptors of the threads stopped, restored before unloading */
+   int audio_fd_wakeup;
+   int monitor_fd_wakeup;
+} test;
+
+/* Section of line 1 in the configuration loaded */
+#define TEST_CONFIG_LINE1 \
+   "enable = 1\n" \
+   "context = test\n" \
+   "snd_capture_device = test\n" \
+   "snd_playback_device = test\n" \
+   "monitor_dialing = 1\n" \
+   "search_extension_trigger = #\n"
+
+/* Sets the configuration file, with line1 as section of line 1 */
+static void test_set_config(const char *line1)
+{
+   char text[1024];
+
+   snprintf(text, sizeof(text),
+      "[general]\n"
+      "lines = 2\n"
+      "audio_thread_priority = 0\n"
+      "[line1]\n"
+      "%s"
+      "[line2]\n"
+      "enable = 1\n"
+      "context = test\n"
+      "snd_capture_device = test\n"
+      "snd_playback_device = test\n"
+      "monitor_dialing = 1\n"
+      "search_extension_trigger = #\n"
+      "dtmf_detect = yes\n", line1);
+   ast_stub_set_config(alsa_input_cfg_file, text);
+}
+
+/*
+ * Checks
+ */
+
+#define TEST_CHECK(cond) test_check((cond), #cond, __LINE__)
+#define TEST_EXPECT(trace, expected) test_expect((trace), (expected), #trace, __LINE__)
+
+static void test_fail(int line, const char *fmt, ...)
+{
+   va_list ap;
+
+   __atomic_add_fetch(&(test.failures), 1, __ATOMIC_RELAXED);
+   fprintf(stderr, "test_alsa_input.c:%d: %s: ", line, (NULL != test.scenario) ? test.scenario : "setup");
+   va_start(ap, fmt);
+   vfprintf(stderr, fmt, ap);
+   va_end(ap);
+}
+
+static void test_check(bool ok, const char *what, int line)
+{
+   if (!ok) {
+      test_fail(line, "'%s' is false\n", what);
+   }
+}
+
+/* Compares a trace with what's expected, then clears it */
+static void test_expect(char *trace, const char *expected, const char *what, int line)
+{
+   if (strcmp(trace, expected)) {
+      test_fail(line, "%s is \"%s\", expected \"%s\"\n", what, trace, expected);
+   }
+   trace[0] = '\0';
+}
+
+static void test_trace(char *trace, char c)
+{
+   size_t len;
+
+   if (!test.tracing) {
+      return;
+   }
+   len = strlen(trace);
+   if (len < (TEST_TRACE_LEN - 1)) {
+      trace[len] = c;
+      trace[len + 1] = '\0';
+   }
+}
+
+/*
+ The conditions of alsa_input_assert() that are false and the errors logged
+ by the driver (unless expected) make the scenario fail
+*/
+static void test_log(int level, const char *fmt, va_list ap)
+{
+   char msg[256];
+
+   if (AST_LOG_DEBUG == level) {
+      if (strncmp(fmt, "condition '", 11)) {
+         return;
+      }
+   }
+   else if (level < AST_LOG_ERROR) {
+      return;
+   }
+   else if (test.errors_expected > 0) {
+      test.errors_expected -= 1;
+      return;
+   }
+   vsnprintf(msg, sizeof(msg), fmt, ap);
+   test_fail(0, "driver logged : %s", msg);
+}
+
+/*
+ * The audio thread, the PBX and the monitor
+ */
+
+/* Takes the commands sent by the driver to the audio thread for the line */
+static void test_audio_thread(test_line_t *l)
+{
+   alsa_input_pvt_t *pvt = l->pvt;
+   unsigned int tail = pvt->audio.cmds_tail;
+   unsigned int head = __atomic_load_n(&(pvt->audio.cmds_head), __ATOMIC_ACQUIRE);
+
+   while (tail != head) {
+      const alsa_input_audio_cmd_t *cmd = &(pvt->audio.cmds[tail % AI_AUDIO_CMDS_LEN]);
+      char c = '?';
+
+      switch (cmd->kind) {
+         case AI_AUDIO_CMD_CAPTURE_START: {
+            c = 'C';
+            break;
+         }
+         case AI_AUDIO_CMD_DETECT_START: {
+            c = 'D';
+            break;
+         }
+         case AI_AUDIO_CMD_CAPTURE_STOP: {
+            c = 'S';
+            break;
+         }
+         case AI_AUDIO_CMD_TONE: {
+            pvt->audio.playback_seq = cmd->playback_seq;
+            if (NULL == cmd->tone_def) {
+               /* Stopping a tone is acknowledged at once */
+               __atomic_store_n(&(pvt->audio.playback_ack), pvt->audio.playback_seq, __ATOMIC_RELEASE);
+               c = 't';
+            }
+            else {
+               c = 'T';
+            }
+            break;
+         }
+         case AI_AUDIO_CMD_PLAYBACK: {
+            c = 'P';
+            break;
+         }
+         case AI_AUDIO_CMD_CLOSE: {
+            /* The sound devices are closed at once */
+            __atomic_store_n(&(pvt->audio.close_ack), cmd->close_seq, __ATOMIC_RELEASE);
+            c = 'X';
+            break;
+         }
+      }
+      test_trace(l->audio, c);
+      tail += 1;
+   }
+   __atomic_store_n(&(pvt->audio.cmds_tail), tail, __ATOMIC_RELEASE);
+}
+
+static test_line_t *test_line_of_pvt(const alsa_input_pvt_t *pvt)
+{
+   return (&(test.lines[pvt->index_line]));
+}
+
+static int test_pbx_start(struct ast_channel *chan)
+{
+   alsa_input_pvt_t *pvt = ast_channel_tech_pvt(chan);
+
+   /* Called by the monitor, the line is linked to the channel */
+   test_line_of_pvt(pvt)->chan = chan;
+   return (0);
+}
+
+static int test_exists_extension(const char *context, const char *exten)
+{
+   return ((!strcmp(exten, TEST_EXTENSION)) || (!strcmp(exten, alsa_input_default_extension)));
+}
+
+static int test_canmatch_extension(const char *context, const char *exten)
+{
+   return (!strncmp(exten, TEST_EXTENSION, strlen(exten)));
+}
+
+static void test_pbx_hangup(test_line_t *l)
+{
+   struct ast_channel *chan = l->chan;
+
+   l->chan = NULL;
+   ast_hangup(chan);
+}
+
+static void test_pbx_answer(test_line_t *l)
+{
+   ast_channel_lock(l->chan);
+   TEST_CHECK(0 == ast_channel_tech(l->chan)->answer(l->chan));
+   ast_channel_unlock(l->chan);
+}
+
+/* Asks the driver for a channel to the line addr, as Dial() does */
+static struct ast_channel *test_pbx_request(const char *addr, int *cause)
+{
+   const struct ast_channel_tech *tech = ast_stub_find_tech(alsa_input_chan_type);
+   struct ast_format_cap *cap = ast_format_cap_alloc(AST_FORMAT_CAP_FLAG_DEFAULT);
+   struct ast_channel *chan;
+
+   ast_format_cap_append(cap, ast_format_slin, 0);
+   chan = tech->requester(alsa_input_chan_type, cap, NULL, NULL, addr, cause);
+   ao2_ref(cap, -1);
+   return (chan);
+}
+
+/* Requests a channel to the line and calls it */
+static void test_pbx_call(test_line_t *l)
+{
+   char addr[16];
+   int cause = 0;
+
+   snprintf(addr, sizeof(addr), "%lu", (unsigned long)(l->pvt->index_line + 1));
+   l->chan = test_pbx_request(addr, &(cause));
+   TEST_CHECK(NULL != l->chan);
+   if (NULL == l->chan) {
+      return;
+   }
+   ast_channel_lock(l->chan);
+   TEST_CHECK(0 == ast_channel_tech(l->chan)->call(l->chan, addr, 0));
+   ast_channel_unlock(l->chan);
+}
+
+/* Takes the frames queued on the channel of the line */
+static void test_pbx(test_line_t *l)
+{
+   struct ast_frame *f;
+   bool hangup = false;
+
+   if (NULL == l->chan) {
+      return;
+   }
+   ast_channel_lock(l->chan);
+   while (NULL != (f = ast_stub_channel_dequeue(l->chan))) {
+      char c = '?';
+
+      if (AST_FRAME_DTMF == f->frametype) {
+         c = (char)(f->subclass.integer);
+      }
+      else if (AST_FRAME_NULL == f->frametype) {
+         c = '.';
+      }
+      else if (AST_FRAME_CONTROL == f->frametype) {
+         switch (f->subclass.integer) {
+            case AST_CONTROL_HANGUP: {
+               c = 'H';
+               hangup = true;
+               break;
+            }
+            case AST_CONTROL_ANSWER: {
+               c = 'A';
+               break;
+            }
+            case AST_CONTROL_RINGING: {
+               c = 'R';
+               break;
+            }
+            case AST_CONTROL_BUSY: {
+               c = 'B';
+               break;
+            }
+            default: {
+               break;
+            }
+         }
+      }
+      test_trace(l->queued, c);
+      ast_frfree(f);
+   }
+   ast_channel_unlock(l->chan);
+   if (hangup) {
+      test_pbx_hangup(l);
+   }
+}
+
+/*
+ Does what the monitor would do (see alsa_input_do_monitor()) : services the
+ lines with input events, kicked or whose deadline is reached, until none
+ is left. The audio thread and the PBX take what the lines sent before each
+ pass.
+*/
+static void test_monitor(void)
+{
+   alsa_input_chan_t *t = &(alsa_input_chan);
+   alsa_input_monitor_prms_t monitor_prms;
+   unsigned int pass;
+
+   monitor_prms.channel_is_locked = false;
+   for (pass = 0; (pass < 16); pass += 1) {
+      alsa_input_pvt_t *pvt;
+      bool serviced = false;
+      size_t i;
+
+      for (i = 0; (i < TEST_LINES); i += 1) {
+         test_audio_thread(&(test.lines[i]));
+         test_pbx(&(test.lines[i]));
+      }
+
+      alsa_input_monitor_lock(t);
+      monitor_prms.now = alsa_input_clock_ms();
+      pvt = __atomic_exchange_n(&(t->monitor.kicked), NULL, __ATOMIC_ACQ_REL);
+      while (NULL != pvt) {
+         alsa_input_pvt_t *next = pvt->monitor.next_kicked;
+         __atomic_store_n(&(pvt->monitor.kicked), 0, __ATOMIC_RELEASE);
+         test_line_of_pvt(pvt)->kicked = true;
+         pvt = next;
+      }
+      for (i = 0; (i < TEST_LINES); i += 1) {
+         test_line_t *l = &(test.lines[i]);
+
+         if ((!l->kicked) && (l->pvt->monitor.events_tail == l->pvt->monitor.events_synced)
+             && (l->deadline > monitor_prms.now)) {
+            continue;
+         }
+         l->kicked = false;
+         alsa_input_monitor_service_pvt(l->pvt, &(monitor_prms));
+         l->deadline = monitor_prms.deadline;
+         serviced = true;
+      }
+      alsa_input_monitor_unlock(t);
+      if (!serviced) {
+         return;
+      }
+   }
+   test_fail(__LINE__, "lines still need to be serviced after %u passes\n", pass);
+}
+
+/* Moves the clock of the driver forward, the lines are serviced */
+static void test_advance(unsigned int ms)
+{
+   uint64_t ns = (test_clock.now.tv_nsec + ((uint64_t)(ms) * 1000000ULL));
+
+   test_clock.now.tv_sec += ns / 1000000000ULL;
+   test_clock.now.tv_nsec = ns % 1000000000ULL;
+   test_monitor();
+}
+
+/* The audio thread has played the whole tone of the line */
+static void test_tone_played(test_line_t *l)
+{
+   __atomic_store_n(&(l->pvt->audio.playback_ack), l->pvt->audio.playback_seq, __ATOMIC_RELEASE);
+   alsa_input_monitor_kick(l->pvt);
+   test_monitor();
+}
+
+/*
+ * Keypads
+ */
+
+static void test_event(test_line_t *l, __u16 type, __u16 code, __s32 value)
+{
+   alsa_input_pvt_t *pvt = l->pvt;
+   struct input_event *ev;
+
+   if ((pvt->monitor.events_head - pvt->monitor.events_tail) >= AI_INPUT_EVENTS_LEN) {
+      test_fail(__LINE__, "too many input events for line %lu\n", (unsigned long)(pvt->index_line + 1));
+      return;
+   }
+   ev = &(pvt->monitor.events[pvt->monitor.events_head % AI_INPUT_EVENTS_LEN]);
+   memset(ev, 0, sizeof(*ev));
+   ev->type = type;
+   ev->code = code;
+   ev->value = value;
+   alsa_input_monitor_events_added(pvt, 1);
+}
+
+/* Input events of a key pressed then released, as an event device reports them */
+static void test_key(test_line_t *l, __u16 code)
+{
+   test_event(l, EV_KEY, code, 1);
+   test_event(l, EV_SYN, SYN_REPORT, 0);
+   test_event(l, EV_KEY, code, 0);
+   test_event(l, EV_SYN, SYN_REPORT, 0);
+}
+
+static __u16 test_digit_code(char digit)
+{
+   if ('#' == digit) {
+      return (KEY_NUMERIC_POUND);
+   }
+   if ('*' == digit) {
+      return (KEY_NUMERIC_STAR);
+   }
+   return (KEY_NUMERIC_0 + (digit - '0'));
+}
+
+static void test_press(test_line_t *l, __u16 code)
+{
+   test_key(l, code);
+   test_monitor();
+}
+
+static void test_dial(test_line_t *l, const char *digits)
+{
+   for (; ('\0' != *digits); digits += 1) {
+      test_press(l, test_digit_code(*digits));
+   }
+}
+
+/* Digits detected by the audio thread in the samples captured */
+static void test_detect(test_line_t *l, const char *digits)
+{
+   alsa_input_pvt_t *pvt = l->pvt;
+   unsigned int head = pvt->audio.dtmf_head;
+
+   for (; ('\0' != *digits); digits += 1) {
+      pvt->audio.dtmf_digits[head % AI_DTMF_DIGITS_LEN] = *digits;
+      head += 1;
+   }
+   __atomic_store_n(&(pvt->audio.dtmf_head), head, __ATOMIC_RELEASE);
+   alsa_input_monitor_kick(pvt);
+   test_monitor();
+}
+
+/*
+ * Scenarios
+ */
+
+static test_line_t *test_line(size_t i)
+{
+   return (&(test.lines[i]));
+}
+
+static alsa_input_state_t test_state(test_line_t *l)
+{
+   return (l->pvt->ast_channel.state);
+}
+
+/* Every scenario starts and ends with all the lines idle */
+static void test_check_idle(void)
+{
+   size_t i;
+
+   for (i = 0; (i < TEST_LINES); i += 1) {
+      test_line_t *l = &(test.lines[i]);
+
+      TEST_CHECK(AI_ST_ON_IDLE == test_state(l));
+      TEST_CHECK(AI_STATUS_ON_HOOK == l->pvt->ast_channel.status);
+      TEST_CHECK((NULL == l->pvt->owner) && (NULL == l->chan));
+      TEST_CHECK(AI_TONE_NONE == l->pvt->ast_channel.tone);
+      TEST_CHECK(!l->pvt->ast_channel.buzzer_is_on);
+      l->audio[0] = '\0';
+      l->queued[0] = '\0';
+   }
+   TEST_CHECK(0 == ast_stub_channel_count());
+   TEST_CHECK(0 == ast_stub_module_refs());
+}
+
+/* Off hook, TEST_EXTENSION dialed and answered by the PBX */
+static void test_make_call(test_line_t *l)
+{
+   test_press(l, KEY_ENTER);
+   test_dial(l, TEST_EXTENSION "#");
+   TEST_CHECK(NULL != l->chan);
+   if (NULL != l->chan) {
+      test_pbx_answer(l);
+      test_monitor();
+   }
+   TEST_CHECK(AI_ST_OFF_TALKING == test_state(l));
+   l->audio[0] = '\0';
+   l->queued[0] = '\0';
+}
+
+static void test_call_answered(void)
+{
+   test_line_t *l = test_line(0);
+   int64_t now = alsa_input_clock_ms();
+
+   test_press(l, KEY_ENTER);
+   TEST_CHECK(AI_ST_OFF_DIALING == test_state(l));
+   TEST_EXPECT(l->audio, "T");
+   /* The monitor searches 's' after dialing_timeout_1st_digit */
+   TEST_CHECK((now + 5000) == l->deadline);
+
+   test_dial(l, TEST_EXTENSION);
+   TEST_CHECK(AI_ST_OFF_DIALING == test_state(l));
+   TEST_CHECK(NULL == l->chan);
+   TEST_EXPECT(l->audio, "t");
+   TEST_CHECK((now + 3000) == l->deadline);
+
+   /* The trigger starts the search at once */
+   test_dial(l, "#");
+   TEST_CHECK(AI_ST_OFF_WAITING_ANSWER == test_state(l));
+   TEST_CHECK((NULL != l->chan) && (l->pvt->owner == l->chan));
+   TEST_CHECK(!strcmp(ast_channel_exten(l->chan), TEST_EXTENSION));
+   TEST_CHECK(AST_STATE_RING == ast_channel_state(l->chan));
+   TEST_CHECK(1 == ast_stub_module_refs());
+   TEST_EXPECT(l->audio, "Ct");
+   TEST_EXPECT(l->queued, "");
+
+   test_pbx_answer(l);
+   test_monitor();
+   TEST_CHECK(AI_ST_OFF_TALKING == test_state(l));
+   TEST_CHECK(AST_STATE_UP == ast_channel_state(l->chan));
+   TEST_EXPECT(l->audio, "t");
+
+   /* On hook : the PBX is asked to hang up */
+   test_press(l, KEY_ESC);
+   TEST_CHECK(AI_ST_ON_IDLE == test_state(l));
+   TEST_EXPECT(l->audio, "Stt");
+   TEST_EXPECT(l->queued, "H");
+}
+
+static void test_call_hung_up_by_peer(void)
+{
+   test_line_t *l = test_line(0);
+
+   test_make_call(l);
+   test_pbx_hangup(l);
+   test_monitor();
+   TEST_CHECK(AI_ST_OFF_NO_SERVICE == test_state(l));
+   TEST_CHECK(AI_TONE_BUSY == l->pvt->ast_channel.tone);
+   TEST_EXPECT(l->audio, "StT");
+   TEST_CHECK(0 == ast_stub_module_refs());
+
+   /* Keys are ignored until the line goes back on hook by itself */
+   test_dial(l, "1");
+   test_advance(DELAY_AUTO_HOOK_ON - 1);
+   TEST_CHECK(AI_ST_OFF_NO_SERVICE == test_state(l));
+   test_advance(1);
+   TEST_CHECK(AI_ST_ON_IDLE == test_state(l));
+   TEST_CHECK(AI_STATUS_ON_HOOK == l->pvt->ast_channel.status);
+   TEST_EXPECT(l->audio, "t");
+}
+
+static void test_invalid_extension(void)
+{
+   test_line_t *l = test_line(0);
+
+   test_press(l, KEY_ENTER);
+   test_dial(l, "9#");
+   TEST_CHECK(AI_ST_OFF_NO_SERVICE == test_state(l));
+   TEST_CHECK(AI_TONE_INVALID == l->pvt->ast_channel.tone);
+   TEST_CHECK(NULL == l->chan);
+   TEST_EXPECT(l->audio, "TtT");
+
+   /* Digits that can't match are detected without trigger nor timeout */
+   test_press(l, KEY_ESC);
+   TEST_CHECK(AI_ST_ON_IDLE == test_state(l));
+   TEST_EXPECT(l->audio, "t");
+   test_press(l, KEY_ENTER);
+   test_dial(l, "19");
+   TEST_CHECK(AI_ST_OFF_DIALING == test_state(l));
+   test_advance(3000);
+   TEST_CHECK(AI_ST_OFF_NO_SERVICE == test_state(l));
+   test_press(l, KEY_ESC);
+   TEST_EXPECT(l->audio, "TtTt");
+}
+
+static void test_dialing_timeouts(void)
+{
+   test_line_t *l = test_line(0);
+
+   /* Nothing dialed : 's' is searched after dialing_timeout_1st_digit */
+   test_press(l, KEY_ENTER);
+   test_advance(4999);
+   TEST_CHECK((AI_ST_OFF_DIALING == test_state(l)) && (NULL == l->chan));
+   test_advance(1);
+   TEST_CHECK((AI_ST_OFF_WAITING_ANSWER == test_state(l)) && (NULL != l->chan));
+   TEST_CHECK((NULL != l->chan) && (!strcmp(ast_channel_exten(l->chan), alsa_input_default_extension)));
+   test_press(l, KEY_ESC);
+   TEST_EXPECT(l->queued, "H");
+
+   /* Digits dialed without trigger are searched after dialing_timeout */
+   test_press(l, KEY_ENTER);
+   test_dial(l, "10");
+   test_advance(2000);
+   test_dial(l, "0");
+   test_advance(2999);
+   TEST_CHECK((AI_ST_OFF_DIALING == test_state(l)) && (NULL == l->chan));
+   test_advance(1);
+   TEST_CHECK((AI_ST_OFF_WAITING_ANSWER == test_state(l)) && (NULL != l->chan));
+   TEST_CHECK((NULL != l->chan) && (!strcmp(ast_channel_exten(l->chan), TEST_EXTENSION)));
+   test_press(l, KEY_ESC);
+   TEST_EXPECT(l->queued, "H");
+}
+
+static void test_ringing_answered(void)
+{
+   test_line_t *l = test_line(0);
+
+   test_pbx_call(l);
+   test_monitor();
+   TEST_CHECK(AI_ST_ON_RINGING == test_state(l));
+   TEST_CHECK(AST_STATE_RINGING == ast_channel_state(l->chan));
+   TEST_CHECK(l->pvt->ast_channel.buzzer_is_on);
+   TEST_EXPECT(l->queued, "R");
+   TEST_EXPECT(l->audio, "");
+
+   /* Cadence of the buzzer */
+   test_advance(RING_CADENCE_ON - 1);
+   TEST_CHECK(l->pvt->ast_channel.buzzer_is_on);
+   test_advance(1);
+   TEST_CHECK(!l->pvt->ast_channel.buzzer_is_on);
+   test_advance(RING_CADENCE_OFF);
+   TEST_CHECK(l->pvt->ast_channel.buzzer_is_on);
+
+   /* Keys other than 'off hook' are ignored while on hook */
+   test_dial(l, "5");
+   TEST_CHECK(AI_ST_ON_RINGING == test_state(l));
+
+   test_press(l, KEY_ENTER);
+   TEST_CHECK(AI_ST_OFF_TALKING == test_state(l));
+   TEST_CHECK(AST_STATE_UP == ast_channel_state(l->chan));
+   TEST_CHECK(!l->pvt->ast_channel.buzzer_is_on);
+   TEST_EXPECT(l->queued, "A");
+   TEST_EXPECT(l->audio, "Ct");
+
+   test_press(l, KEY_ESC);
+   TEST_EXPECT(l->queued, "H");
+}
+
+static void test_ringing_cancelled(void)
+{
+   test_line_t *l = test_line(0);
+
+   test_pbx_call(l);
+   test_monitor();
+   TEST_CHECK(AI_ST_ON_RINGING == test_state(l));
+   test_pbx_hangup(l);
+   test_monitor();
+   TEST_CHECK(AI_ST_ON_IDLE == test_state(l));
+   TEST_CHECK(!l->pvt->ast_channel.buzzer_is_on);
+}
+
+static void test_busy(void)
+{
+   test_line_t *l = test_line(0);
+   struct ast_channel *chan;
+   int cause = 0;
+
+   /* A channel is requested while the user picks up the phone */
+   chan = test_pbx_request("1", &(cause));
+   TEST_CHECK((NULL != chan) && (AI_ST_ON_PRE_RINGING == test_state(l)));
+   l->chan = chan;
+   test_press(l, KEY_ENTER);
+   TEST_CHECK(AI_ST_OFF_NO_SERVICE == test_state(l));
+   TEST_CHECK(AI_TONE_INVALID == l->pvt->ast_channel.tone);
+   TEST_EXPECT(l->queued, "H");
+   TEST_CHECK(NULL == l->chan);
+
+   /* The line is busy while off hook, other lines don't exist */
+   TEST_CHECK(NULL == test_pbx_request("1", &(cause)));
+   TEST_CHECK(AST_CAUSE_BUSY == cause);
+   TEST_CHECK(NULL == test_pbx_request("9", &(cause)));
+   TEST_CHECK(AST_CAUSE_CHANNEL_UNACCEPTABLE == cause);
+   test_press(l, KEY_ESC);
+}
+
+static void test_dtmf_burst(void)
+{
+   test_line_t *l = test_line(0);
+   size_t burst = ARRAY_LEN(l->pvt->ast_channel.digits) + 10;
+   size_t queued = 0;
+   size_t i;
+
+   test_make_call(l);
+
+   /*
+    Digits are queued one at a time : each one lasts MIN_DTMF_DURATION
+    and is followed by MIN_TIME_BETWEEN_DTMF of silence, a null frame
+    is queued at the end of both
+   */
+   test_dial(l, "123");
+   TEST_EXPECT(l->queued, "1");
+   for (i = 0; (i < 3); i += 1) {
+      test_advance(MIN_DTMF_DURATION);
+      test_advance(MIN_TIME_BETWEEN_DTMF);
+   }
+   TEST_EXPECT(l->queued, "..2..3..");
+
+   /* The digits dialed faster than that are buffered, up to the size of the buffer */
+   for (i = 0; (i < burst); i += 1) {
+      test_dial(l, "4");
+   }
+   while ((l->pvt->ast_channel.digits_len > 0) || (NONE != l->pvt->ast_channel.dtmf_sent)) {
+      test_advance(MIN_DTMF_DURATION);
+      test_advance(MIN_TIME_BETWEEN_DTMF);
+      if (strlen(l->queued) > (TEST_TRACE_LEN - 8)) {
+         for (i = 0; ('\0' != l->queued[i]); i += 1) {
+            queued += ('4' == l->queued[i]);
+         }
+         l->queued[0] = '\0';
+      }
+   }
+   for (i = 0; ('\0' != l->queued[i]); i += 1) {
+      queued += ('4' == l->queued[i]);
+   }
+   l->queued[0] = '\0';
+   /* One digit is queued at once, the buffer holds the others */
+   TEST_CHECK((1 + ARRAY_LEN(l->pvt->ast_channel.digits)) == queued);
+
+   /* Mute toggles the capture, volume keys change the gain */
+   test_press(l, KEY_MUTE);
+   test_press(l, KEY_MUTE);
+   TEST_EXPECT(l->audio, "SC");
+   test_press(l, KEY_VOLUMEUP);
+   TEST_CHECK(l->pvt->line_cfg->volume_step == l->pvt->monitor.volume);
+   test_press(l, KEY_VOLUMEDOWN);
+   TEST_CHECK(0 == l->pvt->monitor.volume);
+
+   test_press(l, KEY_ESC);
+   TEST_EXPECT(l->queued, "H");
+}
+
+static void test_detected_digits(void)
+{
+   test_line_t *l = test_line(1);
+
+   /* dtmf_detect : the capture is started while dialing */
+   test_press(l, KEY_ENTER);
+   TEST_EXPECT(l->audio, "DT");
+   test_detect(l, TEST_EXTENSION "#");
+   TEST_CHECK(AI_ST_OFF_WAITING_ANSWER == test_state(l));
+   TEST_CHECK((NULL != l->chan) && (!strcmp(ast_channel_exten(l->chan), TEST_EXTENSION)));
+   TEST_EXPECT(l->audio, "tCt");
+
+   /* While talking, the digits detected are sent as DTMF */
+   test_pbx_answer(l);
+   test_detect(l, "7");
+   TEST_EXPECT(l->queued, "7");
+   test_press(l, KEY_ESC);
+   TEST_EXPECT(l->queued, "H");
+
+   /* Digits detected on hook are ignored */
+   test_detect(l, "1");
+   TEST_CHECK(AI_ST_ON_IDLE == test_state(l));
+}
+
+static void test_tone_ends(void)
+{
+   test_line_t *l = test_line(0);
+
+   /* A digit sent by the peer is played, the monitor stops the tone played */
+   test_make_call(l);
+   TEST_CHECK(0 == ast_channel_tech(l->chan)->send_digit_end(l->chan, '5', 100));
+   test_monitor();
+   TEST_CHECK(AI_TONE_DTMF_5 == l->pvt->ast_channel.tone);
+   TEST_EXPECT(l->audio, "T");
+   test_tone_played(l);
+   TEST_CHECK(AI_TONE_NONE == l->pvt->ast_channel.tone);
+   TEST_EXPECT(l->audio, "t");
+   test_press(l, KEY_ESC);
+}
+
+/*
+ Does what the devices thread would do (see alsa_input_do_devices()) : the
+ lines disconnected to apply a reload are reopened
+*/
+static void test_reopen(void)
+{
+   size_t i;
+
+   for (i = 0; (i < TEST_LINES); i += 1) {
+      test_audio_thread(&(test.lines[i]));
+   }
+   alsa_input_devices_pass(&(alsa_input_chan));
+   test_monitor();
+}
+
+static void test_reload(void)
+{
+   test_line_t *l = test_line(0);
+   const alsa_input_line_config_t *line_cfg = l->pvt->line_cfg;
+
+   /* Parameters of the monitor are applied at once, devices stay open */
+   test_set_config(TEST_CONFIG_LINE1 "context = reloaded\n" "dialing_timeout = 2000\n");
+   TEST_CHECK(AST_MODULE_LOAD_SUCCESS == reload_module());
+   TEST_CHECK(line_cfg != l->pvt->line_cfg);
+   TEST_CHECK(!strcmp(l->pvt->line_cfg->context, "reloaded"));
+   TEST_CHECK(2000 == l->pvt->line_cfg->dialing_timeout);
+   TEST_CHECK(NULL == l->pvt->reload.pending_cfg);
+   test_monitor();
+   TEST_EXPECT(l->audio, "");
+   TEST_CHECK(test_line(1)->pvt->line_cfg == &(alsa_input_chan.config.line_cfgs[1]));
+
+   /* The same configuration changes nothing */
+   line_cfg = l->pvt->line_cfg;
+   TEST_CHECK(AST_MODULE_LOAD_SUCCESS == reload_module());
+   TEST_CHECK(line_cfg == l->pvt->line_cfg);
+
+   /* An invalid configuration is rejected */
+   test_set_config(TEST_CONFIG_LINE1 "periods = 1\n");
+   test.errors_expected = 2;
+   TEST_CHECK(AST_MODULE_LOAD_DECLINE == reload_module());
+   TEST_CHECK(0 == test.errors_expected);
+   TEST_CHECK(line_cfg == l->pvt->line_cfg);
+   TEST_CHECK(NULL == l->pvt->reload.pending_cfg);
+
+   /* Other devices during a call : the line is reopened after the call */
+   test_make_call(l);
+   test_set_config(TEST_CONFIG_LINE1 "snd_capture_device = other\n" "dialing_timeout = 2000\n");
+   TEST_CHECK(AST_MODULE_LOAD_SUCCESS == reload_module());
+   test_monitor();
+   TEST_CHECK(AI_ST_OFF_TALKING == test_state(l));
+   TEST_CHECK(!strcmp(l->pvt->line_cfg->snd_capture_dev_name, "test"));
+   TEST_CHECK(!strcmp(l->pvt->line_cfg->context, "test"));
+   TEST_CHECK(NULL != l->pvt->reload.pending_cfg);
+   TEST_EXPECT(l->audio, "");
+
+   test_press(l, KEY_ESC);
+   TEST_EXPECT(l->queued, "H");
+   TEST_CHECK(AI_ST_DISCONNECTED == test_state(l));
+   TEST_CHECK(l->pvt->reload.reopening);
+   TEST_CHECK(1 == alsa_input_chan.monitor.lines_connected);
+   /* Not before the audio thread has acknowledged the close of the sound devices */
+   TEST_CHECK(l->pvt->reload.requested);
+   l->pvt->audio.close_ack -= 1;
+   alsa_input_devices_pass(&(alsa_input_chan));
+   TEST_CHECK(AI_ST_DISCONNECTED == test_state(l));
+   TEST_CHECK(l->pvt->reload.requested);
+   l->pvt->audio.close_ack += 1;
+   test_reopen();
+   TEST_EXPECT(l->audio, "StttX");
+   TEST_CHECK(!l->pvt->reload.reopening);
+   TEST_CHECK(NULL == l->pvt->reload.pending_cfg);
+   TEST_CHECK(!strcmp(l->pvt->line_cfg->snd_capture_dev_name, "other"));
+   TEST_CHECK(2 == alsa_input_chan.monitor.lines_connected);
+   TEST_CHECK((l->pvt->monitor.fd_pipe >= 0) && (l->pvt->monitor.events_head == l->pvt->monitor.events_tail));
+   TEST_CHECK(AI_ST_ON_IDLE == test_state(l));
+
+   /* The line reopened makes calls */
+   test_make_call(l);
+   test_press(l, KEY_ESC);
+
+   /* Back to the configuration loaded */
+   test_set_config(TEST_CONFIG_LINE1);
+   TEST_CHECK(AST_MODULE_LOAD_SUCCESS == reload_module());
+   test_monitor();
+   test_reopen();
+   TEST_CHECK(!strcmp(l->pvt->line_cfg->snd_capture_dev_name, "test"));
+   TEST_CHECK(AI_ST_ON_IDLE == test_state(l));
+}
+
+static void test_load(const char *line1);
+static void test_unload(void);
+
+static void test_hotplug(void)
+{
+   test_line_t *l = test_line(0);
+   size_t i;
+
+   /* Sound devices named by the id of their card */
+   test_set_config(TEST_CONFIG_LINE1
+      "snd_capture_device = plughw:CARD=Phone,DEV=0\n"
+      "snd_playback_device = plughw:CARD=Phone,DEV=0\n");
+   TEST_CHECK(AST_MODULE_LOAD_SUCCESS == reload_module());
+   test_monitor();
+   test_reopen();
+   TEST_CHECK(AI_ST_ON_IDLE == test_state(l));
+   l->audio[0] = '\0';
+
+   /* The phone is unplugged during a call : the line is disconnected */
+   test_make_call(l);
+   snd_stub_unplug("Phone");
+   l->pvt->monitor.revents_input = EPOLLHUP;
+   alsa_input_monitor_kick(l->pvt);
+   test.errors_expected = 1;
+   test_monitor();
+   TEST_CHECK(0 == test.errors_expected);
+   TEST_CHECK(AI_ST_DISCONNECTED == test_state(l));
+   TEST_EXPECT(l->queued, "H");
+   for (i = 0; (i < TEST_LINES); i += 1) {
+      test_audio_thread(&(test.lines[i]));
+   }
+   TEST_EXPECT(l->audio, "SttX");
+   TEST_CHECK(1 == alsa_input_chan.monitor.lines_connected);
+
+   /* Other devices come and go : the line waits for its own */
+   alsa_input_devices_hotplug(&(alsa_input_chan));
+   TEST_CHECK(!l->pvt->reload.reopening);
+   TEST_CHECK(AI_ST_DISCONNECTED == test_state(l));
+
+   /* The phone is plugged again : only its line is reopened */
+   snd_stub_unplug(NULL);
+   alsa_input_devices_hotplug(&(alsa_input_chan));
+   TEST_CHECK(l->pvt->reload.reopening);
+   TEST_CHECK(!test_line(1)->pvt->reload.reopening);
+   test_reopen();
+   TEST_CHECK(!l->pvt->reload.reopening);
+   TEST_CHECK(AI_ST_ON_IDLE == test_state(l));
+   TEST_CHECK(AI_STATUS_ON_HOOK == l->pvt->ast_channel.status);
+   TEST_CHECK(2 == alsa_input_chan.monitor.lines_connected);
+   TEST_EXPECT(test_line(1)->audio, "");
+
+   /* The line reopened makes calls */
+   test_make_call(l);
+   test_press(l, KEY_ESC);
+
+   /* The phone is unplugged when the module is loaded : the line waits for it */
+   test_unload();
+   snd_stub_unplug("Phone");
+   test.errors_expected = 2;
+   test_load(TEST_CONFIG_LINE1
+      "snd_capture_device = plughw:CARD=Phone,DEV=0\n"
+      "snd_playback_device = plughw:CARD=Phone,DEV=0\n");
+   TEST_CHECK(0 == test.errors_expected);
+   TEST_CHECK(AI_ST_DISCONNECTED == test_state(l));
+   TEST_CHECK(AI_STATUS_DISCONNECTED == l->pvt->ast_channel.status);
+   TEST_CHECK((l->pvt->monitor.fd_input < 0) && (l->pvt->monitor.fd_pipe < 0));
+   TEST_CHECK(NULL == l->pvt->audio.snd_capture.card);
+   TEST_CHECK(1 == alsa_input_chan.monitor.lines_connected);
+   TEST_CHECK(AI_ST_ON_IDLE == test_state(test_line(1)));
+   alsa_input_devices_hotplug(&(alsa_input_chan));
+   TEST_CHECK(!l->pvt->reload.reopening);
+
+   snd_stub_unplug(NULL);
+   alsa_input_devices_hotplug(&(alsa_input_chan));
+   TEST_CHECK(l->pvt->reload.reopening);
+   test_reopen();
+   TEST_CHECK(!l->pvt->reload.reopening);
+   TEST_CHECK(AI_ST_ON_IDLE == test_state(l));
+   TEST_CHECK(AI_STATUS_ON_HOOK == l->pvt->ast_channel.status);
+   TEST_CHECK(2 == alsa_input_chan.monitor.lines_connected);
+   TEST_EXPECT(l->audio, "Stt");
+   test_make_call(l);
+   test_press(l, KEY_ESC);
+
+   /* Back to the configuration loaded */
+   test_set_config(TEST_CONFIG_LINE1);
+   TEST_CHECK(AST_MODULE_LOAD_SUCCESS == reload_module());
+   test_monitor();
+   test_reopen();
+   TEST_CHECK(AI_ST_ON_IDLE == test_state(l));
+}
+
+static void test_input_packets(void)
+{
+   test_line_t *l = test_line(1);
+
+   test_make_call(l);
+
+   /* A key is handled once its packet is complete */
+   test_event(l, EV_KEY, KEY_NUMERIC_1, 1);
+   test_monitor();
+   TEST_EXPECT(l->queued, "");
+   test_event(l, EV_SYN, SYN_REPORT, 0);
+   test_monitor();
+   TEST_EXPECT(l->queued, "1");
+
+   /* The packet following a SYN_DROPPED is ignored, the next one is handled */
+   test_event(l, EV_SYN, SYN_DROPPED, 0);
+   test_event(l, EV_KEY, KEY_NUMERIC_2, 1);
+   test_event(l, EV_SYN, SYN_REPORT, 0);
+   test_monitor();
+   TEST_CHECK(0 == l->pvt->ast_channel.digits_len);
+   test_event(l, EV_KEY, KEY_NUMERIC_3, 1);
+   test_event(l, EV_KEY, KEY_NUMERIC_4, 1);
+   test_event(l, EV_SYN, SYN_REPORT, 0);
+   test_monitor();
+   TEST_CHECK(2 == l->pvt->ast_channel.digits_len);
+   TEST_CHECK(l->pvt->monitor.events_tail == l->pvt->monitor.events_head);
+
+   test_press(l, KEY_ESC);
+   TEST_EXPECT(l->queued, "H");
+}
+
+typedef struct {
+   const char *name;
+   void (*run)(void);
+} test_scenario_t;
+
+static const test_scenario_t test_scenarios[] = {
+   { "call_answered", test_call_answered },
+   { "call_hung_up_by_peer", test_call_hung_up_by_peer },
+   { "invalid_extension", test_invalid_extension },
+   { "dialing_timeouts", test_dialing_timeouts },
+   { "ringing_answered", test_ringing_answered },
+   { "ringing_cancelled", test_ringing_cancelled },
+   { "busy", test_busy },
+   { "dtmf_burst", test_dtmf_burst },
+   { "detected_digits", test_detected_digits },
+   { "tone_ends", test_tone_ends },
+   { "input_packets", test_input_packets },
+   { "reload", test_reload },
+   { "hotplug", test_hotplug },
+};
+
+/*
+ * Throughput
+ */
+
+static void test_throughput(void)
+{
+   static const __u16 keys[] = {
+      KEY_ENTER, KEY_NUMERIC_1, KEY_NUMERIC_0, KEY_NUMERIC_0, KEY_NUMERIC_POUND,
+      KEY_NUMERIC_5, KEY_ESC
+   };
+   struct timespec b;
+   struct timespec e;
+   unsigned long calls = 0;
+   double secs;
+
+   test.tracing = false;
+   clock_gettime(CLOCK_MONOTONIC, &(b));
+   do {
+      unsigned int n;
+
+      /* Checks the time every 1024 calls on each line */
+      for (n = 0; (n < 1024); n += 1) {
+         size_t i;
+         size_t k;
+
+         for (i = 0; (i < TEST_LINES); i += 1) {
+            for (k = 0; (k < ARRAY_LEN(keys)); k += 1) {
+               test_key(&(test.lines[i]), keys[k]);
+            }
+         }
+         test_monitor();
+      }
+      calls += n * TEST_LINES;
+      clock_gettime(CLOCK_MONOTONIC, &(e));
+      secs = (e.tv_sec - b.tv_sec) + ((e.tv_nsec - b.tv_nsec) / 1e9);
+   } while (secs < test.throughput_s);
+   test.tracing = true;
+
+   printf("%lu calls in %.2f s on %d lines : %.0f calls/s, %.0f input events/s (%.0f ns per event)\n",
+      calls, secs, TEST_LINES, calls / secs, (calls * ARRAY_LEN(keys) * 4) / secs,
+      (secs * 1e9) / (calls * ARRAY_LEN(keys) * 4));
+}
+
+/*
+ * Setup
+ */
+
+/* Loads the module with line1 as section of line 1 (see test_set_config()) */
+static void test_load(const char *line1)
+{
+   alsa_input_chan_t *t = &(alsa_input_chan);
+   alsa_input_pvt_t *pvt;
+
+   test_set_config(line1);
+   if (AST_MODULE_LOAD_SUCCESS != load_module()) {
+      fprintf(stderr, "test_alsa_input: load_module() failed\n");
+      exit(1);
+   }
+
+   /*
+    The test plays the monitor, the audio thread and the devices thread
+    (see test_reopen()) : it can reopen lines while stopped
+   */
+   alsa_input_stop_monitor(t);
+   alsa_input_stop_audio(t);
+   alsa_input_stop_devices(t);
+   t->devices.run = true;
+   /* The monitor isn't restarted when a line is reopened */
+   t->monitor.thread = AST_PTHREADT_STOP;
+   test.monitor_fd_wakeup = t->monitor.fd_wakeup;
+   test.audio_fd_wakeup = t->audio.fd_wakeup;
+   t->monitor.fd_wakeup = -1;
+   t->audio.fd_wakeup = -1;
+   clock_gettime(CLOCK_MONOTONIC, &(test_clock.now));
+   test_clock.frozen = true;
+
+   AST_LIST_TRAVERSE(&(t->pvt_list), pvt, list) {
+      test_line_t *l = test_line_of_pvt(pvt);
+      l->pvt = pvt;
+      l->deadline = AI_NO_DEADLINE;
+      /* Commands sent while loading */
+      test_audio_thread(l);
+   }
+   test_monitor();
+   test.tracing = true;
+}
+
+static void test_unload(void)
+{
+   alsa_input_chan_t *t = &(alsa_input_chan);
+
+   test_clock.frozen = false;
+   t->monitor.fd_wakeup = test.monitor_fd_wakeup;
+   t->audio.fd_wakeup = test.audio_fd_wakeup;
+   TEST_CHECK(0 == unload_module());
+   TEST_CHECK(0 == ast_stub_module_refs());
+   TEST_CHECK(0 == snd_stub_open_count());
+}
+
+static void test_usage(void)
+{
+   fprintf(stderr,
+      "Usage: test_alsa_input [options]\n"
+      "  -s name       run only this scenario\n"
+      "  -t secs       measure the throughput of the control path during secs\n"
+      "                seconds instead of running the scenarios\n"
+      "  -v            log the warnings of the driver (-vv : notices, -vvv : all)\n");
+   exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+   size_t i;
+   int opt;
+
+   ast_stub_log_level = AST_LOG_ERROR + 1;
+   while (-1 != (opt = getopt(argc, argv, "s:t:vh"))) {
+      switch (opt) {
+         case 's': {
+            test.only = optarg;
+            break;
+         }
+         case 't': {
+            test.throughput_s = strtoul(optarg, NULL, 10);
+            if (0 == test.throughput_s) {
+               test_usage();
+            }
+            break;
+         }
+         case 'v': {
+            if (ast_stub_log_level > AST_LOG_WARNING) {
+               ast_stub_log_level = AST_LOG_WARNING;
+            }
+            else if (ast_stub_log_level > AST_LOG_DEBUG) {
+               ast_stub_log_level -= 1;
+            }
+            break;
+         }
+         default: {
+            test_usage();
+            break;
+         }
+      }
+   }
+   if (optind != argc) {
+      test_usage();
+   }
+
+   ast_stub_hooks.pbx_start = test_pbx_start;
+   ast_stub_hooks.exists_extension = test_exists_extension;
+   ast_stub_hooks.canmatch_extension = test_canmatch_extension;
+   ast_stub_hooks.log = test_log;
+
+   test_load(TEST_CONFIG_LINE1);
+   test_check_idle();
+   if (0 != test.throughput_s) {
+      test_throughput();
+   }
+   else {
+      for (i = 0; (i < ARRAY_LEN(test_scenarios)); i += 1) {
+         unsigned int failures = test.failures;
+
+         if ((NULL != test.only) && (strcmp(test.only, test_scenarios[i].name))) {
+            continue;
+         }
+         test.scenario = test_scenarios[i].name;
+         test_scenarios[i].run();
+         test_check_idle();
+         printf("%-24s %s\n", test.scenario, (failures == test.failures) ? "ok" : "FAILED");
+      }
+      test.scenario = NULL;
+   }
+   test_unload();
+
+   if (0 != test.failures) {
+      printf("%u checks failed\n", test.failures);
+      return (1);
+   }
+   return (0);
+}
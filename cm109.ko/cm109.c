@@ -149,6 +149,7 @@ struct cm109_dev {
    u32 keystatus;   /* bit fields : last reported status of keys : 1 pressed, 0 released */
    size_t keyindex; /* 16=new scan  0,4,8,12=scan columns  */
    u8 gpi;          /* Cached value of GPI (high nibble) */
+   bool sync_pending; /* Keys reported since the last input_sync() */
 };
 
 /******************************************************************************
@@ -341,14 +342,26 @@ static unsigned short (*keymap)(int) = keymap_kip1000;
 
 /*
  * Completes a request by converting the data into events for the
- * input subsystem.
+ * input subsystem. The packet is ended by report_sync().
  */
 static inline void report_key(struct cm109_dev *dev, int key, int value)
 {
    struct input_dev *idev = dev->idev;
    /* printk(KERN_INFO KBUILD_MODNAME "report_key(key = %d, value = %d)\n", (int)(key), (int)(value)); */
    input_report_key(idev, key, value);
-   input_sync(idev);
+   dev->sync_pending = true;
+}
+
+/*
+ * Ends the packet of the keys reported, if any : readers are woken up
+ * once per packet instead of once per key.
+ */
+static inline void report_sync(struct cm109_dev *dev)
+{
+   if (dev->sync_pending) {
+      dev->sync_pending = false;
+      input_sync(dev->idev);
+   }
 }
 
 /******************************************************************************
@@ -486,6 +499,14 @@ static void cm109_irq_urb_callback(struct urb *urb)
 
  out:
 
+   /*
+    In GPIO mode, the keys of a scan (4 columns, one per URB) are
+    reported in a single packet
+   */
+   if ((!gpio_mode) || (dev->keyindex >= 16)) {
+      report_sync(dev);
+   }
+
    spin_lock(&(dev->ctl_submit_lock));
 
    dev->irq_urb_pending = 0;
@@ -682,6 +703,7 @@ static int cm109_input_open(struct input_dev *idev)
    dev->buzzer_state = 0;
    dev->keystatus = 0;  /* no keys pressed */
    dev->keyindex = 16;
+   dev->sync_pending = false;
    dev->gpi = 0;
 
    /* issue INIT */